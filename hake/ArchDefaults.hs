@@ -86,6 +86,7 @@ kernelLibs arch =
 -- Libraries that are linked to all applications.
 stdLibs arch = 
     [ In InstallTree arch "/lib/libaos.a",
+      In InstallTree arch "/lib/libbitmap.a",
       In InstallTree arch "/errors/errno.o",
       In InstallTree arch "/lib/libc.a",
       In InstallTree arch "/lib/libcompiler-rt.a",
@@ -30,6 +30,20 @@ struct aos_rpc {
  */
 errval_t aos_rpc_send_number(struct aos_rpc *chan, uintptr_t val);
 
+/**
+ * \brief enable or disable the allocation free path for small round trips
+ * (aos_rpc_send_number, aos_rpc_serial_putchar). Enabled by default.
+ */
+void aos_rpc_set_fast_path(bool enable);
+
+/**
+ * \brief enable or disable waiting for the reply in the kernel: small round
+ * trips and RAM requests from a dispatcher with nothing else to do block it
+ * until the reply arrives, instead of it being scheduled again meanwhile.
+ * Enabled by default.
+ */
+void aos_rpc_set_call_mode(bool enable);
+
 /**
  * \brief send a string over the given channel
  */
@@ -42,6 +56,27 @@ errval_t aos_rpc_send_string(struct aos_rpc *chan, const char *string);
 errval_t aos_rpc_get_ram_cap(struct aos_rpc *chan, size_t bytes, size_t align,
                              struct capref *retcap, size_t *ret_bytes);
 
+/**
+ * \brief request up to count RAM capabilities of bytes size each in one round
+ * trip. They are placed in slots first .. first + count - 1 of the L2 CNode
+ * cnode. ret_count is set to the number of caps actually delivered, which is
+ * only less than count if the memory server ran out of memory.
+ */
+errval_t aos_rpc_get_ram_caps(struct aos_rpc *chan, size_t bytes, size_t align,
+                              struct capref cnode, cslot_t first, size_t count,
+                              size_t *ret_count, size_t *ret_bytes);
+
+/**
+ * \brief start init's cross-core URPC benchmark, results go to the console
+ */
+errval_t aos_rpc_urpc_bench(struct aos_rpc *chan);
+
+/**
+ * \brief let init spawn hello `iterations` times with and without batched
+ * capability invocations, results go to the console
+ */
+errval_t aos_rpc_spawn_bench(struct aos_rpc *chan, size_t iterations);
+
 /**
  * \brief get one character from the serial port
  */
@@ -124,6 +159,12 @@ errval_t aos_rpc_led_toggle(struct aos_rpc *chan);
  */
 errval_t aos_rpc_send_message_to_process(struct aos_rpc *chan, domainid_t pid, coreid_t core, void* payload, size_t bytes);
 
+/**
+ * \brief Send a payload to init which drops it and ACKs. Used to benchmark
+ * the transfer paths of the rpc layer.
+ */
+errval_t aos_rpc_bench_sink(struct aos_rpc *chan, void *payload, size_t bytes);
+
 /**
  * \brief Gets a capability to device registers
  * \param rpc  the rpc channel
@@ -56,6 +56,51 @@
 #define RPC_TYPE_REGISTER_AS_NAMESERVER 21
 #define RPC_TYPE_GET_NAME_SERVER        22
 #define RPC_TYPE_DOMAIN_TO_DOMAIN_COM   23
+#define RPC_TYPE_BENCH_SINK             24
+#define RPC_TYPE_RAM_BATCH              25
+#define RPC_TYPE_URPC_BENCH             26
+#define RPC_TYPE_SPAWN_BENCH            27
+// transport internal, never seen by the recv_deal_with_msg handlers. Kept at
+// the top of the type range so it does not collide with the nameserver types
+#define RPC_TYPE_BULK_SETUP             127
+
+// Bulk mode: payloads larger than the threshold (in words) are not chopped
+// into 8 word LMP messages. Instead the sender copies them into a frame it
+// shares with the receiver (negotiated lazily, once per channel direction via
+// RPC_TYPE_BULK_SETUP) and only sends a descriptor over LMP. Descriptors are
+// marked by RPC_BULK_SIZE_MARKER in the length field and carry
+// offset, chunk bytes, total bytes, chunk position.
+// Payloads bigger than half the frame are sent as several descriptors.
+#define RPC_BULK_DEFAULT_THRESHOLD      32
+#define RPC_BULK_FRAME_SIZE             (128 * 1024)
+#define RPC_BULK_SIZE_MARKER            0xFFFF
+
+// Messages of up to this many words fit into a single LMP message and can be
+// sent with send_small, straight from the caller's buffer.
+#define RPC_SMALL_MAX_WORDS             (LMP_MSG_LENGTH - 1)
+
+// Payloads longer than one LMP message go out in long LMP messages
+// (lmp_chan_send_long) of up to this many words plus the header word, each
+// one system call. RPC endpoints are sized to hold two of them. If the peer's
+// endpoint is too small, the channel falls back to 8 word messages.
+#define RPC_LONG_MAX_WORDS              64
+#define RPC_LMP_BUF_WORDS                                                     \
+    (2 * (RPC_LONG_MAX_WORDS + 1 + LMP_RECV_HEADER_LENGTH))
+
+// receive buffer for any message on an RPC channel. It holds anything the
+// endpoint can, so a peer sending more than RPC_LONG_MAX_WORDS can't leave a
+// message behind that we are unable to read.
+struct rpc_recv_msg {
+    struct lmp_recv_buf buf;
+    uintptr_t words[RPC_LMP_BUF_WORDS];
+};
+
+#define RPC_RECV_MSG_INIT { .buf.buflen = RPC_LMP_BUF_WORDS }
+
+// Long messages of up to this many words are reassembled in buffers taken
+// from a per-channel slab pool instead of being malloc'd.
+#define RPC_RECV_SLAB_WORDS             64
+#define RPC_RECV_SLAB_PREALLOC          8
 
 struct recv_list {
     unsigned char type;
@@ -66,24 +111,57 @@ struct recv_list {
     struct lmp_chan *chan;
     uintptr_t *payload;
     struct recv_list *next;
+    bool pooled; // payload lives behind this struct in a recv_slabs block
 };
 
 struct recv_chan {
     struct lmp_chan *chan;
     void (*recv_deal_with_msg)(struct recv_list *);
-    struct recv_list *rpc_recv_list; // TODO: instead of having 1 list which
-                                     // shares type+id, split this off into a
-                                     // list of types which each has a list of
-                                     // ids, thereby drastically speeding up
-                                     // lookup
+    // messages currently being reassembled, indexed directly by type and
+    // then id. The per-type id tables are allocated on first use.
+    struct recv_list **rpc_recv_table[256];
+    struct slab_allocator recv_slabs;
+    struct thread_mutex mutex; // protects rpc_recv_table and recv_slabs
+    void *bulk_base;  // peer's bulk frame, NULL until RPC_TYPE_BULK_SETUP
+    size_t bulk_size;
 };
 
-unsigned char request_fresh_id(unsigned char type);
+// Message ids are allocated per channel and per (raw) message type from a
+// bitmap, so they can be released in any order.
+
+/**
+ * \brief allocate an id for a message of raw type `type` on chan.
+ * Returns LIB_ERR_RPC_NO_IDS if all 256 ids are in flight.
+ */
+errval_t rpc_id_alloc(struct lmp_chan *chan, unsigned char type,
+                      unsigned char *id);
+/// like rpc_id_alloc, but dispatches events until an id becomes available
+unsigned char request_fresh_id(struct lmp_chan *chan, unsigned char type);
+void rpc_id_free(struct lmp_chan *chan, unsigned char type, unsigned char id);
+/// number of ids of raw type `type` currently allocated on chan
+size_t rpc_ids_in_flight(struct lmp_chan *chan, unsigned char type);
 
-// id needs to be a currently unused id obtained via request_fresh_id
+// id needs to be a currently unused id obtained via request_fresh_id. It is
+// released once the message has been sent.
 errval_t send(struct lmp_chan *chan, struct capref cap, unsigned char type,
               size_t payloadsize, uintptr_t *payload,
               struct event_closure callback_when_done, unsigned char id);
+// like send, but the id stays allocated. Used for requests, whose id is
+// released with rpc_id_free once the response arrived.
+errval_t send_request(struct lmp_chan *chan, struct capref cap,
+                      unsigned char type, size_t payloadsize,
+                      uintptr_t *payload,
+                      struct event_closure callback_when_done,
+                      unsigned char id);
+// sends a message of at most RPC_SMALL_MAX_WORDS words without going through
+// the send queue, so nothing is allocated and payload may live on the stack.
+// Waits (dispatching events) until everything queued before has gone out and
+// the channel accepted the message. Like send_request, the id is not
+// released. With call set, the sender waits for the reply in the kernel
+// (lmp_chan_call) if it has nothing else to do.
+errval_t send_small(struct lmp_chan *chan, struct capref cap,
+                    unsigned char type, size_t payloadsize, uintptr_t *payload,
+                    unsigned char id, bool call);
 errval_t persist_send_cleanup_wrapper(struct lmp_chan *chan, struct capref cap,
                                       unsigned char type, size_t payloadsize,
                                       void *payload,
@@ -94,12 +172,37 @@ errval_t send_response(struct recv_list *rl, struct lmp_chan *chan,
 errval_t forward_message(struct recv_list *rl, struct lmp_chan *chan,
                        struct capref cap, size_t payloadsize, void *payload);
 
+/**
+ * \brief set the payload size (in words) above which send() uses the shared
+ * bulk frame. SIZE_MAX disables bulk mode for this domain.
+ */
+void rpc_bulk_set_threshold(size_t words);
+size_t rpc_bulk_get_threshold(void);
+
+/**
+ * \brief enable or disable long LMP messages for payloads that do not fit
+ * into one LMP message. Enabled by default, disabled they go out 8 words at
+ * a time.
+ */
+void rpc_lmp_long_set(bool enable);
+
 #define NULL_EVENT_CLOSURE                                                    \
     (struct event_closure) { NULL, NULL }
 
 // almost definitely not something that belongs into shared
 void recv_handling(void *args);
 
+// sets up rc to dispatch messages arriving on chan to recv_deal_with_msg.
+// Does not touch chan itself, callers still have to register recv_handling.
+void recv_chan_init(struct recv_chan *rc, struct lmp_chan *chan,
+                    void (*recv_deal_with_msg)(struct recv_list *));
+
+// feeds one raw LMP message into the reassembly machinery of rc, calling the
+// channel's handler once a logical message is complete. Malformed bulk
+// messages are dropped with an error.
+errval_t recv_process_msg(struct recv_chan *rc, struct lmp_recv_buf *msg,
+                          struct capref cap);
+
 // TODO: possibly does not belong into shared. Inits mutex, opens the channel
 // to dest and sets recv.
 errval_t init_rpc_client(void (*recv_deal_with_msg)(struct recv_list *),
@@ -0,0 +1,53 @@
+/**
+ * \file
+ * \brief Size class arena malloc
+ *
+ * Every thread allocates from an arena of its own. Small blocks come from
+ * page runs of their size class in O(1), large blocks get a reservation of
+ * their own. Memory is backed lazily by the page fault handler, and runs and
+ * large blocks are given back with paging_free() once they are free.
+ */
+
+/*
+ * Copyright (c) 2016, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#ifndef LIBBARRELFISH_ARENA_H
+#define LIBBARRELFISH_ARENA_H
+
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+#define ARENA_RUN_SIZE      (4 * BASE_PAGE_SIZE) ///< Size of a small block run
+#define ARENA_SMALL_MAX     2048        ///< Largest small block size
+#define ARENA_CLASSES       24          ///< Number of small size classes
+#define ARENA_MAX           32          ///< Arenas before threads share one
+
+struct arena;
+
+/// Counters of the arenas of this domain
+struct arena_stats {
+    size_t runs_mapped;         ///< Small block runs reserved
+    size_t runs_unmapped;       ///< Small block runs given back
+    size_t large_mapped;        ///< Large blocks reserved
+    size_t large_unmapped;      ///< Large blocks given back
+    size_t remote_frees;        ///< Blocks freed by a thread not owning them
+    size_t shared_allocs;       ///< Allocations from the shared arena
+};
+
+void arena_init(void);
+void *arena_malloc(size_t bytes);
+void arena_free(void *ptr);
+void *arena_realloc(void *ptr, size_t bytes);
+void arena_release(struct arena *arena);
+void arena_get_stats(struct arena_stats *stats);
+
+__END_DECLS
+
+#endif // LIBBARRELFISH_ARENA_H
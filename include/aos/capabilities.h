@@ -73,6 +73,33 @@ errval_t idcap_create(struct capref dest);
 errval_t cnode_build_cnoderef(struct cnoderef *cnoder, struct capref capr);
 errval_t cnode_build_l1cnoderef(struct cnoderef *cnoder, struct capref capr);
 
+/// Capability operations collected to run in a single system call
+struct cap_batch {
+    struct cap_batch_op ops[CAP_BATCH_MAX_OPS];
+    size_t count;   ///< Operations added since the last run
+    size_t done;    ///< Operations the last run completed
+};
+
+static inline bool cap_batch_full(struct cap_batch *batch)
+{
+    return batch->count == CAP_BATCH_MAX_OPS;
+}
+
+void cap_batch_init(struct cap_batch *batch);
+errval_t cap_batch_copy(struct cap_batch *batch, struct capref dest,
+                        struct capref src);
+errval_t cap_batch_retype(struct cap_batch *batch, struct capref dest_start,
+                          struct capref src, gensize_t offset,
+                          enum objtype new_type, gensize_t objsize,
+                          size_t count);
+errval_t cap_batch_delete(struct cap_batch *batch, struct capref cap);
+errval_t cap_batch_vnode_map(struct cap_batch *batch, struct capref dest,
+                             struct capref src, capaddr_t slot,
+                             uint64_t attr, uint64_t off, uint64_t pte_count,
+                             struct capref mapping);
+errval_t cap_batch_run(struct cap_batch *batch);
+void cap_batch_set_enabled(bool enable);
+
 /**
  * \brief Mint (Copy changing type-specific parameters) a capability
  *
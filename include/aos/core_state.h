@@ -37,6 +37,21 @@ struct morecore_state {
     char *freep;
 };
 
+// cache of base page sized RAM caps for remote allocations, refilled in
+// batches by a separate thread (see lib/aos/ram_alloc.c)
+struct ram_cache {
+    bool initialized;
+    bool disabled;              ///< setup failed, always go to the server
+    struct capref cnode_cap;    ///< L2 CNode the cached caps live in
+    struct cnoderef cnode;
+    cslot_t head;               ///< slot of the next cap to hand out
+    size_t count;               ///< number of cached caps from head on
+    bool refill_pending;        ///< refill thread was asked to run
+    struct thread_mutex mutex;
+    struct thread_cond refill_cond;
+    struct thread *refill_thread;
+};
+
 struct ram_alloc_state {
     bool mem_connect_done;
     errval_t mem_connect_err;
@@ -45,6 +60,7 @@ struct ram_alloc_state {
     uint64_t default_minbase;
     uint64_t default_maxlimit;
     int base_capnum;
+    struct ram_cache cache;
 };
 
 struct skb_state {
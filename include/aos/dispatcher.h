@@ -33,8 +33,11 @@ struct dispatcher_generic {
     /// Currently-running (or last-run) thread, if any
     struct thread *current;
 
-    /// Thread run queue (all threads eligible to be run)
-    struct thread *runq;
+    /// Thread run queues (all threads eligible to be run), one per priority
+    struct thread *runq[THREAD_PRIORITIES];
+
+    /// Bit l is set iff runq[l] is not empty
+    uint32_t runq_levels;
 
     /// Cap to this dispatcher, used for creating new endpoints
     struct capref dcb_cap;
@@ -52,6 +52,11 @@ errval_t lmp_chan_register_send(struct lmp_chan *lc, struct waitset *ws,
 errval_t lmp_chan_deregister_send(struct lmp_chan *lc);
 void lmp_chan_migrate_send(struct lmp_chan *lc, struct waitset *ws);
 errval_t lmp_chan_alloc_recv_slot(struct lmp_chan *lc);
+errval_t lmp_chan_call(struct lmp_chan *lc, lmp_send_flags_t flags,
+                       struct capref send_cap, uint8_t length_words,
+                       uintptr_t a, uintptr_t b, uintptr_t c, uintptr_t d,
+                       uintptr_t e, uintptr_t f, uintptr_t g, uintptr_t h,
+                       uintptr_t i);
 void lmp_channels_retry_send_disabled(dispatcher_handle_t handle);
 
 /**
@@ -113,6 +118,19 @@ static inline errval_t lmp_chan_recv(struct lmp_chan *lc,
     return lmp_endpoint_recv(lc->endpoint, &msg->buf, cap);
 }
 
+/**
+ * \brief Receive a message of up to buf->buflen words from an LMP channel
+ *
+ * Like lmp_chan_recv, for channels that carry long messages.
+ */
+static inline errval_t lmp_chan_recv_buf(struct lmp_chan *lc,
+                                         struct lmp_recv_buf *buf,
+                                         struct capref *cap)
+{
+    assert(buf != NULL);
+    return lmp_endpoint_recv(lc->endpoint, buf, cap);
+}
+
 /**
  * \brief Check if a channel has data to receive
  */
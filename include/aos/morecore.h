@@ -22,6 +22,9 @@ __BEGIN_DECLS
 
 errval_t morecore_init(void);
 
+/// Number of successful malloc() calls in this domain so far
+extern size_t __malloc_calls;
+
 __END_DECLS
 
 #endif
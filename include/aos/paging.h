@@ -19,6 +19,7 @@
 #include <errors/errno.h>
 #include <aos/capabilities.h>
 #include <aos/slab.h>
+#include <aos/thread_sync.h>
 #include <barrelfish_kpi/paging_arm_v7.h>
 
 typedef int paging_flags_t;
@@ -27,6 +28,12 @@ typedef int paging_flags_t;
 
 #define PAGING_SLAB_BUFSIZE 12
 
+/// Size of the stack every thread handles its page faults on
+#define PAGING_EXCEPTION_STACK_SIZE (16 * 1024)
+
+/// Number of locks that serialize the creation of L2 tables
+#define PAGING_L2_LOCKS 32
+
 #define VREGION_FLAGS_READ     0x01 // Reading allowed
 #define VREGION_FLAGS_WRITE    0x02 // Writing allowed
 #define VREGION_FLAGS_EXECUTE  0x04 // Execute allowed
@@ -44,39 +51,42 @@ typedef int paging_flags_t;
 #define VREGION_FLAGS_READ_WRITE_MPB \
     (VREGION_FLAGS_READ | VREGION_FLAGS_WRITE | VREGION_FLAGS_MPB)
 
-/* if necessary use tree
-struct paging_free_frames_tree {
-    union {
-        struct paging_region *leaf;
-        struct paging_free_frames_tree_node *node;
-    } elm;
-    bool leaf;
-};
-
-struct paging_free_frames_tree_node {
-    lvaddr_t split_addr; //todo: replace/rethinking. This is probably useless and should instead be depth or cut
-    struct paging_free_frames_tree left;
-    struct paging_free_frames_tree right;
-};
-*/
-//tree not necessary for simple impl, trusty linked list it is!
 struct paging_frame_node {
     lvaddr_t base_addr;
     size_t region_size;
     struct paging_frame_node* next;
 };
 
+/// Free range of the virtual address space. The free ranges of a paging
+/// state form an AVL tree ordered by address, where every node also tracks
+/// the largest range of its subtree, so that the first range that fits a
+/// request is found in O(log n).
+struct paging_vspace_node {
+    lvaddr_t base_addr;
+    size_t region_size;
+    size_t max_size;                    ///< Largest region_size in subtree
+    struct paging_vspace_node* left;
+    struct paging_vspace_node* right;
+    int height;
+};
+
 struct paging_map_node {
     struct capref table;
     struct capref mapping;
     struct paging_map_node* next;
 };
 
+/// Mapped range of the virtual address space, kept in an AVL tree ordered
+/// by start_addr.
 struct paging_used_node {
     lvaddr_t start_addr;
     size_t size;
-    struct paging_used_node* next;
+    struct paging_used_node* left;
+    struct paging_used_node* right;
+    int height;
+    bool pending;                       ///< Reserved, still being mapped
     struct paging_map_node* map_list;
+    struct capref frame;                ///< Mapped by the fault handler, or NULL_CAP
 };
 
 // struct to store the paging status of a process
@@ -84,10 +94,19 @@ struct paging_state {
     size_t debug_paging_state_index;
     struct slot_allocator* slot_alloc;
     // TODO: add struct members to keep track of the page tables etc
-    struct slab_allocator slab_alloc;
-    // l2 page tables
-    struct paging_frame_node free_vspace;
+    struct slab_cache slab_alloc;
+    // Protects the vspace trees. Never held across a frame allocation or a
+    // mapping, and nested, so slab refills can map memory.
+    struct thread_mutex mutex;
+    // L2 tables of L1 slot i are created under l2_locks[i % PAGING_L2_LOCKS]
+    struct thread_mutex l2_locks[PAGING_L2_LOCKS];
+    // free and mapped parts of the vspace
+    struct paging_vspace_node *free_vspace;
     struct paging_used_node *mappings;
+    // first free node, which has to exist before the slabs can be refilled
+    struct paging_vspace_node free_vspace_first;
+    bool free_vspace_first_used;
+    // l2 page tables
     struct capref l1_page_table;
     struct l2_page_table{
         struct capref cap;
@@ -103,17 +122,37 @@ errval_t paging_init_state(struct paging_state *st, lvaddr_t start_vaddr,
         struct capref pdir, struct slot_allocator * ca);
 /// initialize self-paging module
 errval_t paging_init(void);
-/// setup paging on new thread (used for user-level threads)
+/// setup paging on new thread (used for user-level threads), its exception
+/// stack has to be set up already
 void paging_init_onthread(struct thread *t);
 
 
+struct paging_hole_node;
+
+struct paging_hole_link {
+    struct paging_hole_node* left;
+    struct paging_hole_node* right;
+    int height;
+};
+
+/// Unmapped range below current_addr of a paging region. Every hole is in
+/// two AVL trees, by address to find the neighbours of a freed range, and by
+/// size (then address) to find the best fit for a mapping.
+struct paging_hole_node {
+    lvaddr_t base_addr;
+    size_t region_size;
+    struct paging_hole_link by_addr;
+    struct paging_hole_link by_size;
+};
+
 struct paging_region {
     lvaddr_t base_addr;
     lvaddr_t current_addr;
     size_t region_size;
-    struct slab_allocator *slab_alloc;
-    // TODO: if needed add struct members for tracking state
-    struct paging_frame_node* holes;
+    struct paging_state *st;            ///< Provides slabs for the holes
+    struct paging_hole_node* holes_by_addr;
+    struct paging_hole_node* holes_by_size;
+    size_t hole_bytes;                  ///< Total size of the holes
 };
 
 errval_t paging_region_init(struct paging_state *st,
@@ -130,7 +169,7 @@ errval_t paging_region_map(struct paging_region *pr, size_t req_size,
  * \brief free a bit of the paging region `pr`.
  * This function gets used in some of the code that is responsible
  * for allocating Frame (and other) capabilities.
- * We ignore unmap requests right now.
+ * The range becomes a hole that later mappings can reuse.
  */
 errval_t paging_region_unmap(struct paging_region *pr, lvaddr_t base, size_t bytes);
 
@@ -139,6 +178,48 @@ errval_t paging_region_unmap(struct paging_region *pr, lvaddr_t base, size_t byt
  *        accomodate a buffer of size `bytes`.
  */
 errval_t paging_alloc(struct paging_state *st, void **buf, size_t bytes);
+/// Like paging_alloc, with the start aligned to `alignment`.
+errval_t paging_alloc_aligned(struct paging_state *st, void **buf,
+                              size_t bytes, size_t alignment);
+
+/// Counts of the page table entries written by paging_map_fixed_attr.
+struct paging_map_stats {
+    size_t sections;        ///< 1M L1 sections
+    size_t large_pages;     ///< 64K L2 large pages
+    size_t small_pages;     ///< 4K L2 small pages
+    size_t invocations;     ///< vnode_map operations for frames
+};
+
+/// Fault-ahead policy of the page fault handler. A fault at the end of the
+/// previous window of a sequential stream maps initial_pages, every further
+/// one doubles the window up to max_pages. max_pages = 1 maps single pages.
+struct paging_fault_policy {
+    size_t initial_pages;
+    size_t max_pages;
+};
+
+#define PAGING_FAULT_POLICY_DEFAULT { .initial_pages = 4, .max_pages = 64 }
+
+/// Page fault counters of a domain.
+struct paging_fault_stats {
+    size_t faults;          ///< Handled page faults
+    size_t sequential;      ///< Faults that continued a sequential stream
+    size_t pages_mapped;    ///< Pages mapped by the handler
+    size_t fallbacks;       ///< Windows cut to one page for lack of memory
+    size_t waits;           ///< Faults on pages another thread was mapping
+};
+
+/// Set the fault-ahead policy of this domain.
+void paging_set_fault_policy(const struct paging_fault_policy *policy);
+/// Get the page fault counters of this domain.
+void paging_get_fault_stats(struct paging_fault_stats *stats);
+/// Reset the page fault counters of this domain.
+void paging_reset_fault_stats(void);
+
+/// Enable or disable 1M section and 64K large page mappings (default on).
+void paging_set_large_mappings(bool enable);
+/// Get the mapping counters of this domain.
+void paging_get_map_stats(struct paging_map_stats *stats);
 
 /**
  * Functions to map a user provided frame.
@@ -164,6 +245,16 @@ errval_t slab_refill_no_pagefault(struct slab_allocator *slabs,
  */
 errval_t paging_unmap(struct paging_state *st, const void *region);
 
+/**
+ * \brief give back a range from paging_alloc and unmap what was faulted in.
+ */
+errval_t paging_free(struct paging_state *st, const void *buf, size_t bytes);
+
+/**
+ * \brief make a range from paging_alloc fault on every access.
+ */
+errval_t paging_guard(struct paging_state *st, const void *buf, size_t bytes);
+
 
 /// Map user provided frame while allocating VA space for it
 static inline errval_t paging_map_frame(struct paging_state *st, void **buf,
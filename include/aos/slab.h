@@ -36,6 +36,7 @@ struct slot_allocator;
 struct slab_allocator {
     struct slab_head *slabs;    ///< Pointer to list of slabs
     size_t blocksize;           ///< Size of blocks managed by this allocator
+    size_t free;                ///< Count of free blocks in all slabs
     slab_refill_func_t refill_func;  ///< Refill function
 };
 
@@ -47,6 +48,42 @@ void slab_free(struct slab_allocator *slabs, void *block);
 size_t slab_freecount(struct slab_allocator *slabs);
 errval_t slab_default_refill(struct slab_allocator *slabs);
 
+/// Blocks in a full magazine of a slab cache
+#define SLAB_MAGAZINE_ROUNDS 16
+
+/**
+ * \brief Magazine layer in front of a slab allocator
+ *
+ * Free blocks are kept in magazines, chains of up to SLAB_MAGAZINE_ROUNDS
+ * blocks. The dispatcher allocates from and frees to its loaded and
+ * previous magazine, and swaps whole magazines with the depot, only an
+ * empty depot goes back to the slabs. Dropping below the watermark queues
+ * the cache for the refill thread, so the refill does not happen in the
+ * middle of whoever allocated the block. Safe to use from all threads of
+ * the dispatcher.
+ */
+struct slab_cache {
+    struct slab_allocator slabs;        ///< Backing slabs, no refill_func
+    struct block_head *loaded;          ///< Magazine allocated from
+    struct block_head *previous;        ///< Full or empty magazine
+    uint32_t loaded_rounds, previous_rounds;
+    struct block_head *depot;           ///< Full magazines
+    size_t depot_magazines;
+    size_t watermark;                   ///< Refill in the background below
+    slab_refill_func_t refill_func;     ///< Grows the slabs it is given
+    bool refill_queued;                 ///< Waits for the refill thread
+    struct slab_cache *refill_next;     ///< Refill queue
+};
+
+void slab_cache_init(struct slab_cache *cache, size_t blocksize,
+                     slab_refill_func_t refill_func, size_t watermark);
+void slab_cache_grow(struct slab_cache *cache, void *buf, size_t buflen);
+void *slab_cache_alloc(struct slab_cache *cache);
+void slab_cache_free(struct slab_cache *cache, void *block);
+size_t slab_cache_freecount(struct slab_cache *cache);
+errval_t slab_cache_refill(struct slab_cache *cache);
+errval_t slab_cache_refill_thread_start(void);
+
 // size of block header
 #define SLAB_BLOCK_HDRSIZE (sizeof(void *))
 // should be able to fit the header into the block
@@ -58,6 +58,23 @@ errval_t sys_print(const char *string, size_t length);
 
 errval_t sys_getchar(char *c);
 
+struct cap_batch_op;
+
+/**
+ * \brief Run a batch of capability invocations in one system call.
+ *
+ * Runs the operations in order and stops at the first one that fails.
+ *
+ * \param ops           Operations, their err fields get the results.
+ * \param count         Number of operations, at most CAP_BATCH_MAX_OPS.
+ * \param ret_done      Filled in with the number of operations that
+ *                      succeeded.
+ *
+ * \return Error of the failing operation, or #SYS_ERR_OK.
+ */
+errval_t sys_invoke_batch(struct cap_batch_op *ops, size_t count,
+                          size_t *ret_done);
+
 /**
  * \brief get time elapsed (in milliseconds) since system boot.
  */
@@ -0,0 +1,54 @@
+/**
+ * \file
+ * \brief Work stealing task pool
+ *
+ * A pool runs tasks on a fixed set of worker threads. Every worker has a
+ * deque of its own: tasks spawned by a worker go to the bottom of its deque
+ * and it runs them LIFO, idle workers steal from the top of the others.
+ * Waiting on a future from within a task runs other tasks meanwhile, so
+ * tasks can fork and join recursively.
+ */
+
+/*
+ * Copyright (c) 2016, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#ifndef LIBBARRELFISH_TASK_POOL_H
+#define LIBBARRELFISH_TASK_POOL_H
+
+#include <sys/cdefs.h>
+#include <errors/errno.h>
+
+__BEGIN_DECLS
+
+#define TASK_POOL_MAX_WORKERS   32      ///< Workers of a pool at most
+
+/// A task, the return value is handed to whoever waits on its future
+typedef int (*task_func_t)(void *arg);
+
+/// Body of a parallel_for, runs the iterations [begin, end)
+typedef void (*task_range_func_t)(void *arg, size_t begin, size_t end);
+
+struct task_pool;
+struct task_future;
+
+errval_t task_pool_create(struct task_pool **ret_pool, size_t workers);
+void task_pool_destroy(struct task_pool *pool);
+size_t task_pool_workers(struct task_pool *pool);
+
+errval_t task_spawn(struct task_pool *pool, task_func_t func, void *arg,
+                    struct task_future **ret_future);
+bool task_future_done(struct task_future *future);
+int task_future_wait(struct task_future *future);
+
+errval_t task_parallel_for(struct task_pool *pool, size_t begin, size_t end,
+                           size_t grain, task_range_func_t func, void *arg);
+
+__END_DECLS
+
+#endif // LIBBARRELFISH_TASK_POOL_H
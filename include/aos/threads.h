@@ -32,6 +32,14 @@ typedef int (*thread_func_t)(void *);
 /// Default size of a thread's stack
 #define THREADS_DEFAULT_STACK_BYTES     (64 * 1024)
 
+/// Thread priorities. The dispatcher runs the highest level that has
+/// runnable threads, round-robin within the level. A thread woken up with an
+/// event runs at least at THREAD_PRIORITY_HIGH until its timeslice ends.
+#define THREAD_PRIORITY_LOW             0   ///< Batch work, busy polling
+#define THREAD_PRIORITY_NORMAL          1   ///< Default of new threads
+#define THREAD_PRIORITY_HIGH            2   ///< Latency critical work
+#define THREAD_PRIORITIES               3
+
 struct thread *thread_create(thread_func_t start_func, void *data);
 struct thread *thread_create_varstack(thread_func_t start_func, void *arg,
                                       size_t stacksize);
@@ -48,6 +56,8 @@ void thread_pause_and_capture_state(struct thread *thread,
                                     arch_registers_state_t **ret_regs,
                                     arch_registers_fpu_state_t **ret_fpuregs);
 void thread_resume(struct thread *thread);
+void thread_set_priority(struct thread *thread, unsigned int priority);
+unsigned int thread_get_priority(struct thread *thread);
 
 void thread_mutex_init(struct thread_mutex *mutex);
 void thread_mutex_lock(struct thread_mutex *mutex);
@@ -90,6 +100,8 @@ void thread_set_rpc_in_progress(bool v);
 bool thread_get_rpc_in_progress(void);
 void thread_set_async_error(errval_t e);
 errval_t thread_get_async_error(void);
+void thread_set_cap_batch_enabled(bool enable);
+bool thread_get_cap_batch_enabled(void);
 
 extern __thread thread_once_t thread_once_local_epoch;
 extern void thread_once_internal(thread_once_t *control, void (*func)(void));
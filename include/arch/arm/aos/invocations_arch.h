@@ -16,6 +16,7 @@
 #define INCLUDEBARRELFISH_INVOCATIONS_ARCH_H
 
 #include <aos/syscall_arch.h> // for sys_invoke and cap_invoke
+#include <barrelfish_kpi/cap_batch.h>
 #include <barrelfish_kpi/dispatcher_shared.h>
 #include <barrelfish_kpi/distcaps.h>            // for distcap_state_t
 #include <barrelfish_kpi/syscalls.h>
@@ -75,6 +76,52 @@ static inline struct sysret cap_invoke(struct capref to, uintptr_t argc, uintptr
     assert(!"reached");
 }
 
+/**
+ * \brief Encode an invocation into a batch operation instead of invoking
+ *
+ * Takes the same arguments as cap_invoke, see also cap_batch_run().
+ */
+static inline void cap_invoke_encode(struct cap_batch_op *op,
+                                     struct capref to, uintptr_t argc,
+                                     uintptr_t cmd, uintptr_t arg2,
+                                     uintptr_t arg3, uintptr_t arg4,
+                                     uintptr_t arg5, uintptr_t arg6,
+                                     uintptr_t arg7, uintptr_t arg8,
+                                     uintptr_t arg9, uintptr_t arg10,
+                                     uintptr_t arg11)
+{
+    enum cnode_type invoke_level = get_cap_level(to);
+
+    assert(cmd <= 0xFF);
+    assert(invoke_level <= 0xF);
+    assert(argc <= 10);
+    // arg0 as built by the syscallN macros, with the argument count
+    op->args[0] = sysord((invoke_level << 16) | (cmd << 8) | SYSCALL_INVOKE,
+                         argc + 2);
+    op->args[1] = get_cap_addr(to);
+    op->args[2] = arg2;
+    op->args[3] = arg3;
+    op->args[4] = arg4;
+    op->args[5] = arg5;
+    op->args[6] = arg6;
+    op->args[7] = arg7;
+    op->args[8] = arg8;
+    op->args[9] = arg9;
+    op->args[10] = arg10;
+    op->args[11] = arg11;
+    op->err = SYS_ERR_OK;
+}
+
+/// Run an encoded invocation on its own
+static inline errval_t cap_invoke_op(struct cap_batch_op *op)
+{
+    op->err = syscall(op->args[1], op->args[2], op->args[3], op->args[4],
+                      op->args[5], op->args[6], op->args[7], op->args[8],
+                      op->args[9], op->args[10], op->args[11],
+                      op->args[0]).error;
+    return op->err;
+}
+
 #define cap_invoke11(to, _a, _b, _c, _d, _e, _f, _g, _h, _i, _j, _k)   \
     cap_invoke(to, 10, _a, _b, _c, _d, _e, _f, _g, _h, _i, _j, _k)
 #define cap_invoke10(to, _a, _b, _c, _d, _e, _f, _g, _h, _i, _j)   \
@@ -65,6 +65,42 @@ lmp_ep_send(
                      arg7, arg8, arg9).error;
 }
 
+/**
+ * \brief Send a message of up to LMP_LONG_MSG_LENGTH words, if possible
+ *
+ * The kernel copies the payload from the buffer into the receiver's endpoint
+ * in one go, so longer messages take a single system call. Fails with
+ * SYS_ERR_LMP_MSG_TOO_LONG if a message longer than LMP_MSG_LENGTH would take
+ * more than half of the receiver's endpoint buffer.
+ *
+ * \param ep Remote endpoint cap
+ * \param flags LMP send flags
+ * \param send_cap (Optional) capability to send with the message
+ * \param buf Message payload, must be mapped
+ * \param length_words Length of the message in words
+ */
+static inline errval_t
+lmp_ep_send_long(
+    struct capref ep,
+    lmp_send_flags_t flags,
+    struct capref send_cap,
+    const uintptr_t *buf,
+    size_t length_words
+    )
+{
+    enum cnode_type invoke_level = get_cap_level(ep);
+    capaddr_t invoke_cptr = get_cap_addr(ep);
+
+    enum cnode_type send_level = get_cap_level(send_cap);
+    capaddr_t send_cptr = get_cap_addr(send_cap);
+
+    assert(length_words <= LMP_LONG_MSG_LENGTH);
+    return syscall5(((flags & 0xf) << 24) | (invoke_level << 16) |
+                    (send_level << 8) | SYSCALL_LMP_LONG,
+                    invoke_cptr, send_cptr, (uintptr_t) buf,
+                    length_words).error;
+}
+
 #define lmp_ep_send9(ep, flags, send_cap, a, b, c, d, e, f, g, h, i)   \
     lmp_ep_send((ep),(flags),(send_cap),9,(a),(b),(c),(d),(e),(f),(g),(h),(i))
 #define lmp_ep_send8(ep, flags, send_cap, a, b, c, d, e, f, g, h)    \
@@ -90,6 +126,9 @@ lmp_ep_send(
     lmp_ep_send((lc)->remote_cap,(flags),(send_cap),(len),              \
                 (a),(b),(c),(d),(e),(f),(g),(h),(i))
 
+#define lmp_chan_send_long(lc,flags,send_cap,buf,len)                   \
+    lmp_ep_send_long((lc)->remote_cap,(flags),(send_cap),(buf),(len))
+
 #define lmp_chan_send9(lc,flags,send_cap,a,b,c,d,e,f,g,h,i)             \
     lmp_ep_send9((lc)->remote_cap,(flags),(send_cap),                   \
                  (a),(b),(c),(d),(e),(f),(g),(h),(i))
@@ -0,0 +1,38 @@
+/**
+ * \file
+ * \brief Batched capability invocations
+ */
+
+/*
+ * Copyright (c) 2016, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#ifndef BARRELFISH_KPI_CAP_BATCH_H
+#define BARRELFISH_KPI_CAP_BATCH_H
+
+#include <stdint.h>
+#include <errors/errno.h>
+
+#define CAP_BATCH_MAX_OPS       16  ///< Operations per SYSCALL_INVOKE_BATCH
+#define CAP_BATCH_OP_ARGS       12  ///< Arguments of an operation, arg0 included
+
+/**
+ * \brief One invocation of a batch
+ *
+ * The arguments are those of the SYSCALL_INVOKE it stands for, arg0 encoded
+ * as for the system call and arg1 the address of the invoked cap. The kernel
+ * runs the operations of a batch in order, stores the result of each in
+ * `err` and stops at the first that fails. Only CNode and VNode operations
+ * can be batched.
+ */
+struct cap_batch_op {
+    uintptr_t args[CAP_BATCH_OP_ARGS];
+    errval_t err;
+};
+
+#endif // BARRELFISH_KPI_CAP_BATCH_H
@@ -20,6 +20,9 @@
 
 #define LMP_RECV_HEADER_LENGTH  1 /* word */
 
+/// Longest message SYSCALL_LMP_LONG sends, the header has 8 bits of length
+#define LMP_LONG_MSG_LENGTH     255 /* words */
+
 #ifndef __ASSEMBLER__
 
 /// Incoming LMP endpoint message buffer
@@ -36,6 +39,7 @@ typedef enum lmp_send_flag {
     LMP_FLAG_SYNC       = 1 << 0,
     LMP_FLAG_YIELD      = 1 << 1,
     LMP_FLAG_GIVEAWAY   = 1 << 2,
+    LMP_FLAG_CALL       = 1 << 3,   ///< With SYNC: block until a message arrives
 } lmp_send_flags_t;
 
 #define LMP_SEND_FLAGS_DEFAULT (LMP_FLAG_SYNC | LMP_FLAG_YIELD)
@@ -60,7 +60,13 @@ struct sysret {
 #define SYSCALL_ARMv7_CACHE_CLEAN    8    ///< Clean (write back) by VA
 #define SYSCALL_ARMv7_CACHE_INVAL    9    ///< Invalidate (discard) by VA
 
-#define SYSCALL_COUNT               12     ///< Number of syscalls [0..SYSCALL_COUNT - 1]
+/* LMP messages longer than the registers */
+#define SYSCALL_LMP_LONG            12    ///< Send an LMP message from a user buffer
+
+/* Several capability invocations in one kernel entry */
+#define SYSCALL_INVOKE_BATCH        13    ///< Run a batch of invocations, see cap_batch.h
+
+#define SYSCALL_COUNT               14     ///< Number of syscalls [0..SYSCALL_COUNT - 1]
 
 /*
  * To understand system calls it might be helpful to know that there
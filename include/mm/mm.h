@@ -21,9 +21,16 @@
 #include <aos/capabilities.h>
 #include <aos/slab.h>
 #include "slot_alloc.h"
+#include "mm_seg.h"
 
 __BEGIN_DECLS
 
+/// How an mm keeps track of its memory.
+enum mm_backend {
+    MM_BACKEND_LIST,       ///< Address ordered list, first fit
+    MM_BACKEND_SEGREGATED  ///< Segregated free lists, O(log n), see mm_seg.h
+};
+
 enum nodetype {
     NodeType_Free,      ///< This region exists and is free
     NodeType_Allocated, ///< This region exists and is allocated
@@ -55,18 +62,30 @@ struct mmnode {
  * them to allocate its memory, we declare it in the public header.
  */
 struct mm {
-    struct slab_allocator slabs; ///< Slab allocator used for allocating nodes
+    struct slab_cache slabs;     ///< Slab cache used for allocating nodes
     slot_alloc_t slot_alloc;     ///< Slot allocator for allocating cspace
     slot_refill_t slot_refill;   ///< Slot allocator refill function
     void *slot_alloc_inst;       ///< Opaque instance pointer for slot allocator
+    struct capref spare_slot;    ///< Slot given back by a failed allocation
     enum objtype objtype;        ///< Type of capabilities stored
     struct mmnode *head;         ///< Head of doubly-linked list of nodes in order
     bool refilling_slabs;        ///< This indicates that a slab refilling is taking place
     genpaddr_t initial_base;     ///< Store the initial offset of the ram cap
     struct capref ram_cap;
+    enum mm_backend backend;     ///< Backend chosen at mm_init
+    struct mm_seg seg;           ///< State of the segregated backend
 };
 
+/// Size of the slab objects an mm allocates its nodes from.
+#define MM_NODE_SIZE                                                          \
+    (sizeof(struct mmnode) > sizeof(struct mm_seg_node) ?                    \
+         sizeof(struct mmnode) : sizeof(struct mm_seg_node))
+
+/// Nodes the slab refill thread keeps free for an mm.
+#define MM_SLAB_WATERMARK 32
+
 errval_t mm_init(struct mm *mm, enum objtype objtype,
+                     enum mm_backend backend,
                      slab_refill_func_t slab_refill_func,
                      slot_alloc_t slot_alloc_func,
                      slot_refill_t slot_refill_func,
@@ -0,0 +1,66 @@
+/**
+ * \file
+ * \brief Segregated free list range allocator
+ *
+ * Bookkeeping of the segregated mm backend. It only deals with address
+ * ranges, the caps are handled in mm.c. Free ranges sit in power of two size
+ * classes, all ranges are kept in an AVL tree and a list ordered by base
+ * address, so allocating, freeing and coalescing are O(log n).
+ *
+ * This file does not depend on anything Barrelfish specific, so the host
+ * side allocator benchmark in tools/mmbench can build it as is.
+ */
+
+#ifndef AOS_MM_SEG_H
+#define AOS_MM_SEG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MM_SEG_CLASSES 64
+
+/**
+ * \brief A range of the address space managed by a struct mm_seg
+ */
+struct mm_seg_node {
+    uint64_t base;                   ///< Base address of this range
+    uint64_t size;                   ///< Size of this range
+    bool free;                       ///< Whether the range can be allocated
+    struct mm_seg_node *prev;        ///< Previous range by address
+    struct mm_seg_node *next;        ///< Next range by address
+    struct mm_seg_node *left;        ///< Tree child with a lower base
+    struct mm_seg_node *right;       ///< Tree child with a higher base
+    int height;                      ///< Height of the subtree
+    struct mm_seg_node *class_prev;  ///< Free list of the size class
+    struct mm_seg_node *class_next;
+};
+
+typedef struct mm_seg_node *(*mm_seg_node_alloc_t)(void *arg);
+typedef void (*mm_seg_node_free_t)(void *arg, struct mm_seg_node *node);
+
+/**
+ * \brief Segregated free list allocator instance
+ */
+struct mm_seg {
+    struct mm_seg_node *root;        ///< AVL tree of all ranges by base
+    struct mm_seg_node *head;        ///< List of all ranges by base
+    struct mm_seg_node *classes[MM_SEG_CLASSES]; ///< Free ranges by size
+    uint64_t nonempty;               ///< Bit c is set iff classes[c] != NULL
+    uint64_t granule;                ///< Alignment of every range
+    mm_seg_node_alloc_t node_alloc;  ///< Allocates node memory
+    mm_seg_node_free_t node_free;    ///< Frees node memory
+    void *node_arg;                  ///< Passed to node_alloc and node_free
+};
+
+void mm_seg_init(struct mm_seg *seg, uint64_t granule,
+                 mm_seg_node_alloc_t node_alloc,
+                 mm_seg_node_free_t node_free, void *node_arg);
+bool mm_seg_add(struct mm_seg *seg, uint64_t base, uint64_t size);
+struct mm_seg_node *mm_seg_alloc(struct mm_seg *seg, uint64_t size,
+                                 uint64_t alignment);
+struct mm_seg_node *mm_seg_lookup(struct mm_seg *seg, uint64_t base);
+void mm_seg_free(struct mm_seg *seg, struct mm_seg_node *node);
+void mm_seg_destroy(struct mm_seg *seg);
+
+#endif /* AOS_MM_SEG_H */
@@ -63,7 +63,8 @@
 #define KPI_PAGING_FLAGS_WRITE   0x02
 #define KPI_PAGING_FLAGS_EXECUTE 0x04
 #define KPI_PAGING_FLAGS_NOCACHE 0x08
-#define KPI_PAGING_FLAGS_MASK    0x0f
+#define KPI_PAGING_FLAGS_LARGE   0x40 // L2 only: map 64K large pages
+#define KPI_PAGING_FLAGS_MASK    0x4f
 
 union arm_l1_entry {
     uint32_t raw;
@@ -176,6 +177,7 @@ union arm_l2_entry {
 
 #define BYTES_PER_SECTION       ARM_L1_SECTION_BYTES
 #define BYTES_PER_LARGE_PAGE    0x10000
+#define PTES_PER_LARGE_PAGE     (BYTES_PER_LARGE_PAGE / BYTES_PER_PAGE)
 #define BYTES_PER_PAGE          0x1000
 #define BYTES_PER_SMALL_PAGE    ARM_L2_TABLE_BYTES
 
@@ -53,6 +53,21 @@ paging_set_flags(union arm_l2_entry *entry, uintptr_t kpi_paging_flags)
         entry->small_page.ap2 = 0;
 }
 
+static inline void
+paging_set_large_flags(union arm_l2_entry *entry, uintptr_t kpi_paging_flags)
+{
+        entry->large_page.tex = 1; /* Write-allocate. */
+        entry->large_page.shareable = 1; /* Coherent. */
+        entry->large_page.bufferable = 1;
+        entry->large_page.cacheable =
+            (kpi_paging_flags & KPI_PAGING_FLAGS_NOCACHE) ? 0 : 1;
+        entry->large_page.ap10  =
+            (kpi_paging_flags & KPI_PAGING_FLAGS_READ)  ? 2 : 0;
+        entry->large_page.ap10 |=
+            (kpi_paging_flags & KPI_PAGING_FLAGS_WRITE) ? 3 : 0;
+        entry->large_page.ap2 = 0;
+}
+
 static void map_kernel_section_hi(lvaddr_t va, union arm_l1_entry l1);
 static union arm_l1_entry make_dev_section(lpaddr_t pa);
 static void paging_print_l1_pte(lvaddr_t va, union arm_l1_entry pte);
@@ -341,6 +356,7 @@ caps_map_l1(struct capability* dest,
     if (src->type != ObjType_VNode_ARM_l2) {
         //large page mapping goes here
         assert(0 == (kpi_paging_flags & ~KPI_PAGING_FLAGS_MASK));
+        kpi_paging_flags &= ~KPI_PAGING_FLAGS_LARGE;
 
         // ARM L1 has 4K entries, we need to fill in individual entries for
         // 1M sections
@@ -393,6 +409,8 @@ caps_map_l1(struct capability* dest,
             entry->raw = 0;
 
             entry->section.type = L1_TYPE_SECTION_ENTRY;
+            entry->section.tex = 1; /* Write-allocate, as for small pages. */
+            entry->section.shareable = 1;
             entry->section.bufferable = 1;
             entry->section.cacheable = (kpi_paging_flags & KPI_PAGING_FLAGS_NOCACHE)? 0: 1;
             entry->section.ap10 = (kpi_paging_flags & KPI_PAGING_FLAGS_READ)? 2:0;
@@ -400,14 +418,14 @@ caps_map_l1(struct capability* dest,
             entry->section.ap2 = 0;
             entry->section.base_address = (src_lpaddr + i * BYTES_PER_SECTION) >> 20;
 
-            entry++;
-
             /* Clean the modified entry to L2 cache. */
             clean_to_pou(entry);
 
-            debug(SUBSYS_PAGING, "L2 mapping %08"PRIxLVADDR"[%"PRIuCSLOT
+            debug(SUBSYS_PAGING, "L1 section %08"PRIxLVADDR"[%"PRIuCSLOT
                                  "] @%p = %08"PRIx32"\n",
-                   dest_lvaddr, slot, entry, entry->raw);
+                   dest_lvaddr, slot + i, entry, entry->raw);
+
+            entry++;
         }
 
         // Flush TLB if remapping.
@@ -492,12 +510,20 @@ caps_map_l2(struct capability* dest,
             struct cte*        mapping_cte)
 {
     assert(0 == (kpi_paging_flags & ~KPI_PAGING_FLAGS_MASK));
+    bool large = kpi_paging_flags & KPI_PAGING_FLAGS_LARGE;
 
     if (slot >= ARM_L2_MAX_ENTRIES) {
         panic("oops: slot >= 256");
         return SYS_ERR_VNODE_SLOT_INVALID;
     }
 
+    // A 64K page takes 16 identical entries, pte_count still counts 4K
+    // entries, so unmapping needs no special case.
+    if (large && ((slot % PTES_PER_LARGE_PAGE) != 0 ||
+                  (pte_count % PTES_PER_LARGE_PAGE) != 0)) {
+        return SYS_ERR_VM_MAP_SIZE;
+    }
+
     if (src->type != ObjType_Frame && src->type != ObjType_DevFrame) {
         panic("oops: src->type != ObjType_Frame && src->type != ObjType_DevFrame");
         return SYS_ERR_WRONG_MAPPING;
@@ -527,6 +553,9 @@ caps_map_l2(struct capability* dest,
     if ((src_lpaddr & (BASE_PAGE_SIZE - 1))) {
         panic("Invalid target");
     }
+    if (large && (src_lpaddr & (BYTES_PER_LARGE_PAGE - 1))) {
+        return SYS_ERR_FRAME_OFFSET_INVALID;
+    }
 
     create_mapping_cap(mapping_cte, src,
                        dest_lpaddr + slot * sizeof(union arm_l2_entry),
@@ -536,9 +565,16 @@ caps_map_l2(struct capability* dest,
     for (int i = 0; i < pte_count; i++) {
         entry->raw = 0;
 
-        entry->small_page.type = L2_TYPE_SMALL_PAGE;
-        paging_set_flags(entry, kpi_paging_flags);
-        entry->small_page.base_address = (src_lpaddr + i * BASE_PAGE_SIZE) >> 12;
+        if (large) {
+            entry->large_page.type = L2_TYPE_LARGE_PAGE;
+            paging_set_large_flags(entry, kpi_paging_flags);
+            entry->large_page.base_address =
+                (src_lpaddr + (i / PTES_PER_LARGE_PAGE) * BYTES_PER_LARGE_PAGE) >> 16;
+        } else {
+            entry->small_page.type = L2_TYPE_SMALL_PAGE;
+            paging_set_flags(entry, kpi_paging_flags);
+            entry->small_page.base_address = (src_lpaddr + i * BASE_PAGE_SIZE) >> 12;
+        }
 
         /* Clean the modified entry to L2 cache. */
         clean_to_pou(entry);
@@ -632,7 +668,11 @@ errval_t paging_modify_flags(struct capability *mapping, uintptr_t offset,
     for (int i = 0; i < pages; i++) {
         union arm_l2_entry *entry =
             (union arm_l2_entry *)base + i;
-        paging_set_flags(entry, kpi_paging_flags);
+        if (L2_TYPE(entry->raw) == L2_TYPE_LARGE_PAGE) {
+            paging_set_large_flags(entry, kpi_paging_flags);
+        } else {
+            paging_set_flags(entry, kpi_paging_flags);
+        }
 
         /* Clean the modified entry to L2 cache. */
         clean_to_pou(entry);
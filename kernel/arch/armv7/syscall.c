@@ -26,8 +26,11 @@
 #include <arch/arm/syscall_arm.h>
 #include <useraccess.h>
 #include <platform.h>
+#include <kcb.h>
 #include <startup_arch.h>
 #include <systime.h>
+#include <wakeup.h>
+#include <barrelfish_kpi/cap_batch.h>
 
 // helper macros  for invocation handler definitions
 #define INVOCATION_HANDLER(func) \
@@ -1102,6 +1105,79 @@ static invocation_t invocations[ObjType_Num][CAP_MAX_CMD] = {
     }
 };
 
+/**
+ * \brief Switch to the receiver of an LMP message if the send flags ask for it
+ *
+ * Does not return if it switches, the result of the send is then stored in
+ * the sender's r0.
+ */
+static void lmp_switch_after_send(arch_registers_state_t *context,
+                                  struct dcb *listener, uint8_t flags,
+                                  errval_t err)
+{
+    // does the sender want to yield their timeslice on success?
+    bool sync = flags & LMP_FLAG_SYNC;
+    // does the sender want to yield to the target
+    // if undeliverable?
+    bool yield = flags & LMP_FLAG_YIELD;
+    // does the sender wait for the reply with nothing else to do?
+    bool call = flags & LMP_FLAG_CALL;
+
+    /* Switch to reciever upon successful delivery
+     * with sync flag, or (some cases of)
+     * unsuccessful delivery with yield flag */
+    enum err_code err_code = err_no(err);
+    if ((sync && err_is_ok(err)) ||
+        (yield && (err_code == SYS_ERR_LMP_BUF_OVERFLOW
+                   || err_code == SYS_ERR_LMP_CAPTRANSFER_DST_CNODE_LOOKUP
+                   || err_code == SYS_ERR_LMP_CAPTRANSFER_DST_CNODE_INVALID
+                   || err_code == SYS_ERR_LMP_CAPTRANSFER_DST_SLOT_OCCUPIED))
+       ) {
+        if (err_is_fail(err)) {
+            struct dispatcher_shared_generic *current_disp =
+                get_dispatcher_shared_generic(dcb_current->disp);
+            struct dispatcher_shared_generic *listener_disp =
+                get_dispatcher_shared_generic(listener->disp);
+            debug(SUBSYS_DISPATCH, "LMP failed; %.*s yields to %.*s: %u\n",
+                  DISP_NAME_LEN, current_disp->name,
+                  DISP_NAME_LEN, listener_disp->name, err_code);
+        }
+
+        // special-case context switch: ensure correct state in current DCB
+        dispatcher_handle_t handle = dcb_current->disp;
+        struct dispatcher_shared_arm *disp =
+            get_dispatcher_shared_arm(handle);
+        dcb_current->disabled = dispatcher_is_disabled_ip(handle, context->named.pc);
+        if (dcb_current->disabled) {
+            assert(context == &disp->disabled_save_area);
+            context->named.r0 = err;
+        }
+        else {
+            assert(context == &disp->enabled_save_area);
+            context->named.r0 = err;
+        }
+
+        /* A call blocks the sender until a message arrives for it, like a
+         * yield without work would. Its dispatcher stays the one last
+         * dispatched by the scheduler, so the time the receiver runs until
+         * the next schedule() is charged to the sender. */
+        if (call && err_is_ok(err)) {
+            struct dispatcher_shared_generic *current_disp =
+                get_dispatcher_shared_generic(handle);
+            systime_t wakeup = current_disp->wakeup;
+            if (current_disp->lmp_delivered == current_disp->lmp_seen
+                && (wakeup == 0 ||
+                    wakeup > systime_now() + kcb_current->kernel_off)) {
+                scheduler_remove(dcb_current);
+                if (wakeup != 0) {
+                    wakeup_set(dcb_current, wakeup);
+                }
+            }
+        }
+        dispatch(listener);
+    }
+}
+
 static struct sysret
 handle_invoke(arch_registers_state_t *context, int argc)
 {
@@ -1142,11 +1218,6 @@ handle_invoke(arch_registers_state_t *context, int argc)
                 /* limit length of message from buggy/malicious sender */
                 length_words = min(length_words, LMP_MSG_LENGTH);
 
-                // does the sender want to yield their timeslice on success?
-                bool sync = flags & LMP_FLAG_SYNC;
-                // does the sender want to yield to the target
-                // if undeliverable?
-                bool yield = flags & LMP_FLAG_YIELD;
                 // is the cap (if present) to be deleted on send?
                 bool give_away = flags & LMP_FLAG_GIVEAWAY;
 
@@ -1170,41 +1241,7 @@ handle_invoke(arch_registers_state_t *context, int argc)
                 r.error = lmp_deliver(to, dcb_current, msg_words,
                                       length_words, send_cptr, send_level, give_away);
 
-                /* Switch to reciever upon successful delivery
-                 * with sync flag, or (some cases of)
-                 * unsuccessful delivery with yield flag */
-                enum err_code err_code = err_no(r.error);
-                if ((sync && err_is_ok(r.error)) ||
-                    (yield && (err_code == SYS_ERR_LMP_BUF_OVERFLOW
-                               || err_code == SYS_ERR_LMP_CAPTRANSFER_DST_CNODE_LOOKUP
-                               || err_code == SYS_ERR_LMP_CAPTRANSFER_DST_CNODE_INVALID
-                               || err_code == SYS_ERR_LMP_CAPTRANSFER_DST_SLOT_OCCUPIED))
-                   ) {
-                    if (err_is_fail(r.error)) {
-                        struct dispatcher_shared_generic *current_disp =
-                            get_dispatcher_shared_generic(dcb_current->disp);
-                        struct dispatcher_shared_generic *listener_disp =
-                            get_dispatcher_shared_generic(listener->disp);
-                        debug(SUBSYS_DISPATCH, "LMP failed; %.*s yields to %.*s: %u\n",
-                              DISP_NAME_LEN, current_disp->name,
-                              DISP_NAME_LEN, listener_disp->name, err_code);
-                    }
-
-                    // special-case context switch: ensure correct state in current DCB
-                    dispatcher_handle_t handle = dcb_current->disp;
-                    struct dispatcher_shared_arm *disp =
-                        get_dispatcher_shared_arm(handle);
-                    dcb_current->disabled = dispatcher_is_disabled_ip(handle, context->named.pc);
-                    if (dcb_current->disabled) {
-                        assert(context == &disp->disabled_save_area);
-                        context->named.r0 = r.error;
-                    }
-                    else {
-                        assert(context == &disp->enabled_save_area);
-                        context->named.r0 = r.error;
-                    }
-                    dispatch(listener);
-                }
+                lmp_switch_after_send(context, listener, flags, r.error);
             }
             else {
                 r.error = SYS_ERR_LMP_NO_TARGET;
@@ -1236,6 +1273,188 @@ handle_invoke(arch_registers_state_t *context, int argc)
     return r;
 }
 
+/**
+ * \brief Send an LMP message of up to LMP_LONG_MSG_LENGTH words
+ *
+ * Like an endpoint invocation, but the payload is copied straight from the
+ * sender's buffer instead of the registers. arg0 is encoded as for an
+ * invocation, arg1 is the endpoint, arg2 the cap to send, arg3 the buffer
+ * and arg4 its length in words. Messages longer than LMP_MSG_LENGTH may take
+ * at most half of the receiver's endpoint buffer.
+ */
+static struct sysret
+handle_lmp_long(arch_registers_state_t *context, int argc)
+{
+    struct registers_arm_syscall_args* sa = &context->syscall_args;
+
+    if (argc != 5) {
+        return SYSRET(SYS_ERR_INVARGS_SYSCALL);
+    }
+
+    uint8_t   flags        = (sa->arg0 >> 24) & 0xf;
+    uint8_t   invoke_level = (sa->arg0 >> 16) & 0xff;
+    uint8_t   send_level   = (sa->arg0 >> 8) & 0xff;
+    capaddr_t invoke_cptr  = sa->arg1;
+    capaddr_t send_cptr    = sa->arg2;
+    lvaddr_t  buf          = sa->arg3;
+    size_t    length_words = sa->arg4;
+
+    if (length_words > LMP_LONG_MSG_LENGTH) {
+        return SYSRET(SYS_ERR_LMP_MSG_TOO_LONG);
+    }
+    if (!access_ok(ACCESS_READ, buf, length_words * sizeof(uintptr_t))) {
+        return SYSRET(SYS_ERR_INVALID_USER_BUFFER);
+    }
+
+    struct capability *to;
+    errval_t err = caps_lookup_cap(&dcb_current->cspace.cap, invoke_cptr,
+                                   invoke_level, &to, CAPRIGHTS_READ);
+    if (err_is_fail(err)) {
+        return SYSRET(err);
+    }
+    if (to->type != ObjType_EndPoint) {
+        return SYSRET(SYS_ERR_ILLEGAL_INVOCATION);
+    }
+    // Receivers size their endpoints for two messages of the longest kind
+    // they read, so a long message may take at most half of the buffer.
+    // Anything longer would not fit the receiver's message buffer.
+    if (length_words > LMP_MSG_LENGTH &&
+        2 * (length_words + LMP_RECV_HEADER_LENGTH) >
+            to->u.endpoint.epbuflen) {
+        return SYSRET(SYS_ERR_LMP_MSG_TOO_LONG);
+    }
+
+    struct dcb *listener = to->u.endpoint.listener;
+    assert(listener != NULL);
+    if (!listener->disp) {
+        return SYSRET(SYS_ERR_LMP_NO_TARGET);
+    }
+
+    // the sender's address space is still the current one, so the payload
+    // goes into the receiver's endpoint without an intermediate copy
+    err = lmp_deliver(to, dcb_current, (uintptr_t *) buf, length_words,
+                      send_cptr, send_level, flags & LMP_FLAG_GIVEAWAY);
+    lmp_switch_after_send(context, listener, flags, err);
+    return SYSRET(err);
+}
+
+/**
+ * \brief Argument count of the invocations a batch may contain, 0 for all
+ * others.
+ *
+ * These handlers only look at the syscall arguments, never take dcb_current
+ * off the run queue and assert on the argument count, which is checked here
+ * before calling them.
+ */
+static uint8_t batch_argc(enum objtype type, uint8_t cmd)
+{
+    switch (type) {
+    case ObjType_L1CNode:
+    case ObjType_L2CNode:
+        switch (cmd) {
+        case CNodeCmd_Copy:     return 9;
+        case CNodeCmd_Mint:     return 11;
+        case CNodeCmd_Retype:   return 11;
+        case CNodeCmd_Delete:   return 4;
+        case CNodeCmd_Create:   return 7;
+        default:                return 0;
+        }
+    case ObjType_VNode_ARM_l1:
+    case ObjType_VNode_ARM_l2:
+        switch (cmd) {
+        case VNodeCmd_Map:      return 10;
+        case VNodeCmd_Unmap:    return 4;
+        default:                return 0;
+        }
+    default:
+        return 0;
+    }
+}
+
+/**
+ * \brief Run a batch of capability invocations
+ *
+ * arg1 points to an array of struct cap_batch_op, arg2 is its length. The
+ * operations run in order until one fails, each gets its result written
+ * back. The return value is the number of operations that succeeded, the
+ * error that of the failing one.
+ */
+static struct sysret
+handle_invoke_batch(arch_registers_state_t *context, int argc)
+{
+    struct registers_arm_syscall_args* sa = &context->syscall_args;
+
+    if (argc != 3) {
+        return SYSRET(SYS_ERR_INVARGS_SYSCALL);
+    }
+
+    struct cap_batch_op *ops = (struct cap_batch_op *) sa->arg1;
+    size_t count = sa->arg2;
+    if (count > CAP_BATCH_MAX_OPS) {
+        return SYSRET(SYS_ERR_INVARGS_SYSCALL);
+    }
+    // the results are written back into ops, so a buffer reaching into
+    // the kernel window must be turned down before the first operation
+    if (!access_ok(ACCESS_WRITE, (lvaddr_t) ops, count * sizeof(*ops))) {
+        return SYSRET(SYS_ERR_INVALID_USER_BUFFER);
+    }
+
+    struct sysret r = { .error = SYS_ERR_OK, .value = 0 };
+    // the handlers read their arguments from a register save area
+    arch_registers_state_t op_context;
+    struct registers_arm_syscall_args *op_sa = &op_context.syscall_args;
+
+    for (size_t i = 0; i < count; i++) {
+        // copy the arguments once, the user may change them meanwhile
+        uintptr_t args[CAP_BATCH_OP_ARGS];
+        memcpy(args, ops[i].args, sizeof(args));
+
+        uint8_t op_argc = (args[0] >> 4) & 0xf;
+        uint8_t invoke_level = (args[0] >> 16) & 0xff;
+        uint8_t cmd = (args[0] >> 8) & 0xff;
+
+        struct capability *to;
+        if ((args[0] & 0xf) != SYSCALL_INVOKE) {
+            r.error = SYS_ERR_INVARGS_SYSCALL;
+        } else {
+            r.error = caps_lookup_cap(&dcb_current->cspace.cap, args[1],
+                                      invoke_level, &to, CAPRIGHTS_READ);
+        }
+        if (err_is_ok(r.error)) {
+            uint8_t expected = batch_argc(to->type, cmd);
+            if (expected == 0 || expected != op_argc) {
+                printk(LOG_ERR, "Bad batched invocation type %d cmd %d "
+                       "argc %d\n", to->type, cmd, op_argc);
+                r.error = SYS_ERR_ILLEGAL_INVOCATION;
+            }
+        }
+        if (err_is_ok(r.error)) {
+            op_sa->arg0 = args[0];
+            op_sa->arg1 = args[1];
+            op_sa->arg2 = args[2];
+            op_sa->arg3 = args[3];
+            op_sa->arg4 = args[4];
+            op_sa->arg5 = args[5];
+            op_sa->arg6 = args[6];
+            op_sa->arg7 = args[7];
+            op_sa->arg8 = args[8];
+            op_sa->arg9 = args[9];
+            op_sa->arg10 = args[10];
+            op_sa->arg11 = args[11];
+            r.error = invocations[to->type][cmd](to, &op_context,
+                                                 op_argc).error;
+        }
+
+        ops[i].err = r.error;
+        if (err_is_fail(r.error)) {
+            break;
+        }
+        r.value++;
+    }
+
+    return r;
+}
+
 static struct sysret handle_debug_syscall(int msg)
 {
     struct sysret retval = { .error = SYS_ERR_OK };
@@ -1331,6 +1550,14 @@ void sys_syscall(arch_registers_state_t* context,
             r = handle_invoke(context, argc);
             break;
 
+        case SYSCALL_LMP_LONG:
+            r = handle_lmp_long(context, argc);
+            break;
+
+        case SYSCALL_INVOKE_BATCH:
+            r = handle_invoke_batch(context, argc);
+            break;
+
         case SYSCALL_YIELD:
             if (argc == 2)
             {
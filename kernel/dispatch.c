@@ -13,6 +13,7 @@
  */
 
 #include <kernel.h>
+#include <string.h>
 #include <barrelfish_kpi/cpu.h>
 #include <exec.h> /* XXX wait_for_interrupt, resume, execute */
 #include <paging_kernel_arch.h>
@@ -303,6 +304,11 @@ errval_t lmp_can_deliver_payload(struct capability *ep,
         return SYS_ERR_LMP_EP_STATE_INVALID;
     }
 
+    /* A message that can never fit is not worth retrying */
+    if (payload_len + LMP_RECV_HEADER_LENGTH >= epbuflen) {
+        return SYS_ERR_LMP_MSG_TOO_LONG;
+    }
+
     /* compute space available in endpoint */
     uint32_t epspace;
     if (pos >= consumed) {
@@ -377,12 +383,16 @@ errval_t lmp_deliver_payload(struct capability *ep, struct dcb *send,
         pos = 0;
     }
 
-    /* Transfer the msg */
-    for(int i = 0; i < payload_len; i++) {
-        recv_ep->buf[pos] = payload[i];
-        if (++pos == epbuflen) {
-            pos = 0;
-        }
+    /* Transfer the msg, in two pieces if it wraps around the buffer end */
+    size_t first = min(payload_len, epbuflen - pos);
+    memcpy(&recv_ep->buf[pos], payload, first * sizeof(uintptr_t));
+    if (first < payload_len) {
+        memcpy(&recv_ep->buf[0], payload + first,
+               (payload_len - first) * sizeof(uintptr_t));
+    }
+    pos += payload_len;
+    if (pos >= epbuflen) {
+        pos -= epbuflen;
     }
 
     // update the delivered pos
@@ -421,7 +431,7 @@ errval_t lmp_deliver(struct capability *ep, struct dcb *send,
     assert(ep->type == ObjType_EndPoint);
     struct dcb *recv = ep->u.endpoint.listener;
     assert(recv != NULL);
-    assert(payload != NULL);
+    assert(payload != NULL || len == 0);
 
     errval_t err;
 
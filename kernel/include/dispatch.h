@@ -52,12 +52,16 @@ struct dcb {
 
     struct dcb          *next;          ///< Next DCB in schedule
     struct dcb          *prev;          ///< Previous DCB in schedule
-                                        /// (only valid iff CONFIG_SCHEDULER_RR)
 #if defined(CONFIG_SCHEDULER_RBED)
     systime_t          release_time, etime, last_dispatch;
     systime_t          wcet, period, deadline;
     unsigned short      weight;
     enum task_type      type;
+    /// Run queue heap links, see schedule_rbed.c
+    struct dcb          *heap_child, *heap_sibling, *heap_prev;
+    systime_t           heap_key, heap_key2; ///< Keys when last sorted in
+    uint64_t            heap_seq;       ///< Insertion order among equal keys
+    uint8_t             heap_id;        ///< Which heap it is in
 #endif
 };
 
@@ -54,8 +54,11 @@ struct kcb {
     enum sched_state sched;
     /// RR scheduler state
     struct dcb *ring_current;
-    /// RBED scheduler state
+    /// RBED scheduler state, queue_head is a list of all queued DCBs in
+    /// insertion order, the heaps order them
     struct dcb *queue_head, *queue_tail;
+    struct dcb *ready_heap, *release_heap;
+    uint64_t queue_seq;
     unsigned int u_hrt, u_srt, w_be, n_be;
     /// current time since kernel start in timeslices. This is necessary to
     /// make the scheduler work correctly
@@ -50,6 +50,22 @@
  *  for best-effort tasks the scheduler is responsible to assigns proper values
  *  the RT parameters. Also, To prioritize between BE tasks, the scheduler uses
  *  ->weight.
+ *
+ * run queue:
+ *  kcb->queue_head links all queued DCBs through ->next and ->prev in
+ *  insertion order, for walking them. The order comes from pairing heaps
+ *  threaded through the ->heap_* fields. Released tasks are ordered by
+ *  deadline (this is doing EDF), then release time, so a best-effort task
+ *  that used up its budget and got re-released goes behind the others with
+ *  the same deadline. Tasks released in the future wait in the release heap,
+ *  ordered by release time, until schedule() sees their release time pass.
+ *  Remaining ties are broken by insertion order, so best-effort tasks with
+ *  equal deadlines and release times get scheduled round-robin. Inserting is
+ *  O(1), removing O(log n) amortized.
+ *
+ *  The heaps compare the keys a task had when it was last sorted in. Code
+ *  changing the deadline or release time of a queued task has to re-sort it
+ *  with queue_rekey().
  */
 
 #include <limits.h>
@@ -65,9 +81,11 @@
 
 /**
  * Minimum resource rate reserved for best-effort processes, in #SPECTRUM.
- * We set this to 10%.
+ * We set this to 10%. tools/schedsim can be built with other values.
  */
+#ifndef BETA
 #define BETA            (SPECTRUM / 10)
+#endif
 
 #define MAX(a, b)       ((a) > (b) ? (a) : (b))
 #define MIN(a, b)       ((a) < (b) ? (a) : (b))
@@ -90,6 +108,99 @@ static inline bool in_queue(struct dcb *dcb)
     return dcb->next != NULL || kcb_current->queue_tail == dcb;
 }
 
+/// Heap order, earlier keys first, then earlier insertion
+static inline bool heap_before(struct dcb *a, struct dcb *b)
+{
+    if(a->heap_key != b->heap_key) {
+        return a->heap_key < b->heap_key;
+    }
+    if(a->heap_key2 != b->heap_key2) {
+        return a->heap_key2 < b->heap_key2;
+    }
+    return a->heap_seq < b->heap_seq;
+}
+
+/**
+ * \brief Melds two heaps, returns the new root.
+ *
+ * The loser becomes the first child of the winner. ->heap_prev of a first
+ * child points to its parent, of later children to the previous sibling.
+ */
+static struct dcb *heap_meld(struct dcb *a, struct dcb *b)
+{
+    if(a == NULL) {
+        return b;
+    }
+    if(b == NULL) {
+        return a;
+    }
+    if(heap_before(b, a)) {
+        struct dcb *t = a;
+        a = b;
+        b = t;
+    }
+    b->heap_prev = a;
+    b->heap_sibling = a->heap_child;
+    if(a->heap_child != NULL) {
+        a->heap_child->heap_prev = b;
+    }
+    a->heap_child = b;
+    return a;
+}
+
+/// Melds a list of siblings pairwise left to right, then right to left
+static struct dcb *heap_meld_pairs(struct dcb *first)
+{
+    struct dcb *pairs = NULL;
+    while(first != NULL) {
+        struct dcb *a = first, *b = first->heap_sibling;
+        first = b != NULL ? b->heap_sibling : NULL;
+        a->heap_sibling = a->heap_prev = NULL;
+        if(b != NULL) {
+            b->heap_sibling = b->heap_prev = NULL;
+        }
+        struct dcb *m = heap_meld(a, b);
+        m->heap_sibling = pairs;
+        pairs = m;
+    }
+
+    struct dcb *root = NULL;
+    while(pairs != NULL) {
+        struct dcb *next = pairs->heap_sibling;
+        pairs->heap_sibling = NULL;
+        root = heap_meld(root, pairs);
+        pairs = next;
+    }
+    return root;
+}
+
+static void heap_insert(struct dcb **root, struct dcb *dcb)
+{
+    dcb->heap_child = dcb->heap_sibling = dcb->heap_prev = NULL;
+    *root = heap_meld(*root, dcb);
+}
+
+static void heap_remove(struct dcb **root, struct dcb *dcb)
+{
+    struct dcb *sub = heap_meld_pairs(dcb->heap_child);
+    if(dcb == *root) {
+        *root = sub;
+    } else {
+        // Cut the subtree of dcb out, then meld what was below it back in
+        struct dcb *prev = dcb->heap_prev;
+        if(prev->heap_child == dcb) {
+            prev->heap_child = dcb->heap_sibling;
+        } else {
+            prev->heap_sibling = dcb->heap_sibling;
+        }
+        if(dcb->heap_sibling != NULL) {
+            dcb->heap_sibling->heap_prev = prev;
+        }
+        *root = heap_meld(*root, sub);
+    }
+    dcb->heap_child = dcb->heap_sibling = dcb->heap_prev = NULL;
+}
+
 static inline unsigned int u_target(struct dcb *dcb)
 {
     return (dcb->wcet * SPECTRUM) / dcb->period;
@@ -97,8 +208,11 @@ static inline unsigned int u_target(struct dcb *dcb)
 
 static inline unsigned int u_actual_srt(struct dcb *dcb)
 {
-    if(u_target(dcb) != 0) {
-        return MIN(u_target(dcb), (1 - BETA - kcb_current->u_hrt) / (kcb_current->u_srt / u_target(dcb)));
+    if(u_target(dcb) != 0 && kcb_current->u_srt != 0) {
+        // Soft real-time tasks share what hard real-time and best-effort
+        // tasks leave, in proportion to their target rates
+        uint64_t left = SPECTRUM - BETA - kcb_current->u_hrt;
+        return MIN(u_target(dcb), (left * u_target(dcb)) / kcb_current->u_srt);
     } else {
         return 0;
     }
@@ -109,51 +223,63 @@ static inline systime_t deadline(struct dcb *dcb)
     return dcb->release_time + dcb->deadline;
 }
 
-static void queue_insert(struct dcb *dcb)
+/// Run queue heaps, ->heap_id of a queued DCB
+enum queue_heap {
+    HEAP_RELEASE,       ///< Released in the future, by release time
+    HEAP_READY,         ///< Released, by deadline
+};
+
+static inline struct dcb **heap_root(struct kcb *k, enum queue_heap id)
 {
-    // Empty queue case
-    if(kcb_current->queue_head == NULL) {
-        assert(kcb_current->queue_tail == NULL);
-        kcb_current->queue_head = kcb_current->queue_tail = queue_tail = dcb;
-        return;
-    }
+    return id == HEAP_READY ? &k->ready_heap : &k->release_heap;
+}
 
-    /* Insert into priority queue (this is doing EDF). We insert at
-     * the tail of a train of tasks with equal deadlines, as well as
-     * equal release times for best-effort tasks, so that trains of
-     * best-effort tasks with equal deadlines (and those released at
-     * the same time) get scheduled in a round-robin fashion. The
-     * release time equality check is important, as best-effort tasks
-     * have lazily allocated deadlines. In some circumstances (like
-     * when another task blocks), this might otherwise cause a wrong
-     * yielding behavior when old deadlines are encountered.
-     */
-    struct dcb *prev = NULL;
-    for(struct dcb *i = kcb_current->queue_head; i != NULL; prev = i, i = i->next) {
-        // Skip over equal, smaller release times if best-effort
-        if(dcb->type == TASK_TYPE_BEST_EFFORT &&
-           dcb->release_time >= i->release_time) {
-            continue;
-        }
+/// Sorts 'dcb' into the heap matching its current parameters
+static void heap_sort_in(struct kcb *k, struct dcb *dcb, systime_t now)
+{
+    if(dcb->release_time > now) {
+        dcb->heap_id = HEAP_RELEASE;
+        dcb->heap_key = dcb->release_time;
+        dcb->heap_key2 = 0;
+    } else {
+        dcb->heap_id = HEAP_READY;
+        dcb->heap_key = deadline(dcb);
+        dcb->heap_key2 = dcb->release_time;
+    }
+    heap_insert(heap_root(k, dcb->heap_id), dcb);
+}
 
-        // Skip over equal deadlines
-        if(deadline(dcb) >= deadline(i)) {
-            continue;
-        }
+static void heap_take_out(struct kcb *k, struct dcb *dcb)
+{
+    heap_remove(heap_root(k, dcb->heap_id), dcb);
+}
 
-        dcb->next = i;
-        if(prev == NULL) {      // Insert before head
-            kcb_current->queue_head = dcb;
-        } else {                // Insert inside queue
-            prev->next = dcb;
-        }
+/**
+ * \brief Insert 'dcb' into the run queue.
+ *
+ * Goes behind all tasks with equal deadline and release time (this is doing
+ * EDF). The release time equality check is important, as best-effort tasks
+ * have lazily allocated deadlines. In some circumstances (like when another
+ * task blocks), this might otherwise cause a wrong yielding behavior when old
+ * deadlines are encountered.
+ */
+static void queue_insert(struct dcb *dcb, systime_t now)
+{
+    struct kcb *k = kcb_current;
 
-        return;
+    // Append to the list of queued tasks
+    dcb->next = NULL;
+    dcb->prev = k->queue_tail;
+    if(k->queue_tail == NULL) {
+        assert(k->queue_head == NULL);
+        k->queue_head = dcb;
+    } else {
+        k->queue_tail->next = dcb;
     }
+    k->queue_tail = queue_tail = dcb;
 
-    // Insert after queue tail
-    kcb_current->queue_tail->next = dcb;
-    kcb_current->queue_tail = queue_tail = dcb;
+    dcb->heap_seq = k->queue_seq++;
+    heap_sort_in(k, dcb, now);
 }
 
 /**
@@ -167,32 +293,57 @@ static void queue_insert(struct dcb *dcb)
  */
 static void queue_remove(struct dcb *dcb)
 {
+    struct kcb *k = kcb_current;
+
     // No-op if not in scheduler ring
     if(!in_queue(dcb)) {
         return;
     }
 
-    if(dcb == kcb_current->queue_head) {
-        kcb_current->queue_head = dcb->next;
-        if(kcb_current->queue_head == NULL) {
-            kcb_current->queue_tail = queue_tail =  NULL;
-        }
+    heap_take_out(k, dcb);
 
-        goto out;
+    if(dcb->prev != NULL) {
+        dcb->prev->next = dcb->next;
+    } else {
+        assert(k->queue_head == dcb);
+        k->queue_head = dcb->next;
+    }
+    if(dcb->next != NULL) {
+        dcb->next->prev = dcb->prev;
+    } else {
+        assert(k->queue_tail == dcb);
+        k->queue_tail = queue_tail = dcb->prev;
     }
 
-    for(struct dcb *i = kcb_current->queue_head; i != NULL; i = i->next) {
-        if(i->next == dcb) {
-            i->next = i->next->next;
-            if(kcb_current->queue_tail == dcb) {
-                kcb_current->queue_tail = queue_tail = i;
-            }
-            break;
-        }
+    dcb->next = dcb->prev = NULL;
+}
+
+/**
+ * \brief Re-sorts a queued 'dcb' whose deadline or release time changed.
+ *
+ * It keeps its place among tasks with equal keys.
+ */
+static void queue_rekey(struct dcb *dcb, systime_t now)
+{
+    heap_take_out(kcb_current, dcb);
+    heap_sort_in(kcb_current, dcb, now);
+}
+
+/// Moves the tasks released by 'now' to the ready heap
+static void queue_release(systime_t now)
+{
+    struct kcb *k = kcb_current;
+    while(k->release_heap != NULL && k->release_heap->heap_key <= now) {
+        struct dcb *dcb = k->release_heap;
+        heap_remove(&k->release_heap, dcb);
+        heap_sort_in(k, dcb, now);
     }
+}
 
- out:
-    dcb->next = NULL;
+/// Returns the released task to run first
+static struct dcb *queue_first(void)
+{
+    return kcb_current->ready_heap;
 }
 
 #if 0
@@ -311,31 +462,10 @@ struct dcb *schedule(void)
     }
 
  start_over:
-    todisp = kcb_current->queue_head;
-
-#ifndef SCHEDULER_SIMULATOR
-#define PRINT_NAME(d) \
-    do { \
-        if (!(d) || !(d)->disp) { \
-            debug(SUBSYS_DISPATCH, "todisp == NULL\n"); \
-            break; \
-        } \
-        struct dispatcher_shared_generic *dst = \
-            get_dispatcher_shared_generic(d->disp); \
-        debug(SUBSYS_DISPATCH, "looking at '%s', release_time=%lu, kernel_now=%zu\n", \
-                dst->name, d->release_time, now); \
-    }while(0)
-#else
-#define PRINT_NAME(d) do{}while(0)
-#endif
-
-    // Skip over all tasks released in the future, they're technically not
-    // in the schedule yet. We just have them to reduce book-keeping.
-    while(todisp != NULL && todisp->release_time > now) {
-        PRINT_NAME(todisp);
-        todisp = todisp->next;
-    }
-#undef PRINT_NAME
+    // Tasks released in the future are technically not in the schedule yet.
+    // They wait in the release heap until their time has come.
+    queue_release(now);
+    todisp = queue_first();
 
     // nothing to dispatch
     if(todisp == NULL) {
@@ -357,6 +487,13 @@ struct dcb *schedule(void)
         if(deadline(todisp) < now) {
             todisp->release_time = now;
         }
+
+        // The new deadline might not be the earliest anymore
+        if(deadline(todisp) != todisp->heap_key ||
+           todisp->release_time != todisp->heap_key2) {
+            queue_rekey(todisp, now);
+            goto start_over;
+        }
     }
 
     // Assert we never miss a hard deadline
@@ -366,6 +503,20 @@ struct dcb *schedule(void)
         assert(false && "HRT task missed a dead line!");
     }
 
+    // A soft real-time task that missed its deadline skips to the period
+    // it should be in by now
+    if(todisp->type == TASK_TYPE_SOFT_REALTIME && now > deadline(todisp)) {
+        struct dcb *dcb = todisp;
+        assert(dcb->period > 0);
+        queue_remove(dcb);
+        systime_t missed = (now - deadline(dcb)) / dcb->period + 1;
+        dcb->release_time += missed * dcb->period;
+        dcb->etime = 0;
+        queue_insert(dcb, now);
+        lastdisp = NULL;
+        goto start_over;
+    }
+
     // Deadline's can't be in the past (or EDF wouldn't work properly)
     assert(deadline(todisp) >= now);
 
@@ -413,7 +564,7 @@ struct dcb *schedule(void)
         dcb->release_time = now;
     }
     dcb->etime = 0;
-    queue_insert(dcb);
+    queue_insert(dcb, now);
     lastdisp = NULL;
 
     goto start_over;
@@ -426,6 +577,9 @@ void schedule_now(struct dcb *dcb)
         dcb->release_time = now;
     }
     dcb->deadline = 1;
+    if (in_queue(dcb)) {
+        queue_rekey(dcb, now);
+    }
 }
 
 void make_runnable(struct dcb *dcb)
@@ -457,7 +611,7 @@ void make_runnable(struct dcb *dcb)
         break;
 
     case TASK_TYPE_SOFT_REALTIME:
-        panic("Unimplemented!");
+        kcb_current->u_srt += u_target(dcb);
         break;
 
     case TASK_TYPE_HARD_REALTIME:
@@ -481,7 +635,7 @@ void make_runnable(struct dcb *dcb)
     }
     /* assert(dcb->release_time >= kernel_now); */
     dcb->etime = 0;
-    queue_insert(dcb);
+    queue_insert(dcb, now);
 }
 
 /**
@@ -512,7 +666,7 @@ void scheduler_remove(struct dcb *dcb)
         break;
 
     case TASK_TYPE_SOFT_REALTIME:
-        panic("Unimplemented!");
+        kcb_current->u_srt -= u_target(dcb);
         break;
 
     case TASK_TYPE_HARD_REALTIME:
@@ -552,7 +706,7 @@ void scheduler_yield(struct dcb *dcb)
     }
     dcb->etime = 0;
     lastdisp = NULL;    // Don't account for us anymore
-    queue_insert(dcb);
+    queue_insert(dcb, now);
 }
 
 #ifndef SCHEDULER_SIMULATOR
@@ -562,10 +716,13 @@ void scheduler_reset_time(void)
     struct kcb *k = kcb_current;
     do {
         printk(LOG_NOTE, "clearing kcb %p\n", k);
+        // All keys change, so sort everything in anew
+        k->ready_heap = k->release_heap = NULL;
         for(struct dcb *i = k->queue_head; i != NULL; i = i->next) {
             i->release_time = 0;
             i->etime = 0;
             i->last_dispatch = 0;
+            heap_sort_in(k, i, 0);
         }
         k = k->next;
     }while(k && k!=kcb_current);
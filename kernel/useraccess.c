@@ -24,6 +24,11 @@
  */
 bool access_ok(uint8_t type, lvaddr_t buffer, size_t size)
 {
-    // FIXME: Implement!
+    // The buffer must not wrap around and has to end below the kernel
+    // window, otherwise a caller could make us read or write kernel memory
+    if (buffer + size < buffer || buffer + size > KERNEL_OFFSET) {
+        return false;
+    }
+    // FIXME: Check that the buffer is mapped with the rights for 'type'
     return true;
 }
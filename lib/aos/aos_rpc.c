@@ -20,11 +20,13 @@ bool aos_rpc_mutex_init = false;
 struct thread_mutex aos_rpc_mutex;
 
 struct rpc_call {
+    struct lmp_chan *chan; // ids are only unique per channel
     unsigned char id;
     unsigned char type;
     bool *done;
     void (*recv_handling)(void *arg1, struct recv_list *data);
     void *arg1;
+    bool fast; // the calling thread's rpc_fast_call slot
     struct rpc_call *next;
 };
 
@@ -41,7 +43,50 @@ struct rpc_call rpc_type_ram_call_buffer[10];
 
 bool part_of_initial_set = false;
 
-static void register_recv(unsigned char id, unsigned char type, bool *done,
+// Pending-reply bookkeeping for small round trips. Every thread has one slot,
+// only calls made while it is taken (i.e. from a handler running during a
+// wait) fall back to malloc.
+static __thread struct rpc_call rpc_fast_call;
+static __thread bool rpc_fast_call_in_use;
+static bool rpc_fast_path_enabled = true;
+
+void aos_rpc_set_fast_path(bool enable)
+{
+    rpc_fast_path_enabled = enable;
+}
+
+// Round trips that send straight from the caller wait for the reply in the
+// kernel (lmp_chan_call) instead of staying runnable after the switch.
+static bool rpc_call_mode_enabled = true;
+
+void aos_rpc_set_call_mode(bool enable)
+{
+    rpc_call_mode_enabled = enable;
+}
+
+static void rpc_call_link(struct rpc_call *call, struct lmp_chan *chan,
+                          unsigned char id, unsigned char type, bool *done,
+                          void (*inst_recv_handling)(void *arg1,
+                                                     struct recv_list *data),
+                          void *recv_handling_arg1)
+{
+    call->chan = chan;
+    call->id = id;
+    call->type = type;
+    call->done = done;
+    call->recv_handling = inst_recv_handling;
+    call->arg1 = recv_handling_arg1;
+
+    // TODO: consider that this might not need a mutex
+    synchronized(aos_rpc_mutex)
+    {
+        call->next = rpc_call_buffer_head;
+        rpc_call_buffer_head = call;
+    }
+}
+
+static void register_recv(struct lmp_chan *chan, unsigned char id,
+                          unsigned char type, bool *done,
                           void (*inst_recv_handling)(void *arg1,
                                                      struct recv_list *data),
                           void *recv_handling_arg1)
@@ -64,18 +109,9 @@ static void register_recv(unsigned char id, unsigned char type, bool *done,
     } else {
         call = malloc(sizeof(struct rpc_call));
     }
-    call->id = id;
-    call->type = type;
-    call->done = done;
-    call->recv_handling = inst_recv_handling;
-    call->arg1 = recv_handling_arg1;
-
-    // TODO: consider that this might not need a mutex
-    synchronized(aos_rpc_mutex)
-    {
-        call->next = rpc_call_buffer_head;
-        rpc_call_buffer_head = call;
-    }
+    call->fast = false;
+    rpc_call_link(call, chan, id, type, done, inst_recv_handling,
+                  recv_handling_arg1);
 }
 
 static void
@@ -84,23 +120,83 @@ rpc_framework(void (*inst_recv_handling)(void *arg1, struct recv_list *data),
               struct lmp_chan *chan, struct capref cap, size_t payloadsize,
               uintptr_t *payload, struct event_closure callback_when_done)
 {
-    unsigned char id = request_fresh_id(RPC_MESSAGE(type));
+    unsigned char id = request_fresh_id(chan, RPC_MESSAGE(type));
 
     bool done = false;
-    register_recv(id, RPC_ACK_MESSAGE(type), &done, inst_recv_handling,
+    register_recv(chan, id, RPC_ACK_MESSAGE(type), &done, inst_recv_handling,
                   recv_handling_arg1);
-    send(chan, cap, RPC_MESSAGE(type), payloadsize, payload,
-         callback_when_done, id);
+    // the id is held until the ACK arrived, so it can't be reused while the
+    // response is still outstanding
+    send_request(chan, cap, RPC_MESSAGE(type), payloadsize, payload,
+                 callback_when_done, id);
     struct waitset *ws = get_default_waitset();
 
     while (!done)
         event_dispatch(ws);
+    rpc_id_free(chan, RPC_MESSAGE(type), id);
+}
+
+// rpc_framework for requests that fit into a single LMP message: the request
+// is sent from the caller's buffer and the pending reply is tracked in the
+// thread's rpc_fast_call slot, so a round trip does not allocate.
+static errval_t
+rpc_small_framework(void (*inst_recv_handling)(void *arg1,
+                                               struct recv_list *data),
+                    void *recv_handling_arg1, unsigned char type,
+                    struct lmp_chan *chan, struct capref cap,
+                    size_t payloadsize, uintptr_t *payload)
+{
+    unsigned char id = request_fresh_id(chan, RPC_MESSAGE(type));
+
+    bool done = false;
+    struct rpc_call *call;
+    if (!rpc_fast_call_in_use) {
+        rpc_fast_call_in_use = true;
+        call = &rpc_fast_call;
+        call->fast = true;
+    } else {
+        call = malloc(sizeof(struct rpc_call));
+        call->fast = false;
+    }
+    rpc_call_link(call, chan, id, RPC_ACK_MESSAGE(type), &done,
+                  inst_recv_handling, recv_handling_arg1);
+
+    errval_t err = send_small(chan, cap, RPC_MESSAGE(type), payloadsize,
+                              payload, id, rpc_call_mode_enabled);
+    if (err_is_fail(err)) {
+        synchronized(aos_rpc_mutex)
+        {
+            struct rpc_call **cur = &rpc_call_buffer_head;
+            while (*cur != call)
+                cur = &(*cur)->next;
+            *cur = call->next;
+        }
+        if (!call->fast)
+            free(call);
+        done = true;
+    }
+
+    struct waitset *ws = get_default_waitset();
+    while (!done)
+        event_dispatch(ws);
+
+    if (call == &rpc_fast_call)
+        rpc_fast_call_in_use = false;
+    rpc_id_free(chan, RPC_MESSAGE(type), id);
+    return err;
 }
 
 errval_t aos_rpc_send_number(struct aos_rpc *chan, uintptr_t val)
 {
     DBG(VERBOSE, "rpc_send_number\n");
 
+    if (rpc_fast_path_enabled) {
+        errval_t err = rpc_small_framework(NULL, NULL, RPC_TYPE_NUMBER,
+                                           &chan->chan, NULL_CAP, 1, &val);
+        DBG(DETAILED, "ACK Received (number)\n");
+        return err;
+    }
+
     uintptr_t *sendargs = malloc(1 * sizeof(uintptr_t));
 
     sendargs[0] = (uintptr_t) val;
@@ -267,8 +363,12 @@ errval_t aos_rpc_get_ram_cap(struct aos_rpc *chan, size_t size, size_t align,
         DBG(DETAILED, "calling lmp_chan_send3 in rpc_ram_send_handler\n");
         // Check if sender is currently busy
         // TODO: could we implement some kind of buffer for this?
-        err = lmp_chan_send3(&chan->chan, LMP_FLAG_SYNC, NULL_CAP, first_byte,
-                             size, align);
+        if (rpc_call_mode_enabled)
+            err = lmp_chan_call(&chan->chan, LMP_FLAG_SYNC, NULL_CAP, 3,
+                                first_byte, size, align, 0, 0, 0, 0, 0, 0);
+        else
+            err = lmp_chan_send3(&chan->chan, LMP_FLAG_SYNC, NULL_CAP,
+                                 first_byte, size, align);
     } while (err == LIB_ERR_CHAN_ALREADY_REGISTERED);
     if (!err_is_ok(err))
         debug_printf("tried to send ram request, ran into issue: %s\n",
@@ -293,6 +393,46 @@ errval_t aos_rpc_get_ram_cap(struct aos_rpc *chan, size_t size, size_t align,
     return SYS_ERR_OK;
 }
 
+errval_t aos_rpc_get_ram_caps(struct aos_rpc *chan, size_t bytes, size_t align,
+                              struct capref cnode, cslot_t first, size_t count,
+                              size_t *ret_count, size_t *ret_bytes)
+{
+    // like aos_rpc_get_ram_cap this can't go through the event loop, as it
+    // is called while refilling the memory allocators
+    assert(first + count <= L2_CNODE_SLOTS);
+    thread_mutex_lock_nested(&chan->mutex);
+
+    DBG(DETAILED, "rpc_get_ram_caps %zu x %zu\n", count, bytes);
+
+    unsigned int first_byte = (RPC_MESSAGE(RPC_TYPE_RAM_BATCH) << 24) +
+                              (0 << 16) + 4;
+    errval_t err;
+    do {
+        if (rpc_call_mode_enabled)
+            err = lmp_chan_call(&chan->chan, LMP_FLAG_SYNC, cnode, 5,
+                                first_byte, bytes, align, first, count,
+                                0, 0, 0, 0);
+        else
+            err = lmp_chan_send5(&chan->chan, LMP_FLAG_SYNC, cnode,
+                                 first_byte, bytes, align, first, count);
+    } while (lmp_err_is_transient(err));
+    if (err_is_fail(err)) {
+        thread_mutex_unlock(&chan->mutex);
+        return err_push(err, LIB_ERR_LMP_CHAN_SEND);
+    }
+
+    struct lmp_recv_msg msg = LMP_RECV_MSG_INIT;
+    struct capref cap;
+    while (!err_is_ok(lmp_chan_recv(&chan->chan, &msg, &cap)));
+
+    // words[1] is the id of the request
+    *ret_count = msg.words[2];
+    *ret_bytes = msg.words[3];
+
+    thread_mutex_unlock(&chan->mutex);
+    return SYS_ERR_OK;
+}
+
 static void serial_getchar_recv(void *arg1, struct recv_list *data)
 {
     char *retc = (char *) arg1;
@@ -312,6 +452,12 @@ errval_t aos_rpc_serial_putchar(struct aos_rpc *rpc, char c)
 {
     assert(rpc != NULL);
     uintptr_t payload = c;
+    if (rpc_fast_path_enabled) {
+        errval_t err = rpc_small_framework(NULL, NULL, RPC_TYPE_PUTCHAR,
+                                           &rpc->chan, NULL_CAP, 1, &payload);
+        DBG(DETAILED, "ACK Received (putchar) \n");
+        return err;
+    }
     rpc_framework(NULL, NULL, RPC_TYPE_PUTCHAR, &rpc->chan, NULL_CAP, 1,
                   &payload, NULL_EVENT_CLOSURE);
     DBG(DETAILED, "ACK Received (putchar) \n");
@@ -398,7 +544,7 @@ errval_t aos_rpc_send_message_to_process(struct aos_rpc *chan, domainid_t pid, c
     bool done = false;
 
     send(&chan->chan, NULL_CAP, RPC_MESSAGE(RPC_TYPE_DOMAIN_TO_DOMAIN_COM), bytes/4, message,
-         MKCLOSURE(aos_rpc_send_message_to_process_done, &done), request_fresh_id(RPC_MESSAGE(RPC_TYPE_DOMAIN_TO_DOMAIN_COM)));
+         MKCLOSURE(aos_rpc_send_message_to_process_done, &done), request_fresh_id(&chan->chan, RPC_MESSAGE(RPC_TYPE_DOMAIN_TO_DOMAIN_COM)));
 
     struct waitset *ws = get_default_waitset();
     while(!done){
@@ -409,10 +555,10 @@ errval_t aos_rpc_send_message_to_process(struct aos_rpc *chan, domainid_t pid, c
     return SYS_ERR_OK;
 
     /*
-    unsigned char id = request_fresh_id(RPC_MESSAGE(type));
+    unsigned char id = request_fresh_id(chan, RPC_MESSAGE(type));
 
     bool done = false;
-    register_recv(id, RPC_ACK_MESSAGE(type), &done, inst_recv_handling,
+    register_recv(chan, id, RPC_ACK_MESSAGE(type), &done, inst_recv_handling,
                   recv_handling_arg1);
     send(chan, cap, RPC_MESSAGE(type), payloadsize, payload,
          callback_when_done, id);
@@ -423,6 +569,33 @@ errval_t aos_rpc_send_message_to_process(struct aos_rpc *chan, domainid_t pid, c
         */
 }
 
+errval_t aos_rpc_bench_sink(struct aos_rpc *chan, void *payload, size_t bytes)
+{
+    uintptr_t *payload2;
+    size_t payloadsize2;
+    convert_charptr_to_uintptr_with_padding_and_copy(payload, bytes, &payload2,
+                                                     &payloadsize2);
+    rpc_framework(NULL, NULL, RPC_TYPE_BENCH_SINK, &chan->chan, NULL_CAP,
+                  payloadsize2, payload2, NULL_EVENT_CLOSURE);
+    free(payload2);
+    return SYS_ERR_OK;
+}
+
+errval_t aos_rpc_urpc_bench(struct aos_rpc *chan)
+{
+    rpc_framework(NULL, NULL, RPC_TYPE_URPC_BENCH, &chan->chan, NULL_CAP, 0,
+                  NULL, NULL_EVENT_CLOSURE);
+    return SYS_ERR_OK;
+}
+
+errval_t aos_rpc_spawn_bench(struct aos_rpc *chan, size_t iterations)
+{
+    uintptr_t payload = iterations;
+    rpc_framework(NULL, NULL, RPC_TYPE_SPAWN_BENCH, &chan->chan, NULL_CAP, 1,
+                  &payload, NULL_EVENT_CLOSURE);
+    return SYS_ERR_OK;
+}
+
 static void aos_rpc_process_register_recv(void *arg1, struct recv_list *data)
 {
     uint32_t *combinedArg = (uint32_t *) data->payload;
@@ -570,7 +743,8 @@ static void aos_rpc_recv_handler(struct recv_list *data)
             struct rpc_call *prev = NULL;
             foodata = rpc_call_buffer_head;
             while (foodata != NULL) {
-                if (foodata->type == data->type &&
+                if (foodata->chan == data->chan &&
+                    foodata->type == data->type &&
                     foodata->id == data->payload[0])
                     break;
                 prev = foodata;
@@ -600,10 +774,11 @@ static void aos_rpc_recv_handler(struct recv_list *data)
         } else {
             if (foodata->recv_handling != NULL)
                 foodata->recv_handling(foodata->arg1, data);
-            MEMORY_BARRIER;
-            *foodata->done = true;
-            MEMORY_BARRIER;
-            if (foodata->type != RPC_ACK_MESSAGE(RPC_TYPE_RAM)) {
+            bool *done = foodata->done;
+            if (foodata->fast) {
+                // the slot belongs to the waiting thread, which may reuse it
+                // as soon as done is set
+            } else if (foodata->type != RPC_ACK_MESSAGE(RPC_TYPE_RAM)) {
                 free(foodata);
             } else {
                 // jup, this is a thing we are doing
@@ -616,6 +791,9 @@ static void aos_rpc_recv_handler(struct recv_list *data)
                     rpc_type_ram_call_buffer_in_use[slot] = false;
                 }
             }
+            MEMORY_BARRIER;
+            *done = true;
+            MEMORY_BARRIER;
         }
     } else {
         struct aos_rpc* rpc = get_init_rpc();
@@ -4,6 +4,7 @@
 #include <aos/aos.h>
 #include <aos/aos_rpc_shared.h>
 #include <aos/generic_threadsafe_queue.h>
+#include <bitmap.h>
 
 // TODO: make properly platform independent and stuff
 
@@ -50,9 +51,64 @@ static errval_t actual_sending(struct lmp_chan *chan, struct capref cap,
     return SYS_ERR_OK;
 }
 
+// sends payloadcount words with the header in front as one long LMP message
+static errval_t actual_sending_long(struct lmp_chan *chan, struct capref cap,
+                                    int first_byte, size_t payloadcount,
+                                    uintptr_t *payload)
+{
+    assert(payloadcount <= RPC_LONG_MAX_WORDS);
+    uintptr_t words[RPC_LONG_MAX_WORDS + 1];
+    words[0] = first_byte;
+    memcpy(&words[1], payload, payloadcount * sizeof(uintptr_t));
+    return lmp_chan_send_long(chan, LMP_FLAG_SYNC, cap, words,
+                              payloadcount + 1);
+}
+
+// like actual_sending, but the caller waits for the reply in the kernel if it
+// has nothing else to do, see lmp_chan_call
+static errval_t actual_calling(struct lmp_chan *chan, struct capref cap,
+                               int first_byte, size_t payloadcount,
+                               uintptr_t *payload)
+{
+    assert(payloadcount < LMP_MSG_LENGTH);
+    uintptr_t words[LMP_MSG_LENGTH] = { first_byte };
+    memcpy(&words[1], payload, payloadcount * sizeof(uintptr_t));
+    return lmp_chan_call(chan, LMP_FLAG_SYNC, cap, payloadcount + 1,
+                         words[0], words[1], words[2], words[3], words[4],
+                         words[5], words[6], words[7], words[8]);
+}
+
+// header in front of every entry in a bulk frame. The sender owns the
+// frame, the receiver only ever writes the done flag.
+struct rpc_bulk_entry {
+    volatile uint32_t done;
+    uint32_t bytes; // including this header
+};
+
+// sending half of a bulk frame, only touched by the sender
+struct rpc_bulk_send {
+    struct capref frame;
+    uint8_t *base;
+    size_t size;
+    size_t head;
+    size_t tail;
+    size_t used;
+    struct thread_mutex mutex;
+};
+
+// ids of one message type on one channel
+struct rpc_id_space {
+    struct bitmap *free;    // set bits are ids that can be handed out
+    bitmap_bit_t last;      // allocation continues after the last id handed out
+};
+
 struct chan_list {
     struct lmp_chan *chan;
     struct generic_queue_obj rpc_send_queue;
+    struct rpc_bulk_send *bulk; // allocated on the first bulk send
+    bool lmp_long; // the peer's endpoint takes long LMP messages
+    struct rpc_id_space *ids[256]; // per raw type, allocated on first use
+    struct thread_mutex id_mutex;
     struct chan_list *next;
 };
 
@@ -66,16 +122,22 @@ struct send_queue {
     unsigned int *payload;
     struct chan_list *parent;
     struct event_closure callback_when_done;
+    bool bulk;           // payload is a bulk descriptor
+    bool release_id;     // false for all but the last chunk of a message
+    uintptr_t bulk_desc[4];
 };
 
 struct chan_list* chan_listing;
 
+static size_t rpc_bulk_threshold = RPC_BULK_DEFAULT_THRESHOLD;
+static bool rpc_lmp_long_enabled = true;
 
-static int rpc_type_min_id[256];
-static int rpc_type_max_id[256];
 bool mutex_init = false;
 struct thread_mutex chan_list_mutex;
 
+static void id_release(struct chan_list *cl, unsigned char type,
+                       unsigned char id);
+
 // TODO: proper error handling
 // TODO: also make it stop growing the stack by trampolining the event_dispatch stuff properly
 static errval_t send_loop(void *args)
@@ -83,17 +145,31 @@ static errval_t send_loop(void *args)
     struct send_queue *sq = (struct send_queue *) args;
     struct capref cap;
     size_t remaining = (sq->size - sq->index);
-    int first_byte = (sq->type << 24) + (sq->id << 16) + sq->size;
+    int first_byte = (sq->type << 24) + (sq->id << 16) +
+                     (sq->bulk ? RPC_BULK_SIZE_MARKER : sq->size);
     if (sq->index == 0) {
         cap = sq->cap;
     } else {
         cap = NULL_CAP;
     }
 
-    errval_t err =
-        actual_sending(sq->chan, cap, first_byte,
-                       remaining > 8 ? 8 : remaining, &sq->payload[sq->index]);
-    if (err_is_fail(err)) {
+    // what does not fit into one message goes out in long ones
+    bool lmp_long = remaining > 8 && rpc_lmp_long_enabled &&
+                    sq->parent->lmp_long;
+    size_t count = MIN(remaining, lmp_long ? RPC_LONG_MAX_WORDS : 8);
+    errval_t err;
+    if (lmp_long)
+        err = actual_sending_long(sq->chan, cap, first_byte, count,
+                                  &sq->payload[sq->index]);
+    else
+        err = actual_sending(sq->chan, cap, first_byte, count,
+                             &sq->payload[sq->index]);
+    if (err_no(err) == SYS_ERR_LMP_MSG_TOO_LONG && lmp_long) {
+        // the peer's endpoint is too small, stick to short messages
+        sq->parent->lmp_long = false;
+        CHECK(lmp_chan_register_send(sq->chan, get_default_waitset(),
+                                     MKCLOSURE((void *) send_loop, sq)));
+    } else if (err_is_fail(err)) {
         if(!lmp_err_is_transient(err)) {
             debug_printf("send loop error: %s\n", err_getstring(err));
             debug_printf("print cap: slot %u, level %u, cnode %u, croot %u\n", (unsigned int) sq->cap.slot, (
@@ -115,9 +191,9 @@ static errval_t send_loop(void *args)
 //        debug_printf("hi from hell\n");
 //        CHECK(event_dispatch(get_default_waitset()));
     } else {
-        if (remaining > 8) {
+        if (remaining > count) {
             // we still have data to send, so we adjust and resend
-            sq->index += 8;
+            sq->index += count;
             CHECK(lmp_chan_register_send(sq->chan, get_default_waitset(),
                                          MKCLOSURE((void *) send_loop, args)));
 //            debug_printf("hi from hell\n");
@@ -126,37 +202,35 @@ static errval_t send_loop(void *args)
             if (sq->callback_when_done.handler != NULL)
                 sq->callback_when_done.handler(sq->callback_when_done.arg);
             bool done = true;
-            synchronized(sq->parent->rpc_send_queue.thread_mutex)
+            struct chan_list *parent = sq->parent;
+            if (sq->release_id) {
+                DBG(VERBOSE,"cleanup on type %u id %u\n",(
+                unsigned int)sq->type,(unsigned int)sq->id);
+                id_release(parent, sq->type, sq->id);
+            }
+            synchronized(parent->rpc_send_queue.thread_mutex)
             {
-                assert(sq->parent->rpc_send_queue.fst->data == args);
+                assert(parent->rpc_send_queue.fst->data == args);
 
                 struct generic_queue *temp =
-                        sq->parent->rpc_send_queue.fst; // dequeue the one we just got done
+                        parent->rpc_send_queue.fst; // dequeue the one we just got done
                                         // with and delete it
-                sq->parent->rpc_send_queue.fst = sq->parent->rpc_send_queue.fst->next;
-
-                if (rpc_type_min_id[sq->type] == sq->id) {
-                    DBG(VERBOSE,"cleanup on type %u id %u\n",(
-                    unsigned int)sq->type,(unsigned int)sq->id);
-                    // TODO: make proper
-                    rpc_type_min_id[sq->type] =
-                        (rpc_type_min_id[sq->type] + 1) % 256;
-                }
+                parent->rpc_send_queue.fst = parent->rpc_send_queue.fst->next;
 
                 free(temp->data);
                 free(temp);
 
-                if (sq->parent->rpc_send_queue.fst != NULL) // more to be ran
+                if (parent->rpc_send_queue.fst != NULL) // more to be ran
                     done = false;
                 else
-                    sq->parent->rpc_send_queue.last = NULL;
+                    parent->rpc_send_queue.last = NULL;
 
             }
             if (!done) {
                 CHECK(lmp_chan_register_send(
-                    ((struct send_queue *) sq->parent->rpc_send_queue.fst->data)->chan,
+                    ((struct send_queue *) parent->rpc_send_queue.fst->data)->chan,
                     get_default_waitset(),
-                    MKCLOSURE((void *) send_loop, sq->parent->rpc_send_queue.fst->data)));
+                    MKCLOSURE((void *) send_loop, parent->rpc_send_queue.fst->data)));
 //                debug_printf("hi from hell2\n");
 //                CHECK(event_dispatch(get_default_waitset()));
             }
@@ -166,31 +240,8 @@ static errval_t send_loop(void *args)
     return SYS_ERR_OK;
 }
 
-// TODO: consider using a bitfield instead of this fairly brittle thing
-unsigned char request_fresh_id(unsigned char type)
-{
-    unsigned char id;
-    synchronized(chan_list_mutex)
-    {
-        unsigned char min_id = rpc_type_min_id[type];
-        unsigned char max_id = rpc_type_max_id[type];
-        if ((max_id + 1) % 256 == min_id)
-            USER_PANIC("we ran out of message slots\n");
-        // TODO: turn this into a proper error msg that gets returned and is
-        // expected to be handled by the caller.
-
-        rpc_type_max_id[type] = (max_id + 1) % 256;
-        id = max_id;
-    }
-    return id;
-}
-
-errval_t send(struct lmp_chan *chan, struct capref cap, unsigned char type,
-              size_t payloadsize, uintptr_t *payload,
-              struct event_closure callback_when_done, unsigned char id)
+static struct chan_list *chan_list_lookup(struct lmp_chan *chan)
 {
-    // obtain fresh ID for type then enqueue message into sending loop
-    assert(payloadsize < 65536); // Needed so we can encode the size in 16 bits
     struct chan_list *chan_entry = NULL;
     bool done = false;
     synchronized(chan_list_mutex) {
@@ -225,25 +276,105 @@ errval_t send(struct lmp_chan *chan, struct capref cap, unsigned char type,
                 thread_mutex_init(&chan_entry->rpc_send_queue.thread_mutex);
                 chan_entry->rpc_send_queue.fst = NULL;
                 chan_entry->rpc_send_queue.last = NULL;
+                chan_entry->bulk = NULL;
+                chan_entry->lmp_long = true;
+                memset(chan_entry->ids, 0, sizeof(chan_entry->ids));
+                thread_mutex_init(&chan_entry->id_mutex);
                 chan_entry->next = chan_listing;
                 chan_listing = chan_entry;
             }
         }
+    return chan_entry;
+}
+
+// Needs cl->id_mutex held.
+static struct rpc_id_space *id_space_get(struct chan_list *cl,
+                                         unsigned char type)
+{
+    if (cl->ids[type] == NULL) {
+        struct rpc_id_space *space = malloc(sizeof(struct rpc_id_space));
+        assert(space != NULL);
+        space->free = bitmap_alloc(256);
+        assert(space->free != NULL);
+        bitmap_set_all(space->free);
+        space->last = BITMAP_BIT_NONE;
+        cl->ids[type] = space;
+    }
+    return cl->ids[type];
+}
+
+errval_t rpc_id_alloc(struct lmp_chan *chan, unsigned char type,
+                      unsigned char *id)
+{
+    struct chan_list *cl = chan_list_lookup(chan);
+    errval_t err = SYS_ERR_OK;
+    synchronized(cl->id_mutex) {
+        struct rpc_id_space *space = id_space_get(cl, type);
+        // next fit, so a just released id is only handed out again after
+        // all others were used. That keeps late ACKs from matching a new
+        // request.
+        bitmap_bit_t next = bitmap_get_next(space->free, space->last);
+        if (next == BITMAP_BIT_NONE)
+            next = bitmap_get_first(space->free);
+        if (next == BITMAP_BIT_NONE) {
+            err = LIB_ERR_RPC_NO_IDS;
+        } else {
+            bitmap_clear_bit(space->free, next);
+            space->last = next;
+            *id = next;
+        }
+    }
+    return err;
+}
+
+unsigned char request_fresh_id(struct lmp_chan *chan, unsigned char type)
+{
+    unsigned char id;
+    errval_t err;
+    while (true) {
+        err = rpc_id_alloc(chan, type, &id);
+        if (err_is_ok(err))
+            break;
+        assert(err_no(err) == LIB_ERR_RPC_NO_IDS);
+        DBG(VERBOSE, "out of ids for type %u, waiting\n", (unsigned int) type);
+        event_dispatch(get_default_waitset());
+    }
+    return id;
+}
 
+static void id_release(struct chan_list *cl, unsigned char type,
+                       unsigned char id)
+{
+    synchronized(cl->id_mutex) {
+        bitmap_set_bit(id_space_get(cl, type)->free, id);
+    }
+}
+
+void rpc_id_free(struct lmp_chan *chan, unsigned char type, unsigned char id)
+{
+    id_release(chan_list_lookup(chan), type, id);
+}
+
+size_t rpc_ids_in_flight(struct lmp_chan *chan, unsigned char type)
+{
+    struct chan_list *cl = chan_list_lookup(chan);
+    size_t count = 0;
+    synchronized(cl->id_mutex) {
+        if (cl->ids[type] != NULL)
+            count = 256 - bitmap_get_weight(cl->ids[type]->free);
+    }
+    return count;
+}
+
+// appends sq to the send queue of its channel and kicks off the send loop if
+// the queue was idle
+static void send_enqueue(struct chan_list *chan_entry, struct send_queue *sq)
+{
     bool need_to_start = false;
-    DBG(DETAILED, "Sending message with: raw type %u id %u\n", type, id);
+    DBG(DETAILED, "Sending message with: raw type %u id %u\n", sq->type,
+        sq->id);
     synchronized(chan_entry->rpc_send_queue.thread_mutex)
     {
-        struct send_queue *sq = malloc(sizeof(struct send_queue));
-
-        sq->type = type;
-        sq->id = id;
-        sq->index = 0;
-        sq->size = payloadsize;
-        sq->payload = payload;
-        sq->cap = cap;
-        sq->chan = chan;
-        sq->callback_when_done = callback_when_done;
         sq->parent = chan_entry;
 
         struct generic_queue *new = malloc(sizeof(struct generic_queue));
@@ -268,40 +399,361 @@ errval_t send(struct lmp_chan *chan, struct capref cap, unsigned char type,
             MKCLOSURE((void *) send_loop, chan_entry->rpc_send_queue.fst->data)));
         CHECK(event_dispatch(get_default_waitset()));
     }
-    return SYS_ERR_OK;
 }
 
-static struct recv_list *rpc_recv_lookup(struct recv_list *head,
-                                         unsigned char type, unsigned char id)
+static struct send_queue *send_queue_new(struct lmp_chan *chan,
+                                         struct capref cap, unsigned char type,
+                                         unsigned char id, size_t payloadsize,
+                                         uintptr_t *payload,
+                                         struct event_closure callback)
+{
+    struct send_queue *sq = malloc(sizeof(struct send_queue));
+
+    sq->type = type;
+    sq->id = id;
+    sq->index = 0;
+    sq->size = payloadsize;
+    sq->payload = (unsigned int *) payload;
+    sq->cap = cap;
+    sq->chan = chan;
+    sq->callback_when_done = callback;
+    sq->bulk = false;
+    sq->release_id = true;
+    return sq;
+}
+
+void rpc_bulk_set_threshold(size_t words)
+{
+    rpc_bulk_threshold = words;
+}
+
+size_t rpc_bulk_get_threshold(void)
+{
+    return rpc_bulk_threshold;
+}
+
+void rpc_lmp_long_set(bool enable)
+{
+    rpc_lmp_long_enabled = enable;
+}
+
+// creates and maps the frame for our sending direction of the channel and
+// hands it to the peer. LMP is ordered, so the setup message is guaranteed
+// to arrive before the first descriptor referencing the frame.
+static errval_t bulk_setup(struct chan_list *chan_entry)
 {
-    while (head != NULL) {
-/*        if(type == 11)
-            debug_printf("found type %u with id %u\n",(unsigned int)head->type,(unsigned int)id);
-*/        if (head->type == type && head->id == id)
-            return head;
-        head = head->next;
+    struct rpc_bulk_send *b = malloc(sizeof(struct rpc_bulk_send));
+    if (b == NULL)
+        return LIB_ERR_MALLOC_FAIL;
+
+    errval_t err = frame_alloc(&b->frame, RPC_BULK_FRAME_SIZE, &b->size);
+    if (err_is_fail(err)) {
+        free(b);
+        return err_push(err, LIB_ERR_FRAME_ALLOC);
+    }
+    void *buf;
+    err = paging_map_frame_attr(get_current_paging_state(), &buf, b->size,
+                                b->frame, VREGION_FLAGS_READ_WRITE, NULL,
+                                NULL);
+    if (err_is_fail(err)) {
+        cap_destroy(b->frame);
+        free(b);
+        return err_push(err, LIB_ERR_VSPACE_MAP);
     }
-    return NULL;
+    b->base = buf;
+    b->head = 0;
+    b->tail = 0;
+    b->used = 0;
+    thread_mutex_init(&b->mutex);
+
+    struct send_queue *sq = send_queue_new(
+        chan_entry->chan, b->frame, RPC_MESSAGE(RPC_TYPE_BULK_SETUP),
+        request_fresh_id(chan_entry->chan, RPC_MESSAGE(RPC_TYPE_BULK_SETUP)),
+        1, NULL,
+        NULL_EVENT_CLOSURE);
+    // reuse the descriptor storage, the setup message only carries the size
+    sq->bulk_desc[0] = b->size;
+    sq->payload = (unsigned int *) sq->bulk_desc;
+
+    chan_entry->bulk = b;
+    send_enqueue(chan_entry, sq);
+    return SYS_ERR_OK;
 }
 
-static void rpc_recv_list_remove(struct recv_list **rl_head,
-                                 struct recv_list *rl)
+// advance the tail over every entry the receiver has marked done
+static void bulk_reclaim(struct rpc_bulk_send *b)
 {
-    assert(rl != NULL);
+    while (b->used > 0) {
+        struct rpc_bulk_entry *e = (struct rpc_bulk_entry *) &b->base[b->tail];
+        if (!e->done)
+            break;
+        b->tail += e->bytes;
+        b->used -= e->bytes;
+        if (b->tail == b->size)
+            b->tail = 0;
+    }
+    if (b->used == 0) {
+        b->head = 0;
+        b->tail = 0;
+    }
+}
 
-    struct recv_list *prev = NULL;
-    struct recv_list *cur = *rl_head;
+// reserve a contiguous entry of `need` bytes (header included). Has to be
+// called with b->mutex held, may drop it while waiting for the receiver.
+static size_t bulk_reserve(struct rpc_bulk_send *b, size_t need)
+{
+    assert(need <= b->size / 2);
     while (true) {
-        if (rl == cur)
+        bulk_reclaim(b);
+        bool full = b->used != 0 && b->head == b->tail;
+        if (!full && b->head >= b->tail) {
+            if (b->size - b->head >= need)
+                break;
+            if (b->tail >= need) {
+                // not enough room at the end, pad it out and wrap around
+                struct rpc_bulk_entry *pad =
+                    (struct rpc_bulk_entry *) &b->base[b->head];
+                pad->bytes = b->size - b->head;
+                pad->done = 1;
+                b->used += pad->bytes;
+                b->head = 0;
+                continue;
+            }
+        } else if (!full && b->tail - b->head >= need) {
             break;
-        prev = cur;
-        cur = cur->next;
+        }
+        // the receiver still holds on to the space, let it run
+        thread_mutex_unlock(&b->mutex);
+        event_dispatch_non_block(get_default_waitset());
+        thread_yield();
+        thread_mutex_lock_nested(&b->mutex);
     }
 
-    if (prev == NULL)
-        *rl_head = cur->next;
-    else
-        prev->next = cur->next;
+    size_t offset = b->head;
+    struct rpc_bulk_entry *e = (struct rpc_bulk_entry *) &b->base[offset];
+    e->done = 0;
+    e->bytes = need;
+    b->head += need;
+    b->used += need;
+    if (b->head == b->size)
+        b->head = 0;
+    return offset;
+}
+
+static errval_t bulk_send(struct chan_list *chan_entry, struct capref cap,
+                          unsigned char type, size_t payloadsize,
+                          uintptr_t *payload,
+                          struct event_closure callback_when_done,
+                          unsigned char id, bool release_id)
+{
+    if (chan_entry->bulk == NULL) {
+        errval_t err = bulk_setup(chan_entry);
+        if (err_is_fail(err))
+            return err;
+    }
+    struct rpc_bulk_send *b = chan_entry->bulk;
+
+    size_t total = payloadsize * sizeof(uintptr_t);
+    size_t max_chunk = b->size / 2 - sizeof(struct rpc_bulk_entry);
+    size_t pos = 0;
+    while (pos < total) {
+        size_t chunk = MIN(total - pos, max_chunk);
+        size_t need = ROUND_UP(sizeof(struct rpc_bulk_entry) + chunk,
+                               sizeof(struct rpc_bulk_entry));
+        size_t offset;
+        synchronized(b->mutex)
+        {
+            offset = bulk_reserve(b, need);
+            memcpy(&b->base[offset + sizeof(struct rpc_bulk_entry)],
+                   &((uint8_t *) payload)[pos], chunk);
+        }
+        MEMORY_BARRIER;
+
+        bool last = pos + chunk == total;
+        struct send_queue *sq = send_queue_new(
+            chan_entry->chan, pos == 0 ? cap : NULL_CAP, type, id, 4, NULL,
+            last ? callback_when_done : NULL_EVENT_CLOSURE);
+        sq->bulk = true;
+        sq->release_id = last && release_id;
+        sq->bulk_desc[0] = offset;
+        sq->bulk_desc[1] = chunk;
+        sq->bulk_desc[2] = total;
+        sq->bulk_desc[3] = pos;
+        sq->payload = (unsigned int *) sq->bulk_desc;
+        send_enqueue(chan_entry, sq);
+
+        pos += chunk;
+    }
+    return SYS_ERR_OK;
+}
+
+static errval_t send_internal(struct lmp_chan *chan, struct capref cap,
+                              unsigned char type, size_t payloadsize,
+                              uintptr_t *payload,
+                              struct event_closure callback_when_done,
+                              unsigned char id, bool release_id)
+{
+    // enqueue message into sending loop
+    struct chan_list *chan_entry = chan_list_lookup(chan);
+
+    if (payloadsize > rpc_bulk_threshold)
+        return bulk_send(chan_entry, cap, type, payloadsize, payload,
+                         callback_when_done, id, release_id);
+
+    // Needed so we can encode the size in 16 bits
+    assert(payloadsize < RPC_BULK_SIZE_MARKER);
+    struct send_queue *sq = send_queue_new(chan, cap, type, id, payloadsize,
+                                           payload, callback_when_done);
+    sq->release_id = release_id;
+    send_enqueue(chan_entry, sq);
+    return SYS_ERR_OK;
+}
+
+errval_t send(struct lmp_chan *chan, struct capref cap, unsigned char type,
+              size_t payloadsize, uintptr_t *payload,
+              struct event_closure callback_when_done, unsigned char id)
+{
+    return send_internal(chan, cap, type, payloadsize, payload,
+                         callback_when_done, id, true);
+}
+
+errval_t send_request(struct lmp_chan *chan, struct capref cap,
+                      unsigned char type, size_t payloadsize,
+                      uintptr_t *payload,
+                      struct event_closure callback_when_done,
+                      unsigned char id)
+{
+    return send_internal(chan, cap, type, payloadsize, payload,
+                         callback_when_done, id, false);
+}
+
+// sends a single LMP message if nothing is queued on the channel, so the
+// ordering with queued messages is kept. Returns
+// LIB_ERR_CHAN_ALREADY_REGISTERED if the queue is busy.
+static errval_t send_try_direct(struct chan_list *chan_entry,
+                                struct capref cap, unsigned char type,
+                                unsigned char id, size_t payloadsize,
+                                uintptr_t *payload, bool call)
+{
+    errval_t err = LIB_ERR_CHAN_ALREADY_REGISTERED;
+    int first_byte = (type << 24) + (id << 16) + payloadsize;
+    synchronized(chan_entry->rpc_send_queue.thread_mutex)
+    {
+        if (chan_entry->rpc_send_queue.fst == NULL) {
+            if (call)
+                err = actual_calling(chan_entry->chan, cap, first_byte,
+                                     payloadsize, payload);
+            else
+                err = actual_sending(chan_entry->chan, cap, first_byte,
+                                     payloadsize, payload);
+        }
+    }
+    return err;
+}
+
+errval_t send_small(struct lmp_chan *chan, struct capref cap,
+                    unsigned char type, size_t payloadsize, uintptr_t *payload,
+                    unsigned char id, bool call)
+{
+    assert(payloadsize <= RPC_SMALL_MAX_WORDS);
+    struct chan_list *chan_entry = chan_list_lookup(chan);
+
+    errval_t err = send_try_direct(chan_entry, cap, type, id, payloadsize,
+                                   payload, call);
+    while (err_no(err) == LIB_ERR_CHAN_ALREADY_REGISTERED ||
+           lmp_err_is_transient(err)) {
+        // let the queue drain and the receiver catch up
+        event_dispatch_non_block(get_default_waitset());
+        thread_yield();
+        err = send_try_direct(chan_entry, cap, type, id, payloadsize,
+                              payload, call);
+    }
+    return err;
+}
+
+#define RECV_SLAB_BLOCKSIZE                                                   \
+    (sizeof(struct recv_list) + RPC_RECV_SLAB_WORDS * sizeof(uintptr_t))
+
+// returns the reassembly slot for (type, id). Needs rc->mutex held.
+static struct recv_list **recv_table_slot(struct recv_chan *rc,
+                                          unsigned char type, unsigned char id)
+{
+    if (rc->rpc_recv_table[type] == NULL) {
+        rc->rpc_recv_table[type] = calloc(256, sizeof(struct recv_list *));
+        assert(rc->rpc_recv_table[type] != NULL);
+    }
+    return &rc->rpc_recv_table[type][id];
+}
+
+// Needs rc->mutex held.
+static struct recv_list *recv_entry_alloc(struct recv_chan *rc, size_t words)
+{
+    struct recv_list *rl;
+    if (words <= RPC_RECV_SLAB_WORDS) {
+        rl = slab_alloc(&rc->recv_slabs);
+        if (rl == NULL) {
+            size_t bytes = SLAB_STATIC_SIZE(RPC_RECV_SLAB_PREALLOC,
+                                            RECV_SLAB_BLOCKSIZE);
+            void *buf = malloc(bytes);
+            assert(buf != NULL);
+            slab_grow(&rc->recv_slabs, buf, bytes);
+            rl = slab_alloc(&rc->recv_slabs);
+        }
+        assert(rl != NULL);
+        rl->payload = (uintptr_t *) (rl + 1);
+        rl->pooled = true;
+    } else {
+        rl = malloc(sizeof(struct recv_list));
+        assert(rl != NULL);
+        rl->payload = malloc(words * sizeof(uintptr_t));
+        assert(rl->payload != NULL);
+        rl->pooled = false;
+    }
+    return rl;
+}
+
+// Needs rc->mutex held.
+static void recv_entry_free(struct recv_chan *rc, struct recv_list *rl)
+{
+    if (rl->pooled) {
+        slab_free(&rc->recv_slabs, rl);
+    } else {
+        free(rl->payload);
+        free(rl);
+    }
+}
+
+// returns the message (type, id) that is being reassembled, starting a new
+// one of `words` words if there is none yet. Needs rc->mutex held.
+static struct recv_list *recv_reassembly_get(struct recv_chan *rc,
+                                             unsigned char type,
+                                             unsigned char id,
+                                             struct capref cap, size_t words)
+{
+    struct recv_list **slot = recv_table_slot(rc, type, id);
+    if (*slot == NULL) {
+        struct recv_list *rl = recv_entry_alloc(rc, words);
+        rl->size = words;
+        rl->id = id;
+        rl->type = type;
+        rl->cap = cap;
+        rl->index = 0;
+        rl->chan = rc->chan;
+        rl->next = NULL;
+        *slot = rl;
+    }
+    return *slot;
+}
+
+// hands a fully reassembled message to the handler. rl has to be removed from
+// the table already; the handler runs without rc->mutex held.
+static void recv_reassembly_deliver(struct recv_chan *rc, struct recv_list *rl)
+{
+    DBG(VERBOSE, "call long msg handler\n");
+    rc->recv_deal_with_msg(rl);
+    synchronized(rc->mutex) {
+        recv_entry_free(rc, rl);
+    }
 }
 
 struct send_cleanup_struct {
@@ -357,6 +809,24 @@ errval_t send_response(struct recv_list *rl, struct lmp_chan *chan,
     // round to 32 bit
     // ( we are assuming here that the id is smaller than an int)
     size_t payloadsize2 = payloadsize + 1;
+    unsigned char id = request_fresh_id(chan, rl->type + 1);
+
+    if (payloadsize2 <= RPC_SMALL_MAX_WORDS) {
+        // short responses go out straight from the stack if the channel is
+        // idle, we only queue (and allocate) if it is busy
+        uintptr_t small[RPC_SMALL_MAX_WORDS];
+        small[0] = (int) rl->id;
+        if (payloadsize2 > 1)
+            memcpy(&small[1], payload, payloadsize * sizeof(uintptr_t));
+        errval_t err = send_try_direct(chan_list_lookup(chan), cap,
+                                       rl->type + 1, id, payloadsize2, small,
+                                       false);
+        if (err_is_ok(err)) {
+            rpc_id_free(chan, rl->type + 1, id);
+            return SYS_ERR_OK;
+        }
+    }
+
     uintptr_t *payload2 = malloc(payloadsize2 * sizeof(uintptr_t));
 
     if (payloadsize2 > 1)
@@ -371,8 +841,7 @@ errval_t send_response(struct recv_list *rl, struct lmp_chan *chan,
 
     struct event_closure callback = MKCLOSURE(send_cleanup, scs);
 
-    return send(chan, cap, rl->type + 1, payloadsize2, payload2, callback,
-                request_fresh_id(rl->type + 1));
+    return send(chan, cap, rl->type + 1, payloadsize2, payload2, callback, id);
 }
 // conveniance function for forwarding messages
 errval_t forward_message(struct recv_list *rl, struct lmp_chan *chan,
@@ -397,41 +866,148 @@ errval_t forward_message(struct recv_list *rl, struct lmp_chan *chan,
     struct event_closure callback = MKCLOSURE(send_cleanup, scs);
 
     return send(chan, cap, rl->type, payloadsize2, payload2, callback,
-                request_fresh_id(rl->type));
+                request_fresh_id(chan, rl->type));
 }
 
-static int refill_nono = 0;
+// maps the peer's bulk frame. The size comes from the peer, so it has to
+// match the frame it sent along.
+static errval_t bulk_recv_setup(struct recv_chan *rc, struct capref frame,
+                                size_t bytes)
+{
+    if (rc->bulk_base != NULL) {
+        return LIB_ERR_RPC_BULK_SETUP;
+    }
+    struct frame_identity fi;
+    errval_t err = frame_identify(frame, &fi);
+    if (err_is_fail(err)) {
+        return err_push(err, LIB_ERR_RPC_BULK_SETUP);
+    }
+    if (bytes < 2 * sizeof(struct rpc_bulk_entry) || bytes > fi.bytes) {
+        return LIB_ERR_RPC_BULK_SETUP;
+    }
 
-// TODO: error handling
-void recv_handling(void *args)
+    void *buf;
+    err = paging_map_frame_attr(get_current_paging_state(), &buf, bytes,
+                                frame, VREGION_FLAGS_READ_WRITE, NULL, NULL);
+    if (err_is_fail(err)) {
+        return err_push(err, LIB_ERR_VSPACE_MAP);
+    }
+    rc->bulk_base = buf;
+    rc->bulk_size = bytes;
+    return SYS_ERR_OK;
+}
+
+// whether the entry at `offset` with `bytes` of payload lies in the frame
+static bool bulk_entry_valid(struct recv_chan *rc, size_t offset,
+                             size_t bytes)
 {
-    free(malloc(100));
-    refill_nono++;
-    struct recv_chan *rc = (struct recv_chan *) args;
-    struct lmp_recv_msg msg = LMP_RECV_MSG_INIT;
-    struct capref cap;
+    const size_t hdr = sizeof(struct rpc_bulk_entry);
+    return rc->bulk_base != NULL && offset % hdr == 0 &&
+           rc->bulk_size >= hdr && offset <= rc->bulk_size - hdr &&
+           bytes <= rc->bulk_size - hdr - offset;
+}
 
-    lmp_chan_recv(rc->chan, &msg, &cap);
-    if (!capref_is_null(cap)) {
-        //we logically only need to realloc, if we received a cap
-        lmp_chan_alloc_recv_slot(rc->chan);
+// The descriptor comes from the peer. A bad one is dropped, the entry is
+// still handed back if it lies in the frame so the sender does not stall.
+static errval_t bulk_recv(struct recv_chan *rc, unsigned char type,
+                          unsigned char id, struct capref cap, uintptr_t *desc)
+{
+    size_t offset = desc[0];
+    size_t bytes = desc[1];
+    size_t total = desc[2];
+    size_t pos = desc[3];
+
+    if (!bulk_entry_valid(rc, offset, bytes)) {
+        return LIB_ERR_RPC_BULK_DESC;
     }
-    CHECK(lmp_chan_register_recv(rc->chan, get_default_waitset(),
-                           MKCLOSURE(recv_handling, args)));
-    slot_alloc_refill_preallocated_slots_conditional(refill_nono);
+    struct rpc_bulk_entry *e =
+        (struct rpc_bulk_entry *) ((uint8_t *) rc->bulk_base + offset);
+    uint8_t *data = (uint8_t *) (e + 1);
+
+    if (total % sizeof(uintptr_t) != 0 || bytes % sizeof(uintptr_t) != 0 ||
+        pos > total || bytes > total - pos) {
+        e->done = 1;
+        return LIB_ERR_RPC_BULK_DESC;
+    }
+
+    if (pos == 0 && bytes == total) {
+        // the whole message sits in the frame, hand it out without copying
+        struct recv_list rl;
+        rl.payload = (uintptr_t *) data;
+        rl.size = total / sizeof(uintptr_t);
+        rl.id = id;
+        rl.type = type;
+        rl.cap = cap;
+        rl.index = rl.size;
+        rl.next = NULL;
+        rl.chan = rc->chan;
+        rl.pooled = false;
+        rc->recv_deal_with_msg(&rl);
+        MEMORY_BARRIER;
+        e->done = 1;
+        return SYS_ERR_OK;
+    }
+
+    struct recv_list *rl;
+    bool complete = false;
+    errval_t err = SYS_ERR_OK;
+    synchronized(rc->mutex) {
+        rl = recv_reassembly_get(rc, type, id, cap,
+                                 total / sizeof(uintptr_t));
+        if (total != rl->size * sizeof(uintptr_t)) {
+            err = LIB_ERR_RPC_BULK_DESC;
+        } else {
+            memcpy(&((uint8_t *) rl->payload)[pos], data, bytes);
+            rl->index += bytes / sizeof(uintptr_t);
+            if (rl->index >= rl->size) {
+                rc->rpc_recv_table[type][id] = NULL;
+                complete = true;
+            }
+        }
+        MEMORY_BARRIER;
+        e->done = 1;
+    }
+    if (complete)
+        recv_reassembly_deliver(rc, rl);
+    return err;
+}
+
+static int refill_nono = 0;
 
-    assert(msg.buf.msglen > 0);
+errval_t recv_process_msg(struct recv_chan *rc, struct lmp_recv_buf *msg,
+                          struct capref cap)
+{
+    assert(msg->msglen > 0);
 
-    unsigned char type = msg.words[0] >> 24;
-    unsigned char id = (msg.words[0] >> 16) & 0xFF;
-    size_t size = msg.words[0] & 0xFFFF;
+    unsigned char type = msg->words[0] >> 24;
+    unsigned char id = (msg->words[0] >> 16) & 0xFF;
+    size_t size = msg->words[0] & 0xFFFF;
     DBG(DETAILED, "Received message with: type 0x%x %s id %u and size %u\n", type >> 1, type & 1 ? "ACK" : "", id, size);
 
     //debug_printf("receive with size: %d\n", size);
-    if (size < 9) // fast path for small messages
+    if (type == RPC_MESSAGE(RPC_TYPE_BULK_SETUP)) {
+        errval_t err = msg->msglen < 2 ? LIB_ERR_RPC_BULK_SETUP
+                                       : bulk_recv_setup(rc, cap,
+                                                         msg->words[1]);
+        if (err_is_fail(err)) {
+            if (!capref_is_null(cap))
+                cap_destroy(cap);
+            return err;
+        }
+    } else if (size == RPC_BULK_SIZE_MARKER) {
+        errval_t err = msg->msglen < 5 ? LIB_ERR_RPC_BULK_DESC
+                                       : bulk_recv(rc, type, id, cap,
+                                                   &msg->words[1]);
+        if (err_is_fail(err)) {
+            // a dropped chunk's cap never made it into the reassembly
+            if (!capref_is_null(cap))
+                cap_destroy(cap);
+            return err;
+        }
+    } else if (size < msg->msglen) // fast path, the whole message is here
     {
         struct recv_list rl;
-        rl.payload = &msg.words[1];
+        rl.payload = &msg->words[1];
         rl.size = size;
         rl.id = id;
         rl.type = type;
@@ -439,42 +1015,89 @@ void recv_handling(void *args)
         rl.index = size;
         rl.next = NULL;
         rl.chan = rc->chan;
+        rl.pooled = false;
         rc->recv_deal_with_msg(&rl);
     } else {
-        //todo: give it its own mutex instead of using the send_queue's mutex
-        synchronized(chan_list_mutex) {
-            struct recv_list *rl = rpc_recv_lookup(rc->rpc_recv_list, type, id);
-            if (rl == NULL) {
-                rl = malloc(sizeof(struct recv_list));
-                rl->payload = malloc(size * 4);
-                rl->size = size;
-                rl->id = id;
-                rl->type = type;
-                rl->cap = cap;
-                rl->index = 0;
-                rl->chan = rc->chan;
-                rl->next = rc->rpc_recv_list;
-                rc->rpc_recv_list = rl;
-            }
+        struct recv_list *rl;
+        bool complete = false;
+        synchronized(rc->mutex) {
+            rl = recv_reassembly_get(rc, type, id, cap, size);
             size_t rem = rl->size - rl->index;
-            size_t count = (rem > 8 ? 8 : rem);
-            memcpy(&rl->payload[rl->index], &msg.words[1], count * 4);
+            size_t count = MIN(rem, msg->msglen - 1);
+            memcpy(&rl->payload[rl->index], &msg->words[1],
+                   count * sizeof(uintptr_t));
             rl->index += count;
             assert(rl->index <= rl->size);
             if (rl->index == rl->size) {
-                // done transferring this msg, we can now do whatever we should do
-                // with this
-                rpc_recv_list_remove(&rc->rpc_recv_list, rl);
-                DBG(VERBOSE, "call long msg handler\n");
-                rc->recv_deal_with_msg(rl);
-                free(rl->payload);
-                free(rl);
+                // done transferring this msg, we can now do whatever we
+                // should do with this
+                rc->rpc_recv_table[type][id] = NULL;
+                complete = true;
             }
         }
+        if (complete)
+            recv_reassembly_deliver(rc, rl);
+    }
+    return SYS_ERR_OK;
+}
+
+// TODO: error handling
+void recv_handling(void *args)
+{
+    refill_nono++;
+    struct recv_chan *rc = (struct recv_chan *) args;
+    struct rpc_recv_msg msg = RPC_RECV_MSG_INIT;
+    struct capref cap;
+
+    errval_t err = lmp_chan_recv_buf(rc->chan, &msg.buf, &cap);
+    // an oversized message is consumed and dropped, everything else that
+    // fails left the endpoint alone
+    bool dropped = err_no(err) == LIB_ERR_LMP_RECV_BUF_OVERFLOW;
+    if (err_is_fail(err) && !dropped) {
+        cap = NULL_CAP;
+    }
+    if (!capref_is_null(cap)) {
+        //we logically only need to realloc, if we received a cap
+        lmp_chan_alloc_recv_slot(rc->chan);
+    }
+    CHECK(lmp_chan_register_recv(rc->chan, get_default_waitset(),
+                           MKCLOSURE(recv_handling, args)));
+    slot_alloc_refill_preallocated_slots_conditional(refill_nono);
+
+    if (dropped) {
+        DEBUG_ERR(err, "dropping an oversized message from the peer");
+        if (!capref_is_null(cap))
+            cap_destroy(cap);
+    } else if (err_is_ok(err)) {
+        err = recv_process_msg(rc, &msg.buf, cap);
+        if (err_is_fail(err)) {
+            DEBUG_ERR(err, "dropping a message from the peer");
+        }
+    } else if (err_no(err) != LIB_ERR_NO_LMP_MSG) {
+        DEBUG_ERR(err, "receiving on an RPC channel");
     }
     refill_nono--;
 }
 
+void recv_chan_init(struct recv_chan *rc, struct lmp_chan *chan,
+                    void (*recv_deal_with_msg)(struct recv_list *))
+{
+    rc->chan = chan;
+    rc->recv_deal_with_msg = recv_deal_with_msg;
+    memset(rc->rpc_recv_table, 0, sizeof(rc->rpc_recv_table));
+    thread_mutex_init(&rc->mutex);
+
+    slab_init(&rc->recv_slabs, RECV_SLAB_BLOCKSIZE, NULL);
+    size_t bytes = SLAB_STATIC_SIZE(RPC_RECV_SLAB_PREALLOC,
+                                    RECV_SLAB_BLOCKSIZE);
+    void *buf = malloc(bytes);
+    assert(buf != NULL);
+    slab_grow(&rc->recv_slabs, buf, bytes);
+
+    rc->bulk_base = NULL;
+    rc->bulk_size = 0;
+}
+
 errval_t init_rpc_client(void (*recv_deal_with_msg)(struct recv_list *),
                          struct lmp_chan *chan, struct capref dest)
 {
@@ -485,12 +1108,10 @@ errval_t init_rpc_client(void (*recv_deal_with_msg)(struct recv_list *),
     // Allocate lmp channel structure.
     // Create local endpoint.
     // Set remote endpoint to dest's endpoint.
-    CHECK(lmp_chan_accept(chan, DEFAULT_LMP_BUF_WORDS, dest));
+    CHECK(lmp_chan_accept(chan, RPC_LMP_BUF_WORDS, dest));
     lmp_chan_alloc_recv_slot(chan);
     struct recv_chan *rc = malloc(sizeof(struct recv_chan));
-    rc->chan = chan;
-    rc->recv_deal_with_msg = recv_deal_with_msg;
-    rc->rpc_recv_list = NULL;
+    recv_chan_init(rc, chan, recv_deal_with_msg);
 
     lmp_chan_register_recv(rc->chan, get_default_waitset(),
                            MKCLOSURE(recv_handling, rc));
@@ -504,12 +1125,10 @@ errval_t init_rpc_server(void (*recv_deal_with_msg)(struct recv_list *),
         thread_mutex_init(&chan_list_mutex);
         mutex_init = true;
     }
-    CHECK(lmp_chan_accept(chan, DEFAULT_LMP_BUF_WORDS, NULL_CAP));
+    CHECK(lmp_chan_accept(chan, RPC_LMP_BUF_WORDS, NULL_CAP));
     CHECK(lmp_chan_alloc_recv_slot(chan));
     struct recv_chan *rc = malloc(sizeof(struct recv_chan));
-    rc->chan = chan;
-    rc->recv_deal_with_msg = recv_deal_with_msg;
-    rc->rpc_recv_list = NULL;
+    recv_chan_init(rc, chan, recv_deal_with_msg);
 
     lmp_chan_register_recv(rc->chan, get_default_waitset(),
                            MKCLOSURE(recv_handling, rc));
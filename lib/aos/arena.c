@@ -0,0 +1,385 @@
+/**
+ * \file
+ * \brief Size class arena malloc
+ *
+ * Small blocks are rounded up to one of ARENA_CLASSES size classes and
+ * handed out from runs of ARENA_RUN_SIZE bytes, which hold blocks of one
+ * class only. The run header sits at the start of the run, runs are aligned
+ * to their size, so a block finds its run by rounding down. Blocks larger
+ * than ARENA_SMALL_MAX get a reservation of their own, also starting with a
+ * header at an ARENA_RUN_SIZE boundary.
+ *
+ * Every thread takes an arena the first time it allocates and only it
+ * touches the runs of its arena, so allocating and freeing are O(1) without
+ * any locks. Blocks freed by another thread are pushed onto the remote list
+ * of the owning arena and picked up the next time it runs out of blocks. The
+ * arena of a thread that is freed goes to the orphans for the next new
+ * thread. Once ARENA_MAX arenas exist, new threads share a locked one.
+ *
+ * Like the old morecore, the memory is reserved with paging_alloc and
+ * faulted in on first touch. The header is written right after reserving,
+ * so the mapped header page keeps the fault-ahead windows of neighbouring
+ * reservations out of the run. Empty runs, except one per class, and large
+ * blocks go back with paging_free.
+ */
+
+/*
+ * Copyright (c) 2016, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#include <aos/aos.h>
+#include <aos/arena.h>
+#include <aos/morecore.h>
+#include <aos/paging.h>
+#include <aos/static_assert.h>
+
+#include "threads_priv.h"
+
+#define ARENA_RUN_MAGIC     0x72756e73  ///< Header of a run of small blocks
+#define ARENA_LARGE_MAGIC   0x6c617267  ///< Header of a large block
+#define ARENA_HEADER        64          ///< Bytes before the first block
+
+struct arena_block {
+    struct arena_block *next;
+};
+
+struct arena_run {
+    uint32_t magic;
+    uint16_t cls;                   ///< Size class of the blocks
+    uint16_t used;                  ///< Blocks handed out
+    struct arena *arena;            ///< Owner, never changes
+    struct arena_block *free;       ///< Freed blocks
+    char *unused;                   ///< Blocks from here on never handed out
+    struct arena_run *prev, *next;  ///< Runs of the class with free blocks
+};
+
+struct arena_large {
+    uint32_t magic;
+    size_t size;                    ///< Bytes reserved, header included
+};
+
+STATIC_ASSERT(sizeof(struct arena_run) <= ARENA_HEADER, "run header size");
+STATIC_ASSERT(sizeof(struct arena_large) <= ARENA_HEADER, "large header size");
+
+struct arena_class {
+    struct arena_run *partial;      ///< Runs with free blocks
+    struct arena_run *spare;        ///< Empty run kept to avoid remapping
+};
+
+struct arena {
+    struct arena_class classes[ARENA_CLASSES];
+    struct arena_block *remote;     ///< Freed by other threads, atomic
+    struct arena *next;             ///< Next orphan
+    bool shared;                    ///< Used by several threads
+    struct thread_mutex mutex;      ///< Protects a shared arena
+};
+
+/// Multiples of 16 up to 128, then four classes per power of two.
+static const uint16_t class_size[ARENA_CLASSES] = {
+    16,   32,   48,   64,   80,   96,   112,  128,
+    160,  192,  224,  256,  320,  384,  448,  512,
+    640,  768,  896,  1024, 1280, 1536, 1792, 2048
+};
+
+static struct arena arenas[ARENA_MAX];
+static size_t arenas_used;
+static struct arena *orphans;
+static struct thread_mutex arenas_mutex;
+static struct arena shared_arena;
+static struct arena_stats stats;
+
+static inline size_t arena_class(size_t bytes)
+{
+    if (bytes <= 128)
+        return bytes == 0 ? 0 : (bytes - 1) / 16;
+    size_t bits = 31 - __builtin_clz(bytes - 1);
+    return 8 + (bits - 7) * 4 + ((bytes - 1) >> (bits - 2)) - 4;
+}
+
+static inline struct arena_run *run_of(const void *ptr)
+{
+    return (struct arena_run *) ROUND_DOWN((lvaddr_t) ptr, ARENA_RUN_SIZE);
+}
+
+static inline bool run_full(struct arena_run *run)
+{
+    return run->free == NULL &&
+           run->unused + class_size[run->cls] >
+               (char *) run + ARENA_RUN_SIZE;
+}
+
+static void run_link(struct arena_class *c, struct arena_run *run)
+{
+    run->prev = NULL;
+    run->next = c->partial;
+    if (c->partial != NULL)
+        c->partial->prev = run;
+    c->partial = run;
+}
+
+static void run_unlink(struct arena_class *c, struct arena_run *run)
+{
+    if (run->prev != NULL)
+        run->prev->next = run->next;
+    else
+        c->partial = run->next;
+    if (run->next != NULL)
+        run->next->prev = run->prev;
+}
+
+/**
+ * \brief Returns the arena of the calling thread, taking one if it has none.
+ */
+static struct arena *arena_get(void)
+{
+    struct thread *me = thread_self();
+    if (me->arena != NULL)
+        return me->arena;
+
+    thread_mutex_lock(&arenas_mutex);
+    struct arena *a = orphans;
+    if (a != NULL)
+        orphans = a->next;
+    else if (arenas_used < ARENA_MAX)
+        a = &arenas[arenas_used++];
+    else
+        a = &shared_arena;
+    thread_mutex_unlock(&arenas_mutex);
+
+    me->arena = a;
+    return a;
+}
+
+/**
+ * \brief Adds a run to class `cls` of `a`, the spare one if there is one.
+ *
+ * Writing the header faults the first page in, and the fault handler may
+ * allocate. The run is only linked afterwards, so the arena is consistent
+ * for such nested calls.
+ */
+static struct arena_run *run_new(struct arena *a, size_t cls)
+{
+    struct arena_class *c = &a->classes[cls];
+    struct arena_run *run = c->spare;
+    if (run != NULL) {
+        c->spare = NULL;
+    } else {
+        void *buf;
+        errval_t err = paging_alloc_aligned(get_current_paging_state(), &buf,
+                                            ARENA_RUN_SIZE, ARENA_RUN_SIZE);
+        if (err_is_fail(err)) {
+            DEBUG_ERR(err, "arena: reserving a run");
+            return NULL;
+        }
+        run = buf;
+        run->magic = ARENA_RUN_MAGIC;
+        run->arena = a;
+        __sync_fetch_and_add(&stats.runs_mapped, 1);
+    }
+    run->cls = cls;
+    run->used = 0;
+    run->free = NULL;
+    run->unused = (char *) run + ARENA_HEADER;
+    run_link(c, run);
+    return run;
+}
+
+static void *run_alloc(struct arena *a, struct arena_run *run)
+{
+    void *ptr;
+    if (run->free != NULL) {
+        ptr = run->free;
+        run->free = run->free->next;
+    } else {
+        ptr = run->unused;
+        run->unused += class_size[run->cls];
+    }
+    run->used++;
+    if (run_full(run))
+        run_unlink(&a->classes[run->cls], run);
+    return ptr;
+}
+
+static void run_free(struct arena *a, struct arena_run *run, void *ptr)
+{
+    struct arena_class *c = &a->classes[run->cls];
+    bool was_full = run_full(run);
+
+    struct arena_block *block = ptr;
+    block->next = run->free;
+    run->free = block;
+    run->used--;
+    if (was_full)
+        run_link(c, run);
+    if (run->used > 0)
+        return;
+
+    run_unlink(c, run);
+    if (c->spare == NULL) {
+        c->spare = run;
+        return;
+    }
+    errval_t err = paging_free(get_current_paging_state(), run,
+                               ARENA_RUN_SIZE);
+    if (err_is_fail(err)) {
+        DEBUG_ERR(err, "arena: giving back a run");
+        return;
+    }
+    __sync_fetch_and_add(&stats.runs_unmapped, 1);
+}
+
+/// Frees the blocks other threads gave back to `a`.
+static void arena_drain(struct arena *a)
+{
+    struct arena_block *block = __sync_lock_test_and_set(&a->remote, NULL);
+    while (block != NULL) {
+        struct arena_block *next = block->next;
+        run_free(a, run_of(block), block);
+        block = next;
+    }
+}
+
+static void *large_alloc(size_t bytes)
+{
+    size_t size = ROUND_UP(bytes + ARENA_HEADER, BASE_PAGE_SIZE);
+    if (size < bytes)
+        return NULL;
+
+    void *buf;
+    errval_t err = paging_alloc_aligned(get_current_paging_state(), &buf,
+                                        size, ARENA_RUN_SIZE);
+    if (err_is_fail(err)) {
+        DEBUG_ERR(err, "arena: reserving %zu bytes", bytes);
+        return NULL;
+    }
+    struct arena_large *large = buf;
+    large->magic = ARENA_LARGE_MAGIC;
+    large->size = size;
+    __sync_fetch_and_add(&stats.large_mapped, 1);
+    return (char *) buf + ARENA_HEADER;
+}
+
+static void large_free(struct arena_large *large)
+{
+    errval_t err = paging_free(get_current_paging_state(), large,
+                               large->size);
+    if (err_is_fail(err)) {
+        DEBUG_ERR(err, "arena: giving back a large block");
+        return;
+    }
+    __sync_fetch_and_add(&stats.large_unmapped, 1);
+}
+
+void *arena_malloc(size_t bytes)
+{
+    void *ptr = NULL;
+    if (bytes > ARENA_SMALL_MAX) {
+        ptr = large_alloc(bytes);
+    } else {
+        struct arena *a = arena_get();
+        size_t cls = arena_class(bytes);
+        if (a->shared) {
+            thread_mutex_lock_nested(&a->mutex);
+            stats.shared_allocs++;
+        }
+
+        struct arena_run *run = a->classes[cls].partial;
+        if (run == NULL && a->remote != NULL) {
+            arena_drain(a);
+            run = a->classes[cls].partial;
+        }
+        if (run == NULL)
+            run = run_new(a, cls);
+        if (run != NULL)
+            ptr = run_alloc(a, run);
+
+        if (a->shared)
+            thread_mutex_unlock(&a->mutex);
+    }
+    if (ptr != NULL)
+        __sync_fetch_and_add(&__malloc_calls, 1);
+    return ptr;
+}
+
+void arena_free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    struct arena_run *run = run_of(ptr);
+    if (run->magic == ARENA_LARGE_MAGIC) {
+        large_free((struct arena_large *) run);
+        return;
+    }
+    assert(run->magic == ARENA_RUN_MAGIC);
+
+    struct arena *a = run->arena;
+    if (a->shared) {
+        thread_mutex_lock_nested(&a->mutex);
+        run_free(a, run, ptr);
+        thread_mutex_unlock(&a->mutex);
+    } else if (a == thread_self()->arena) {
+        run_free(a, run, ptr);
+    } else {
+        struct arena_block *block = ptr;
+        struct arena_block *head;
+        do {
+            head = a->remote;
+            block->next = head;
+        } while (!__sync_bool_compare_and_swap(&a->remote, head, block));
+        __sync_fetch_and_add(&stats.remote_frees, 1);
+    }
+}
+
+void *arena_realloc(void *ptr, size_t bytes)
+{
+    if (ptr == NULL)
+        return arena_malloc(bytes);
+
+    struct arena_run *run = run_of(ptr);
+    size_t usable;
+    if (run->magic == ARENA_LARGE_MAGIC)
+        usable = ((struct arena_large *) run)->size - ARENA_HEADER;
+    else
+        usable = class_size[run->cls];
+    // keep the block unless it shrinks to less than half
+    if (bytes <= usable && bytes > usable / 2)
+        return ptr;
+
+    void *new_ptr = arena_malloc(bytes);
+    if (new_ptr == NULL)
+        return NULL;
+    memcpy(new_ptr, ptr, MIN(bytes, usable));
+    arena_free(ptr);
+    return new_ptr;
+}
+
+/**
+ * \brief Hands the arena of a freed thread to the next new one.
+ */
+void arena_release(struct arena *arena)
+{
+    if (arena == NULL || arena->shared)
+        return;
+    thread_mutex_lock(&arenas_mutex);
+    arena->next = orphans;
+    orphans = arena;
+    thread_mutex_unlock(&arenas_mutex);
+}
+
+void arena_get_stats(struct arena_stats *ret)
+{
+    *ret = stats;
+}
+
+void arena_init(void)
+{
+    thread_mutex_init(&arenas_mutex);
+    thread_mutex_init(&shared_arena.mutex);
+    shared_arena.shared = true;
+}
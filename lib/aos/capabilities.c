@@ -363,6 +363,164 @@ errval_t cap_destroy(struct capref cap)
     return SYS_ERR_OK;
 }
 
+/**
+ * \brief Choose between one system call per batch and one per operation.
+ *
+ * Enabled by default. Disabled, cap_batch_run() invokes the operations one
+ * by one, which is only useful to measure what batching saves. The choice
+ * only applies to batches run by the calling thread.
+ */
+void cap_batch_set_enabled(bool enable)
+{
+    thread_set_cap_batch_enabled(enable);
+}
+
+void cap_batch_init(struct cap_batch *batch)
+{
+    batch->count = 0;
+    batch->done = 0;
+}
+
+static struct cap_batch_op *cap_batch_next(struct cap_batch *batch)
+{
+    if (cap_batch_full(batch)) {
+        return NULL;
+    }
+    return &batch->ops[batch->count++];
+}
+
+/**
+ * \brief Add a cap_copy() to a batch
+ */
+errval_t cap_batch_copy(struct cap_batch *batch, struct capref dest,
+                        struct capref src)
+{
+    struct cap_batch_op *op = cap_batch_next(batch);
+    if (op == NULL) {
+        return LIB_ERR_CAP_BATCH_FULL;
+    }
+
+    // arguments as for invoke_cnode_copy()
+    cap_invoke_encode(op, cap_root, 7, CNodeCmd_Copy, get_croot_addr(dest),
+                      get_cnode_addr(dest), dest.slot, get_croot_addr(src),
+                      get_cap_addr(src), get_cnode_level(dest),
+                      get_cap_level(src), 0, 0, 0);
+    return SYS_ERR_OK;
+}
+
+/**
+ * \brief Add a cap_retype() to a batch
+ *
+ * Unlike cap_retype(), a retype the kernel wants to go through the monitor
+ * fails with SYS_ERR_RETRY_THROUGH_MONITOR.
+ */
+errval_t cap_batch_retype(struct cap_batch *batch, struct capref dest_start,
+                          struct capref src, gensize_t offset,
+                          enum objtype new_type, gensize_t objsize,
+                          size_t count)
+{
+    assert(new_type < ObjType_Num);
+    assert(offset <= 0xFFFFFFFF);
+    assert(objsize <= 0xFFFFFFFF);
+
+    struct cap_batch_op *op = cap_batch_next(batch);
+    if (op == NULL) {
+        return LIB_ERR_CAP_BATCH_FULL;
+    }
+
+    // arguments as for invoke_cnode_retype()
+    enum cnode_type dcn_level = get_cnode_level(dest_start);
+    cap_invoke_encode(op, cap_root, 9, CNodeCmd_Retype, get_croot_addr(src),
+                      get_cap_addr(src), offset,
+                      ((uint32_t)dcn_level << 16) | new_type, objsize, count,
+                      get_croot_addr(dest_start), get_cnode_addr(dest_start),
+                      dest_start.slot, 0);
+    return SYS_ERR_OK;
+}
+
+/**
+ * \brief Add a cap_delete() to a batch
+ *
+ * Like cap_batch_retype(), a delete needing the monitor fails.
+ */
+errval_t cap_batch_delete(struct cap_batch *batch, struct capref cap)
+{
+    struct cap_batch_op *op = cap_batch_next(batch);
+    if (op == NULL) {
+        return LIB_ERR_CAP_BATCH_FULL;
+    }
+
+    // arguments as for invoke_cnode_delete()
+    cap_invoke_encode(op, get_croot_capref(cap), 2, CNodeCmd_Delete,
+                      get_cap_addr(cap), get_cap_level(cap), 0, 0, 0, 0, 0,
+                      0, 0, 0);
+    return SYS_ERR_OK;
+}
+
+/**
+ * \brief Add a vnode_map() to a batch
+ */
+errval_t cap_batch_vnode_map(struct cap_batch *batch, struct capref dest,
+                             struct capref src, capaddr_t slot,
+                             uint64_t attr, uint64_t off, uint64_t pte_count,
+                             struct capref mapping)
+{
+    assert(get_croot_addr(dest) == CPTR_ROOTCN);
+    assert(slot <= 0xffff);
+    assert(off <= 0xffffffff);
+    assert(attr <= 0xffffffff);
+    assert(pte_count <= 0xffff);
+
+    struct cap_batch_op *op = cap_batch_next(batch);
+    if (op == NULL) {
+        return LIB_ERR_CAP_BATCH_FULL;
+    }
+
+    // arguments as for invoke_vnode_map()
+    uintptr_t small_values = get_cap_level(src) |
+                             (get_cnode_level(mapping) << 4) |
+                             (mapping.slot << 8) |
+                             (slot << 16);
+    cap_invoke_encode(op, dest, 8, VNodeCmd_Map, get_croot_addr(src),
+                      get_cap_addr(src), attr, off, pte_count,
+                      get_croot_addr(mapping), get_cnode_addr(mapping),
+                      small_values, 0, 0);
+    return SYS_ERR_OK;
+}
+
+/**
+ * \brief Run the operations added to a batch and empty it
+ *
+ * The operations run in the order they were added, up to the first that
+ * fails. batch->done is set to the number that succeeded and every
+ * operation that ran has its result in its err field.
+ *
+ * \return Error of the failing operation, or #SYS_ERR_OK.
+ */
+errval_t cap_batch_run(struct cap_batch *batch)
+{
+    errval_t err = SYS_ERR_OK;
+    size_t count = batch->count;
+    batch->count = 0;
+    batch->done = 0;
+    if (count == 0) {
+        return SYS_ERR_OK;
+    }
+
+    if (thread_get_cap_batch_enabled()) {
+        err = sys_invoke_batch(batch->ops, count, &batch->done);
+    } else {
+        while (batch->done < count) {
+            err = cap_invoke_op(&batch->ops[batch->done]);
+            if (err_is_fail(err)) {
+                break;
+            }
+            batch->done++;
+        }
+    }
+    return err;
+}
+
 /**
  * \brief Replace own L1 CNode
  *
@@ -680,8 +838,18 @@ errval_t frame_create(struct capref dest, size_t bytes, size_t *retbytes)
 
     bytes = ROUND_UP(bytes, BASE_PAGE_SIZE);
 
+    // Align large frames, so paging can map them with 1M sections or
+    // 64K pages. Fall back to page alignment if that is not possible.
     struct capref ram;
-    err = ram_alloc(&ram, bytes);
+    err = LIB_ERR_RAM_ALLOC_MS_CONSTRAINTS;
+    if (bytes >= BYTES_PER_SECTION) {
+        err = ram_alloc_aligned(&ram, bytes, BYTES_PER_SECTION);
+    } else if (bytes >= BYTES_PER_LARGE_PAGE) {
+        err = ram_alloc_aligned(&ram, bytes, BYTES_PER_LARGE_PAGE);
+    }
+    if (err_is_fail(err)) {
+        err = ram_alloc(&ram, bytes);
+    }
     if (err_is_fail(err)) {
         if (err_no(err) == MM_ERR_NOT_FOUND ||
             err_no(err) == LIB_ERR_RAM_ALLOC_WRONG_SIZE) {
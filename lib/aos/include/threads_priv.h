@@ -48,7 +48,8 @@ struct thread {
     struct tls_dtv      *tls_dtv;           ///< TLS thread vector
     struct thread       *next, *prev;       ///< Next/prev threads in list
     arch_registers_state_t regs;            ///< Register state snapshot
-    void                *stack;             ///< Malloced stack area
+    void                *stack;             ///< Stack area, see stack_alloc
+    size_t              stack_size;         ///< Bytes reserved for stack
     void                *stack_top;         ///< Stack bounds
     void                *exception_stack;   ///< Stack for exception handling
     void                *exception_stack_top; ///< Bounds of exception stack
@@ -67,11 +68,15 @@ struct thread {
     bool                joining;            ///< true if someone is joining
     bool                in_exception;       ///< true if running exception handler
     bool                used_fpu;           ///< Ever used FPU?
+    uint8_t             priority;           ///< THREAD_PRIORITY_*
+    uint8_t             level;              ///< Run queue, priority or boosted
+    bool                event_wait;         ///< Blocked waiting for an event
 #if defined(__x86_64__)
     uint16_t            thread_seg_selector; ///< Segment selector for TCB
 #endif
     arch_registers_fpu_state_t fpu_state;   ///< FPU state
     void                *slab;              ///< Base of slab block containing this TCB
+    struct arena        *arena;             ///< malloc arena, see arena.c
     uintptr_t           id;                 ///< User-defined thread identifier
 
     uint32_t            token_number;	    ///< RPC next token
@@ -81,6 +86,7 @@ struct thread {
     bool    rpc_in_progress;	            ///< RPC in progress
     errval_t    async_error;                ///< RPC async error
     uint32_t    outgoing_token;             ///< Token of outgoing message
+    bool    cap_batch_off;                  ///< cap_batch_run() goes one by one
 };
 
 void thread_enqueue(struct thread *thread, struct thread **queue);
@@ -95,7 +101,7 @@ void thread_init_disabled(dispatcher_handle_t handle, bool init_domain);
 static inline bool havework_disabled(dispatcher_handle_t handle)
 {
     struct dispatcher_generic *disp = get_dispatcher_generic(handle);
-    return disp->runq != NULL
+    return disp->runq_levels != 0
 #ifdef CONFIG_INTERCONNECT_DRIVER_LMP
             || disp->lmp_send_events_list != NULL
 #endif
@@ -114,6 +120,8 @@ struct thread *thread_unblock_one_disabled(dispatcher_handle_t handle,
 struct thread *thread_unblock_all_disabled(dispatcher_handle_t handle,
                                            struct thread **queue, void *reason);
 
+bool thread_is_alone_disabled(dispatcher_handle_t handle);
+
 struct thread *thread_create_unrunnable(thread_func_t start_func, void *arg,
                                         size_t stacksize);
 
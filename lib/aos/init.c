@@ -203,7 +203,10 @@ errval_t barrelfish_init_onthread(struct spawn_domain_params *params)
     // Register ourselves with init
     aos_rpc_init(&init_rpc);
     ram_alloc_set(NULL);
-
+    err = ram_alloc_cache_init();
+    if (err_is_fail(err)) {
+        DEBUG_ERR(err, "ram cache setup failed, not caching");
+    }
 
     // Register ourselves in the process manager.
     DBG(VERBOSE, "We're gonna register ourself with the procman now\n");
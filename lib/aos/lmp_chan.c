@@ -17,7 +17,9 @@
 #include <aos/dispatcher_arch.h>
 #include <aos/caddr.h>
 #include <aos/waitset_chan.h>
+#include <aos/lmp_endpoints.h>
 #include "waitset_chan_priv.h"
+#include "threads_priv.h"
 
 /**
  * \brief Initialise a new LMP channel
@@ -209,6 +211,47 @@ errval_t lmp_chan_alloc_recv_slot(struct lmp_chan *lc)
     return SYS_ERR_OK;
 }
 
+/**
+ * \brief Send a request on an LMP channel and wait for the reply in the kernel
+ *
+ * Like lmp_chan_send with LMP_FLAG_SYNC, which switches straight to the
+ * receiver. If the calling thread is the only one with work in this
+ * dispatcher, LMP_FLAG_CALL is added, so the kernel also takes the dispatcher
+ * off the run queue until a message arrives, instead of running it again
+ * just to find nothing to do. The check and the send happen while disabled,
+ * so no other thread can become runnable in between. Messages delivered by
+ * then are polled before enabling again, as the run upcall would have done.
+ *
+ * \param lc LMP channel
+ * \param flags LMP send flags, LMP_FLAG_SYNC is implied
+ * \param send_cap (Optional) capability to send with the message
+ * \param length_words Length of the message in words
+ * \param a..i Message payload
+ */
+errval_t lmp_chan_call(struct lmp_chan *lc, lmp_send_flags_t flags,
+                       struct capref send_cap, uint8_t length_words,
+                       uintptr_t a, uintptr_t b, uintptr_t c, uintptr_t d,
+                       uintptr_t e, uintptr_t f, uintptr_t g, uintptr_t h,
+                       uintptr_t i)
+{
+    dispatcher_handle_t handle = disp_disable();
+    struct dispatcher_shared_generic *disp =
+        get_dispatcher_shared_generic(handle);
+
+    flags |= LMP_FLAG_SYNC;
+    if (thread_is_alone_disabled(handle)) {
+        flags |= LMP_FLAG_CALL;
+    }
+    errval_t err = lmp_chan_send(lc, flags, send_cap, length_words,
+                                 a, b, c, d, e, f, g, h, i);
+
+    if (disp->lmp_delivered != disp->lmp_seen) {
+        lmp_endpoints_poll_disabled(handle);
+    }
+    disp_enable(handle);
+    return err;
+}
+
 /**
  * \brief Trigger send events for all LMP channels that are registered
  *
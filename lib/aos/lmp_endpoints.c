@@ -362,7 +362,9 @@ void lmp_endpoint_migrate(struct lmp_endpoint *ep, struct waitset *ws)
  *
  * \return LIB_ERR_NO_LMP_MSG if no message is available
  * \return LIB_ERR_LMP_RECV_BUF_OVERFLOW if user-provided receive buffer is too small
- *                                       to store the entire message
+ *                                       to store the entire message. The message
+ *                                       is dropped, but a cap that came with it
+ *                                       is still returned in `cap`.
  */
 errval_t lmp_endpoint_recv(struct lmp_endpoint *ep, struct lmp_recv_buf *buf,
                            struct capref *cap)
@@ -391,15 +393,17 @@ errval_t lmp_endpoint_recv(struct lmp_endpoint *ep, struct lmp_recv_buf *buf,
                    ep->buflen);
     }
 
-    /* check for space in the user's buffer */
+    /* check for space in the user's buffer. A message that does not fit is
+     * dropped, leaving it in the endpoint would block the ones behind it */
+    errval_t err = SYS_ERR_OK;
     if (header.x.length > buf->buflen) {
-        disp_enable(handle);
         debug_printf("lmp_endpoint_recv: recv buf (%zu words @ %p) overflow"
-                     " by pending message (%u words @ %"PRIu32")."
+                     " by pending message (%u words @ %"PRIu32"), dropped."
                      " delivered=%"PRIu32" consumed=%"PRIu32" len=%"PRIu32"\n",
                      buf->buflen, &buf, header.x.length, pos,
                      ep->k.delivered, ep->k.consumed, ep->buflen);
-        return LIB_ERR_LMP_RECV_BUF_OVERFLOW;
+        buf->msglen = 0;
+        err = LIB_ERR_LMP_RECV_BUF_OVERFLOW;
     }
 
     /* consume the header */
@@ -407,13 +411,19 @@ errval_t lmp_endpoint_recv(struct lmp_endpoint *ep, struct lmp_recv_buf *buf,
         pos = 0;
     }
 
-    /* copy the rest out one word at a time... */
-    for (int i = 0; i < header.x.length; i++) {
-        buf->words[i] = ep->k.buf[pos];
-        if (++pos == ep->buflen) {
-            pos = 0;
+    /* copy the rest out, in two pieces if it wraps around the buffer end */
+    if (err_is_ok(err)) {
+        size_t first = MIN(header.x.length, ep->buflen - pos);
+        memcpy(buf->words, &ep->k.buf[pos], first * sizeof(uintptr_t));
+        if (first < header.x.length) {
+            memcpy(&buf->words[first], &ep->k.buf[0],
+                   (header.x.length - first) * sizeof(uintptr_t));
         }
     }
+    pos += header.x.length;
+    if (pos >= ep->buflen) {
+        pos -= ep->buflen;
+    }
 
     /* did we get a cap? */
     if (header.x.flags.captransfer) {
@@ -431,7 +441,7 @@ errval_t lmp_endpoint_recv(struct lmp_endpoint *ep, struct lmp_recv_buf *buf,
 
     disp_enable(handle);
 
-    return SYS_ERR_OK;
+    return err;
 }
 
 /**
@@ -14,6 +14,7 @@
  */
 
 #include <aos/aos.h>
+#include <aos/arena.h>
 #include <aos/core_state.h>
 #include <aos/morecore.h>
 #include <stdio.h>
@@ -24,10 +25,23 @@ extern morecore_alloc_func_t sys_morecore_alloc;
 typedef void (*morecore_free_func_t)(void *base, size_t bytes);
 extern morecore_free_func_t sys_morecore_free;
 
+typedef void *(*alt_malloc_t)(size_t bytes);
+extern alt_malloc_t alt_malloc;
+
+typedef void (*alt_free_t)(void *p);
+extern alt_free_t alt_free;
+
+typedef void *(*alt_realloc_t)(void *p, size_t bytes);
+extern alt_realloc_t alt_realloc;
+
 // this define makes morecore use an implementation that just has a static
 // 16MB heap.
 //#define USE_STATIC_HEAP
 
+// this define replaces the K&R malloc of libc with the thread local size
+// class arenas of lib/aos/arena.c. Only used with the paging heap.
+#define USE_ARENA_MALLOC
+
 
 #ifdef USE_STATIC_HEAP
 
@@ -121,6 +135,13 @@ errval_t morecore_init(void)
     sys_morecore_alloc = morecore_alloc;
     sys_morecore_free = morecore_free;
 
+#ifdef USE_ARENA_MALLOC
+    arena_init();
+    alt_malloc = arena_malloc;
+    alt_free = arena_free;
+    alt_realloc = arena_realloc;
+#endif
+
     return SYS_ERR_OK;
 }
 
@@ -15,6 +15,7 @@ struct aos_rpc nameserver_connection;
 struct thread_mutex ns_rpc_mutex;
 
 struct rpc_call {
+    struct lmp_chan *chan; // ids are only unique per channel
     unsigned char id;
     unsigned char type;
     bool *done;
@@ -25,12 +26,14 @@ struct rpc_call {
 
 struct rpc_call *ns_rpc_call_buffer_head = NULL;
 
-static void register_recv(unsigned char id, unsigned char type, bool *done,
+static void register_recv(struct lmp_chan *chan, unsigned char id,
+                          unsigned char type, bool *done,
                           void (*inst_recv_handling)(void *arg1,
                                                      struct recv_list *data),
                           void *recv_handling_arg1)
 {
     struct rpc_call *call = malloc(sizeof(struct rpc_call));
+    call->chan = chan;
     call->id = id;
     call->type = type;
     call->done = done;
@@ -51,17 +54,20 @@ rpc_framework(void (*inst_recv_handling)(void *arg1, struct recv_list *data),
               struct lmp_chan *chan, struct capref cap, size_t payloadsize,
               uintptr_t *payload, struct event_closure callback_when_done)
 {
-    unsigned char id = request_fresh_id(RPC_MESSAGE(type));
+    unsigned char id = request_fresh_id(chan, RPC_MESSAGE(type));
 
     bool done = false;
-    register_recv(id, RPC_ACK_MESSAGE(type), &done, inst_recv_handling,
+    register_recv(chan, id, RPC_ACK_MESSAGE(type), &done, inst_recv_handling,
                   recv_handling_arg1);
-    send(chan, cap, RPC_MESSAGE(type), payloadsize, payload,
-         callback_when_done, id);
+    // the id is held until the ACK arrived, so it can't be reused while the
+    // response is still outstanding
+    send_request(chan, cap, RPC_MESSAGE(type), payloadsize, payload,
+                 callback_when_done, id);
     struct waitset *ws = get_default_waitset();
 //if(strcmp(disp_name(),"init") != 0) //in an ideal world our processes would all have a main loop they are pumping in a seperate thread which only does that pumping and this hack here would not be required, but this world is not that world.
     while (!done)
         event_dispatch(ws);
+    rpc_id_free(chan, RPC_MESSAGE(type), id);
 }
 
 
@@ -78,7 +84,8 @@ static void ns_rpc_recv_handler(struct recv_list *data)
             struct rpc_call *prev = NULL;
             foodata = ns_rpc_call_buffer_head;
             while (foodata != NULL) {
-                if (foodata->type == data->type &&
+                if (foodata->chan == data->chan &&
+                    foodata->type == data->type &&
                     foodata->id == data->payload[0])
                     break;
                 prev = foodata;
@@ -25,14 +25,18 @@
 #include <string.h>
 #include <aos/dispatcher.h>
 
-#define PAGEFAULT_STACK_SIZE (16 * 1024) // = 16kb
-
 //#define no_page_align_in_frame_alloc
 
+/// Paging nodes kept free by the slab refill thread
+#define PAGING_SLAB_WATERMARK 64
+
 static struct paging_state current;
-static struct thread_mutex mutex;
 static bool print_oh_print = false;
 
+// Whether paging_map_fixed_attr may use 1M sections and 64K pages.
+static bool large_mappings = true;
+static struct paging_map_stats map_stats;
+
 static errval_t eternal_sadness(struct capref dest, size_t bytes, size_t *retbytes)
 {
     assert(bytes > 0);
@@ -45,7 +49,14 @@ static errval_t eternal_sadness(struct capref dest, size_t bytes, size_t *retbyt
     struct capref ram;
     if(print_oh_print)
         debug_printf("fc2\n");
-    err = ram_alloc(&ram, bytes);
+    // fault-ahead windows of 64K or more can use large pages if aligned
+    if (bytes >= BYTES_PER_LARGE_PAGE) {
+        err = ram_alloc_aligned(&ram, bytes, BYTES_PER_LARGE_PAGE);
+        if (err_is_fail(err))
+            err = ram_alloc(&ram, bytes);
+    } else {
+        err = ram_alloc(&ram, bytes);
+    }
     if(print_oh_print)
         debug_printf("fc3\n");
     if (err_is_fail(err)) {
@@ -102,38 +113,66 @@ static errval_t the_taste_of_sadness(struct capref *dest, size_t bytes, size_t *
 }
 
 
-static char pagefault_stack[PAGEFAULT_STACK_SIZE];
-// TODO: Make threadsafe (Probably best to acquire a lock o.s.s.?)
+/*
+ * Fault-ahead. Faults are grouped into a few sequential streams, like the
+ * readahead windows of a file system. A fault right at the end of what a
+ * stream mapped last time grows its window, any other fault starts a new
+ * stream with a single page, so sparse accesses do not map more than they
+ * touch.
+ */
+
+#define PAGING_FAULT_STREAMS 4
+
+struct fault_stream {
+    lvaddr_t next;      ///< First address after the last window
+    size_t pages;       ///< Size of the last window
+};
+
+static struct fault_stream fault_streams[PAGING_FAULT_STREAMS];
+static size_t fault_stream_victim;
+static struct paging_fault_policy fault_policy = PAGING_FAULT_POLICY_DEFAULT;
+static struct paging_fault_stats fault_stats;
+
+// A window never crosses a 1M boundary, see fault_window
+#define PAGING_FAULT_MAX_L1_SLOTS 1
+
+static size_t fault_window(struct paging_state *st, lvaddr_t vaddr);
+static void fault_window_shrink(lvaddr_t vaddr);
+
+static struct paging_used_node *used_floor(struct paging_used_node *n,
+                                           lvaddr_t vaddr);
+static struct paging_used_node *used_insert(struct paging_used_node *root,
+                                            struct paging_used_node *node);
+static void paging_slab_reserve(struct paging_state *st, size_t count);
+static errval_t paging_install(struct paging_state *st, lvaddr_t vaddr,
+                               struct capref frame, size_t bytes, int flags,
+                               struct paging_used_node *node);
+
+// Used by the first thread, all others carry their own exception stack at
+// the end of their thread stack.
+static char pagefault_stack[PAGING_EXCEPTION_STACK_SIZE];
+
+/*
+ * The handler only holds st->mutex while it looks at and updates the vspace
+ * trees. The faulting range is reserved there as a pending mapping before
+ * the frame is allocated and mapped, so faults of other threads go ahead in
+ * parallel, and a thread faulting on a pending range waits for it.
+ */
 static void pagefault_handler(enum exception_type type, int subtype,
                               void *addr, arch_registers_state_t *regs,
                               arch_registers_fpu_state_t *fpuregs)
 {
-    thread_mutex_lock(&mutex);
     struct paging_state *st = get_current_paging_state();
     struct dispatcher_generic *disp_gen = get_dispatcher_generic(curdispatcher());
     struct thread *thread = disp_gen->current;
 
-/*    //and in the darkest of hells this hack was born, so that it may once and for all slay the forces of scheduling
-    struct thread *next = thread->next;
-    struct thread *prev = thread->prev;
-    thread->next = thread;
-    thread->prev = thread;
-    //end of the first act
-*/
     lvaddr_t vaddr = (lvaddr_t) addr;
-/*    if(!strcmp("turtleback",disp_name())) {
-        print_oh_print = true;
-        debug_printf("vaddr: %p\n", addr);
-    }
-*/
     // Do some checks
     if (vaddr == 0x0) {
-        thread_mutex_unlock(&mutex);
         DBG(ERR, "Tried to dereference NULL. IP is %p\n", registers_get_ip(regs));
         thread_exit(1);
     }
     if (vaddr > 0x80000000) {
-        thread_mutex_unlock(&mutex);
         // check if we want to map something to kernel space (2GB)
         DBG(ERR, "Tried to alloc something in kernel space. IP is %p\n", registers_get_ip(regs));
         thread_exit(1);
@@ -146,7 +185,6 @@ static void pagefault_handler(enum exception_type type, int subtype,
     lvaddr_t sp = (lvaddr_t) registers_get_sp(regs);
     if (sp < (lvaddr_t)thread->stack ||
             sp > (lvaddr_t)thread->stack_top) {
-        thread_mutex_unlock(&mutex);
         // check if we want to map something to kernel space (2GB)
         DBG(ERR, "Stack overflow. IP is %p\n", registers_get_ip(regs));
         thread_exit(1);
@@ -155,32 +193,76 @@ static void pagefault_handler(enum exception_type type, int subtype,
     if(print_oh_print)
         debug_printf("hi2\n");
 
-
     // TODO: Check if we are in a valid heap-range address.
-    // TODO: Also check if we need to refill slabs and do so if yes.
 
     // Align the address where the fault occurred against base page size.
     vaddr = vaddr - (vaddr % BASE_PAGE_SIZE);
 
+    // The reservation and the mapping itself take slabs, get them now.
+    paging_slab_reserve(st, 2 + 3 * PAGING_FAULT_MAX_L1_SLOTS);
+
+    thread_mutex_lock_nested(&st->mutex);
+    struct paging_used_node *node = used_floor(st->mappings, vaddr);
+    if (node != NULL && node->start_addr + node->size > vaddr) {
+        bool pending = node->pending;
+        if (pending)
+            fault_stats.waits++;
+        thread_mutex_unlock(&st->mutex);
+        if (pending) {
+            // Another thread is mapping this page, run the access again
+            // once it is done.
+            thread_yield();
+            return;
+        }
+        DBG(ERR, "Access violation at %p. IP is %p\n", addr,
+            registers_get_ip(regs));
+        thread_exit(1);
+    }
+
+    // Map a whole window if the faults look sequential.
+    size_t window = fault_window(st, vaddr);
+    node = (struct paging_used_node *) slab_cache_alloc(&st->slab_alloc);
+    node->start_addr = vaddr;
+    node->size = window;
+    node->pending = true;
+    node->map_list = NULL;
+    node->frame = NULL_CAP;
+    st->mappings = used_insert(st->mappings, node);
+    thread_mutex_unlock(&st->mutex);
+
     struct capref frame;
     size_t retsize;
     if(print_oh_print)
         debug_printf("hi3\n");
 
-    CHECK(the_taste_of_sadness(&frame, BASE_PAGE_SIZE, &retsize)); //frame_alloc call
+    errval_t err = the_taste_of_sadness(&frame, window, &retsize); //frame_alloc call
+    if (err_is_fail(err) && window > BASE_PAGE_SIZE) {
+        // Low on memory, fall back to the faulting page.
+        if (err_no(err) != LIB_ERR_SLOT_ALLOC)
+            slot_free(frame);
+        thread_mutex_lock_nested(&st->mutex);
+        node->size = BASE_PAGE_SIZE;
+        fault_stats.fallbacks++;
+        fault_window_shrink(vaddr);
+        thread_mutex_unlock(&st->mutex);
+        err = the_taste_of_sadness(&frame, BASE_PAGE_SIZE, &retsize);
+    }
+    CHECK(err);
     if(print_oh_print)
         debug_printf("hi4\n");
-    CHECK(paging_map_fixed_attr(st, vaddr, frame, retsize,
-                                VREGION_FLAGS_READ_WRITE));
+    CHECK(paging_install(st, vaddr, frame, retsize, VREGION_FLAGS_READ_WRITE,
+                         node));
+
+    thread_mutex_lock_nested(&st->mutex);
+    node->frame = frame;
+    node->pending = false;
+    fault_stats.faults++;
+    fault_stats.pages_mapped += retsize / BASE_PAGE_SIZE;
+    thread_mutex_unlock(&st->mutex);
     if(print_oh_print) {
         print_oh_print = false;
         debug_printf("hi5\n");
     }
-/*    //and in the second act we restore what was once taken
-    thread->next = next;
-    thread->prev = prev;
-    //end of the second act
-*/    thread_mutex_unlock(&mutex);
 }
 
 /**
@@ -195,6 +277,210 @@ __attribute__((unused)) static errval_t arml2_alloc(struct paging_state *st,
     return SYS_ERR_OK;
 }
 
+/**
+ * \brief Returns the L2 table for `l1_index`, creating and installing it in
+ *        the L1 table if it does not exist yet.
+ *
+ * Tables are never removed, so an existing one is returned without locking.
+ * A new one is created before taking the lock of its L1 slot, the thread
+ * that loses the race to install it destroys its copy again.
+ */
+static errval_t paging_get_l2(struct paging_state *st, lvaddr_t l1_index,
+                              struct capref *ret)
+{
+    if (st->l2_page_tables[l1_index].init) {
+        // Table exists.
+        DBG(DETAILED, "found l2 page table \n");
+        *ret = st->l2_page_tables[l1_index].cap;
+        return SYS_ERR_OK;
+    }
+
+    // Create a new table.
+    DBG(DETAILED, "making l2 page table \n");
+    struct capref l2_pagetable;
+    CHECK(arml2_alloc(st, &l2_pagetable));
+
+    DBG(DETAILED, "creating l1 l2 mapping capability \n");
+    // Write the L1 table entry.
+    struct capref l2_l1_mapping;
+    CHECK(st->slot_alloc->alloc(st->slot_alloc, &l2_l1_mapping));
+
+    struct thread_mutex *lock = &st->l2_locks[l1_index % PAGING_L2_LOCKS];
+    thread_mutex_lock_nested(lock);
+    if (st->l2_page_tables[l1_index].init) {
+        // Someone else was faster.
+        thread_mutex_unlock(lock);
+        CHECK(cap_destroy(l2_pagetable));
+        CHECK(st->slot_alloc->free(st->slot_alloc, l2_l1_mapping));
+        *ret = st->l2_page_tables[l1_index].cap;
+        return SYS_ERR_OK;
+    }
+
+    DBG(DETAILED, "mapping l2 page table \n");
+    CHECK(vnode_map(st->l1_page_table, l2_pagetable, l1_index,
+                    VREGION_FLAGS_READ_WRITE, 0, 1, l2_l1_mapping));
+
+    // Add cap to tracking array, the cap has to be there before others see
+    // the table as initialized.
+    st->l2_page_tables[l1_index].cap = l2_pagetable;
+    __sync_synchronize();
+    st->l2_page_tables[l1_index].init = true;
+    thread_mutex_unlock(lock);
+
+    // Add to child process if necessary.
+    if (st->spawninfo != NULL) {
+        DBG(DETAILED, "I should add the new slot to the child\n");
+        ((struct spawninfo *) st->spawninfo)
+            ->slot_callback(((struct spawninfo *) st->spawninfo),
+                            l2_pagetable);
+        ((struct spawninfo *) st->spawninfo)
+            ->slot_callback(((struct spawninfo *) st->spawninfo),
+                            l2_l1_mapping);
+    }
+
+    *ret = l2_pagetable;
+    return SYS_ERR_OK;
+}
+
+/// Smallest free range that ends above `vaddr`.
+static struct paging_vspace_node *vspace_ceil(struct paging_vspace_node *n,
+                                              lvaddr_t vaddr)
+{
+    struct paging_vspace_node *best = NULL;
+    while (n != NULL) {
+        if (n->base_addr + n->region_size > vaddr) {
+            best = n;
+            n = n->left;
+        } else {
+            n = n->right;
+        }
+    }
+    return best;
+}
+
+/// Mapping with the highest start address at or below `vaddr`.
+static struct paging_used_node *used_floor(struct paging_used_node *n,
+                                           lvaddr_t vaddr)
+{
+    struct paging_used_node *best = NULL;
+    while (n != NULL) {
+        if (n->start_addr <= vaddr) {
+            best = n;
+            n = n->right;
+        } else {
+            n = n->left;
+        }
+    }
+    return best;
+}
+
+/// Mapping with the lowest start address above `vaddr`.
+static struct paging_used_node *used_ceil(struct paging_used_node *n,
+                                          lvaddr_t vaddr)
+{
+    struct paging_used_node *best = NULL;
+    while (n != NULL) {
+        if (n->start_addr > vaddr) {
+            best = n;
+            n = n->left;
+        } else {
+            n = n->right;
+        }
+    }
+    return best;
+}
+
+/**
+ * \brief Returns how many bytes to map for a fault at page `vaddr` and
+ *        updates the fault streams.
+ *
+ * The window never reaches into free vspace, an existing mapping or the
+ * next L2 table. Called with st->mutex held.
+ */
+static size_t fault_window(struct paging_state *st, lvaddr_t vaddr)
+{
+    struct fault_stream *stream = NULL;
+    for (int i = 0; i < PAGING_FAULT_STREAMS; i++) {
+        if (fault_streams[i].next == vaddr && vaddr != 0) {
+            stream = &fault_streams[i];
+            break;
+        }
+    }
+
+    size_t pages = 1;
+    if (stream != NULL) {
+        fault_stats.sequential++;
+        pages = stream->pages == 1 ? fault_policy.initial_pages
+                                   : 2 * stream->pages;
+        pages = MIN(pages, fault_policy.max_pages);
+    } else {
+        stream = &fault_streams[fault_stream_victim];
+        fault_stream_victim = (fault_stream_victim + 1) % PAGING_FAULT_STREAMS;
+    }
+    pages = MAX(pages, 1);
+
+    lvaddr_t end = vaddr + pages * BASE_PAGE_SIZE;
+    end = MIN(end, ROUND_DOWN(vaddr, BYTES_PER_SECTION) + BYTES_PER_SECTION);
+    struct paging_vspace_node *free = vspace_ceil(st->free_vspace, vaddr);
+    if (free != NULL) {
+        if (free->base_addr <= vaddr)
+            end = vaddr + BASE_PAGE_SIZE; // not reserved, keep it minimal
+        else
+            end = MIN(end, free->base_addr);
+    }
+    struct paging_used_node *used = used_ceil(st->mappings, vaddr);
+    if (used != NULL)
+        end = MIN(end, used->start_addr);
+    end = MAX(end, vaddr + BASE_PAGE_SIZE);
+
+    stream->next = end;
+    stream->pages = (end - vaddr) / BASE_PAGE_SIZE;
+    return end - vaddr;
+}
+
+/// The window for `vaddr` could not be allocated, restart its stream.
+static void fault_window_shrink(lvaddr_t vaddr)
+{
+    for (int i = 0; i < PAGING_FAULT_STREAMS; i++) {
+        if (fault_streams[i].next > vaddr &&
+            fault_streams[i].next - vaddr <=
+                fault_policy.max_pages * BASE_PAGE_SIZE) {
+            fault_streams[i].next = vaddr + BASE_PAGE_SIZE;
+            fault_streams[i].pages = 1;
+        }
+    }
+}
+
+/**
+ * \brief Sets the fault-ahead policy of this domain.
+ */
+void paging_set_fault_policy(const struct paging_fault_policy *policy)
+{
+    thread_mutex_lock_nested(&current.mutex);
+    fault_policy = *policy;
+    thread_mutex_unlock(&current.mutex);
+}
+
+/**
+ * \brief Returns the page fault counters of this domain.
+ */
+void paging_get_fault_stats(struct paging_fault_stats *stats)
+{
+    thread_mutex_lock_nested(&current.mutex);
+    *stats = fault_stats;
+    thread_mutex_unlock(&current.mutex);
+}
+
+/**
+ * \brief Resets the page fault counters of this domain.
+ */
+void paging_reset_fault_stats(void)
+{
+    thread_mutex_lock_nested(&current.mutex);
+    memset(&fault_stats, 0, sizeof(fault_stats));
+    thread_mutex_unlock(&current.mutex);
+}
+
 // For debugging only. Keeps track of number of created paging states.
 static size_t ps_index = 1;
 
@@ -210,6 +496,305 @@ static errval_t slot_free2(struct slot_allocator *ca, struct capref cap)
 
 static struct slot_allocator k;
 
+/*
+ * Free vspace tree. An AVL tree of free ranges ordered by address, every node
+ * also holds the largest range in its subtree. Descending towards the lowest
+ * subtree that still has a large enough range gives first fit in O(log n),
+ * and the neighbours of a freed range are found the same way.
+ */
+
+static inline int vspace_height(struct paging_vspace_node *n)
+{
+    return n != NULL ? n->height : 0;
+}
+
+static inline size_t vspace_max(struct paging_vspace_node *n)
+{
+    return n != NULL ? n->max_size : 0;
+}
+
+static void vspace_fix(struct paging_vspace_node *n)
+{
+    n->height = 1 + MAX(vspace_height(n->left), vspace_height(n->right));
+    n->max_size = MAX(n->region_size, MAX(vspace_max(n->left),
+                                          vspace_max(n->right)));
+}
+
+static struct paging_vspace_node *vspace_rotate_right(
+    struct paging_vspace_node *n)
+{
+    struct paging_vspace_node *l = n->left;
+    n->left = l->right;
+    l->right = n;
+    vspace_fix(n);
+    vspace_fix(l);
+    return l;
+}
+
+static struct paging_vspace_node *vspace_rotate_left(
+    struct paging_vspace_node *n)
+{
+    struct paging_vspace_node *r = n->right;
+    n->right = r->left;
+    r->left = n;
+    vspace_fix(n);
+    vspace_fix(r);
+    return r;
+}
+
+static struct paging_vspace_node *vspace_balance(struct paging_vspace_node *n)
+{
+    vspace_fix(n);
+    int balance = vspace_height(n->left) - vspace_height(n->right);
+    if (balance > 1) {
+        if (vspace_height(n->left->left) < vspace_height(n->left->right))
+            n->left = vspace_rotate_left(n->left);
+        return vspace_rotate_right(n);
+    }
+    if (balance < -1) {
+        if (vspace_height(n->right->right) < vspace_height(n->right->left))
+            n->right = vspace_rotate_right(n->right);
+        return vspace_rotate_left(n);
+    }
+    return n;
+}
+
+static struct paging_vspace_node *vspace_insert(struct paging_vspace_node *root,
+                                                struct paging_vspace_node *n)
+{
+    if (root == NULL) {
+        n->left = n->right = NULL;
+        vspace_fix(n);
+        return n;
+    }
+    if (n->base_addr < root->base_addr)
+        root->left = vspace_insert(root->left, n);
+    else
+        root->right = vspace_insert(root->right, n);
+    return vspace_balance(root);
+}
+
+static struct paging_vspace_node *vspace_remove_min(
+    struct paging_vspace_node *root, struct paging_vspace_node **min)
+{
+    if (root->left == NULL) {
+        *min = root;
+        return root->right;
+    }
+    root->left = vspace_remove_min(root->left, min);
+    return vspace_balance(root);
+}
+
+/// Replaces `n` by the join of its subtrees.
+static struct paging_vspace_node *vspace_unlink(struct paging_vspace_node *n)
+{
+    if (n->left == NULL)
+        return n->right;
+    if (n->right == NULL)
+        return n->left;
+    struct paging_vspace_node *succ;
+    struct paging_vspace_node *right = vspace_remove_min(n->right, &succ);
+    succ->left = n->left;
+    succ->right = right;
+    return vspace_balance(succ);
+}
+
+static struct paging_vspace_node *vspace_remove(struct paging_vspace_node *root,
+                                                struct paging_vspace_node *n)
+{
+    assert(root != NULL);
+    if (root == n)
+        return vspace_unlink(root);
+    if (n->base_addr < root->base_addr)
+        root->left = vspace_remove(root->left, n);
+    else
+        root->right = vspace_remove(root->right, n);
+    return vspace_balance(root);
+}
+
+/// Takes `bytes` from the front of the lowest range that is large enough.
+/// A range that is used up is unlinked and returned in `*emptied`.
+static struct paging_vspace_node *vspace_take(struct paging_vspace_node *root,
+                                              size_t bytes, lvaddr_t *base,
+                                              struct paging_vspace_node **emptied)
+{
+    if (vspace_max(root->left) >= bytes) {
+        root->left = vspace_take(root->left, bytes, base, emptied);
+    } else if (root->region_size >= bytes) {
+        *base = root->base_addr;
+        root->base_addr += bytes;
+        root->region_size -= bytes;
+        if (root->region_size == 0) {
+            *emptied = root;
+            return vspace_unlink(root);
+        }
+    } else {
+        root->right = vspace_take(root->right, bytes, base, emptied);
+    }
+    return vspace_balance(root);
+}
+
+/// Finds a free range that overlaps or touches [base, end].
+static struct paging_vspace_node *vspace_find_touching(
+    struct paging_vspace_node *n, lvaddr_t base, lvaddr_t end)
+{
+    while (n != NULL) {
+        if (n->base_addr + n->region_size < base)
+            n = n->right;
+        else if (n->base_addr > end)
+            n = n->left;
+        else
+            return n;
+    }
+    return NULL;
+}
+
+static struct paging_vspace_node *vspace_node_alloc(struct paging_state *st)
+{
+    if (!st->free_vspace_first_used) {
+        st->free_vspace_first_used = true;
+        return &st->free_vspace_first;
+    }
+    return (struct paging_vspace_node *) slab_cache_alloc(&st->slab_alloc);
+}
+
+static void vspace_node_free(struct paging_state *st,
+                             struct paging_vspace_node *n)
+{
+    if (n == &st->free_vspace_first)
+        st->free_vspace_first_used = false;
+    else
+        slab_cache_free(&st->slab_alloc, n);
+}
+
+/// Returns [base, base + size) to the free vspace, merging it with the free
+/// ranges it touches. Fixed mappings never took their range out of the free
+/// tree, so overlaps are merged as well. Called with st->mutex held.
+static void paging_add_space(struct paging_state *st, lvaddr_t base,
+                             size_t size)
+{
+    lvaddr_t end = base + ROUND_UP(size, BASE_PAGE_SIZE);
+    struct paging_vspace_node *node = NULL;
+    struct paging_vspace_node *n;
+    while ((n = vspace_find_touching(st->free_vspace, base, end)) != NULL) {
+        st->free_vspace = vspace_remove(st->free_vspace, n);
+        end = MAX(end, n->base_addr + n->region_size);
+        base = MIN(base, n->base_addr);
+        if (node == NULL)
+            node = n;
+        else
+            vspace_node_free(st, n);
+    }
+    if (node == NULL)
+        node = vspace_node_alloc(st);
+    node->base_addr = base;
+    node->region_size = end - base;
+    st->free_vspace = vspace_insert(st->free_vspace, node);
+}
+
+/*
+ * Mapping tree, an AVL tree of the mapped ranges ordered by start address.
+ */
+
+static inline int used_height(struct paging_used_node *n)
+{
+    return n != NULL ? n->height : 0;
+}
+
+static inline void used_fix(struct paging_used_node *n)
+{
+    n->height = 1 + MAX(used_height(n->left), used_height(n->right));
+}
+
+static struct paging_used_node *used_rotate_right(struct paging_used_node *n)
+{
+    struct paging_used_node *l = n->left;
+    n->left = l->right;
+    l->right = n;
+    used_fix(n);
+    used_fix(l);
+    return l;
+}
+
+static struct paging_used_node *used_rotate_left(struct paging_used_node *n)
+{
+    struct paging_used_node *r = n->right;
+    n->right = r->left;
+    r->left = n;
+    used_fix(n);
+    used_fix(r);
+    return r;
+}
+
+static struct paging_used_node *used_balance(struct paging_used_node *n)
+{
+    used_fix(n);
+    int balance = used_height(n->left) - used_height(n->right);
+    if (balance > 1) {
+        if (used_height(n->left->left) < used_height(n->left->right))
+            n->left = used_rotate_left(n->left);
+        return used_rotate_right(n);
+    }
+    if (balance < -1) {
+        if (used_height(n->right->right) < used_height(n->right->left))
+            n->right = used_rotate_right(n->right);
+        return used_rotate_left(n);
+    }
+    return n;
+}
+
+static struct paging_used_node *used_insert(struct paging_used_node *root,
+                                            struct paging_used_node *n)
+{
+    if (root == NULL) {
+        n->left = n->right = NULL;
+        used_fix(n);
+        return n;
+    }
+    if (n->start_addr < root->start_addr)
+        root->left = used_insert(root->left, n);
+    else
+        root->right = used_insert(root->right, n);
+    return used_balance(root);
+}
+
+static struct paging_used_node *used_remove_min(struct paging_used_node *root,
+                                                struct paging_used_node **min)
+{
+    if (root->left == NULL) {
+        *min = root;
+        return root->right;
+    }
+    root->left = used_remove_min(root->left, min);
+    return used_balance(root);
+}
+
+/// Unlinks the mapping starting at `addr` and returns it in `*found`.
+static struct paging_used_node *used_remove(struct paging_used_node *root,
+                                            lvaddr_t addr,
+                                            struct paging_used_node **found)
+{
+    if (root == NULL)
+        return NULL;
+    if (addr < root->start_addr) {
+        root->left = used_remove(root->left, addr, found);
+    } else if (addr > root->start_addr) {
+        root->right = used_remove(root->right, addr, found);
+    } else {
+        *found = root;
+        if (root->left == NULL)
+            return root->right;
+        if (root->right == NULL)
+            return root->left;
+        struct paging_used_node *succ;
+        struct paging_used_node *right = used_remove_min(root->right, &succ);
+        succ->left = root->left;
+        succ->right = right;
+        root = succ;
+    }
+    return used_balance(root);
+}
+
 errval_t paging_init_state(struct paging_state *st, lvaddr_t start_vaddr,
                            struct capref pdir, struct slot_allocator *ca)
 {
@@ -237,12 +822,20 @@ errval_t paging_init_state(struct paging_state *st, lvaddr_t start_vaddr,
         st->l2_page_tables[i].init = false;
     }
     // Set the start of the free space.
-    st->free_vspace.base_addr = start_vaddr;
+    st->free_vspace_first_used = false;
+    struct paging_vspace_node *first = vspace_node_alloc(st);
+    first->base_addr = start_vaddr;
+    first->region_size = 0xFFFFFFFF - start_vaddr;
     DBG(DETAILED, "At time of init our base addr is at: %p \n",
-        st->free_vspace.base_addr);
-    st->free_vspace.region_size = 0xFFFFFFFF - start_vaddr;
+        first->base_addr);
+    st->free_vspace = vspace_insert(NULL, first);
+    st->mappings = NULL;
+
+    thread_mutex_init(&st->mutex);
+    for (i = 0; i < PAGING_L2_LOCKS; ++i) {
+        thread_mutex_init(&st->l2_locks[i]);
+    }
 
-    st->free_vspace.next = NULL;
     st->spawninfo = NULL;
 
     // TODO: This is an ugly hack so we don't need individual slab allocs.
@@ -254,8 +847,12 @@ errval_t paging_init_state(struct paging_state *st, lvaddr_t start_vaddr,
 
     if (sizeof(struct paging_used_node) > minbytes)
         minbytes = sizeof(struct paging_used_node);
+    if (sizeof(struct paging_vspace_node) > minbytes)
+        minbytes = sizeof(struct paging_vspace_node);
+    if (sizeof(struct paging_hole_node) > minbytes)
+        minbytes = sizeof(struct paging_hole_node);
 
-    slab_init(&st->slab_alloc, minbytes, slab_default_refill);
+    slab_cache_init(&st->slab_alloc, minbytes, slab_default_refill, 0);
 
     return SYS_ERR_OK;
 }
@@ -270,7 +867,7 @@ errval_t paging_init(void)
 
     CHECK(thread_set_exception_handler(
         pagefault_handler, NULL, (void *) &pagefault_stack,
-        (void *) &pagefault_stack + PAGEFAULT_STACK_SIZE, NULL, NULL));
+        (void *) &pagefault_stack + PAGING_EXCEPTION_STACK_SIZE, NULL, NULL));
     set_current_paging_state(&current);
 
     // According to the book, the L1 page table is at the following address.
@@ -280,8 +877,9 @@ errval_t paging_init(void)
 
     paging_init_state(&current, PAGING_VADDR_START, l1_pagetable,
                       get_default_slot_allocator());
+    // Only our own paging state lives long enough for the refill thread.
+    current.slab_alloc.watermark = PAGING_SLAB_WATERMARK;
 
-    thread_mutex_init(&mutex);
     return SYS_ERR_OK;
 }
 
@@ -291,8 +889,193 @@ errval_t paging_init(void)
 void paging_init_onthread(struct thread *t)
 {
     t->exception_handler = pagefault_handler;
-    t->exception_stack = (void *) &pagefault_stack;
-    t->exception_stack_top = (void *) &pagefault_stack + PAGEFAULT_STACK_SIZE;
+    // The stack has to be mapped before the first exception is delivered
+    // on it, so fault it in now.
+    for (volatile char *p = t->exception_stack;
+         p < (char *) t->exception_stack_top; p += BASE_PAGE_SIZE) {
+        *p = 0;
+    }
+    *((volatile char *) t->exception_stack_top - 1) = 0;
+}
+
+/*
+ * Holes of a paging region, see struct paging_hole_node. The same AVL code
+ * serves both trees, `by_size` selects the links and the order.
+ */
+
+static inline struct paging_hole_link *hole_link(struct paging_hole_node *n,
+                                                 bool by_size)
+{
+    return by_size ? &n->by_size : &n->by_addr;
+}
+
+static inline int hole_height(struct paging_hole_node *n, bool by_size)
+{
+    return n != NULL ? hole_link(n, by_size)->height : 0;
+}
+
+static inline bool hole_less(struct paging_hole_node *a,
+                             struct paging_hole_node *b, bool by_size)
+{
+    if (by_size && a->region_size != b->region_size)
+        return a->region_size < b->region_size;
+    return a->base_addr < b->base_addr;
+}
+
+static void hole_fix(struct paging_hole_node *n, bool by_size)
+{
+    struct paging_hole_link *l = hole_link(n, by_size);
+    l->height = 1 + MAX(hole_height(l->left, by_size),
+                        hole_height(l->right, by_size));
+}
+
+static struct paging_hole_node *hole_rotate_right(struct paging_hole_node *n,
+                                                  bool by_size)
+{
+    struct paging_hole_node *l = hole_link(n, by_size)->left;
+    hole_link(n, by_size)->left = hole_link(l, by_size)->right;
+    hole_link(l, by_size)->right = n;
+    hole_fix(n, by_size);
+    hole_fix(l, by_size);
+    return l;
+}
+
+static struct paging_hole_node *hole_rotate_left(struct paging_hole_node *n,
+                                                 bool by_size)
+{
+    struct paging_hole_node *r = hole_link(n, by_size)->right;
+    hole_link(n, by_size)->right = hole_link(r, by_size)->left;
+    hole_link(r, by_size)->left = n;
+    hole_fix(n, by_size);
+    hole_fix(r, by_size);
+    return r;
+}
+
+static struct paging_hole_node *hole_balance(struct paging_hole_node *n,
+                                             bool by_size)
+{
+    struct paging_hole_link *l = hole_link(n, by_size);
+    hole_fix(n, by_size);
+    int bal = hole_height(l->left, by_size) - hole_height(l->right, by_size);
+    if (bal > 1) {
+        struct paging_hole_link *ll = hole_link(l->left, by_size);
+        if (hole_height(ll->left, by_size) < hole_height(ll->right, by_size))
+            l->left = hole_rotate_left(l->left, by_size);
+        return hole_rotate_right(n, by_size);
+    }
+    if (bal < -1) {
+        struct paging_hole_link *rl = hole_link(l->right, by_size);
+        if (hole_height(rl->right, by_size) < hole_height(rl->left, by_size))
+            l->right = hole_rotate_right(l->right, by_size);
+        return hole_rotate_left(n, by_size);
+    }
+    return n;
+}
+
+static struct paging_hole_node *hole_insert(struct paging_hole_node *root,
+                                            struct paging_hole_node *n,
+                                            bool by_size)
+{
+    if (root == NULL) {
+        struct paging_hole_link *l = hole_link(n, by_size);
+        l->left = l->right = NULL;
+        l->height = 1;
+        return n;
+    }
+    struct paging_hole_link *l = hole_link(root, by_size);
+    if (hole_less(n, root, by_size))
+        l->left = hole_insert(l->left, n, by_size);
+    else
+        l->right = hole_insert(l->right, n, by_size);
+    return hole_balance(root, by_size);
+}
+
+static struct paging_hole_node *hole_remove_min(struct paging_hole_node *root,
+                                                struct paging_hole_node **min,
+                                                bool by_size)
+{
+    struct paging_hole_link *l = hole_link(root, by_size);
+    if (l->left == NULL) {
+        *min = root;
+        return l->right;
+    }
+    l->left = hole_remove_min(l->left, min, by_size);
+    return hole_balance(root, by_size);
+}
+
+static struct paging_hole_node *hole_remove(struct paging_hole_node *root,
+                                            struct paging_hole_node *n,
+                                            bool by_size)
+{
+    assert(root != NULL);
+    struct paging_hole_link *l = hole_link(root, by_size);
+    if (root == n) {
+        if (l->left == NULL)
+            return l->right;
+        if (l->right == NULL)
+            return l->left;
+        struct paging_hole_node *succ;
+        struct paging_hole_node *right = hole_remove_min(l->right, &succ,
+                                                         by_size);
+        hole_link(succ, by_size)->left = l->left;
+        hole_link(succ, by_size)->right = right;
+        return hole_balance(succ, by_size);
+    }
+    if (hole_less(n, root, by_size))
+        l->left = hole_remove(l->left, n, by_size);
+    else
+        l->right = hole_remove(l->right, n, by_size);
+    return hole_balance(root, by_size);
+}
+
+/// Smallest hole of at least `bytes`, the lowest one among equals.
+static struct paging_hole_node *hole_best_fit(struct paging_hole_node *n,
+                                              size_t bytes)
+{
+    struct paging_hole_node *best = NULL;
+    while (n != NULL) {
+        if (n->region_size >= bytes) {
+            best = n;
+            n = n->by_size.left;
+        } else {
+            n = n->by_size.right;
+        }
+    }
+    return best;
+}
+
+/// Holes right below and above `base`.
+static void hole_neighbours(struct paging_hole_node *n, lvaddr_t base,
+                            struct paging_hole_node **below,
+                            struct paging_hole_node **above)
+{
+    *below = *above = NULL;
+    while (n != NULL) {
+        if (n->base_addr < base) {
+            *below = n;
+            n = n->by_addr.right;
+        } else {
+            *above = n;
+            n = n->by_addr.left;
+        }
+    }
+}
+
+static void hole_add(struct paging_region *pr, struct paging_hole_node *n)
+{
+    pr->holes_by_addr = hole_insert(pr->holes_by_addr, n, false);
+    pr->holes_by_size = hole_insert(pr->holes_by_size, n, true);
+}
+
+static void hole_drop(struct paging_region *pr, struct paging_hole_node *n)
+{
+    pr->holes_by_addr = hole_remove(pr->holes_by_addr, n, false);
+    pr->holes_by_size = hole_remove(pr->holes_by_size, n, true);
+}
+
+static void hole_free(struct paging_region *pr, struct paging_hole_node *n)
+{
+    slab_cache_free(&pr->st->slab_alloc, n);
 }
 
 /**
@@ -308,20 +1091,37 @@ errval_t paging_region_init(struct paging_state *st, struct paging_region *pr,
     pr->base_addr = (lvaddr_t) base;
     pr->current_addr = pr->base_addr;
     pr->region_size = size;
-    pr->slab_alloc = &st->slab_alloc;
+    pr->st = st;
+    pr->holes_by_addr = NULL;
+    pr->holes_by_size = NULL;
+    pr->hole_bytes = 0;
     // TODO: maybe add paging regions to paging state?
     return SYS_ERR_OK;
 }
 
-/**
- * \brief return a pointer to a bit of the paging region `pr`.
- * This function gets used in some of the code that is responsible
- * for allocating Frame (and other) capabilities.
- */
-errval_t paging_region_map(struct paging_region *pr, size_t req_size,
-                           void **retbuf, size_t *ret_size)
+/// paging_region_map with pr->st->mutex held.
+static errval_t region_map_locked(struct paging_region *pr, size_t req_size,
+                                  void **retbuf, size_t *ret_size)
 {
-    // TODO: allow it to use holes for mapping
+    struct paging_hole_node *hole = hole_best_fit(pr->holes_by_size,
+                                                  req_size);
+    if (hole != NULL && req_size > 0) {
+        *retbuf = (void *) hole->base_addr;
+        *ret_size = req_size;
+        pr->hole_bytes -= req_size;
+        // Taking the front keeps the address order, only the size changes.
+        pr->holes_by_size = hole_remove(pr->holes_by_size, hole, true);
+        if (hole->region_size == req_size) {
+            pr->holes_by_addr = hole_remove(pr->holes_by_addr, hole, false);
+            hole_free(pr, hole);
+        } else {
+            hole->base_addr += req_size;
+            hole->region_size -= req_size;
+            pr->holes_by_size = hole_insert(pr->holes_by_size, hole, true);
+        }
+        return SYS_ERR_OK;
+    }
+
     lvaddr_t end_addr = pr->base_addr + pr->region_size;
     ssize_t rem = end_addr - pr->current_addr;
     if (rem > req_size) {
@@ -341,96 +1141,99 @@ errval_t paging_region_map(struct paging_region *pr, size_t req_size,
     return SYS_ERR_OK;
 }
 
+/// paging_region_unmap with pr->st->mutex held and a free slab reserved.
+static errval_t region_unmap_locked(struct paging_region *pr, lvaddr_t base,
+                                    size_t bytes)
+{
+    assert(base >= pr->base_addr);
+    assert(base + bytes <= pr->current_addr);
+    if (bytes == 0) {
+        return SYS_ERR_OK;
+    }
+
+    struct paging_hole_node *below, *above;
+    hole_neighbours(pr->holes_by_addr, base, &below, &above);
+    assert(below == NULL || below->base_addr + below->region_size <= base);
+    assert(above == NULL || base + bytes <= above->base_addr);
+    pr->hole_bytes += bytes;
+
+    struct paging_hole_node *hole;
+    if (below != NULL && below->base_addr + below->region_size == base) {
+        hole = below;
+        pr->holes_by_size = hole_remove(pr->holes_by_size, hole, true);
+        hole->region_size += bytes;
+        if (above != NULL && above->base_addr == base + bytes) {
+            hole->region_size += above->region_size;
+            hole_drop(pr, above);
+            hole_free(pr, above);
+        }
+        pr->holes_by_size = hole_insert(pr->holes_by_size, hole, true);
+    } else if (above != NULL && above->base_addr == base + bytes) {
+        // Moving the base down keeps the address order.
+        hole = above;
+        pr->holes_by_size = hole_remove(pr->holes_by_size, hole, true);
+        hole->base_addr = base;
+        hole->region_size += bytes;
+        pr->holes_by_size = hole_insert(pr->holes_by_size, hole, true);
+    } else if (base + bytes == pr->current_addr) {
+        // Nothing to track, just shrink the region.
+        pr->current_addr = base;
+        pr->hole_bytes -= bytes;
+        return SYS_ERR_OK;
+    } else {
+        hole = (struct paging_hole_node *) slab_cache_alloc(
+            &pr->st->slab_alloc);
+        hole->base_addr = base;
+        hole->region_size = bytes;
+        hole_add(pr, hole);
+    }
+
+    // Give the top hole back to the end of the region.
+    if (hole->base_addr + hole->region_size == pr->current_addr) {
+        pr->current_addr = hole->base_addr;
+        pr->hole_bytes -= hole->region_size;
+        hole_drop(pr, hole);
+        hole_free(pr, hole);
+    }
+
+    return SYS_ERR_OK;
+}
+
+/**
+ * \brief return a pointer to a bit of the paging region `pr`.
+ * This function gets used in some of the code that is responsible
+ * for allocating Frame (and other) capabilities.
+ *
+ * The smallest hole that fits is used first, only then the region grows.
+ * The holes and current_addr are protected by the paging state's mutex.
+ */
+errval_t paging_region_map(struct paging_region *pr, size_t req_size,
+                           void **retbuf, size_t *ret_size)
+{
+    thread_mutex_lock_nested(&pr->st->mutex);
+    errval_t err = region_map_locked(pr, req_size, retbuf, ret_size);
+    thread_mutex_unlock(&pr->st->mutex);
+    return err;
+}
+
 /**
  * \brief free a bit of the paging region `pr`.
  * This function gets used in some of the code that is responsible
  * for allocating Frame (and other) capabilities.
- * NOTE: Implementing this function is optional.
+ *
+ * The range is merged with the holes next to it, and given back to the end
+ * of the region if it reaches current_addr.
  */
 errval_t paging_region_unmap(struct paging_region *pr, lvaddr_t base,
                              size_t bytes)
 {
     DBG(DETAILED, "paging_region_unmap with %llx and %u", base, bytes);
-    // XXX: should free up some space in paging region, however need to track
-    //      holes for non-trivial case
-    assert(pr->base_addr >= base);
-    assert(pr->base_addr + pr->region_size >= base + bytes);
-    assert(pr->current_addr >= base + bytes);
-    if (pr->current_addr - bytes == base) {
-        pr->current_addr = base;
-    } else {
-        // TODO: catch node overlaps via asserts
-        if (pr->holes == NULL) {
-            struct paging_frame_node *new_node =
-                (struct paging_frame_node *) slab_alloc(pr->slab_alloc);
-            new_node->base_addr = base;
-            new_node->region_size = bytes;
-            new_node->next = NULL;
-            pr->holes = new_node;
-        } else {
-            struct paging_frame_node *node = pr->holes;
-            bool done = false;
-            while (node->next != NULL) {
-                if (node->base_addr < base) {
-                    if (node->base_addr + node->region_size == base) {
-                        node->region_size += bytes;
-                        done = true;
-                        break;
-                    } else {
-                        node = node->next;
-                    }
-                } else {
-                    struct paging_frame_node *new_node =
-                        (struct paging_frame_node *) slab_alloc(
-                            pr->slab_alloc);
-
-                    new_node->base_addr = node->base_addr;
-                    new_node->region_size = node->region_size;
-                    new_node->next = node->next;
-                    node->base_addr = base;
-                    node->region_size = bytes;
-                    node->next = new_node;
-                    done = true;
-                    break;
-                }
-            }
-            if (!done) {
-                struct paging_frame_node *new_node =
-                    (struct paging_frame_node *) slab_alloc(pr->slab_alloc);
-                new_node->base_addr = base;
-                new_node->region_size = bytes;
-                new_node->next = NULL;
-                node->next = new_node;
-            }
-        }
-    }
-
-    // Coalesce holes.
-    if (pr->holes) {
-        struct paging_frame_node *node = pr->holes;
-        struct paging_frame_node *prev = NULL;
-        while (node->next != NULL) {
-            struct paging_frame_node *temp = node->next;
-            if (temp->base_addr == node->base_addr + node->region_size) {
-                node->region_size += temp->region_size;
-                node->next = temp->next;
-                slab_free(pr->slab_alloc, temp);
-            } else {
-                prev = node;
-                node = node->next;
-            }
-        }
-        if (node->base_addr + node->region_size == pr->current_addr) {
-            pr->current_addr -= node->region_size;
-            slab_free(pr->slab_alloc, node);
-            if (prev != NULL)
-                prev->next = NULL;
-            else
-                pr->holes = NULL;
-        }
-    }
-
-    return SYS_ERR_OK;
+    // a new hole may need a slab, refilling maps and must not hold the lock
+    paging_slab_reserve(pr->st, 1);
+    thread_mutex_lock_nested(&pr->st->mutex);
+    errval_t err = region_unmap_locked(pr, base, bytes);
+    thread_mutex_unlock(&pr->st->mutex);
+    return err;
 }
 
 /**
@@ -445,51 +1248,84 @@ errval_t paging_region_unmap(struct paging_region *pr, lvaddr_t base,
 // So that one needs fixing first
 errval_t paging_alloc(struct paging_state *st, void **buf, size_t bytes)
 {
-    struct paging_frame_node *node = &st->free_vspace;
-    while (node != NULL) {
-        if (node->region_size >= bytes) {
-            DBG(DETAILED, "ps %u paging_alloc base: %p size: %u req: %u \n",
-                st->debug_paging_state_index, node->base_addr,
-                node->region_size, bytes);
-            *buf = (void *) node->base_addr;
-            node->base_addr += bytes;
-
 #ifndef no_page_align_in_frame_alloc
-            lvaddr_t temp = ROUND_UP(node->base_addr, BASE_PAGE_SIZE);
-            DBG(DETAILED, "ps %u alignment change does: %u \n",
-                st->debug_paging_state_index,
-                (size_t)(temp - node->base_addr));
-            node->region_size -= bytes + (temp - node->base_addr);
-            node->base_addr = temp;
+    // every range starts page aligned, so keep them that way
+    size_t size = ROUND_UP(bytes, BASE_PAGE_SIZE);
 #else
-            node->region_size -= bytes;
+    size_t size = bytes;
 #endif
+    thread_mutex_lock_nested(&st->mutex);
+    if (size == 0 || vspace_max(st->free_vspace) < size) {
+        DBG(DETAILED, "ps %u we requested %u bytes but the largest free "
+                      "region has only %u\n",
+            st->debug_paging_state_index, bytes, vspace_max(st->free_vspace));
+        thread_mutex_unlock(&st->mutex);
+        return LIB_ERR_OUT_OF_VIRTUAL_ADDR;
+    }
 
-            DBG(DETAILED, "ps %u paging_alloc new base: %p new size: %u\n",
-                st->debug_paging_state_index, node->base_addr,
-                node->region_size);
-
-            if (node->region_size == 0) {
-                // TODO: add removing, just move content of next node
-                // into this and delete next node
-                // this does mean we'll eventually trail a size 0 node
-                // at maxaddr, but that's still cheaper than doubly linked
-                // list. And less of a perf issue than going from start to
-                // remove properly from the list
-                // random sidenote: it might be worth having pools, if aquiring
-                // capabilities is so expensive, on the other hand that sounds
-                // like a great way to get security issues later down the line.
-            }
-            return SYS_ERR_OK;
-        }
+    lvaddr_t base = 0;
+    struct paging_vspace_node *emptied = NULL;
+    st->free_vspace = vspace_take(st->free_vspace, size, &base, &emptied);
+    if (emptied != NULL) {
+        vspace_node_free(st, emptied);
+    }
+    thread_mutex_unlock(&st->mutex);
+    DBG(DETAILED, "ps %u paging_alloc base: %p size: %u req: %u \n",
+        st->debug_paging_state_index, base, size, bytes);
+
+    *buf = (void *) base;
+    return SYS_ERR_OK;
+}
+
+/**
+ * \brief Like paging_alloc, but the returned address is a multiple of
+ *        `alignment`, which has to be a multiple of BASE_PAGE_SIZE.
+ */
+errval_t paging_alloc_aligned(struct paging_state *st, void **buf,
+                              size_t bytes, size_t alignment)
+{
+    if (alignment <= BASE_PAGE_SIZE) {
+        return paging_alloc(st, buf, bytes);
+    }
+    assert(alignment % BASE_PAGE_SIZE == 0);
 
-        DBG(DETAILED, "ps %u we requested %u bytes but only had %u available "
-                      "anymore on region %p \n",
-            st->debug_paging_state_index, bytes, node->region_size,
-            node->base_addr);
-        node = node->next;
+    // Take enough to align within it and give back the rest.
+    size_t size = ROUND_UP(bytes, BASE_PAGE_SIZE);
+    void *raw;
+    thread_mutex_lock_nested(&st->mutex);
+    errval_t err = paging_alloc(st, &raw, size + alignment - BASE_PAGE_SIZE);
+    if (err_is_fail(err)) {
+        thread_mutex_unlock(&st->mutex);
+        return err;
     }
-    return LIB_ERR_OUT_OF_VIRTUAL_ADDR;
+    lvaddr_t base = ROUND_UP((lvaddr_t) raw, alignment);
+    lvaddr_t end = (lvaddr_t) raw + size + alignment - BASE_PAGE_SIZE;
+    if (base > (lvaddr_t) raw) {
+        paging_add_space(st, (lvaddr_t) raw, base - (lvaddr_t) raw);
+    }
+    if (end > base + size) {
+        paging_add_space(st, base + size, end - (base + size));
+    }
+    thread_mutex_unlock(&st->mutex);
+
+    *buf = (void *) base;
+    return SYS_ERR_OK;
+}
+
+/**
+ * \brief Enables or disables mapping with 1M sections and 64K large pages.
+ */
+void paging_set_large_mappings(bool enable)
+{
+    large_mappings = enable;
+}
+
+/**
+ * \brief Returns how many sections, large and small pages were mapped.
+ */
+void paging_get_map_stats(struct paging_map_stats *stats)
+{
+    *stats = map_stats;
 }
 
 /**
@@ -500,201 +1336,203 @@ errval_t paging_map_frame_attr(struct paging_state *st, void **buf,
                                size_t bytes, struct capref frame, int flags,
                                void *arg1, void *arg2)
 {
-    CHECK_MSG(paging_alloc(st, buf, bytes), "to addr %p of size %i\n", *buf,
-              bytes);
+    // Align large buffers, so they can be mapped with sections or 64K
+    // pages if the frame is aligned as well.
+    size_t alignment = BASE_PAGE_SIZE;
+    if (large_mappings && bytes >= BYTES_PER_SECTION)
+        alignment = BYTES_PER_SECTION;
+    else if (large_mappings && bytes >= BYTES_PER_LARGE_PAGE)
+        alignment = BYTES_PER_LARGE_PAGE;
+    CHECK_MSG(paging_alloc_aligned(st, buf, bytes, alignment),
+              "to addr %p of size %i\n", *buf, bytes);
     return paging_map_fixed_attr(st, (lvaddr_t)(*buf), frame, bytes, flags);
 }
 
-errval_t slab_refill_no_pagefault(struct slab_allocator *slabs,
-                                  struct capref frame, size_t minbytes)
+/**
+ * \brief Allocates a frame of at least `minbytes` and maps it without
+ *        taking any slabs, so it works while they are empty.
+ */
+static errval_t paging_map_nofault(struct capref frame, size_t minbytes,
+                                   void **buf, size_t *retbytes)
 {
-    DBG(DETAILED, "slab_refill_no_pagefault wants to alloc bytes: %u\n",
-        minbytes);
-
-    // Refill the two-level slot allocator without causing a page-fault
-    void *buf;
     struct paging_state *st = get_current_paging_state();
-    buf = NULL;
     size_t frame_size;
     DBG(DETAILED, "allocing at least: %u\n", minbytes);
     CHECK(frame_alloc(&frame, minbytes, &frame_size));
     DBG(DETAILED, "allocing in reality: %u\n", frame_size);
 
-    size_t mapped_bytes = 0;
-    size_t bytes = frame_size;
-    int flags = VREGION_FLAGS_READ_WRITE;
-    CHECK_MSG(paging_alloc(st, &buf, bytes), "to addr %p of size %i\n", buf,
-              bytes);
+    *buf = NULL;
+    CHECK_MSG(paging_alloc(st, buf, frame_size), "to addr %p of size %i\n",
+              *buf, frame_size);
     DBG(DETAILED,
         "now pagefault goes into replication of the fixed mapping\n");
-    lvaddr_t vaddr = (lvaddr_t) buf;
-    while (bytes > 0) {
-        // Get the index of the L2 table in the L1 table.
-        lvaddr_t l1_index = ARM_L1_OFFSET(vaddr);
+    CHECK(paging_install(st, (lvaddr_t) *buf, frame, frame_size,
+                         VREGION_FLAGS_READ_WRITE, NULL));
+    *retbytes = frame_size;
+    return SYS_ERR_OK;
+}
 
-        // Check if the table already exists.
-        struct capref l2_pagetable;
-        if (st->l2_page_tables[l1_index].init) {
-            // Table exists.
-            DBG(DETAILED, "found l2 page table \n");
-            l2_pagetable = st->l2_page_tables[l1_index].cap;
-        } else {
-            // Create a L2 pagetable.
-
-            // Create a new table.
-            DBG(DETAILED, "making l2 page table \n");
-            CHECK(arml2_alloc(st, &l2_pagetable));
-
-            DBG(DETAILED, "creating l1 l2 mapping capability \n");
-            // Write the L1 table entry.
-            struct capref l2_l1_mapping;
-            CHECK(st->slot_alloc->alloc(st->slot_alloc, &l2_l1_mapping));
-
-            DBG(DETAILED, "mapping l2 page table \n");
-            CHECK(vnode_map(st->l1_page_table, l2_pagetable, l1_index,
-                            VREGION_FLAGS_READ_WRITE, 0, 1, l2_l1_mapping));
-
-            // Add cap to tracking array.
-            st->l2_page_tables[l1_index].cap = l2_pagetable;
-            st->l2_page_tables[l1_index].init = true;
-
-            // Add to child process if necessary.
-            if (st->spawninfo != NULL) {
-                DBG(DETAILED, "I should add the new slot to the child\n");
-                ((struct spawninfo *) st->spawninfo)
-                    ->slot_callback(((struct spawninfo *) st->spawninfo),
-                                    l2_pagetable);
-                ((struct spawninfo *) st->spawninfo)
-                    ->slot_callback(((struct spawninfo *) st->spawninfo),
-                                    l2_l1_mapping);
-            }
-        }
-        DBG(DETAILED, "now allocing slot for frame mapping \n");
+errval_t slab_refill_no_pagefault(struct slab_allocator *slabs,
+                                  struct capref frame, size_t minbytes)
+{
+    DBG(DETAILED, "slab_refill_no_pagefault wants to alloc bytes: %u\n",
+        minbytes);
 
-        // Get the frame from the L2 table.
-        lvaddr_t l2_index = ARM_L2_OFFSET(vaddr);
+    // Refill the two-level slot allocator without causing a page-fault
+    void *buf;
+    size_t frame_size;
+    CHECK(paging_map_nofault(frame, minbytes, &buf, &frame_size));
+    slab_grow(slabs, buf, frame_size);
 
-        // How many bytes should we map in that frame?
-        size_t mapping_size =
-            MIN(bytes, (ARM_L2_MAX_ENTRIES - l2_index) * BASE_PAGE_SIZE);
+    return SYS_ERR_OK;
+}
 
-        // Finally, do the mapping.
-        struct capref l2_frame;
-        CHECK(st->slot_alloc->alloc(st->slot_alloc, &l2_frame));
-        CHECK(vnode_map(l2_pagetable, frame, l2_index, flags, mapped_bytes,
-                        mapping_size / BASE_PAGE_SIZE, l2_frame));
-        if (st->spawninfo != NULL) {
+/**
+ * \brief Makes sure the slabs of `st` have `count` free entries, without
+ *        holding st->mutex while mapping new ones.
+ */
+static void paging_slab_reserve(struct paging_state *st, size_t count)
+{
+    while (slab_cache_freecount(&st->slab_alloc) < count) {
+        DBG(DETAILED, "triggering special slab refill\n");
+        struct capref slabframe;
+        st->slot_alloc->alloc(st->slot_alloc, &slabframe);
+        void *buf;
+        size_t frame_size;
+        CHECK(paging_map_nofault(slabframe, BASE_PAGE_SIZE, &buf,
+                                 &frame_size));
+        slab_cache_grow(&st->slab_alloc, buf, frame_size);
+    }
+}
+
+/**
+ * \brief Runs the frame mappings paging_install collected, then hands the
+ * new mapping caps to the process being spawned, if any.
+ */
+static errval_t paging_install_flush(struct paging_state *st,
+                                     struct cap_batch *batch,
+                                     struct capref *mappings)
+{
+    size_t count = batch->count;
+    errval_t err = cap_batch_run(batch);
+    if (err_is_fail(err)) {
+        return err_push(err, LIB_ERR_VNODE_MAP);
+    }
+    if (st->spawninfo != NULL) {
+        for (size_t i = 0; i < count; i++) {
             ((struct spawninfo *) st->spawninfo)
                 ->slot_callback(((struct spawninfo *) st->spawninfo),
-                                l2_frame);
+                                mappings[i]);
         }
-
-        // To some house keeping for the next round:
-        mapped_bytes += mapping_size;
-        bytes -= mapping_size;
-        vaddr += mapping_size;
-        l1_index++;
-        DBG(DETAILED, "Still need to map: %" PRIuGENSIZE " bytes starting "
-                      "from 0x%p\n",
-            (gensize_t) bytes, vaddr);
     }
-
-    assert(bytes == 0);
-    DBG(DETAILED, "mapped %" PRIuGENSIZE " bytes\n", (gensize_t) mapped_bytes);
-
-    slab_grow(slabs, buf, frame_size);
-
     return SYS_ERR_OK;
 }
 
 /**
- * \brief map a user provided frame at user provided VA.
+ * \brief Maps `bytes` of `frame` at `vaddr`, which has to be reserved by
+ *        the caller, with sections and 64K pages where alignment allows.
+ *        The mappings are recorded in `node` unless it is NULL.
+ *
+ * Only the slab allocations take st->mutex. The range belongs to the
+ * caller, so no one else writes its page table entries, and new L2 tables
+ * are installed under their own lock in paging_get_l2.
  */
-errval_t paging_map_fixed_attr(struct paging_state *st, lvaddr_t vaddr,
-                               struct capref frame, size_t bytes, int flags)
+static errval_t paging_install(struct paging_state *st, lvaddr_t vaddr,
+                               struct capref frame, size_t bytes, int flags,
+                               struct paging_used_node *node)
 {
-   if(!strcmp("network",disp_name()))
-        DBG(DETAILED, "st %u fixed alloc: vaddr: %p, bytes: 0x%x \n",
-        st->debug_paging_state_index, vaddr, bytes);
-
-    // Iterate over the L2 page tables and map the memory.
     size_t mapped_bytes = 0;
-    if (slab_freecount(&st->slab_alloc) == 0) {
-        DBG(DETAILED, "triggering special slab refill\n");
-        struct capref slabframe;
-        st->slot_alloc->alloc(st->slot_alloc, &slabframe);
-        DBG(DETAILED, "first hurdle made\n");
-        slab_refill_no_pagefault(&st->slab_alloc, slabframe, BASE_PAGE_SIZE);
-        DBG(DETAILED, "second hurdle made\n");
+
+    // The frame mappings of a range go into the kernel in batches, only
+    // L2 tables are created and mapped right away.
+    struct cap_batch batch;
+    cap_batch_init(&batch);
+    struct capref batch_mappings[CAP_BATCH_MAX_OPS];
+
+    // Large mappings need the physical address of the frame.
+    genpaddr_t frame_base = 0;
+    bool large = false;
+    if (large_mappings && bytes >= BYTES_PER_LARGE_PAGE) {
+        struct frame_identity id;
+        large = err_is_ok(frame_identify(frame, &id));
+        frame_base = id.base;
     }
 
-    struct paging_used_node *mappings =
-        (struct paging_used_node *) slab_alloc(&st->slab_alloc);
-    DBG(DETAILED, "we got past the slab_alloc bit");
-    mappings->start_addr = vaddr;
-    mappings->size = bytes;
-    mappings->next = st->mappings;
-    st->mappings = mappings;
-    mappings->map_list = NULL;
     while (bytes > 0) {
         // Get the index of the L2 table in the L1 table.
         lvaddr_t l1_index = ARM_L1_OFFSET(vaddr);
+        genpaddr_t paddr = frame_base + mapped_bytes;
+
+        struct capref table;
+        struct capref l2_frame;
+        size_t mapping_size;
+        CHECK(st->slot_alloc->alloc(st->slot_alloc, &l2_frame));
 
-        // Check if the table already exists.
-        struct capref l2_pagetable;
-        if (st->l2_page_tables[l1_index].init) {
-            // Table exists.
-            DBG(DETAILED, "found l2 page table \n");
-            l2_pagetable = st->l2_page_tables[l1_index].cap;
+        // A section covers a whole 1M slot of the range, so no other
+        // thread can be creating an L2 table for it.
+        if (large && bytes >= BYTES_PER_SECTION &&
+            ARM_L1_SECTION_OFFSET(vaddr) == 0 &&
+            ARM_L1_SECTION_OFFSET(paddr) == 0 &&
+            !st->l2_page_tables[l1_index].init) {
+            // Map 1M sections straight into the L1 table, as many as we
+            // can before hitting an L2 table.
+            size_t sections = 1;
+            while (sections < bytes / BYTES_PER_SECTION &&
+                   l1_index + sections < ARM_L1_MAX_ENTRIES &&
+                   !st->l2_page_tables[l1_index + sections].init) {
+                sections++;
+            }
+            table = st->l1_page_table;
+            mapping_size = sections * BYTES_PER_SECTION;
+            CHECK(cap_batch_vnode_map(&batch, table, frame, l1_index, flags,
+                                      mapped_bytes, sections, l2_frame));
+            thread_mutex_lock_nested(&st->mutex);
+            map_stats.sections += sections;
+            thread_mutex_unlock(&st->mutex);
         } else {
-            // Create a L2 pagetable.
-
-            // Create a new table.
-            DBG(DETAILED, "making l2 page table \n");
-            CHECK(arml2_alloc(st, &l2_pagetable));
-
-            DBG(DETAILED, "creating l1 l2 mapping capability \n");
-            // Write the L1 table entry.
-            struct capref l2_l1_mapping;
-            CHECK(st->slot_alloc->alloc(st->slot_alloc, &l2_l1_mapping));
-
-            DBG(DETAILED, "mapping l2 page table \n");
-            CHECK(vnode_map(st->l1_page_table, l2_pagetable, l1_index,
-                            VREGION_FLAGS_READ_WRITE, 0, 1, l2_l1_mapping));
-
-            // Add cap to tracking array.
-            st->l2_page_tables[l1_index].cap = l2_pagetable;
-            st->l2_page_tables[l1_index].init = true;
-
-            // Add to child process if necessary.
-            if (st->spawninfo != NULL) {
-                DBG(DETAILED, "I should add the new slot to the child\n");
-                ((struct spawninfo *) st->spawninfo)
-                    ->slot_callback(((struct spawninfo *) st->spawninfo),
-                                    l2_pagetable);
-                ((struct spawninfo *) st->spawninfo)
-                    ->slot_callback(((struct spawninfo *) st->spawninfo),
-                                    l2_l1_mapping);
+            // Get or create the L2 table.
+            CHECK(paging_get_l2(st, l1_index, &table));
+            DBG(DETAILED, "now allocing slot for frame mapping \n");
+
+            // Get the frame from the L2 table.
+            lvaddr_t l2_index = ARM_L2_OFFSET(vaddr);
+
+            // How many bytes should we map in that frame?
+            mapping_size =
+                MIN(bytes, (ARM_L2_MAX_ENTRIES - l2_index) * BASE_PAGE_SIZE);
+
+            int map_flags = flags;
+            if (large && (vaddr - paddr) % BYTES_PER_LARGE_PAGE == 0) {
+                size_t head = (BYTES_PER_LARGE_PAGE -
+                               vaddr % BYTES_PER_LARGE_PAGE) %
+                              BYTES_PER_LARGE_PAGE;
+                if (head == 0 && mapping_size >= BYTES_PER_LARGE_PAGE) {
+                    // 64K pages, the tail is done with small pages
+                    mapping_size = ROUND_DOWN(mapping_size,
+                                              BYTES_PER_LARGE_PAGE);
+                    map_flags |= KPI_PAGING_FLAGS_LARGE;
+                } else if (head > 0 && mapping_size >= head +
+                                                       BYTES_PER_LARGE_PAGE) {
+                    // small pages up to the first 64K boundary
+                    mapping_size = head;
+                }
             }
-        }
-        DBG(DETAILED, "now allocing slot for frame mapping \n");
-
-        // Get the frame from the L2 table.
-        lvaddr_t l2_index = ARM_L2_OFFSET(vaddr);
 
-        // How many bytes should we map in that frame?
-        size_t mapping_size =
-            MIN(bytes, (ARM_L2_MAX_ENTRIES - l2_index) * BASE_PAGE_SIZE);
-
-        // Finally, do the mapping.
-        struct capref l2_frame;
-        CHECK(st->slot_alloc->alloc(st->slot_alloc, &l2_frame));
-        CHECK(vnode_map(l2_pagetable, frame, l2_index, flags, mapped_bytes,
-                        mapping_size / BASE_PAGE_SIZE, l2_frame));
-        if (st->spawninfo != NULL) {
-            ((struct spawninfo *) st->spawninfo)
-                ->slot_callback(((struct spawninfo *) st->spawninfo),
-                                l2_frame);
+            // Finally, do the mapping.
+            CHECK(cap_batch_vnode_map(&batch, table, frame, l2_index,
+                                      map_flags, mapped_bytes,
+                                      mapping_size / BASE_PAGE_SIZE,
+                                      l2_frame));
+            thread_mutex_lock_nested(&st->mutex);
+            if (map_flags & KPI_PAGING_FLAGS_LARGE)
+                map_stats.large_pages += mapping_size / BYTES_PER_LARGE_PAGE;
+            else
+                map_stats.small_pages += mapping_size / BASE_PAGE_SIZE;
+            thread_mutex_unlock(&st->mutex);
+        }
+        batch_mappings[batch.count - 1] = l2_frame;
+        if (cap_batch_full(&batch)) {
+            CHECK(paging_install_flush(st, &batch, batch_mappings));
         }
 
         // TODO: store l2_l1_mapping and l2_frame (also a mapping), further,
@@ -702,39 +1540,66 @@ errval_t paging_map_fixed_attr(struct paging_state *st, lvaddr_t vaddr,
         // however we might want to levy it later for finding an empty frame
         // range. if we do levy it for that, rewrite frame_alloc and remove the
         // frame_alloc specific suff from st
-        DBG(DETAILED, "now doing the storing thing \n");
-        struct paging_map_node *mapentry =
-            (struct paging_map_node *) slab_alloc(&st->slab_alloc);
-        mapentry->table = l2_pagetable;
-        mapentry->mapping = l2_frame;
-        mapentry->next = mappings->map_list;
-        mappings->map_list = mapentry;
+        thread_mutex_lock_nested(&st->mutex);
+        map_stats.invocations++;
+        if (node != NULL) {
+            DBG(DETAILED, "now doing the storing thing \n");
+            struct paging_map_node *mapentry =
+                (struct paging_map_node *) slab_cache_alloc(&st->slab_alloc);
+            mapentry->table = table;
+            mapentry->mapping = l2_frame;
+            mapentry->next = node->map_list;
+            node->map_list = mapentry;
+        }
+        thread_mutex_unlock(&st->mutex);
 
         // To some house keeping for the next round:
         mapped_bytes += mapping_size;
         bytes -= mapping_size;
         vaddr += mapping_size;
-        l1_index++;
         DBG(DETAILED, "Still need to map: %" PRIuGENSIZE " bytes starting "
                       "from 0x%p\n",
             (gensize_t) bytes, vaddr);
     }
     assert(bytes == 0);
+    CHECK(paging_install_flush(st, &batch, batch_mappings));
     DBG(DETAILED, "mapped %" PRIuGENSIZE " bytes\n", (gensize_t) mapped_bytes);
     return SYS_ERR_OK;
 }
 
-static void paging_add_space(struct paging_state *st, lvaddr_t base,
-                             size_t size)
+/**
+ * \brief map a user provided frame at user provided VA.
+ */
+errval_t paging_map_fixed_attr(struct paging_state *st, lvaddr_t vaddr,
+                               struct capref frame, size_t bytes, int flags)
 {
-    // TODO: Coalesce nodes
-    // TODO: Sort space
-    struct paging_frame_node *node =
-        (struct paging_frame_node *) slab_alloc(&st->slab_alloc);
-    node->base_addr = base;
-    node->region_size = size;
-    node->next = st->free_vspace.next;
-    st->free_vspace.next = node;
+   if(!strcmp("network",disp_name()))
+        DBG(DETAILED, "st %u fixed alloc: vaddr: %p, bytes: 0x%x \n",
+        st->debug_paging_state_index, vaddr, bytes);
+
+    // One node for the range and up to three map nodes per 1M slot (head,
+    // 64K pages, tail), refilled before anything is locked.
+    size_t slots = ARM_L1_OFFSET(vaddr + bytes - 1) - ARM_L1_OFFSET(vaddr) + 1;
+    paging_slab_reserve(st, 2 + 3 * slots);
+
+    thread_mutex_lock_nested(&st->mutex);
+    struct paging_used_node *mappings =
+        (struct paging_used_node *) slab_cache_alloc(&st->slab_alloc);
+    DBG(DETAILED, "we got past the slab_alloc bit");
+    mappings->start_addr = vaddr;
+    mappings->size = bytes;
+    mappings->pending = true;
+    mappings->map_list = NULL;
+    mappings->frame = NULL_CAP;
+    st->mappings = used_insert(st->mappings, mappings);
+    thread_mutex_unlock(&st->mutex);
+
+    CHECK(paging_install(st, vaddr, frame, bytes, flags, mappings));
+
+    thread_mutex_lock_nested(&st->mutex);
+    mappings->pending = false;
+    thread_mutex_unlock(&st->mutex);
+    return SYS_ERR_OK;
 }
 
 /**
@@ -746,35 +1611,158 @@ errval_t paging_unmap(struct paging_state *st, const void *region)
     DBG(VERBOSE, "st %u - unmapping %p\n", st->debug_paging_state_index,
         region);
 
-    struct paging_used_node *node = st->mappings;
-    struct paging_used_node *prev = NULL;
-
-    while (true) {
-        assert(node != NULL); // TODO: make nicer
-        if (node->start_addr == (lvaddr_t) region) {
-            break;
-        }
-        prev = node;
-        node = node->next;
+    thread_mutex_lock_nested(&st->mutex);
+    struct paging_used_node *node = used_floor(st->mappings,
+                                               (lvaddr_t) region);
+    if (node == NULL || node->start_addr != (lvaddr_t) region ||
+        node->pending) {
+        thread_mutex_unlock(&st->mutex);
+        return LIB_ERR_VREGION_NOT_FOUND;
     }
+    st->mappings = used_remove(st->mappings, (lvaddr_t) region, &node);
+    thread_mutex_unlock(&st->mutex);
 
-    if (prev != NULL)
-        prev->next = node->next;
-    else
-        st->mappings = node->next;
+    // The range is still reserved, so the tables can go without the lock.
+    for (struct paging_map_node *mapnode = node->map_list; mapnode != NULL;
+         mapnode = mapnode->next) {
+        vnode_unmap(mapnode->table, mapnode->mapping);
+    }
 
+    thread_mutex_lock_nested(&st->mutex);
     struct paging_map_node *mapnode = node->map_list;
-
     while (mapnode != NULL) {
         struct paging_map_node *temp = mapnode;
         mapnode = mapnode->next;
-        vnode_unmap(temp->table, temp->mapping);
-        slab_free(&st->slab_alloc, temp);
+        slab_cache_free(&st->slab_alloc, temp);
+    }
+
+    lvaddr_t start_addr = node->start_addr;
+    size_t size = node->size;
+    // free the node first, so adding the space never has to refill the slabs
+    slab_cache_free(&st->slab_alloc, node);
+    paging_add_space(st, start_addr, size);
+    thread_mutex_unlock(&st->mutex);
+
+    return SYS_ERR_OK;
+}
+
+/// Deletes a mapping cap paging_install created and frees its slot.
+static void paging_mapping_destroy(struct paging_state *st,
+                                   struct capref mapping)
+{
+    errval_t err = cap_delete(mapping);
+    if (err_is_ok(err))
+        err = st->slot_alloc->free(st->slot_alloc, mapping);
+    if (err_is_fail(err))
+        DEBUG_ERR(err, "paging_free: destroying a mapping");
+}
+
+/**
+ * \brief Gives back [buf, buf + bytes), which came from paging_alloc, and
+ *        unmaps the pages the fault handler mapped in it.
+ *
+ * A mapping reaching over either end of the range was faulted in through a
+ * neighbouring reservation, it stays and so does the part of the range it
+ * covers. The frames the fault handler allocated go back together with their
+ * mapping caps.
+ */
+errval_t paging_free(struct paging_state *st, const void *buf, size_t bytes)
+{
+    lvaddr_t base = (lvaddr_t) buf;
+    lvaddr_t end = base + ROUND_UP(bytes, BASE_PAGE_SIZE);
+    lvaddr_t free_base = base;
+    lvaddr_t free_end = end;
+    struct paging_used_node *unmapped = NULL;
+
+    thread_mutex_lock_nested(&st->mutex);
+    struct paging_used_node *first = used_floor(st->mappings, base);
+    if (first != NULL && first->start_addr < base) {
+        if (first->start_addr + first->size > base)
+            free_base = MIN(end, first->start_addr + first->size);
+        first = used_ceil(st->mappings, base);
+    }
+
+    // Another thread is still faulting on the range, leave it alone.
+    for (struct paging_used_node *n = first; n != NULL && n->start_addr < end;
+         n = used_ceil(st->mappings, n->start_addr)) {
+        if (n->pending) {
+            thread_mutex_unlock(&st->mutex);
+            return LIB_ERR_VREGION_NOT_FOUND;
+        }
+    }
+
+    struct paging_used_node *next;
+    for (struct paging_used_node *n = first; n != NULL && n->start_addr < end;
+         n = next) {
+        next = used_ceil(st->mappings, n->start_addr);
+        if (n->start_addr + n->size > end) {
+            free_end = n->start_addr;
+            break;
+        }
+        struct paging_used_node *removed;
+        st->mappings = used_remove(st->mappings, n->start_addr, &removed);
+        removed->left = unmapped;
+        unmapped = removed;
+    }
+    thread_mutex_unlock(&st->mutex);
+
+    for (struct paging_used_node *n = unmapped; n != NULL; n = n->left) {
+        for (struct paging_map_node *mapnode = n->map_list; mapnode != NULL;
+             mapnode = mapnode->next) {
+            vnode_unmap(mapnode->table, mapnode->mapping);
+            paging_mapping_destroy(st, mapnode->mapping);
+        }
+        if (!capref_is_null(n->frame)) {
+            errval_t err = cap_destroy(n->frame);
+            if (err_is_fail(err))
+                DEBUG_ERR(err, "paging_free: destroying a frame");
+        }
     }
 
-    paging_add_space(st, (lvaddr_t) node->start_addr, node->size);
+    thread_mutex_lock_nested(&st->mutex);
+    while (unmapped != NULL) {
+        struct paging_used_node *n = unmapped;
+        unmapped = n->left;
+        struct paging_map_node *mapnode = n->map_list;
+        while (mapnode != NULL) {
+            struct paging_map_node *temp = mapnode;
+            mapnode = mapnode->next;
+            slab_cache_free(&st->slab_alloc, temp);
+        }
+        slab_cache_free(&st->slab_alloc, n);
+    }
+    if (free_end > free_base)
+        paging_add_space(st, free_base, free_end - free_base);
+    thread_mutex_unlock(&st->mutex);
 
-    slab_free(&st->slab_alloc, node);
+    return SYS_ERR_OK;
+}
+
+/**
+ * \brief Turns [buf, buf + bytes), reserved with paging_alloc, into a guard.
+ *
+ * The range gets a mapping without any frames, so the page fault handler
+ * reports every access to it as an access violation. paging_free gives it
+ * back along with the range around it.
+ */
+errval_t paging_guard(struct paging_state *st, const void *buf, size_t bytes)
+{
+    paging_slab_reserve(st, 1);
+
+    thread_mutex_lock_nested(&st->mutex);
+    struct paging_used_node *node =
+        (struct paging_used_node *) slab_cache_alloc(&st->slab_alloc);
+    if (node == NULL) {
+        thread_mutex_unlock(&st->mutex);
+        return LIB_ERR_SLAB_ALLOC_FAIL;
+    }
+    node->start_addr = (lvaddr_t) buf;
+    node->size = ROUND_UP(bytes, BASE_PAGE_SIZE);
+    node->pending = false;
+    node->map_list = NULL;
+    node->frame = NULL_CAP;
+    st->mappings = used_insert(st->mappings, node);
+    thread_mutex_unlock(&st->mutex);
 
     return SYS_ERR_OK;
 }
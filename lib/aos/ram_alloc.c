@@ -15,9 +15,18 @@
 #include <aos/aos.h>
 #include <aos/core_state.h>
 #include <aos/aos_rpc.h>
+#include <aos/generic_threadsafe_queue.h>
 
-/* remote (indirect through a channel) version of ram_alloc, for most domains */
-static errval_t ram_alloc_remote(struct capref *ret, size_t size, size_t alignment)
+/// Number of caps the cache holds at most
+#define RAM_CACHE_CAPACITY      64
+/// The refill thread is woken once fewer caps than this are cached
+#define RAM_CACHE_LOW_WATER     16
+/// Caps requested from the memory server per refill
+#define RAM_CACHE_BATCH         32
+
+/* single cap round trip to the memory server */
+static errval_t ram_alloc_remote_single(struct capref *ret, size_t size,
+                                        size_t alignment)
 {
     /* 
      * From the book on this procedure:
@@ -38,6 +47,140 @@ static errval_t ram_alloc_remote(struct capref *ret, size_t size, size_t alignme
     return SYS_ERR_OK;
 }
 
+static int ram_cache_refill_thread(void *arg)
+{
+    struct ram_cache *cache = arg;
+    struct aos_rpc *memchan = aos_rpc_get_memory_channel();
+
+    while (true) {
+        cslot_t first;
+        size_t count;
+        synchronized(cache->mutex)
+        {
+            while (!cache->refill_pending)
+                thread_cond_wait(&cache->refill_cond, &cache->mutex);
+            // only the refill thread adds caps, so the slots after the cached
+            // ones stay free while we are waiting for the reply
+            first = (cache->head + cache->count) % L2_CNODE_SLOTS;
+            count = MIN(RAM_CACHE_BATCH, RAM_CACHE_CAPACITY - cache->count);
+            count = MIN(count, L2_CNODE_SLOTS - first);
+        }
+
+        size_t got = 0, bytes;
+        errval_t err = aos_rpc_get_ram_caps(memchan, BASE_PAGE_SIZE,
+                                            BASE_PAGE_SIZE, cache->cnode_cap,
+                                            first, count, &got, &bytes);
+        if (err_is_fail(err)) {
+            DEBUG_ERR(err, "refilling the ram cache");
+        }
+
+        synchronized(cache->mutex)
+        {
+            cache->count += got;
+            cache->refill_pending = false;
+        }
+    }
+    return 0;
+}
+
+static errval_t ram_cache_init(struct ram_cache *cache)
+{
+    errval_t err = cnode_create_l2(&cache->cnode_cap, &cache->cnode);
+    if (err_is_fail(err)) {
+        return err_push(err, LIB_ERR_CNODE_CREATE);
+    }
+    cache->head = 0;
+    cache->count = 0;
+    cache->refill_pending = true;
+    thread_mutex_init(&cache->mutex);
+    thread_cond_init(&cache->refill_cond);
+    cache->refill_thread = thread_create(ram_cache_refill_thread, cache);
+    if (cache->refill_thread == NULL) {
+        return LIB_ERR_THREAD_CREATE;
+    }
+    return SYS_ERR_OK;
+}
+
+// hands out a cap from the cache. Returns false if the cache is empty, the
+// caller then has to go to the memory server itself.
+static bool ram_cache_get(struct ram_cache *cache, struct capref *ret)
+{
+    // allocate the destination slot before taking the cache lock, slot
+    // refills may allocate RAM themselves
+    struct capref dest;
+    errval_t err = slot_alloc(&dest);
+    if (err_is_fail(err)) {
+        DEBUG_ERR(err, "slot_alloc for a cached ram cap");
+        return false;
+    }
+
+    bool hit = false;
+    struct capref src = { .cnode = cache->cnode };
+    synchronized(cache->mutex)
+    {
+        if (cache->count > 0) {
+            src.slot = cache->head;
+            cache->head = (cache->head + 1) % L2_CNODE_SLOTS;
+            cache->count--;
+            hit = true;
+        }
+        if (cache->count < RAM_CACHE_LOW_WATER && !cache->refill_pending) {
+            cache->refill_pending = true;
+            thread_cond_signal(&cache->refill_cond);
+        }
+    }
+    if (!hit) {
+        slot_free(dest);
+        return false;
+    }
+
+    // move the cap out of the cache cnode, so the caller can treat it like
+    // any other cap in its cspace
+    CHECK(cap_copy(dest, src));
+    CHECK(cap_delete(src));
+    *ret = dest;
+    return true;
+}
+
+/* remote (indirect through a channel) version of ram_alloc, for most domains */
+static errval_t ram_alloc_remote(struct capref *ret, size_t size, size_t alignment)
+{
+    struct ram_cache *cache = &get_ram_alloc_state()->cache;
+
+    // only base pages are cached, those are what paging and slab refills ask
+    // for. The refill thread must never wait for itself.
+    if (size != BASE_PAGE_SIZE || alignment > BASE_PAGE_SIZE ||
+        !cache->initialized || cache->disabled ||
+        thread_self() == cache->refill_thread) {
+        return ram_alloc_remote_single(ret, size, alignment);
+    }
+
+    if (ram_cache_get(cache, ret)) {
+        return SYS_ERR_OK;
+    }
+    return ram_alloc_remote_single(ret, size, alignment);
+}
+
+/**
+ * \brief Sets up the cache of RAM caps used by the remote allocator
+ *
+ * Must be called once, after ram_alloc_set(NULL) and before the domain starts
+ * further threads. Setting up the cache allocates RAM itself, which goes the
+ * single cap way until we are done. If it fails, the remote allocator keeps
+ * asking the memory server for every cap.
+ */
+errval_t ram_alloc_cache_init(void)
+{
+    struct ram_cache *cache = &get_ram_alloc_state()->cache;
+    assert(!cache->initialized);
+
+    errval_t err = ram_cache_init(cache);
+    if (err_is_fail(err)) {
+        cache->disabled = true;
+    }
+    cache->initialized = true;
+    return err;
+}
 
 void ram_set_affinity(uint64_t minbase, uint64_t maxlimit)
 {
@@ -132,6 +275,9 @@ void ram_alloc_init(void)
     ram_alloc_state->default_minbase  = 0;
     ram_alloc_state->default_maxlimit = 0;
     ram_alloc_state->base_capnum      = 0;
+    ram_alloc_state->cache.initialized = false;
+    ram_alloc_state->cache.disabled = false;
+    ram_alloc_state->cache.refill_thread = NULL;
 }
 
 /**
@@ -37,6 +37,7 @@ void slab_init(struct slab_allocator *slabs, size_t blocksize,
 {
     slabs->slabs = NULL;
     slabs->blocksize = SLAB_REAL_BLOCKSIZE(blocksize);
+    slabs->free = 0;
     slabs->refill_func = refill_func;
 }
 
@@ -74,6 +75,7 @@ void slab_grow(struct slab_allocator *slabs, void *buf, size_t buflen)
     /* enqueue slab in list of slabs */
     head->next = slabs->slabs;
     slabs->slabs = head;
+    slabs->free += head->total;
 }
 
 /**
@@ -87,8 +89,10 @@ void *slab_alloc(struct slab_allocator *slabs)
 {
     errval_t err;
     /* find a slab with free blocks */
-    struct slab_head *sh;
-    for (sh = slabs->slabs; sh != NULL && sh->free == 0; sh = sh->next);
+    struct slab_head *sh = NULL;
+    if (slabs->free > 0) {
+        for (sh = slabs->slabs; sh != NULL && sh->free == 0; sh = sh->next);
+    }
 
     if (sh == NULL) {
         /* out of memory. try refill function if we have one */
@@ -113,6 +117,7 @@ void *slab_alloc(struct slab_allocator *slabs)
     assert(bh != NULL);
     sh->blocks = bh->next;
     sh->free--;
+    slabs->free--;
 
     return bh;
 }
@@ -148,6 +153,7 @@ void slab_free(struct slab_allocator *slabs, void *block)
     bh->next = sh->blocks;
     sh->blocks = bh;
     sh->free++;
+    slabs->free++;
     assert(sh->free <= sh->total);
 }
 
@@ -160,14 +166,7 @@ void slab_free(struct slab_allocator *slabs, void *block)
  */
 size_t slab_freecount(struct slab_allocator *slabs)
 {
-    size_t ret = 0;
-
-    for (struct slab_head *sh = slabs->slabs; sh != NULL; sh = sh->next) {
-        //debug_printf("SLAB: Block : %zx free: %d\n", sh, sh->free);
-        ret += sh->free;
-    }
-
-    return ret;
+    return slabs->free;
 }
 
 /**
@@ -219,3 +218,279 @@ errval_t slab_default_refill(struct slab_allocator *slabs)
 {
     return slab_refill_pages(slabs, BASE_PAGE_SIZE);
 }
+
+/*
+ * Magazine layer. A magazine is a chain of free blocks linked through their
+ * first word. Full magazines in the depot are linked through the second
+ * word of their first block, so moving a magazine is O(1) and needs no
+ * memory of its own. The magazines belong to the dispatcher, its threads
+ * only touch them with the dispatcher disabled for a few instructions.
+ */
+
+struct magazine_head {
+    struct block_head *next;            ///< Next block of the magazine
+    struct block_head *next_magazine;   ///< Next full magazine in the depot
+};
+
+/// Caches waiting for the refill thread
+static struct slab_cache *refill_queue;
+static struct thread_mutex refill_mutex = THREAD_MUTEX_INITIALIZER;
+static struct thread_cond refill_cond = THREAD_COND_INITIALIZER;
+static bool refill_thread_running;
+
+/**
+ * \brief Initialise a new slab cache
+ *
+ * \param cache Pointer to slab cache instance, to be filled-in
+ * \param blocksize Size of blocks to be allocated by this cache
+ * \param refill_func Function that grows the slab allocator it is passed
+ * \param watermark Free blocks the refill thread keeps around, 0 for none
+ */
+void slab_cache_init(struct slab_cache *cache, size_t blocksize,
+                     slab_refill_func_t refill_func, size_t watermark)
+{
+    if (blocksize < sizeof(struct magazine_head)) {
+        blocksize = sizeof(struct magazine_head);
+    }
+    slab_init(&cache->slabs, blocksize, NULL);
+    cache->loaded = cache->previous = NULL;
+    cache->loaded_rounds = cache->previous_rounds = 0;
+    cache->depot = NULL;
+    cache->depot_magazines = 0;
+    cache->watermark = watermark;
+    cache->refill_func = refill_func;
+    cache->refill_queued = false;
+    cache->refill_next = NULL;
+}
+
+/**
+ * \brief Add memory (a new slab) to a slab cache
+ */
+void slab_cache_grow(struct slab_cache *cache, void *buf, size_t buflen)
+{
+    bool was_enabled;
+    dispatcher_handle_t handle = disp_try_disable(&was_enabled);
+    slab_grow(&cache->slabs, buf, buflen);
+    if (was_enabled) {
+        disp_enable(handle);
+    }
+}
+
+/// Takes a block out of the magazines, called while disabled.
+static void *magazine_pop(struct slab_cache *cache)
+{
+    if (cache->loaded_rounds == 0) {
+        if (cache->previous_rounds > 0) {
+            // previous is full
+            cache->loaded = cache->previous;
+            cache->loaded_rounds = cache->previous_rounds;
+            cache->previous = NULL;
+            cache->previous_rounds = 0;
+        } else if (cache->depot != NULL) {
+            struct magazine_head *mag = (struct magazine_head *)cache->depot;
+            cache->depot = mag->next_magazine;
+            cache->depot_magazines--;
+            cache->loaded = (struct block_head *)mag;
+            cache->loaded_rounds = SLAB_MAGAZINE_ROUNDS;
+        } else {
+            // load a magazine straight from the slabs
+            while (cache->loaded_rounds < SLAB_MAGAZINE_ROUNDS) {
+                struct block_head *bh = slab_alloc(&cache->slabs);
+                if (bh == NULL) {
+                    break;
+                }
+                bh->next = cache->loaded;
+                cache->loaded = bh;
+                cache->loaded_rounds++;
+            }
+            if (cache->loaded_rounds == 0) {
+                return NULL;
+            }
+        }
+    }
+
+    struct block_head *bh = cache->loaded;
+    cache->loaded = bh->next;
+    cache->loaded_rounds--;
+    return bh;
+}
+
+/// Puts a block into the magazines, called while disabled.
+static void magazine_push(struct slab_cache *cache, struct block_head *bh)
+{
+    if (cache->loaded_rounds == SLAB_MAGAZINE_ROUNDS) {
+        if (cache->previous_rounds > 0) {
+            // both are full, previous goes to the depot
+            struct magazine_head *mag =
+                (struct magazine_head *)cache->previous;
+            mag->next_magazine = cache->depot;
+            cache->depot = cache->previous;
+            cache->depot_magazines++;
+        }
+        cache->previous = cache->loaded;
+        cache->previous_rounds = cache->loaded_rounds;
+        cache->loaded = NULL;
+        cache->loaded_rounds = 0;
+    }
+    bh->next = cache->loaded;
+    cache->loaded = bh;
+    cache->loaded_rounds++;
+}
+
+static size_t cache_freecount(struct slab_cache *cache)
+{
+    return cache->slabs.free + cache->loaded_rounds + cache->previous_rounds
+           + cache->depot_magazines * SLAB_MAGAZINE_ROUNDS;
+}
+
+/// Hands the cache to the refill thread, if there is one.
+static void slab_cache_queue_refill(struct slab_cache *cache)
+{
+    thread_mutex_lock(&refill_mutex);
+    if (refill_thread_running) {
+        cache->refill_next = refill_queue;
+        refill_queue = cache;
+        thread_cond_signal(&refill_cond);
+    } else {
+        cache->refill_queued = false;
+    }
+    thread_mutex_unlock(&refill_mutex);
+}
+
+/**
+ * \brief Allocate a new block from the slab cache
+ *
+ * Only refills in place if the reserve above the watermark ran out.
+ *
+ * \returns Pointer to block on success, NULL on error (out of memory)
+ */
+void *slab_cache_alloc(struct slab_cache *cache)
+{
+    bool was_enabled;
+    dispatcher_handle_t handle = disp_try_disable(&was_enabled);
+    void *block = magazine_pop(cache);
+    bool low = !cache->refill_queued &&
+               cache_freecount(cache) < cache->watermark;
+    if (low) {
+        cache->refill_queued = true;
+    }
+    if (was_enabled) {
+        disp_enable(handle);
+    }
+
+    if (low) {
+        slab_cache_queue_refill(cache);
+    }
+    if (block == NULL && cache->refill_func != NULL) {
+        errval_t err = slab_cache_refill(cache);
+        if (err_is_fail(err)) {
+            DEBUG_ERR(err, "slab refill_func failed");
+            return NULL;
+        }
+        handle = disp_try_disable(&was_enabled);
+        block = magazine_pop(cache);
+        if (was_enabled) {
+            disp_enable(handle);
+        }
+    }
+    return block;
+}
+
+/**
+ * \brief Free a block to the slab cache
+ *
+ * \param cache Pointer to slab cache instance
+ * \param block Pointer to block previously returned by #slab_cache_alloc
+ */
+void slab_cache_free(struct slab_cache *cache, void *block)
+{
+    if (block == NULL) {
+        return;
+    }
+
+    bool was_enabled;
+    dispatcher_handle_t handle = disp_try_disable(&was_enabled);
+    magazine_push(cache, block);
+    if (was_enabled) {
+        disp_enable(handle);
+    }
+}
+
+/**
+ * \brief Returns the count of free blocks in the cache and its slabs
+ */
+size_t slab_cache_freecount(struct slab_cache *cache)
+{
+    return cache_freecount(cache);
+}
+
+/**
+ * \brief Grows the cache by one call of its refill function
+ *
+ * The refill function works on a private allocator, which is then handed
+ * over as a whole, so it can map memory and allocate from this very cache
+ * while it runs.
+ */
+errval_t slab_cache_refill(struct slab_cache *cache)
+{
+    struct slab_allocator fresh;
+    slab_init(&fresh, cache->slabs.blocksize, NULL);
+    errval_t err = cache->refill_func(&fresh);
+    if (err_is_fail(err)) {
+        return err;
+    }
+
+    bool was_enabled;
+    dispatcher_handle_t handle = disp_try_disable(&was_enabled);
+    while (fresh.slabs != NULL) {
+        struct slab_head *sh = fresh.slabs;
+        fresh.slabs = sh->next;
+        sh->next = cache->slabs.slabs;
+        cache->slabs.slabs = sh;
+    }
+    cache->slabs.free += fresh.free;
+    if (was_enabled) {
+        disp_enable(handle);
+    }
+    return SYS_ERR_OK;
+}
+
+static int slab_refill_thread(void *arg)
+{
+    for (;;) {
+        thread_mutex_lock(&refill_mutex);
+        while (refill_queue == NULL) {
+            thread_cond_wait(&refill_cond, &refill_mutex);
+        }
+        struct slab_cache *cache = refill_queue;
+        refill_queue = cache->refill_next;
+        thread_mutex_unlock(&refill_mutex);
+
+        while (slab_cache_freecount(cache) < cache->watermark) {
+            errval_t err = slab_cache_refill(cache);
+            if (err_is_fail(err)) {
+                DEBUG_ERR(err, "background slab refill failed");
+                break;
+            }
+        }
+        cache->refill_queued = false;
+    }
+    return 0;
+}
+
+/**
+ * \brief Starts the thread that keeps slab caches above their watermark
+ *
+ * Until it runs, caches are only refilled when they are empty.
+ */
+errval_t slab_cache_refill_thread_start(void)
+{
+    struct thread *t = thread_create(slab_refill_thread, NULL);
+    if (t == NULL) {
+        return LIB_ERR_THREAD_CREATE;
+    }
+    thread_mutex_lock(&refill_mutex);
+    refill_thread_running = true;
+    thread_mutex_unlock(&refill_mutex);
+    return thread_detach(t);
+}
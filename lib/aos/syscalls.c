@@ -37,6 +37,14 @@ errval_t sys_print(const char *string, size_t length)
     return syscall3(SYSCALL_PRINT, (uintptr_t)string, length).error;
 }
 
+errval_t sys_invoke_batch(struct cap_batch_op *ops, size_t count,
+                          size_t *ret_done)
+{
+    struct sysret ret = syscall3(SYSCALL_INVOKE_BATCH, (uintptr_t)ops, count);
+    *ret_done = ret.value;
+    return ret.error;
+}
+
 errval_t sys_getchar(char *c)
 {
     struct sysret ret= syscall1(SYSCALL_GETCHAR);
@@ -0,0 +1,433 @@
+/**
+ * \file
+ * \brief Work stealing task pool
+ *
+ * Every worker owns a deque, a ring buffer that grows when it fills up. The
+ * owner pushes and pops at the bottom, thieves take from the top, each side
+ * under the worker's mutex. Thieves only try the lock, a busy deque is
+ * skipped rather than waited for. Tasks spawned from outside the pool are
+ * spread over the workers round-robin.
+ *
+ * A worker that finds no task anywhere sleeps on the pool's condition
+ * variable until the number of queued tasks goes up again. Spawning only
+ * takes the pool mutex if a worker sleeps.
+ *
+ * All workers run on the dispatcher of the thread that created the pool.
+ */
+
+/*
+ * Copyright (c) 2016, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#include <aos/aos.h>
+#include <aos/task_pool.h>
+
+#define TASK_DEQUE_INITIAL  64      ///< Initial deque capacity, power of two
+
+struct task {
+    task_func_t func;
+    void *arg;
+    struct task_future *future;     ///< NULL if nobody waits for the task
+};
+
+struct task_future {
+    struct task_pool *pool;         ///< Where a waiter looks for work
+    struct thread_mutex mutex;
+    struct thread_cond cond;
+    bool done;
+    int retval;
+};
+
+struct task_worker {
+    struct task_pool *pool;
+    struct thread *thread;
+    size_t index;
+    struct thread_mutex mutex;      ///< Protects the deque
+    struct task *ring;
+    size_t capacity;
+    size_t top;                     ///< Next task to steal
+    size_t bottom;                  ///< Next free slot of the owner
+};
+
+struct task_pool {
+    size_t nworkers;
+    struct task_worker workers[TASK_POOL_MAX_WORKERS];
+    size_t next;                    ///< Round-robin for outside spawns
+    size_t queued;                  ///< Tasks in all deques, atomic
+    size_t sleeping;                ///< Workers waiting on cond, atomic
+    bool stop;
+    struct thread_mutex mutex;
+    struct thread_cond cond;
+};
+
+/// Worker the calling thread is, if any
+static __thread struct task_worker *current_worker;
+
+static void future_init(struct task_future *future, struct task_pool *pool)
+{
+    future->pool = pool;
+    thread_mutex_init(&future->mutex);
+    thread_cond_init(&future->cond);
+    future->done = false;
+    future->retval = 0;
+}
+
+static void future_complete(struct task_future *future, int retval)
+{
+    thread_mutex_lock(&future->mutex);
+    future->retval = retval;
+    future->done = true;
+    thread_cond_broadcast(&future->cond);
+    thread_mutex_unlock(&future->mutex);
+}
+
+static bool deque_push(struct task_worker *w, struct task *task)
+{
+    struct task_pool *pool = w->pool;
+    thread_mutex_lock(&w->mutex);
+    if (w->bottom - w->top == w->capacity) {
+        struct task *ring = malloc(2 * w->capacity * sizeof(struct task));
+        if (ring == NULL) {
+            thread_mutex_unlock(&w->mutex);
+            return false;
+        }
+        for (size_t i = w->top; i != w->bottom; i++) {
+            ring[i - w->top] = w->ring[i & (w->capacity - 1)];
+        }
+        free(w->ring);
+        w->ring = ring;
+        w->bottom -= w->top;
+        w->top = 0;
+        w->capacity *= 2;
+    }
+    w->ring[w->bottom & (w->capacity - 1)] = *task;
+    w->bottom++;
+    __sync_fetch_and_add(&pool->queued, 1);
+    thread_mutex_unlock(&w->mutex);
+    return true;
+}
+
+static bool deque_pop(struct task_worker *w, struct task *task)
+{
+    bool found = false;
+    thread_mutex_lock(&w->mutex);
+    if (w->bottom != w->top) {
+        w->bottom--;
+        *task = w->ring[w->bottom & (w->capacity - 1)];
+        __sync_fetch_and_sub(&w->pool->queued, 1);
+        found = true;
+    }
+    thread_mutex_unlock(&w->mutex);
+    return found;
+}
+
+static bool deque_steal(struct task_worker *w, struct task *task)
+{
+    if (w->bottom == w->top || !thread_mutex_trylock(&w->mutex)) {
+        return false;
+    }
+    bool found = false;
+    if (w->bottom != w->top) {
+        *task = w->ring[w->top & (w->capacity - 1)];
+        w->top++;
+        __sync_fetch_and_sub(&w->pool->queued, 1);
+        found = true;
+    }
+    thread_mutex_unlock(&w->mutex);
+    return found;
+}
+
+/**
+ * \brief Takes a task off the own deque of `self`, or steals one.
+ *
+ * \param self  The calling worker, NULL for a thread outside the pool.
+ */
+static bool find_task(struct task_pool *pool, struct task_worker *self,
+                      struct task *task)
+{
+    if (self != NULL && deque_pop(self, task)) {
+        return true;
+    }
+    size_t start = self != NULL ? self->index + 1 : pool->next;
+    for (size_t i = 0; i < pool->nworkers; i++) {
+        struct task_worker *victim = &pool->workers[(start + i) % pool->nworkers];
+        if (victim != self && deque_steal(victim, task)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void run_task(struct task *task)
+{
+    int retval = task->func(task->arg);
+    if (task->future != NULL) {
+        future_complete(task->future, retval);
+    }
+}
+
+/// Runs tasks of the pool until `future` is done, then sleeps on it.
+static int future_join(struct task_future *future)
+{
+    struct task_worker *self = current_worker;
+    if (self != NULL && self->pool != future->pool) {
+        self = NULL;
+    }
+    struct task task;
+    while (!future->done && find_task(future->pool, self, &task)) {
+        run_task(&task);
+    }
+
+    thread_mutex_lock(&future->mutex);
+    while (!future->done) {
+        thread_cond_wait(&future->cond, &future->mutex);
+    }
+    int retval = future->retval;
+    thread_mutex_unlock(&future->mutex);
+    return retval;
+}
+
+static int worker_main(void *arg)
+{
+    struct task_worker *w = arg;
+    struct task_pool *pool = w->pool;
+    current_worker = w;
+
+    for (;;) {
+        struct task task;
+        if (find_task(pool, w, &task)) {
+            run_task(&task);
+            continue;
+        }
+        if (pool->queued > 0) {
+            // a busy deque was skipped, let its owner go on
+            thread_yield();
+            continue;
+        }
+
+        thread_mutex_lock(&pool->mutex);
+        if (pool->stop) {
+            thread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        __sync_fetch_and_add(&pool->sleeping, 1);
+        if (pool->queued == 0) {
+            thread_cond_wait(&pool->cond, &pool->mutex);
+        }
+        __sync_fetch_and_sub(&pool->sleeping, 1);
+        thread_mutex_unlock(&pool->mutex);
+    }
+    return 0;
+}
+
+/**
+ * \brief Creates a pool and starts its workers.
+ *
+ * \param ret_pool  Returns the pool.
+ * \param workers   Number of worker threads, 1 to TASK_POOL_MAX_WORKERS.
+ */
+errval_t task_pool_create(struct task_pool **ret_pool, size_t workers)
+{
+    assert(ret_pool != NULL);
+    assert(workers > 0 && workers <= TASK_POOL_MAX_WORKERS);
+
+    struct task_pool *pool = calloc(1, sizeof(struct task_pool));
+    if (pool == NULL) {
+        return LIB_ERR_MALLOC_FAIL;
+    }
+    thread_mutex_init(&pool->mutex);
+    thread_cond_init(&pool->cond);
+
+    for (size_t i = 0; i < workers; i++) {
+        struct task_worker *w = &pool->workers[i];
+        w->pool = pool;
+        w->index = i;
+        thread_mutex_init(&w->mutex);
+        w->capacity = TASK_DEQUE_INITIAL;
+        w->ring = malloc(w->capacity * sizeof(struct task));
+        if (w->ring == NULL) {
+            pool->nworkers = i;
+            task_pool_destroy(pool);
+            return LIB_ERR_MALLOC_FAIL;
+        }
+    }
+    // workers look at nworkers, so only start them once all are set up
+    pool->nworkers = workers;
+    for (size_t i = 0; i < workers; i++) {
+        struct task_worker *w = &pool->workers[i];
+        w->thread = thread_create(worker_main, w);
+        if (w->thread == NULL) {
+            task_pool_destroy(pool);
+            return LIB_ERR_THREAD_CREATE;
+        }
+    }
+
+    *ret_pool = pool;
+    return SYS_ERR_OK;
+}
+
+/**
+ * \brief Runs the queued tasks to completion, then stops the workers and
+ *        frees the pool.
+ */
+void task_pool_destroy(struct task_pool *pool)
+{
+    thread_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    thread_cond_broadcast(&pool->cond);
+    thread_mutex_unlock(&pool->mutex);
+
+    for (size_t i = 0; i < pool->nworkers; i++) {
+        struct task_worker *w = &pool->workers[i];
+        if (w->thread != NULL) {
+            int retval;
+            errval_t err = thread_join(w->thread, &retval);
+            if (err_is_fail(err)) {
+                DEBUG_ERR(err, "joining task pool worker %zu", i);
+            }
+        }
+        free(w->ring);
+    }
+    free(pool);
+}
+
+size_t task_pool_workers(struct task_pool *pool)
+{
+    return pool->nworkers;
+}
+
+/**
+ * \brief Queues a task in the pool.
+ *
+ * From a worker of the pool the task goes to the worker's own deque.
+ *
+ * \param ret_future  Returns a future to wait for the task with, NULL if
+ *                    nobody is interested in the result. A future has to be
+ *                    waited for exactly once.
+ */
+errval_t task_spawn(struct task_pool *pool, task_func_t func, void *arg,
+                    struct task_future **ret_future)
+{
+    struct task task = { .func = func, .arg = arg, .future = NULL };
+    if (ret_future != NULL) {
+        task.future = malloc(sizeof(struct task_future));
+        if (task.future == NULL) {
+            return LIB_ERR_MALLOC_FAIL;
+        }
+        future_init(task.future, pool);
+    }
+
+    struct task_worker *w = current_worker;
+    if (w == NULL || w->pool != pool) {
+        size_t i = __sync_fetch_and_add(&pool->next, 1);
+        w = &pool->workers[i % pool->nworkers];
+    }
+    if (!deque_push(w, &task)) {
+        free(task.future);
+        return LIB_ERR_MALLOC_FAIL;
+    }
+
+    if (pool->sleeping > 0) {
+        thread_mutex_lock(&pool->mutex);
+        thread_cond_signal(&pool->cond);
+        thread_mutex_unlock(&pool->mutex);
+    }
+
+    if (ret_future != NULL) {
+        *ret_future = task.future;
+    }
+    return SYS_ERR_OK;
+}
+
+bool task_future_done(struct task_future *future)
+{
+    return future->done;
+}
+
+/**
+ * \brief Waits for a task and frees its future.
+ *
+ * The caller runs other tasks of the pool while the task is not done.
+ *
+ * \returns The return value of the task.
+ */
+int task_future_wait(struct task_future *future)
+{
+    int retval = future_join(future);
+    free(future);
+    return retval;
+}
+
+struct parallel_for {
+    task_range_func_t func;
+    void *arg;
+    size_t end;
+    size_t grain;
+    size_t remaining;               ///< Chunks not done yet, atomic
+    struct task_future done;
+};
+
+struct parallel_for_chunk {
+    struct parallel_for *pf;
+    size_t begin;
+};
+
+static int parallel_for_chunk(void *arg)
+{
+    struct parallel_for_chunk *chunk = arg;
+    struct parallel_for *pf = chunk->pf;
+    pf->func(pf->arg, chunk->begin, MIN(chunk->begin + pf->grain, pf->end));
+    if (__sync_sub_and_fetch(&pf->remaining, 1) == 0) {
+        future_complete(&pf->done, 0);
+    }
+    return 0;
+}
+
+/**
+ * \brief Runs `func` on [begin, end) in chunks of `grain` iterations and
+ *        returns once all are done. The caller runs chunks as well.
+ *
+ * \param grain  Iterations per task, 0 for four chunks per worker.
+ */
+errval_t task_parallel_for(struct task_pool *pool, size_t begin, size_t end,
+                           size_t grain, task_range_func_t func, void *arg)
+{
+    if (end <= begin) {
+        return SYS_ERR_OK;
+    }
+    if (grain == 0) {
+        grain = MAX(1, (end - begin) / (4 * pool->nworkers));
+    }
+    size_t nchunks = (end - begin + grain - 1) / grain;
+
+    struct parallel_for_chunk *chunks =
+        malloc(nchunks * sizeof(struct parallel_for_chunk));
+    if (chunks == NULL) {
+        return LIB_ERR_MALLOC_FAIL;
+    }
+    struct parallel_for pf = {
+        .func = func, .arg = arg, .end = end, .grain = grain,
+        .remaining = nchunks,
+    };
+    future_init(&pf.done, pool);
+
+    // the first chunk stays with the caller
+    for (size_t i = 0; i < nchunks; i++) {
+        chunks[i].pf = &pf;
+        chunks[i].begin = begin + i * grain;
+        if (i > 0 && err_is_fail(task_spawn(pool, parallel_for_chunk,
+                                            &chunks[i], NULL))) {
+            parallel_for_chunk(&chunks[i]);
+        }
+    }
+    parallel_for_chunk(&chunks[0]);
+
+    future_join(&pf.done);
+    free(chunks);
+    return SYS_ERR_OK;
+}
@@ -20,6 +20,7 @@
 #include <aos/dispatcher_arch.h>
 #include <aos/debug.h>
 #include <aos/slab.h>
+#include <aos/arena.h>
 #include <aos/caddr.h>
 #include <aos/curdispatcher_arch.h>
 #include <aos/paging.h>
@@ -45,6 +46,12 @@
 // there is no point having MAX_THREADS > LDT_NENTRIES on x86 (see ldt.c)
 #define MAX_THREADS 256
 
+/// Exited threads with a default sized stack kept for reuse
+#define THREADS_POOL_MAX 64
+
+/// Unmapped guard below every thread stack
+#define THREADS_GUARD_BYTES BASE_PAGE_SIZE
+
 /// 16-byte alignment required for x86-64
 // FIXME: this should be in an arch header
 #define STACK_ALIGNMENT (sizeof(uint64_t) * 2)
@@ -73,6 +80,11 @@ static struct paging_region thread_slabs_vm;
 static spinlock_t thread_slabs_spinlock;
 static struct thread_mutex thread_slabs_mutex = THREAD_MUTEX_INITIALIZER;
 
+/// Exited threads whose TCB and stack thread_create can reuse, linked
+/// through next. Protected by thread_slabs_spinlock as well.
+static struct thread *thread_pool;
+static size_t thread_pool_count;
+
 /// Base and size of the original ("pristine") thread-local storage init data
 static void *tls_block_init_base;
 static size_t tls_block_init_len;
@@ -203,6 +215,86 @@ void thread_remove_from_queue(struct thread **queue, struct thread *thread)
 #endif
 }
 
+/**
+ * \brief Put a runnable thread on the run queue of its level
+ *
+ * Only while disabled.
+ */
+static void runq_enqueue(struct dispatcher_generic *disp_gen,
+                         struct thread *thread)
+{
+    thread_enqueue(thread, &disp_gen->runq[thread->level]);
+    disp_gen->runq_levels |= 1 << thread->level;
+}
+
+/**
+ * \brief Take a thread off its run queue
+ *
+ * Only while disabled.
+ */
+static void runq_remove(struct dispatcher_generic *disp_gen,
+                        struct thread *thread)
+{
+    thread_remove_from_queue(&disp_gen->runq[thread->level], thread);
+    if (disp_gen->runq[thread->level] == NULL) {
+        disp_gen->runq_levels &= ~(1 << thread->level);
+    }
+}
+
+/// Highest level with runnable threads, disp_gen->runq_levels must not be 0
+static inline unsigned int runq_top(struct dispatcher_generic *disp_gen)
+{
+    return 31 - __builtin_clz(disp_gen->runq_levels);
+}
+
+/// Thread to run next, NULL if there is none. Only while disabled.
+static struct thread *runq_first(struct dispatcher_generic *disp_gen)
+{
+    if (disp_gen->runq_levels == 0) {
+        return NULL;
+    }
+    return disp_gen->runq[runq_top(disp_gen)];
+}
+
+/**
+ * \brief Reserves a stack with a guard page below it and the exception stack
+ *        above it. The pages are faulted in on first use.
+ */
+static void *stack_alloc(size_t stacksize)
+{
+    struct paging_state *st = get_current_paging_state();
+    size_t bytes = THREADS_GUARD_BYTES + stacksize + PAGING_EXCEPTION_STACK_SIZE;
+    void *base;
+    errval_t err = paging_alloc(st, &base, bytes);
+    if (err_is_fail(err)) {
+        DEBUG_ERR(err, "reserving a thread stack");
+        return NULL;
+    }
+    err = paging_guard(st, base, THREADS_GUARD_BYTES);
+    if (err_is_fail(err)) {
+        DEBUG_ERR(err, "guarding a thread stack");
+        paging_free(st, base, bytes);
+        return NULL;
+    }
+    return (char *)base + THREADS_GUARD_BYTES;
+}
+
+/**
+ * \brief Gives a stack from stack_alloc back, guard and exception stack
+ *        included. paging_free returns the frames faulted in on the stack
+ *        and their slots as well.
+ */
+static void stack_free(void *stack, size_t stacksize)
+{
+    errval_t err = paging_free(get_current_paging_state(),
+                               (char *)stack - THREADS_GUARD_BYTES,
+                               THREADS_GUARD_BYTES + stacksize +
+                               PAGING_EXCEPTION_STACK_SIZE);
+    if (err_is_fail(err)) {
+        DEBUG_ERR(err, "freeing a thread stack");
+    }
+}
+
 /// Refill backing storage for thread region
 static errval_t refill_thread_slabs(struct slab_allocator *slabs)
 {
@@ -248,6 +340,8 @@ static void thread_init(dispatcher_handle_t disp, struct thread *newthread)
     newthread->in_exception = false;
     newthread->used_fpu = false;
     newthread->paused = false;
+    newthread->priority = newthread->level = THREAD_PRIORITY_NORMAL;
+    newthread->event_wait = false;
     newthread->slab = NULL;
     newthread->token = 0;
     newthread->token_number = 1;
@@ -255,6 +349,7 @@ static void thread_init(dispatcher_handle_t disp, struct thread *newthread)
 
     newthread->rpc_in_progress = false;
     newthread->async_error = SYS_ERR_OK;
+    newthread->cap_batch_off = false;
 }
 
 /**
@@ -304,15 +399,31 @@ void thread_run_disabled(dispatcher_handle_t handle)
         dispatcher_get_enabled_save_area(handle);
 
     if (disp_gen->current != NULL) {
-        assert_disabled(disp_gen->runq != NULL);
+        struct thread *current = disp_gen->current;
+        assert_disabled(disp_gen->runq_levels != 0);
 
         // check stack bounds
         warn_disabled(&stack_warned,
-                      thread_check_stack_bounds(disp_gen->current, enabled_area));
+                      thread_check_stack_bounds(current, enabled_area));
+
+        // a wakeup boost only lasts for one timeslice
+        if (current->level != current->priority) {
+            runq_remove(disp_gen, current);
+            current->level = current->priority;
+            runq_enqueue(disp_gen, current);
+        }
 
-        struct thread *next = disp_gen->current->next;
+        // round-robin within the highest level
+        unsigned int top = runq_top(disp_gen);
+        struct thread *next;
+        if (top == current->level) {
+            next = current->next;
+            disp_gen->runq[top] = next;
+        } else {
+            next = disp_gen->runq[top];
+        }
         assert_disabled(next != NULL);
-        if (next != disp_gen->current) {
+        if (next != current) {
             fpu_context_switch(disp_gen, next);
 
             // save previous thread's state
@@ -324,11 +435,12 @@ void thread_run_disabled(dispatcher_handle_t handle)
             // same thread as before
             disp_resume(handle, enabled_area);
         }
-    } else if (disp_gen->runq != NULL) {
-        fpu_context_switch(disp_gen, disp_gen->runq);
-        disp_gen->current = disp_gen->runq;
+    } else if (disp_gen->runq_levels != 0) {
+        struct thread *next = runq_first(disp_gen);
+        fpu_context_switch(disp_gen, next);
+        disp_gen->current = next;
         disp->haswork = true;
-        disp_resume(handle, &disp_gen->runq->regs);
+        disp_resume(handle, &next->regs);
     } else {
         // kernel gave us the CPU when we have nothing to do. block!
         disp->haswork = havework_disabled(handle);
@@ -356,16 +468,32 @@ static void free_thread(struct thread *thread)
     ldt_free_segment(thread->thread_seg_selector);
 #endif
 
-    free(thread->stack);
-    if (thread->tls_dtv != NULL) {
-        free(thread->tls_dtv);
-    }
+    arena_release(thread->arena);
+
+    void *stack = thread->stack;
+    size_t stacksize = thread->stack_size;
+    struct tls_dtv *dtv = thread->tls_dtv;
 
     thread_mutex_lock(&thread_slabs_mutex);
     acquire_spinlock(&thread_slabs_spinlock);
+    if (stacksize == THREADS_DEFAULT_STACK_BYTES &&
+        thread_pool_count < THREADS_POOL_MAX) {
+        // keep TCB, stack and TLS vector for the next thread_create
+        thread->next = thread_pool;
+        thread_pool = thread;
+        thread_pool_count++;
+        release_spinlock(&thread_slabs_spinlock);
+        thread_mutex_unlock(&thread_slabs_mutex);
+        return;
+    }
     slab_free(&thread_slabs, thread->slab); // frees thread itself
     release_spinlock(&thread_slabs_spinlock);
     thread_mutex_unlock(&thread_slabs_mutex);
+
+    stack_free(stack, stacksize);
+    if (dtv != NULL) {
+        free(dtv);
+    }
 }
 
 /**
@@ -380,23 +508,47 @@ static void free_thread(struct thread *thread)
 struct thread *thread_create_unrunnable(thread_func_t start_func, void *arg,
                                         size_t stacksize)
 {
-    // allocate stack
     assert((stacksize % sizeof(uintptr_t)) == 0);
-    void *stack = malloc(stacksize);
-    if (stack == NULL) {
-        return NULL;
-    }
+    stacksize = ROUND_UP(stacksize, BASE_PAGE_SIZE);
 
-    // allocate space for TCB + initial TLS data
+    // take an exited thread if the stack fits, the pages it faulted in
+    // stay mapped. Stacks of other sizes are freed with their frames.
     // no mutex as it may deadlock: see comment for thread_slabs_spinlock
-    // thread_mutex_lock(&thread_slabs_mutex);
-    acquire_spinlock(&thread_slabs_spinlock);
-    void *space = slab_alloc(&thread_slabs);
-    release_spinlock(&thread_slabs_spinlock);
-    // thread_mutex_unlock(&thread_slabs_mutex);
-    if (space == NULL) {
-        free(stack);
-        return NULL;
+    struct thread *pooled = NULL;
+    if (stacksize == THREADS_DEFAULT_STACK_BYTES) {
+        acquire_spinlock(&thread_slabs_spinlock);
+        pooled = thread_pool;
+        if (pooled != NULL) {
+            thread_pool = pooled->next;
+            thread_pool_count--;
+        }
+        release_spinlock(&thread_slabs_spinlock);
+    }
+
+    void *stack;
+    void *space;
+    struct tls_dtv *dtv = NULL;
+    if (pooled != NULL) {
+        stack = pooled->stack;
+        space = pooled->slab;
+        dtv = pooled->tls_dtv;
+    } else {
+        // allocate stack, the exception stack goes right after it
+        stack = stack_alloc(stacksize);
+        if (stack == NULL) {
+            return NULL;
+        }
+
+        // allocate space for TCB + initial TLS data
+        // thread_mutex_lock(&thread_slabs_mutex);
+        acquire_spinlock(&thread_slabs_spinlock);
+        space = slab_alloc(&thread_slabs);
+        release_spinlock(&thread_slabs_spinlock);
+        // thread_mutex_unlock(&thread_slabs_mutex);
+        if (space == NULL) {
+            stack_free(stack, stacksize);
+            return NULL;
+        }
     }
 
     // split space into TLS data followed by TCB
@@ -408,6 +560,8 @@ struct thread *thread_create_unrunnable(thread_func_t start_func, void *arg,
     // init thread
     thread_init(curdispatcher(), newthread);
     newthread->slab = space;
+    // not in thread_init, the cleanup thread keeps its arena on reuse
+    newthread->arena = NULL;
 
     if (tls_block_total_len > 0) {
         // populate initial TLS data from pristine copy
@@ -418,8 +572,10 @@ struct thread *thread_create_unrunnable(thread_func_t start_func, void *arg,
         memset((char *)tls_data + tls_block_init_len, 0,
                tls_block_total_len - tls_block_init_len);
 
-        // create a TLS thread vector
-        struct tls_dtv *dtv = malloc(sizeof(struct tls_dtv) + 1 * sizeof(void *));
+        // create a TLS thread vector, unless the pooled thread has one
+        if (dtv == NULL) {
+            dtv = malloc(sizeof(struct tls_dtv) + 1 * sizeof(void *));
+        }
         assert(dtv != NULL);
 
         dtv->gen = 0;
@@ -440,12 +596,18 @@ struct thread *thread_create_unrunnable(thread_func_t start_func, void *arg,
 
     // init stack
     newthread->stack = stack;
+    newthread->stack_size = stacksize;
     newthread->stack_top = (char *)stack + stacksize;
 
-    // waste space for alignment, if malloc gave us an unaligned stack
+    // waste space for alignment, if we got an unaligned stack
     newthread->stack_top = (char *)newthread->stack_top
         - (lvaddr_t)newthread->stack_top % STACK_ALIGNMENT;
 
+    // a thread can block in its page fault handler, so every thread needs
+    // its own exception stack
+    newthread->exception_stack = (char *)stack + stacksize;
+    newthread->exception_stack_top = (char *)newthread->exception_stack
+        + PAGING_EXCEPTION_STACK_SIZE;
     paging_init_onthread(newthread);
 
     // init registers
@@ -474,7 +636,7 @@ struct thread *thread_create_varstack(thread_func_t start_func, void *arg,
         dispatcher_handle_t handle = disp_disable();
         struct dispatcher_generic *disp_gen = get_dispatcher_generic(handle);
         newthread->disp = handle;
-        thread_enqueue(newthread, &disp_gen->runq);
+        runq_enqueue(disp_gen, newthread);
         disp_enable(handle);
     }
     return newthread;
@@ -678,6 +840,17 @@ errval_t thread_get_async_error(void)
     return thread_self()->async_error;
 }
 
+void thread_set_cap_batch_enabled(bool enable)
+{
+    thread_self()->cap_batch_off = !enable;
+}
+
+bool thread_get_cap_batch_enabled(void)
+{
+    struct thread *me = thread_self();
+    return me == NULL || !me->cap_batch_off;
+}
+
 /**
  * \brief Yield the calling thread
  *
@@ -697,27 +870,61 @@ void thread_yield(void)
     struct thread *next = me;
     me->yield_epoch = disp_gen->timeslice;
 
-    do {
-        assert_disabled(next != NULL);
-        next = next->next;
-        if (next == me) {
-            break; // Everybody yielded this timeslice
+    // Highest priority thread that did not yield this timeslice yet, so
+    // yielding lets lower levels run as well. Everybody yielded if none.
+    for (int l = runq_top(disp_gen); l >= 0 && next == me; l--) {
+        struct thread *first = disp_gen->runq[l];
+        if (first == NULL) {
+            continue;
         }
-    } while(next->yield_epoch == disp_gen->timeslice);
+        if (l == me->level) {
+            first = me->next;
+        }
+        struct thread *t = first;
+        do {
+            if (t != me && t->yield_epoch != disp_gen->timeslice) {
+                next = t;
+                break;
+            }
+            t = t->next;
+        } while (t != first);
+    }
 
     poll_channels_disabled(handle);
 
     if (next != me) {
+        if (next->level == me->level) {
+            disp_gen->runq[me->level] = next;
+        }
         fpu_context_switch(disp_gen, next);
         disp_gen->current = next;
         disp_switch(handle, &me->regs, &next->regs);
     } else {
-        assert_disabled(disp_gen->runq != NULL);
+        assert_disabled(disp_gen->runq_levels != 0);
         assert_disabled(disp->haswork);
         disp_save(handle, enabled_area, true, CPTR_NULL);
     }
 }
 
+/**
+ * \brief Returns true if no thread but the caller is runnable and the
+ * dispatcher has no pending sends or polled channels
+ *
+ * Only while disabled, so nothing can become runnable until the caller
+ * enables again.
+ */
+bool thread_is_alone_disabled(dispatcher_handle_t handle)
+{
+    struct dispatcher_generic *disp_gen = get_dispatcher_generic(handle);
+    struct thread *me = disp_gen->current;
+    return me != NULL && me->next == me &&
+           disp_gen->runq_levels == (1u << me->level) &&
+#ifdef CONFIG_INTERCONNECT_DRIVER_LMP
+           disp_gen->lmp_send_events_list == NULL &&
+#endif
+           disp_gen->polled_channels == NULL;
+}
+
 /**
  * \brief Yield both the calling thread, and the dispatcher to another domain
  *
@@ -735,7 +942,7 @@ void thread_yield_dispatcher(struct capref endpoint)
     arch_registers_state_t *enabled_area =
         dispatcher_get_enabled_save_area(handle);
 
-    assert_disabled(disp_gen->runq != NULL);
+    assert_disabled(disp_gen->runq_levels != 0);
     assert_disabled(disp->haswork);
 
     disp_save(handle, enabled_area, true, get_cap_addr(endpoint));
@@ -762,9 +969,9 @@ static int cleanup_thread(void *arg)
     assert(ft == NULL);
 
     // run the next thread, if any
-    struct thread *next = me->next;
-    thread_remove_from_queue(&disp_gen->runq, me);
-    if (next != me) {
+    runq_remove(disp_gen, me);
+    struct thread *next = runq_first(disp_gen);
+    if (next != NULL) {
         disp_gen->current = next;
         disp_resume(handle, &next->regs);
     } else {
@@ -808,9 +1015,9 @@ void thread_exit(int status)
 #endif
 
         // run the next thread, if any
-        struct thread *next = me->next;
-        thread_remove_from_queue(&disp_gen->runq, me);
-        if (next != me) {
+        runq_remove(disp_gen, me);
+        struct thread *next = runq_first(disp_gen);
+        if (next != NULL) {
             fpu_context_switch(disp_gen, next);
             disp_gen->current = next;
             disp_resume(handle, &next->regs);
@@ -849,8 +1056,8 @@ void thread_exit(int status)
         }
 #endif
 
-        thread_remove_from_queue(&disp_gen->runq, me);
-        thread_enqueue(dg->cleanupthread, &disp_gen->runq);
+        runq_remove(disp_gen, me);
+        runq_enqueue(disp_gen, dg->cleanupthread);
         disp_gen->cleanupthread->disp = handle;
         fpu_context_switch(disp_gen, dg->cleanupthread);
         disp_gen->current = dg->cleanupthread;
@@ -880,9 +1087,9 @@ void thread_exit(int status)
 #endif
 
         // run the next thread, if any
-        struct thread *next = me->next;
-        thread_remove_from_queue(&disp_gen->runq, me);
-        if (next != me) {
+        runq_remove(disp_gen, me);
+        struct thread *next = runq_first(disp_gen);
+        if (next != NULL) {
             fpu_context_switch(disp_gen, next);
             disp_gen->current = next;
             disp_resume(handle, &next->regs);
@@ -921,13 +1128,11 @@ void *thread_block_and_release_spinlock_disabled(dispatcher_handle_t handle,
         get_dispatcher_shared_generic(handle);
     struct dispatcher_generic *disp_gen = get_dispatcher_generic(handle);
     struct thread *me = disp_gen->current;
-    struct thread *next = me->next;
-    assert_disabled(next != NULL);
 
     assert_disabled(me->state == THREAD_STATE_RUNNABLE);
     me->state = THREAD_STATE_BLOCKED;
 
-    thread_remove_from_queue(&disp_gen->runq, me);
+    runq_remove(disp_gen, me);
     if (queue != NULL) {
         thread_enqueue(me, queue);
     }
@@ -936,13 +1141,12 @@ void *thread_block_and_release_spinlock_disabled(dispatcher_handle_t handle,
         release_spinlock(spinlock);
     }
 
-    if (next != me) {
-        assert_disabled(disp_gen->runq != NULL);
+    struct thread *next = runq_first(disp_gen);
+    if (next != NULL) {
         fpu_context_switch(disp_gen, next);
         disp_gen->current = next;
         disp_switch(handle, &me->regs, &next->regs);
     } else {
-        assert_disabled(disp_gen->runq == NULL);
         disp_gen->current = NULL;
         disp->haswork = havework_disabled(handle);
         disp_save(handle, &me->regs, true, CPTR_NULL);
@@ -1014,11 +1218,18 @@ struct thread *thread_unblock_one_disabled(dispatcher_handle_t handle,
     assert_disabled(wakeup->state == THREAD_STATE_BLOCKED);
     wakeup->state = THREAD_STATE_RUNNABLE;
 
+    // threads waiting for an event go ahead of batch work for a timeslice
+    wakeup->level = wakeup->priority;
+    if (wakeup->event_wait && wakeup->level < THREAD_PRIORITY_HIGH) {
+        wakeup->level = THREAD_PRIORITY_HIGH;
+    }
+    wakeup->event_wait = false;
+
     /* enqueue on run queue if it's "our" thread, and not paused */
     if (wakeup->disp == handle) {
         if (!wakeup->paused) {
             struct dispatcher_generic *disp_gen = get_dispatcher_generic(handle);
-            thread_enqueue(wakeup, &disp_gen->runq);
+            runq_enqueue(disp_gen, wakeup);
         }
         return NULL;
     } else {
@@ -1128,6 +1339,12 @@ static int bootstrap_thread(struct spawn_domain_params *params)
     }
     slab_init(&thread_slabs, blocksize, refill_thread_slabs);
 
+    // Keeps the slab caches of paging and mm above their watermark.
+    err = slab_cache_refill_thread_start();
+    if (err_is_fail(err)) {
+        USER_PANIC_ERR(err, "starting the slab refill thread failed\n");
+    }
+
     // Until we have self-paging, we cannot use the paging-region based thread
     // control block slab allocator, so just run main thread directly
 #ifndef SELF_PAGING_WORKS
@@ -1202,7 +1419,7 @@ void thread_init_disabled(dispatcher_handle_t handle, bool init_domain)
 
     // Switch to it (always on this dispatcher)
     thread->disp = handle;
-    thread_enqueue(thread, &disp_gen->runq);
+    runq_enqueue(disp_gen, thread);
     disp_gen->current = thread;
     disp->haswork = true;
     disp_resume(handle, &thread->regs);
@@ -1218,7 +1435,7 @@ void thread_init_remote(dispatcher_handle_t handle, struct thread *thread)
     struct dispatcher_shared_generic *disp =
         get_dispatcher_shared_generic(handle);
     struct dispatcher_generic *disp_gen = get_dispatcher_generic(handle);
-    thread_enqueue(thread, &disp_gen->runq);
+    runq_enqueue(disp_gen, thread);
     disp_gen->current = thread;
     disp->haswork = true;
     disp_resume(handle, &thread->regs);
@@ -1289,7 +1506,7 @@ void thread_pause_and_capture_state(struct thread *thread,
                 assert_disabled(thread->state == THREAD_STATE_RUNNABLE);
                 thread_block_disabled(dh, NULL);
             } else if (thread->state == THREAD_STATE_RUNNABLE) {
-                thread_remove_from_queue(&disp->runq, thread);
+                runq_remove(disp, thread);
             }
         }
         if (ret_regs != NULL) {
@@ -1331,7 +1548,7 @@ void thread_resume(struct thread *thread)
         if (thread->paused) {
             thread->paused = false;
             if (thread->state == THREAD_STATE_RUNNABLE) {
-                thread_enqueue(thread, &disp->runq);
+                runq_enqueue(disp, thread);
             }
         }
     } else {
@@ -1340,6 +1557,52 @@ void thread_resume(struct thread *thread)
     disp_enable(dh);
 }
 
+/**
+ * \brief Set the priority of a thread, one of THREAD_PRIORITY_*
+ *
+ * A runnable thread moves to the run queue of its new level and loses any
+ * wakeup boost. The running thread is not preempted, the new priority counts
+ * from the next scheduling decision on.
+ */
+void thread_set_priority(struct thread *thread, unsigned int priority)
+{
+    assert(thread != NULL);
+    assert(priority < THREAD_PRIORITIES);
+    dispatcher_handle_t dh = disp_disable();
+    struct dispatcher_generic *disp = get_dispatcher_generic(dh);
+    if (thread->disp != dh) {
+        USER_PANIC("NYI: remote dispatcher thread_set_priority()");
+    }
+
+    // unrunnable and paused threads are not on a run queue
+    bool queued = false;
+    struct thread *t = disp->runq[thread->level];
+    if (t != NULL) {
+        do {
+            queued = t == thread;
+            t = t->next;
+        } while (!queued && t != disp->runq[thread->level]);
+    }
+
+    if (queued) {
+        runq_remove(disp, thread);
+    }
+    thread->priority = thread->level = priority;
+    if (queued) {
+        runq_enqueue(disp, thread);
+    }
+    disp_enable(dh);
+}
+
+/**
+ * \brief Returns the priority of a thread
+ */
+unsigned int thread_get_priority(struct thread *thread)
+{
+    assert(thread != NULL);
+    return thread->priority;
+}
+
 /**
  * \brief Set old-style thread-local storage pointer.
  * \param p   User's pointer
@@ -1488,7 +1751,7 @@ void thread_deliver_exception_disabled(dispatcher_handle_t handle,
     struct dispatcher_generic *disp_gen = get_dispatcher_generic(handle);
     struct thread *thread = disp_gen->current;
     assert_disabled(thread != NULL);
-    assert_disabled(disp_gen->runq != NULL);
+    assert_disabled(disp_gen->runq_levels != 0);
 
     // can we deliver the exception?
     if (thread->exception_handler == NULL || thread->exception_stack_top == NULL
@@ -1516,7 +1779,7 @@ void thread_deliver_exception_disabled(dispatcher_handle_t handle,
 
         // TODO: actually delete the thread!
         disp_gen->current = NULL;
-        thread_remove_from_queue(&disp_gen->runq, thread);
+        runq_remove(disp_gen, thread);
         return;
     }
 
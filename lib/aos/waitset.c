@@ -331,6 +331,7 @@ errval_t get_next_event_disabled(struct waitset *ws,
         }
         chan = ws->pending; // check a pending queue
         if (!chan) { // if nothing then wait
+            thread_self_disabled()->event_wait = true;
             thread_block_disabled(handle, &ws->waiting_threads);
             disp_disable();
         } else { // something but it's not our event
@@ -25,6 +25,9 @@ alt_free_t alt_free = NULL;
 size_t __malloc_instrumented_allocated;
 #endif
 
+/* Number of successful malloc() calls, read by benchmarks */
+size_t __malloc_calls;
+
 #ifdef CONFIG_MALLOC_DEBUG_INTERNAL
 #include <stdio.h>
 #include <assert.h>
@@ -63,6 +66,7 @@ malloc(size_t nbytes)
 			}
             p->s.magic = 0xdeadbeef;
 			state->header_freep = prevp;
+			__malloc_calls++;
 #ifdef CONFIG_MALLOC_DEBUG
 			{
 				/* Write bit pattern over data */
@@ -41,7 +41,7 @@ static struct mmnode *mm_create_node(struct mm *mm, enum nodetype type,
                                      genpaddr_t base, gensize_t size)
 {
     // Create the node in memory.
-    struct mmnode *node = slab_alloc(&mm->slabs);
+    struct mmnode *node = slab_cache_alloc(&mm->slabs);
     node->base = base;
     node->size = size;
     node->type = type;
@@ -135,7 +135,7 @@ static errval_t mm_mmnode_remove(struct mm *mm, struct mmnode **p_node)
     }
 
     // Free the node memory.
-    slab_free(&mm->slabs, node);
+    slab_cache_free(&mm->slabs, node);
 
     return SYS_ERR_OK;
 }
@@ -189,6 +189,12 @@ static errval_t mm_slot_alloc(struct mm *mm, uint64_t slots,
 {
     struct slot_prealloc *sa = (struct slot_prealloc *) mm->slot_alloc_inst;
 
+    if (slots == 1 && !capref_is_null(mm->spare_slot)) {
+        *cap = mm->spare_slot;
+        mm->spare_slot = NULL_CAP;
+        return SYS_ERR_OK;
+    }
+
     // Check both entries of the metadata array for free slots
     // we need slots to allocate new ones so make sure the slot count is above
     // a certain threshold. Also make sure that we are not currently refilling
@@ -208,11 +214,36 @@ static errval_t mm_slot_alloc(struct mm *mm, uint64_t slots,
     return SYS_ERR_OK;
 }
 
+/// Give back a slot from mm_slot_alloc that ended up unused. The slot
+/// allocators can't take slots back, so we keep one for the next allocation.
+static void mm_slot_free(struct mm *mm, struct capref cap)
+{
+    if (capref_is_null(mm->spare_slot)) {
+        mm->spare_slot = cap;
+    } else {
+        DBG(DETAILED, "already holding a spare slot, slot lost\n");
+    }
+}
+
+/// Node memory of the segregated backend comes from the same slabs.
+static struct mm_seg_node *seg_node_alloc(void *arg)
+{
+    struct mm *mm = arg;
+    return slab_cache_alloc(&mm->slabs);
+}
+
+static void seg_node_free(void *arg, struct mm_seg_node *node)
+{
+    struct mm *mm = arg;
+    slab_cache_free(&mm->slabs, node);
+}
+
 /**
  * \brief Initialize the memory manager.
  *
  * \param  mm               The mm struct to initialize.
  * \param  objtype          The cap type this manager should deal with.
+ * \param  backend          How free memory is kept track of.
  * \param  slab_refill_func Custom function for refilling the slab allocator.
  * \param  slot_alloc_func  Function for allocating capability slots.
  * \param  slot_refill_func Function for refilling (making) new slots.
@@ -220,7 +251,7 @@ static errval_t mm_slot_alloc(struct mm *mm, uint64_t slots,
  * \returns                 Error return code.
  */
 errval_t mm_init(struct mm *mm, enum objtype objtype,
-                 slab_refill_func_t slab_refill_func,
+                 enum mm_backend backend, slab_refill_func_t slab_refill_func,
                  slot_alloc_t slot_alloc_func, slot_refill_t slot_refill_func,
                  void *slot_alloc_inst)
 {
@@ -231,16 +262,21 @@ errval_t mm_init(struct mm *mm, enum objtype objtype,
     mm->slot_refill = slot_refill_func;
     mm->objtype = objtype;
     mm->slot_alloc_inst = slot_alloc_inst;
+    mm->spare_slot = NULL_CAP;
     mm->head = NULL;
     mm->refilling_slabs = false;
+    mm->backend = backend;
+    mm_seg_init(&mm->seg, BASE_PAGE_SIZE, seg_node_alloc, seg_node_free, mm);
 
     // There is a default slab refill function that can be used if no
     // custom function is provided.
     if (slab_refill_func == NULL) {
         slab_refill_func = slab_default_refill;
     }
-    // Create the first slab to hold exactly one mmnode.
-    slab_init(&mm->slabs, sizeof(struct mmnode), slab_refill_func);
+    // The refill thread keeps enough nodes around that adding and splitting
+    // nodes does not have to map memory itself.
+    slab_cache_init(&mm->slabs, MM_NODE_SIZE, slab_refill_func,
+                    MM_SLAB_WATERMARK);
 
     DBG(VERBOSE, "libmm: Initialized\n");
     return SYS_ERR_OK;
@@ -253,6 +289,14 @@ errval_t mm_init(struct mm *mm, enum objtype objtype,
  */
 void mm_destroy(struct mm *mm)
 {
+    if (mm->backend == MM_BACKEND_SEGREGATED) {
+        // the allocated regions' caps are owned by the clients
+        mm_seg_destroy(&mm->seg);
+        cap_revoke(mm->ram_cap);
+        cap_destroy(mm->ram_cap);
+        return;
+    }
+
     // Iterate over all mm nodes and destroy their capabilities.
     struct mmnode *node = mm->head;
     struct mmnode *next_node = mm->head;
@@ -282,6 +326,17 @@ errval_t mm_add(struct mm *mm, struct capref cap, genpaddr_t base,
     DBG(VERBOSE, "libmm: Adding a capability of size %" PRIu64 " MB at %zx \n",
         size / 1048576, base);
 
+    if (mm->backend == MM_BACKEND_SEGREGATED) {
+        // Allocations are retyped straight from the ram cap, so there is
+        // no cap of our own to make here.
+        if (!mm_seg_add(&mm->seg, base, size))
+            return MM_ERR_ALREADY_PRESENT;
+        mm->initial_base = base;
+        mm->ram_cap = cap;
+        thread_mutex_init(&mutex);
+        return SYS_ERR_OK;
+    }
+
     // Create the node.
     struct mmnode *node = NULL;
 
@@ -311,6 +366,71 @@ errval_t mm_add(struct mm *mm, struct capref cap, genpaddr_t base,
     return SYS_ERR_OK;
 }
 
+/// mm_alloc_aligned for the segregated backend, size and alignment are
+/// already page aligned.
+static errval_t seg_alloc_aligned(struct mm *mm, size_t size,
+                                  size_t alignment, struct capref *retcap)
+{
+    errval_t err;
+
+    thread_mutex_lock(&mutex);
+    struct mm_seg_node *node = mm_seg_alloc(&mm->seg, size, alignment);
+    thread_mutex_unlock(&mutex);
+    if (node == NULL) {
+        debug_printf("we wanted to get a node with size %d and alignment %d "
+                     "but couldn't find one\n",
+                     size, alignment);
+        return MM_ERR_NOT_FOUND;
+    }
+
+    // Regions that still have descendants we could not retype. They stay
+    // allocated until we are done, so the retries below don't get them
+    // again, and are linked through class_next, which allocated nodes don't
+    // use.
+    struct mm_seg_node *busy = NULL;
+    err = mm_slot_alloc(mm, 1, retcap);
+    if (err_is_fail(err)) {
+        goto out_free;
+    }
+
+    err = cap_retype(*retcap, mm->ram_cap, node->base - mm->initial_base,
+                     mm->objtype, (gensize_t) size, 1);
+    while (err_no(err) == SYS_ERR_REVOKE_FIRST) {
+        // Same as the list backend, some caps cannot be revoked yet. Set the
+        // region aside and try the next one with the same slot.
+        DBG(DETAILED, "retype of 0x%" PRIxGENPADDR " failed, skipping\n",
+            (genpaddr_t) node->base);
+        node->class_next = busy;
+        busy = node;
+        thread_mutex_lock(&mutex);
+        node = mm_seg_alloc(&mm->seg, size, alignment);
+        thread_mutex_unlock(&mutex);
+        if (node == NULL) {
+            err = MM_ERR_NOT_FOUND;
+            break;
+        }
+        err = cap_retype(*retcap, mm->ram_cap, node->base - mm->initial_base,
+                         mm->objtype, (gensize_t) size, 1);
+    }
+    if (err_is_fail(err)) {
+        mm_slot_free(mm, *retcap);
+    }
+
+out_free:
+    thread_mutex_lock(&mutex);
+    if (err_is_fail(err) && node != NULL) {
+        mm_seg_free(&mm->seg, node);
+    }
+    // later allocations may find the set aside regions retypeable again
+    while (busy != NULL) {
+        struct mm_seg_node *next = busy->class_next;
+        mm_seg_free(&mm->seg, busy);
+        busy = next;
+    }
+    thread_mutex_unlock(&mutex);
+    return err;
+}
+
 /**
  * Allocate aligned physical memory.
  *
@@ -347,15 +467,19 @@ errval_t mm_alloc_aligned(struct mm *mm, size_t size, size_t alignment,
     // Check if we have enough slabs left first. If we fill the last slab,
     // we cannot create new slabs because they need slabs themselves.
     // We do this here to not disrupt the addition of the actual node
-    if (slab_freecount(&mm->slabs) < 4 && !mm->refilling_slabs) {
+    // Normally the refill thread got there first.
+    if (slab_cache_freecount(&mm->slabs) < 4 && !mm->refilling_slabs) {
         // Indicate that we are refilling the slabs.
         DBG(DETAILED, "refilling slabs!\n");
         mm->refilling_slabs = true;
-        CHECK(mm->slabs.refill_func(&mm->slabs));
+        CHECK(slab_cache_refill(&mm->slabs));
         // Indicate that we are done.
         mm->refilling_slabs = false;
     }
 
+    if (mm->backend == MM_BACKEND_SEGREGATED)
+        return seg_alloc_aligned(mm, size, alignment, retcap);
+
     thread_mutex_lock(&mutex);
 
     // Find a free node in the list.
@@ -409,7 +533,7 @@ errval_t mm_alloc_aligned(struct mm *mm, size_t size, size_t alignment,
         // allocate a new node and store the remaining space in there.
         // Size of the node exactly as needed.
         DBG(VERBOSE, "Memory reuse\n");
-        slab_free(&(mm->slabs), new_node);
+        slab_cache_free(&mm->slabs, new_node);
         new_node = node;
     }
     DBG(VERBOSE, "new node: base: 0x%" PRIxGENPADDR " size: %" PRIu64 " KB\n",
@@ -499,6 +623,44 @@ static errval_t re_search_free(struct mm *mm, struct capref cap,
     return MM_ERR_NOT_FOUND;
 }
 
+/// mm_free for the segregated backend.
+static errval_t seg_free(struct mm *mm, struct capref cap, genpaddr_t base,
+                         gensize_t size)
+{
+    gensize_t rounded = ROUND_UP(size, BASE_PAGE_SIZE);
+    thread_mutex_lock(&mutex);
+    struct mm_seg_node *node = mm_seg_lookup(&mm->seg, base);
+    bool found = node != NULL && !node->free && node->size == rounded;
+    thread_mutex_unlock(&mutex);
+    if (!found) {
+        debug_printf("we wanted to free a node with base 0x%" PRIxGENPADDR
+                     " and size %" PRIu64 " KB but did not find one\n",
+                     base, size / 1024);
+        return MM_ERR_MM_FREE;
+    }
+
+    // Revoking the handed in cap takes care of all its copies. Only once
+    // they are gone can the range be handed out again.
+    errval_t err = cap_revoke(cap);
+    if (err_is_fail(err)) {
+        return err_push(err, MM_ERR_MM_FREE);
+    }
+    err = cap_destroy(cap);
+    if (err_is_fail(err)) {
+        return err_push(err, MM_ERR_MM_FREE);
+    }
+
+    // look the node up again, a second free of the range may have won
+    thread_mutex_lock(&mutex);
+    node = mm_seg_lookup(&mm->seg, base);
+    found = node != NULL && !node->free && node->size == rounded;
+    if (found) {
+        mm_seg_free(&mm->seg, node);
+    }
+    thread_mutex_unlock(&mutex);
+    return found ? SYS_ERR_OK : MM_ERR_MM_FREE;
+}
+
 /**
  * \brief Free a certain region (for later re-use).
  *
@@ -511,6 +673,9 @@ static errval_t re_search_free(struct mm *mm, struct capref cap,
 errval_t mm_free(struct mm *mm, struct capref cap, genpaddr_t base,
                  gensize_t size)
 {
+    if (mm->backend == MM_BACKEND_SEGREGATED)
+        return seg_free(mm, cap, base, size);
+
     // Iterate over the list to find the correct node to free.
     thread_mutex_lock(&mutex);
     struct mmnode *node = mm->head;
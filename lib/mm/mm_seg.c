@@ -0,0 +1,427 @@
+/**
+ * \file
+ * \brief Segregated free list range allocator
+ */
+
+#include <assert.h>
+#include <mm/mm_seg.h>
+
+/// Free ranges of a size class looked at for one allocation. Out of those
+/// the lowest fitting one is taken, which keeps fragmentation close to that
+/// of an address ordered first fit.
+#define MM_SEG_PROBE 8
+
+static int floor_log2(uint64_t x)
+{
+    assert(x != 0);
+    return 63 - __builtin_clzll(x);
+}
+
+static uint64_t round_up(uint64_t x, uint64_t to)
+{
+    return (x + to - 1) / to * to;
+}
+
+/// Padding needed to align node's base to alignment.
+static uint64_t align_pad(struct mm_seg_node *node, uint64_t alignment)
+{
+    uint64_t dif = node->base % alignment;
+    return dif > 0 ? alignment - dif : 0;
+}
+
+static bool fits(struct mm_seg_node *node, uint64_t size, uint64_t alignment)
+{
+    return align_pad(node, alignment) + size <= node->size;
+}
+
+/*
+ * AVL tree keyed by base address.
+ */
+
+static int height(struct mm_seg_node *node)
+{
+    return node != NULL ? node->height : 0;
+}
+
+static void update_height(struct mm_seg_node *node)
+{
+    int l = height(node->left);
+    int r = height(node->right);
+    node->height = 1 + (l > r ? l : r);
+}
+
+static struct mm_seg_node *rotate_right(struct mm_seg_node *y)
+{
+    struct mm_seg_node *x = y->left;
+    y->left = x->right;
+    x->right = y;
+    update_height(y);
+    update_height(x);
+    return x;
+}
+
+static struct mm_seg_node *rotate_left(struct mm_seg_node *x)
+{
+    struct mm_seg_node *y = x->right;
+    x->right = y->left;
+    y->left = x;
+    update_height(x);
+    update_height(y);
+    return y;
+}
+
+static struct mm_seg_node *balance(struct mm_seg_node *node)
+{
+    update_height(node);
+    int bf = height(node->left) - height(node->right);
+    if (bf > 1) {
+        if (height(node->left->left) < height(node->left->right))
+            node->left = rotate_left(node->left);
+        return rotate_right(node);
+    }
+    if (bf < -1) {
+        if (height(node->right->right) < height(node->right->left))
+            node->right = rotate_right(node->right);
+        return rotate_left(node);
+    }
+    return node;
+}
+
+static struct mm_seg_node *tree_insert(struct mm_seg_node *root,
+                                       struct mm_seg_node *node)
+{
+    if (root == NULL) {
+        node->left = NULL;
+        node->right = NULL;
+        node->height = 1;
+        return node;
+    }
+    if (node->base < root->base)
+        root->left = tree_insert(root->left, node);
+    else
+        root->right = tree_insert(root->right, node);
+    return balance(root);
+}
+
+static struct mm_seg_node *tree_remove_min(struct mm_seg_node *root,
+                                           struct mm_seg_node **min)
+{
+    if (root->left == NULL) {
+        *min = root;
+        return root->right;
+    }
+    root->left = tree_remove_min(root->left, min);
+    return balance(root);
+}
+
+static struct mm_seg_node *tree_remove(struct mm_seg_node *root,
+                                       uint64_t base)
+{
+    if (root == NULL)
+        return NULL;
+    if (base < root->base) {
+        root->left = tree_remove(root->left, base);
+    } else if (base > root->base) {
+        root->right = tree_remove(root->right, base);
+    } else {
+        struct mm_seg_node *left = root->left;
+        struct mm_seg_node *right = root->right;
+        if (right == NULL)
+            return left;
+        struct mm_seg_node *min;
+        right = tree_remove_min(right, &min);
+        min->left = left;
+        min->right = right;
+        return balance(min);
+    }
+    return balance(root);
+}
+
+/// Range with the highest base <= base, NULL if there is none.
+static struct mm_seg_node *tree_floor(struct mm_seg_node *root, uint64_t base)
+{
+    struct mm_seg_node *best = NULL;
+    while (root != NULL) {
+        if (root->base == base)
+            return root;
+        if (root->base < base) {
+            best = root;
+            root = root->right;
+        } else {
+            root = root->left;
+        }
+    }
+    return best;
+}
+
+/*
+ * Address ordered list and size class lists.
+ */
+
+static void list_insert_after(struct mm_seg *seg, struct mm_seg_node *prev,
+                              struct mm_seg_node *node)
+{
+    node->prev = prev;
+    node->next = prev != NULL ? prev->next : seg->head;
+    if (node->next != NULL)
+        node->next->prev = node;
+    if (prev != NULL)
+        prev->next = node;
+    else
+        seg->head = node;
+}
+
+static void list_remove(struct mm_seg *seg, struct mm_seg_node *node)
+{
+    if (node->prev != NULL)
+        node->prev->next = node->next;
+    else
+        seg->head = node->next;
+    if (node->next != NULL)
+        node->next->prev = node->prev;
+}
+
+static void class_insert(struct mm_seg *seg, struct mm_seg_node *node)
+{
+    int c = floor_log2(node->size);
+    node->class_prev = NULL;
+    node->class_next = seg->classes[c];
+    if (node->class_next != NULL)
+        node->class_next->class_prev = node;
+    seg->classes[c] = node;
+    seg->nonempty |= (uint64_t) 1 << c;
+}
+
+static void class_remove(struct mm_seg *seg, struct mm_seg_node *node)
+{
+    int c = floor_log2(node->size);
+    if (node->class_prev != NULL)
+        node->class_prev->class_next = node->class_next;
+    else
+        seg->classes[c] = node->class_next;
+    if (node->class_next != NULL)
+        node->class_next->class_prev = node->class_prev;
+    if (seg->classes[c] == NULL)
+        seg->nonempty &= ~((uint64_t) 1 << c);
+}
+
+/// Adds a new range next to (after if after is set) an existing one.
+static void insert_range(struct mm_seg *seg, struct mm_seg_node *node,
+                         struct mm_seg_node *at, bool after, uint64_t base,
+                         uint64_t size)
+{
+    node->base = base;
+    node->size = size;
+    node->free = true;
+    list_insert_after(seg, after ? at : at->prev, node);
+    seg->root = tree_insert(seg->root, node);
+    class_insert(seg, node);
+}
+
+/// Removes node from the list and the tree and frees it.
+static void drop_range(struct mm_seg *seg, struct mm_seg_node *node)
+{
+    list_remove(seg, node);
+    seg->root = tree_remove(seg->root, node->base);
+    seg->node_free(seg->node_arg, node);
+}
+
+/**
+ * \brief Initialize a segregated free list allocator.
+ *
+ * \param seg        The allocator to initialize.
+ * \param granule    Every range and every allocation is a multiple of this.
+ * \param node_alloc Function allocating the nodes ranges are kept in.
+ * \param node_free  Function freeing them again.
+ * \param node_arg   Argument for node_alloc and node_free.
+ */
+void mm_seg_init(struct mm_seg *seg, uint64_t granule,
+                 mm_seg_node_alloc_t node_alloc,
+                 mm_seg_node_free_t node_free, void *node_arg)
+{
+    assert(granule > 0);
+    seg->root = NULL;
+    seg->head = NULL;
+    for (int c = 0; c < MM_SEG_CLASSES; c++)
+        seg->classes[c] = NULL;
+    seg->nonempty = 0;
+    seg->granule = granule;
+    seg->node_alloc = node_alloc;
+    seg->node_free = node_free;
+    seg->node_arg = node_arg;
+}
+
+/**
+ * \brief Add a free range. Fails if it overlaps a known range or no node
+ * could be allocated.
+ */
+bool mm_seg_add(struct mm_seg *seg, uint64_t base, uint64_t size)
+{
+    assert(base % seg->granule == 0 && size % seg->granule == 0);
+    if (size == 0)
+        return false;
+
+    struct mm_seg_node *prev = tree_floor(seg->root, base);
+    if (prev != NULL && prev->base + prev->size > base)
+        return false;
+    struct mm_seg_node *next = prev != NULL ? prev->next : seg->head;
+    if (next != NULL && next->base < base + size)
+        return false;
+
+    struct mm_seg_node *node = seg->node_alloc(seg->node_arg);
+    if (node == NULL)
+        return false;
+    node->base = base;
+    node->size = size;
+    node->free = true;
+    list_insert_after(seg, prev, node);
+    seg->root = tree_insert(seg->root, node);
+    class_insert(seg, node);
+    return true;
+}
+
+/// Lowest fitting range among the first MM_SEG_PROBE of a class list. *last
+/// is where the probing stopped.
+static struct mm_seg_node *probe_class(struct mm_seg_node *node,
+                                       uint64_t size, uint64_t alignment,
+                                       struct mm_seg_node **last)
+{
+    struct mm_seg_node *best = NULL;
+    for (int i = 0; node != NULL && i < MM_SEG_PROBE; i++) {
+        if (fits(node, size, alignment) &&
+            (best == NULL || node->base < best->base)) {
+            best = node;
+        }
+        node = node->class_next;
+    }
+    *last = node;
+    return best;
+}
+
+/// Cuts [size] bytes at [alignment] out of the free range node.
+static struct mm_seg_node *carve(struct mm_seg *seg, struct mm_seg_node *node,
+                                 uint64_t size, uint64_t alignment)
+{
+    uint64_t dif = align_pad(node, alignment);
+    bool rest = node->size > dif + size;
+
+    // get the nodes first, so we can still back out
+    struct mm_seg_node *gap = NULL;
+    struct mm_seg_node *rem = NULL;
+    if (dif > 0 && (gap = seg->node_alloc(seg->node_arg)) == NULL)
+        return NULL;
+    if (rest && (rem = seg->node_alloc(seg->node_arg)) == NULL) {
+        if (gap != NULL)
+            seg->node_free(seg->node_arg, gap);
+        return NULL;
+    }
+
+    class_remove(seg, node);
+    uint64_t base = node->base;
+    uint64_t end = node->base + node->size;
+    // Moving the base within the node's own range keeps the tree ordered.
+    node->base = base + dif;
+    node->size = size;
+    node->free = false;
+    if (gap != NULL)
+        insert_range(seg, gap, node, false, base, dif);
+    if (rem != NULL)
+        insert_range(seg, rem, node, true, base + dif + size,
+                     end - (base + dif + size));
+    return node;
+}
+
+/**
+ * \brief Allocate a range.
+ *
+ * Takes a fitting range of the size class of the request if one of the
+ * first few does, else one of the next larger non-empty class, where every
+ * range fits.
+ *
+ * \returns The allocated range or NULL.
+ */
+struct mm_seg_node *mm_seg_alloc(struct mm_seg *seg, uint64_t size,
+                                 uint64_t alignment)
+{
+    if (size == 0)
+        return NULL;
+    size = round_up(size, seg->granule);
+    if (alignment < seg->granule)
+        alignment = seg->granule;
+    alignment = round_up(alignment, seg->granule);
+
+    // worst case padding, as every base is granule aligned
+    uint64_t need = size + alignment - seg->granule;
+    int c = floor_log2(need);
+
+    struct mm_seg_node *rest, *unused;
+    struct mm_seg_node *node = probe_class(seg->classes[c], size, alignment,
+                                           &rest);
+    if (node != NULL)
+        return carve(seg, node, size, alignment);
+
+    // every range in a higher class is at least 2^(c + 1) > need
+    uint64_t higher = c + 1 < MM_SEG_CLASSES ?
+                      seg->nonempty & ~(((uint64_t) 2 << c) - 1) : 0;
+    if (higher != 0) {
+        node = probe_class(seg->classes[__builtin_ctzll(higher)], size,
+                           alignment, &unused);
+        assert(node != NULL);
+        return carve(seg, node, size, alignment);
+    }
+
+    // last resort, the rest of the class
+    for (node = rest; node != NULL; node = node->class_next) {
+        if (fits(node, size, alignment))
+            return carve(seg, node, size, alignment);
+    }
+    return NULL;
+}
+
+/**
+ * \brief Find the range starting at base.
+ */
+struct mm_seg_node *mm_seg_lookup(struct mm_seg *seg, uint64_t base)
+{
+    struct mm_seg_node *node = tree_floor(seg->root, base);
+    return node != NULL && node->base == base ? node : NULL;
+}
+
+/**
+ * \brief Free an allocated range and merge it with free neighbours.
+ */
+void mm_seg_free(struct mm_seg *seg, struct mm_seg_node *node)
+{
+    assert(!node->free);
+    node->free = true;
+
+    struct mm_seg_node *next = node->next;
+    if (next != NULL && next->free && next->base == node->base + node->size) {
+        class_remove(seg, next);
+        node->size += next->size;
+        drop_range(seg, next);
+    }
+    struct mm_seg_node *prev = node->prev;
+    if (prev != NULL && prev->free && prev->base + prev->size == node->base) {
+        class_remove(seg, prev);
+        prev->size += node->size;
+        drop_range(seg, node);
+        node = prev;
+    }
+    class_insert(seg, node);
+}
+
+/**
+ * \brief Free all nodes of the allocator.
+ */
+void mm_seg_destroy(struct mm_seg *seg)
+{
+    struct mm_seg_node *node = seg->head;
+    while (node != NULL) {
+        struct mm_seg_node *next = node->next;
+        seg->node_free(seg->node_arg, node);
+        node = next;
+    }
+    mm_seg_init(seg, seg->granule, seg->node_alloc, seg->node_free,
+                seg->node_arg);
+}
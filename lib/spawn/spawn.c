@@ -35,21 +35,34 @@ static errval_t init_cspace(struct spawninfo *si)
 
     DBG(DETAILED, "2. Create RAM caps for SLOT_BASE_PAGE_CN");
     // Give the SLOT_BASE_PAGE_CN some memory by iterating over all L2 slots.
+    // The copies and the deletes of our caps go into the kernel in batches.
+    struct cap_batch batch;
+    cap_batch_init(&batch);
+    struct capref memory[CAP_BATCH_MAX_OPS / 2];
+    size_t pending = 0;
     struct capref rootcn_slot_base_page_cn = {
         .cnode = si->l2_cnode_list[ROOTCN_SLOT_BASE_PAGE_CN]};
     for (rootcn_slot_base_page_cn.slot = 0;
          rootcn_slot_base_page_cn.slot < L2_CNODE_SLOTS;
          rootcn_slot_base_page_cn.slot++) {
-        struct capref memory;
-
         // Allocate the memory.
-        CHECK(ram_alloc(&memory, BASE_PAGE_SIZE));
+        CHECK(ram_alloc(&memory[pending], BASE_PAGE_SIZE));
 
         // Copy the memory capability into our SLOT_BASE_PAGE_CN slot.
-        CHECK(cap_copy(rootcn_slot_base_page_cn, memory));
-
-        // Cleanup. Destroy the memory capability again.
-        CHECK(cap_destroy(memory));
+        CHECK(cap_batch_copy(&batch, rootcn_slot_base_page_cn,
+                             memory[pending]));
+        pending++;
+        if (pending < ARRAY_LENGTH(memory) &&
+            rootcn_slot_base_page_cn.slot < L2_CNODE_SLOTS - 1)
+            continue;
+
+        // Cleanup. Destroy the memory capabilities again.
+        for (size_t i = 0; i < pending; i++)
+            CHECK(cap_batch_delete(&batch, memory[i]));
+        CHECK(cap_batch_run(&batch));
+        for (size_t i = 0; i < pending; i++)
+            CHECK(slot_free(memory[i]));
+        pending = 0;
     }
 
     return SYS_ERR_OK;
@@ -99,12 +112,6 @@ static errval_t init_dispatcher(struct spawninfo *si)
     DBG(DETAILED, " Create the dispatcher.\n");
     CHECK(dispatcher_create(si->dispatcher));
 
-    DBG(DETAILED, " Set an endpoint for the dispatcher.\n");
-    struct capref dispatcher_end;
-    CHECK(slot_alloc(&dispatcher_end));
-    CHECK(
-        cap_retype(dispatcher_end, si->dispatcher, 0, ObjType_EndPoint, 0, 1));
-
     DBG(DETAILED, " Create a memory frame for the dispatcher.\n");
     size_t retsize;
     struct capref dispatcher_memframe;
@@ -113,31 +120,44 @@ static errval_t init_dispatcher(struct spawninfo *si)
     if (retsize != DISPATCHER_SIZE)
         return LIB_ERR_NO_SIZE_MATCH;
 
+    // The endpoint and the copies into the new cspace take a single system
+    // call.
+    struct cap_batch batch;
+    cap_batch_init(&batch);
+
+    DBG(DETAILED, " Set an endpoint for the dispatcher.\n");
+    struct capref dispatcher_end;
+    CHECK(slot_alloc(&dispatcher_end));
+    CHECK(cap_batch_retype(&batch, dispatcher_end, si->dispatcher, 0,
+                           ObjType_EndPoint, 0, 1));
+
     DBG(DETAILED, " Copy the dispatcher into the spawned process's VSpace.\n");
     struct capref spawned_dispatcher = {
         .cnode = si->l2_cnode_list[ROOTCN_SLOT_TASKCN],
         .slot = TASKCN_SLOT_DISPATCHER};
-    CHECK(cap_copy(spawned_dispatcher, si->dispatcher));
+    CHECK(cap_batch_copy(&batch, spawned_dispatcher, si->dispatcher));
 
     DBG(DETAILED, " Copy the endpoint into the spawned process's VSpace.\n");
     struct capref spawned_endpoint = {
         .cnode = si->l2_cnode_list[ROOTCN_SLOT_TASKCN],
         .slot = TASKCN_SLOT_SELFEP};
-    CHECK(cap_copy(spawned_endpoint, dispatcher_end));
+    CHECK(cap_batch_copy(&batch, spawned_endpoint, dispatcher_end));
 
     DBG(DETAILED, " Create the endpoint to the init process in the spawned "
                   "process' CSpace\n");
     struct capref init_endpoint = {.cnode =
                                        si->l2_cnode_list[ROOTCN_SLOT_TASKCN],
                                    .slot = TASKCN_SLOT_INITEP};
-    CHECK(cap_copy(init_endpoint, cap_initep));
+    CHECK(cap_batch_copy(&batch, init_endpoint, cap_initep));
 
     DBG(DETAILED, " Copy the dispatcher's mem frame into the new "
                   "process's VSpace.\n");
     si->spawned_disp_memframe.cnode = si->l2_cnode_list[ROOTCN_SLOT_TASKCN];
     si->spawned_disp_memframe.slot = TASKCN_SLOT_DISPFRAME;
 
-    CHECK(cap_copy(si->spawned_disp_memframe, dispatcher_memframe));
+    CHECK(cap_batch_copy(&batch, si->spawned_disp_memframe,
+                         dispatcher_memframe));
+    CHECK(cap_batch_run(&batch));
 
     DBG(DETAILED, " Map the dispatcher's memory frame into the "
                   "current VSpace.\n");
@@ -301,7 +321,7 @@ static errval_t elf_alloc_sect_func(void *state, genvaddr_t base, size_t size,
                            NULL, NULL));
 
     struct paging_frame_node *new_node =
-        (struct paging_frame_node *) slab_alloc(
+        (struct paging_frame_node *) slab_cache_alloc(
             &((struct spawninfo *) state)->paging_state.slab_alloc);
     new_node->base_addr = (lvaddr_t) *ret;
     new_node->region_size = retsize;
@@ -321,18 +341,8 @@ __attribute__((unused)) static errval_t map_paging_state_to_child(struct paging_
 {
     struct capref frame;
     size_t ret;
-    size_t nodes = 0;
-    struct paging_frame_node *x = &st->free_vspace;
 
-    while (x->next != NULL) {
-        nodes++;
-        x = x->next;
-    }
-
-    CHECK(frame_alloc(&frame,
-                      sizeof(struct paging_state) +
-                          nodes * sizeof(struct paging_frame_node),
-                      &ret));
+    CHECK(frame_alloc(&frame, sizeof(struct paging_state), &ret));
     paging_map_fixed(st, PAGING_STATE_PADDR, frame, ret);
 
     void *our_side;
@@ -341,15 +351,11 @@ __attribute__((unused)) static errval_t map_paging_state_to_child(struct paging_
     struct paging_state *mapped_st = (struct paging_state *) our_side;
     *mapped_st = *st;
 
-    // We move past the paging_state in the memblock now and then map our nodes
-    struct paging_frame_node *mem =
-        (struct paging_frame_node *) &(mapped_st[1]);
-    x = &st->free_vspace;
-    while (x->next != NULL) {
-        *mem = *x;
-        x = x->next;
-        mem->next = &mem[1];
-    }
+    // The vspace trees live in our slabs, the child has to rebuild them from
+    // its own mappings.
+    mapped_st->free_vspace = NULL;
+    mapped_st->mappings = NULL;
+    mapped_st->free_vspace_first_used = false;
     return SYS_ERR_OK;
 }
 
@@ -450,7 +456,7 @@ errval_t spawn_load_by_name(char *binary_name, struct spawninfo *si)
                      (void *) si->allocated_sects->base_addr);
         struct paging_frame_node *prev = si->allocated_sects;
         si->allocated_sects = si->allocated_sects->next;
-        slab_free(&si->paging_state.slab_alloc, prev);
+        slab_cache_free(&si->paging_state.slab_alloc, prev);
     }
 
     return SYS_ERR_OK;
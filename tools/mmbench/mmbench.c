@@ -0,0 +1,432 @@
+/**
+ * \file
+ * \brief Host side benchmark of the lib/mm allocator backends
+ *
+ * Replays an allocation trace against the segregated backend (lib/mm's
+ * mm_seg.c, built as is) and against a model of the list backend, which
+ * does the same first fit walk and splitting as mm.c without the caps.
+ *
+ * A trace has one operation per line:
+ *     a <id> <bytes> <alignment>   allocate and name the result id
+ *     f <id>                       free the allocation named id
+ * Without a trace file a spawn/kill churn trace is generated.
+ *
+ * Usage: mmbench [-n operations] [-s seed] [trace]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <mm/mm_seg.h>
+
+#define PAGE            4096ULL
+#define MEM_BASE        0x80000000ULL
+#define MEM_SIZE        (1024ULL * 1024 * 1024)
+
+struct op {
+    char kind;
+    uint32_t id;
+    uint64_t bytes;
+    uint64_t alignment;
+};
+
+struct trace {
+    struct op *ops;
+    size_t count;
+    size_t capacity;
+    uint32_t max_id;
+};
+
+static void trace_push(struct trace *t, char kind, uint32_t id, uint64_t bytes,
+                       uint64_t alignment)
+{
+    if (t->count == t->capacity) {
+        t->capacity = t->capacity ? 2 * t->capacity : 4096;
+        t->ops = realloc(t->ops, t->capacity * sizeof(struct op));
+        if (t->ops == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    t->ops[t->count++] = (struct op) { kind, id, bytes, alignment };
+    if (id + 1 > t->max_id)
+        t->max_id = id + 1;
+}
+
+static void trace_read(struct trace *t, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        unsigned long id;
+        unsigned long long bytes, alignment;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "a %lu %llu %llu", &id, &bytes, &alignment) == 3) {
+            trace_push(t, 'a', id, bytes, alignment);
+        } else if (sscanf(line, "f %lu", &id) == 1) {
+            trace_push(t, 'f', id, 0, 0);
+        } else {
+            fprintf(stderr, "%s:%d: bad line\n", path, lineno);
+            exit(1);
+        }
+    }
+    fclose(f);
+}
+
+/// Processes come and go, each one allocating a handful of frames of
+/// mixed sizes (page tables, stacks, heap, ELF segments, the odd large and
+/// aligned buffer). Some allocations are long lived and pin the memory.
+/// There are at most LONG_LIVED of them, the oldest one is freed to make
+/// room, so the trace stays well within MEM_SIZE however long it runs.
+static void trace_generate(struct trace *t, size_t ops, unsigned int seed)
+{
+    enum { PROCS = 64, PER_PROC = 48, LONG_LIVED = 128 };
+    static uint32_t live[PROCS][PER_PROC];
+    static int nlive[PROCS];
+    static uint32_t pinned[LONG_LIVED];
+    size_t npinned = 0;
+    uint32_t next_id = 0;
+
+    srand(seed);
+    while (t->count < ops) {
+        int p = rand() % PROCS;
+        if (nlive[p] > 0 && rand() % 4 == 0) {
+            // kill, the process frees everything it has
+            for (int i = 0; i < nlive[p]; i++)
+                trace_push(t, 'f', live[p][i], 0, 0);
+            nlive[p] = 0;
+            continue;
+        }
+        if (nlive[p] == PER_PROC)
+            continue;
+        uint64_t bytes, alignment = PAGE;
+        int r = rand() % 100;
+        if (r < 50)
+            bytes = PAGE;
+        else if (r < 75)
+            bytes = PAGE * (1 + rand() % 16);
+        else if (r < 93)
+            bytes = PAGE * (16 + rand() % 240);
+        else if (r < 98)
+            bytes = (1 + rand() % 4) * 1024 * 1024;
+        else {
+            bytes = 1024 * 1024;
+            alignment = 1024 * 1024;
+        }
+        // a few allocations outlive their process
+        if (rand() % 50 == 0) {
+            size_t slot = npinned++ % LONG_LIVED;
+            if (npinned > LONG_LIVED)
+                trace_push(t, 'f', pinned[slot], 0, 0);
+            pinned[slot] = next_id;
+            trace_push(t, 'a', next_id++, bytes, alignment);
+            continue;
+        }
+        live[p][nlive[p]++] = next_id;
+        trace_push(t, 'a', next_id++, bytes, alignment);
+    }
+}
+
+/*
+ * Model of the list backend of lib/mm/mm.c.
+ */
+
+struct lnode {
+    uint64_t base, size;
+    bool free;
+    struct lnode *prev, *next;
+};
+
+struct list {
+    struct lnode *head;
+    uint64_t visited;
+};
+
+static struct lnode *lnode_new(uint64_t base, uint64_t size, bool free)
+{
+    struct lnode *n = malloc(sizeof(*n));
+    n->base = base;
+    n->size = size;
+    n->free = free;
+    return n;
+}
+
+static void list_insert_before(struct list *l, struct lnode *at,
+                               struct lnode *n)
+{
+    n->next = at;
+    n->prev = at->prev;
+    if (at->prev != NULL)
+        at->prev->next = n;
+    else
+        l->head = n;
+    at->prev = n;
+}
+
+static void list_insert_after(struct lnode *at, struct lnode *n)
+{
+    n->prev = at;
+    n->next = at->next;
+    if (at->next != NULL)
+        at->next->prev = n;
+    at->next = n;
+}
+
+static void list_unlink(struct list *l, struct lnode *n)
+{
+    if (n->prev != NULL)
+        n->prev->next = n->next;
+    else
+        l->head = n->next;
+    if (n->next != NULL)
+        n->next->prev = n->prev;
+    free(n);
+}
+
+static void *list_alloc(struct list *l, uint64_t size, uint64_t alignment)
+{
+    for (struct lnode *n = l->head; n != NULL; n = n->next) {
+        l->visited++;
+        uint64_t dif = n->base % alignment ? alignment - n->base % alignment
+                                           : 0;
+        if (!n->free || size + dif > n->size)
+            continue;
+        if (dif > 0) {
+            list_insert_before(l, n, lnode_new(n->base, dif, true));
+            n->base += dif;
+            n->size -= dif;
+        }
+        if (n->size > size) {
+            list_insert_after(n, lnode_new(n->base + size, n->size - size,
+                                           true));
+            n->size = size;
+        }
+        n->free = false;
+        return n;
+    }
+    return NULL;
+}
+
+static void list_free(struct list *l, uint64_t base)
+{
+    struct lnode *n = l->head;
+    while (n != NULL && n->base != base) {
+        l->visited++;
+        n = n->next;
+    }
+    if (n == NULL || n->free) {
+        fprintf(stderr, "list: bad free of 0x%llx\n",
+                (unsigned long long) base);
+        exit(1);
+    }
+    n->free = true;
+    if (n->next != NULL && n->next->free) {
+        n->size += n->next->size;
+        list_unlink(l, n->next);
+    }
+    if (n->prev != NULL && n->prev->free) {
+        n->prev->size += n->size;
+        list_unlink(l, n);
+    }
+}
+
+/*
+ * Segregated backend.
+ */
+
+static struct mm_seg_node *seg_node_alloc(void *arg)
+{
+    return malloc(sizeof(struct mm_seg_node));
+}
+
+static void seg_node_free(void *arg, struct mm_seg_node *node)
+{
+    free(node);
+}
+
+/*
+ * Replay.
+ */
+
+struct result {
+    double seconds;
+    size_t failed;
+    size_t first_failed;    ///< index of the first failed operation
+    size_t free_ranges;
+    uint64_t free_bytes;
+    uint64_t largest_free;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t page_round(uint64_t x)
+{
+    return (x + PAGE - 1) / PAGE * PAGE;
+}
+
+static uint64_t align_round(uint64_t alignment)
+{
+    return alignment < PAGE ? PAGE : page_round(alignment);
+}
+
+static struct result replay_list(struct trace *t, uint64_t *visited)
+{
+    struct result res = { 0 };
+    struct list l = { .head = lnode_new(MEM_BASE, MEM_SIZE, true) };
+    l.head->prev = l.head->next = NULL;
+    uint64_t *bases = calloc(t->max_id, sizeof(uint64_t));
+
+    double start = now();
+    for (size_t i = 0; i < t->count; i++) {
+        struct op *op = &t->ops[i];
+        if (op->kind == 'a') {
+            struct lnode *n = list_alloc(&l, page_round(op->bytes),
+                                         align_round(op->alignment));
+            if (n == NULL && res.failed++ == 0)
+                res.first_failed = i;
+            bases[op->id] = n != NULL ? n->base : 0;
+        } else if (bases[op->id] != 0) {
+            list_free(&l, bases[op->id]);
+            bases[op->id] = 0;
+        }
+    }
+    res.seconds = now() - start;
+
+    for (struct lnode *n = l.head; n != NULL;) {
+        struct lnode *next = n->next;
+        if (n->free) {
+            res.free_ranges++;
+            res.free_bytes += n->size;
+            if (n->size > res.largest_free)
+                res.largest_free = n->size;
+        }
+        free(n);
+        n = next;
+    }
+    free(bases);
+    *visited = l.visited;
+    return res;
+}
+
+static struct result replay_seg(struct trace *t)
+{
+    struct result res = { 0 };
+    struct mm_seg seg;
+    mm_seg_init(&seg, PAGE, seg_node_alloc, seg_node_free, NULL);
+    mm_seg_add(&seg, MEM_BASE, MEM_SIZE);
+    struct mm_seg_node **nodes = calloc(t->max_id, sizeof(*nodes));
+
+    double start = now();
+    for (size_t i = 0; i < t->count; i++) {
+        struct op *op = &t->ops[i];
+        if (op->kind == 'a') {
+            nodes[op->id] = mm_seg_alloc(&seg, op->bytes, op->alignment);
+            if (nodes[op->id] == NULL && res.failed++ == 0)
+                res.first_failed = i;
+        } else if (nodes[op->id] != NULL) {
+            // look up by base like mm_free does
+            struct mm_seg_node *n = mm_seg_lookup(&seg, nodes[op->id]->base);
+            if (n != nodes[op->id]) {
+                fprintf(stderr, "seg: lookup of 0x%llx failed\n",
+                        (unsigned long long) nodes[op->id]->base);
+                exit(1);
+            }
+            mm_seg_free(&seg, n);
+            nodes[op->id] = NULL;
+        }
+    }
+    res.seconds = now() - start;
+
+    for (struct mm_seg_node *n = seg.head; n != NULL; n = n->next) {
+        if (n->next != NULL && n->base + n->size > n->next->base) {
+            fprintf(stderr, "seg: ranges overlap at 0x%llx\n",
+                    (unsigned long long) n->next->base);
+            exit(1);
+        }
+        if (n->free) {
+            res.free_ranges++;
+            res.free_bytes += n->size;
+            if (n->size > res.largest_free)
+                res.largest_free = n->size;
+        }
+    }
+    mm_seg_destroy(&seg);
+    free(nodes);
+    return res;
+}
+
+static void print_result(const char *name, struct trace *t, struct result *r)
+{
+    printf("%-5s %8.3f s %10.0f ops/s  free ranges %6zu  "
+           "free %5llu MB  largest %5llu MB  ",
+           name, r->seconds, t->count / r->seconds, r->free_ranges,
+           (unsigned long long) (r->free_bytes >> 20),
+           (unsigned long long) (r->largest_free >> 20));
+    if (r->failed == 0) {
+        printf("fragmentation %.3f\n",
+               r->free_bytes ? 1.0 - (double) r->largest_free / r->free_bytes
+                             : 0.0);
+    } else {
+        // the free space left over by an exhausted allocator says nothing
+        // about how well it packs
+        printf("fragmentation n/a\n");
+        printf("      %zu allocations failed, the first at operation %zu\n",
+               r->failed, r->first_failed);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t ops = 1000000;
+    unsigned int seed = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:s:")) != -1) {
+        switch (c) {
+        case 'n':
+            ops = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n operations] [-s seed] [trace]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    struct trace t = { 0 };
+    if (optind < argc)
+        trace_read(&t, argv[optind]);
+    else
+        trace_generate(&t, ops, seed);
+    printf("replaying %zu operations on %llu MB\n", t.count,
+           (unsigned long long) (MEM_SIZE >> 20));
+
+    uint64_t visited;
+    struct result list = replay_list(&t, &visited);
+    print_result("list", &t, &list);
+    printf("      %.1f nodes visited per operation\n",
+           (double) visited / t.count);
+    struct result seg = replay_seg(&t);
+    print_result("seg", &t, &seg);
+
+    free(t.ops);
+    return 0;
+}
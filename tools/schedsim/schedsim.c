@@ -0,0 +1,433 @@
+/**
+ * \file
+ * \brief Host side simulator of the RBED kernel scheduler
+ *
+ * Runs kernel/schedule_rbed.c, built as is, on a simulated clock in
+ * microseconds. The kernel is modelled with a periodic timer tick of one
+ * timeslice: the scheduler runs at every tick, whenever the running task
+ * blocks or yields, and whenever a blocked task is woken up.
+ *
+ * Real-time tasks have a job of `exec` microseconds per period that is due
+ * `deadline` microseconds after its release. They yield once the job is done.
+ * A job still unfinished at its deadline counts as a miss and is dropped.
+ * Best-effort tasks compute for `burst` microseconds, then block for `sleep`
+ * microseconds, like a dispatcher waiting for IPC. The wakeup goes through
+ * make_runnable() and schedule_now() like an LMP delivery. A sleep of 0 makes
+ * a CPU bound task.
+ *
+ * A trace has one task per line, times in microseconds:
+ *     h <start> <wcet> <period> <deadline> [exec]   hard real-time
+ *     s <start> <wcet> <period> <deadline> [exec]   soft real-time
+ *     b <start> <burst> <sleep> [weight]            best-effort
+ * exec defaults to wcet. Without a trace file a mixed workload is generated.
+ *
+ * Usage: schedsim [-t duration] [-q timeslice] [-s seed] [-v] [trace]
+ */
+
+/*
+ * Copyright (c) 2016, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "schedsim.h"
+
+#define MAX_TASKS       256
+
+struct task {
+    struct dcb dcb;                 ///< What the scheduler sees
+    char kind;                      ///< 'h', 's' or 'b'
+    systime_t start;
+    systime_t wcet, period, deadline, exec;
+    systime_t burst, sleep;
+    unsigned short weight;
+
+    bool started;
+    bool blocked;
+    systime_t wake;                 ///< Blocked best-effort task wakes up
+    systime_t work;                 ///< Left of the current job or burst
+    systime_t release;              ///< Release of the current job
+
+    systime_t cpu;
+    size_t jobs, misses;
+    size_t wakeups;
+    systime_t latency_sum, latency_max;
+};
+
+static struct task tasks[MAX_TASKS];
+static size_t ntasks;
+
+/*
+ * Kernel stand-ins.
+ */
+
+static struct kcb kcb;
+struct kcb *kcb_current = &kcb;
+struct dcb *dcb_current;
+systime_t kernel_timeslice = 10000;
+
+static systime_t sim_now;
+static jmp_buf sim_abort;
+static char abort_msg[256];
+
+systime_t systime_now(void)
+{
+    return sim_now;
+}
+
+void panic(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(abort_msg, sizeof(abort_msg), fmt, ap);
+    va_end(ap);
+    longjmp(sim_abort, 1);
+}
+
+/*
+ * Workload.
+ */
+
+static void task_add(struct task *t)
+{
+    if (ntasks == MAX_TASKS) {
+        fprintf(stderr, "too many tasks, at most %d\n", MAX_TASKS);
+        exit(1);
+    }
+    if (t->kind != 'b' && (t->wcet == 0 || t->period == 0 ||
+                           t->deadline == 0)) {
+        fprintf(stderr, "real-time task needs wcet, period and deadline\n");
+        exit(1);
+    }
+    if (t->kind != 'b' && t->exec == 0)
+        t->exec = t->wcet;
+    tasks[ntasks++] = *t;
+}
+
+static void trace_read(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        unsigned long long a, b, c, d, e;
+        struct task t = { 0 };
+        int n;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if ((line[0] == 'h' || line[0] == 's') &&
+            (n = sscanf(line + 1, "%llu %llu %llu %llu %llu",
+                        &a, &b, &c, &d, &e)) >= 4) {
+            t = (struct task) { .kind = line[0], .start = a, .wcet = b,
+                                .period = c, .deadline = d,
+                                .exec = n == 5 ? e : 0 };
+        } else if (line[0] == 'b' &&
+                   (n = sscanf(line + 1, "%llu %llu %llu %llu",
+                               &a, &b, &c, &d)) >= 3) {
+            t = (struct task) { .kind = 'b', .start = a, .burst = b,
+                                .sleep = c, .weight = n == 4 ? d : 0 };
+        } else {
+            fprintf(stderr, "%s:%d: bad line\n", path, lineno);
+            exit(1);
+        }
+        task_add(&t);
+    }
+    fclose(f);
+}
+
+/// A few periodic real-time tasks using about half the CPU, some
+/// best-effort tasks doing short bursts between IPC waits and a few CPU
+/// bound ones. Everything starts within the first 100 ms.
+static void trace_generate(unsigned int seed)
+{
+    srand(seed);
+    for (int i = 0; i < 5; i++) {
+        systime_t period = 1000 * (10 + rand() % 91);
+        // 10% each, the last two soft
+        struct task t = { .kind = i < 3 ? 'h' : 's',
+                          .start = rand() % 100000,
+                          .wcet = period / 10, .period = period,
+                          .deadline = period };
+        // real jobs mostly take less than their WCET
+        t.exec = t.wcet * (50 + rand() % 51) / 100;
+        task_add(&t);
+    }
+    for (int i = 0; i < 16; i++) {
+        struct task t = { .kind = 'b', .start = rand() % 100000,
+                          .burst = 100 + rand() % 1900,
+                          .sleep = i < 12 ? 1000 + rand() % 19000 : 0 };
+        task_add(&t);
+    }
+}
+
+/*
+ * Simulation.
+ */
+
+struct stats {
+    systime_t busy;
+    size_t decisions;
+    uint64_t ns_sum, ns_max;
+    size_t queue_sum, queue_max;
+};
+
+/// Static, so it is up to date when a panic jumps out of the simulation
+static struct stats stats;
+
+static inline struct task *task_of(struct dcb *dcb)
+{
+    return (struct task *) ((char *) dcb - offsetof(struct task, dcb));
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/// Starts and wakes up tasks and drops jobs past their deadline
+static void sim_events(void)
+{
+    for (size_t i = 0; i < ntasks; i++) {
+        struct task *t = &tasks[i];
+        if (!t->started) {
+            if (t->start > sim_now)
+                continue;
+            t->started = true;
+            t->dcb.type = t->kind == 'h' ? TASK_TYPE_HARD_REALTIME
+                        : t->kind == 's' ? TASK_TYPE_SOFT_REALTIME
+                                         : TASK_TYPE_BEST_EFFORT;
+            t->dcb.weight = t->weight;
+            if (t->kind == 'b') {
+                t->work = t->burst;
+            } else {
+                t->dcb.wcet = t->wcet;
+                t->dcb.period = t->period;
+                t->dcb.deadline = t->deadline;
+                t->dcb.release_time = sim_now;
+                t->release = sim_now;
+                t->work = t->exec;
+            }
+            make_runnable(&t->dcb);
+        }
+        if (t->blocked && t->wake <= sim_now) {
+            t->blocked = false;
+            t->work = t->burst;
+            t->wake = sim_now;
+            make_runnable(&t->dcb);
+            schedule_now(&t->dcb);
+        }
+        while (t->kind != 'b' && t->work > 0 &&
+               t->release + t->deadline <= sim_now) {
+            t->misses++;
+            t->release += t->period;
+            t->work = t->exec;
+        }
+    }
+}
+
+/// Time of the next tick, start or wakeup after now
+static systime_t sim_next_event(void)
+{
+    systime_t next = (sim_now / kernel_timeslice + 1) * kernel_timeslice;
+    for (size_t i = 0; i < ntasks; i++) {
+        struct task *t = &tasks[i];
+        if (!t->started && t->start < next)
+            next = t->start;
+        if (t->blocked && t->wake < next)
+            next = t->wake;
+    }
+    return next;
+}
+
+static void sim_run(systime_t duration, struct stats *st)
+{
+    while (sim_now < duration) {
+        sim_events();
+
+        size_t queued = 0;
+        for (struct dcb *d = kcb.queue_head; d != NULL; d = d->next)
+            queued++;
+        uint64_t start = now_ns();
+        struct dcb *next = schedule();
+        uint64_t ns = now_ns() - start;
+        st->decisions++;
+        st->ns_sum += ns;
+        st->ns_max = ns > st->ns_max ? ns : st->ns_max;
+        st->queue_sum += queued;
+        st->queue_max = queued > st->queue_max ? queued : st->queue_max;
+        dcb_current = next;
+
+        systime_t until = sim_next_event();
+        if (next == NULL) {
+            sim_now = until;
+            continue;
+        }
+
+        struct task *t = task_of(next);
+        if (t->kind != 'b' && (t->work == 0 || t->release > sim_now)) {
+            // the job is done already, the dispatcher yields right away
+            scheduler_yield(next);
+            continue;
+        }
+        if (t->wake != 0 && t->kind == 'b') {
+            systime_t latency = sim_now - t->wake;
+            t->wakeups++;
+            t->latency_sum += latency;
+            if (latency > t->latency_max)
+                t->latency_max = latency;
+            t->wake = 0;
+        }
+
+        bool cpu_bound = t->kind == 'b' && t->sleep == 0;
+        if (!cpu_bound && sim_now + t->work < until)
+            until = sim_now + t->work;
+        systime_t ran = until - sim_now;
+        sim_now = until;
+        t->cpu += ran;
+        st->busy += ran;
+        if (cpu_bound)
+            continue;
+        t->work -= ran;
+        if (t->work > 0)
+            continue;
+
+        if (t->kind == 'b') {
+            scheduler_remove(next);
+            t->blocked = true;
+            t->wake = sim_now + t->sleep;
+        } else {
+            t->jobs++;
+            t->release += t->period;
+            t->work = t->exec;
+            scheduler_yield(next);
+        }
+    }
+}
+
+static void print_results(systime_t duration, struct stats *st, bool verbose)
+{
+    static const char kinds[] = "hsb";
+    static const char *names[] = { "hard", "soft", "best-effort" };
+
+    printf("simulated %.3f s, timeslice %llu us, %zu tasks\n",
+           duration / 1e6, (unsigned long long) kernel_timeslice, ntasks);
+    printf("utilization %.1f%%  decisions %zu  schedule() avg %.0f ns "
+           "max %llu ns  queue length avg %.1f max %zu\n",
+           100.0 * st->busy / duration, st->decisions,
+           st->decisions ? (double) st->ns_sum / st->decisions : 0.0,
+           (unsigned long long) st->ns_max,
+           st->decisions ? (double) st->queue_sum / st->decisions : 0.0,
+           st->queue_max);
+
+    for (int k = 0; k < 3; k++) {
+        size_t n = 0, jobs = 0, misses = 0, wakeups = 0;
+        systime_t cpu = 0, lat_sum = 0, lat_max = 0;
+        for (size_t i = 0; i < ntasks; i++) {
+            struct task *t = &tasks[i];
+            if (t->kind != kinds[k])
+                continue;
+            n++;
+            cpu += t->cpu;
+            jobs += t->jobs;
+            misses += t->misses;
+            wakeups += t->wakeups;
+            lat_sum += t->latency_sum;
+            if (t->latency_max > lat_max)
+                lat_max = t->latency_max;
+        }
+        if (n == 0)
+            continue;
+        printf("%-11s %3zu tasks  cpu %5.1f%%", names[k], n,
+               100.0 * cpu / duration);
+        if (kinds[k] == 'b')
+            printf("  wakeups %7zu  latency avg %8.0f us max %8llu us\n",
+                   wakeups, wakeups ? (double) lat_sum / wakeups : 0.0,
+                   (unsigned long long) lat_max);
+        else
+            printf("  jobs %7zu  deadline misses %5zu\n", jobs, misses);
+    }
+
+    if (!verbose)
+        return;
+    for (size_t i = 0; i < ntasks; i++) {
+        struct task *t = &tasks[i];
+        printf("  %3zu %c cpu %5.1f%%", i, t->kind, 100.0 * t->cpu / duration);
+        if (t->kind == 'b')
+            printf("  burst %6llu sleep %7llu  wakeups %6zu latency max "
+                   "%8llu us\n", (unsigned long long) t->burst,
+                   (unsigned long long) t->sleep, t->wakeups,
+                   (unsigned long long) t->latency_max);
+        else
+            printf("  wcet %6llu period %7llu  jobs %6zu misses %5zu\n",
+                   (unsigned long long) t->wcet,
+                   (unsigned long long) t->period, t->jobs, t->misses);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    systime_t duration = 10000000;
+    unsigned int seed = 1;
+    bool verbose = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:q:s:v")) != -1) {
+        switch (c) {
+        case 't':
+            duration = strtoull(optarg, NULL, 0);
+            break;
+        case 'q':
+            kernel_timeslice = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t duration] [-q timeslice] "
+                    "[-s seed] [-v] [trace]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (kernel_timeslice == 0) {
+        fprintf(stderr, "timeslice must not be 0\n");
+        return 1;
+    }
+
+    if (optind < argc)
+        trace_read(argv[optind]);
+    else
+        trace_generate(seed);
+
+    int ret = 0;
+    if (setjmp(sim_abort) == 0) {
+        sim_run(duration, &stats);
+    } else {
+        printf("scheduler panic at %llu us: %s\n",
+               (unsigned long long) sim_now, abort_msg);
+        duration = sim_now > 0 ? sim_now : 1;
+        ret = 2;
+    }
+    print_results(duration, &stats, verbose);
+    return ret;
+}
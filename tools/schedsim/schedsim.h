@@ -0,0 +1,69 @@
+/**
+ * \file
+ * \brief Stand-ins for the kernel parts kernel/schedule_rbed.c uses
+ *
+ * The scheduler is built with SCHEDULER_SIMULATOR defined and this header
+ * forced in front of it, so only the fields it touches need to exist.
+ */
+
+/*
+ * Copyright (c) 2016, ETH Zurich.
+ * All rights reserved.
+ *
+ * This file is distributed under the terms in the attached LICENSE file.
+ * If you do not find this file, copies can be found by writing to:
+ * ETH Zurich D-INFK, Universitaetstr. 6, CH-8092 Zurich. Attn: Systems Group.
+ */
+
+#ifndef SCHEDSIM_H
+#define SCHEDSIM_H
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef uint64_t systime_t;
+
+enum task_type {
+    TASK_TYPE_BEST_EFFORT,
+    TASK_TYPE_SOFT_REALTIME,
+    TASK_TYPE_HARD_REALTIME
+};
+
+/// The RBED part of the kernel's struct dcb
+struct dcb {
+    struct dcb          *next, *prev;
+    systime_t           release_time, etime, last_dispatch;
+    systime_t           wcet, period, deadline;
+    unsigned short      weight;
+    enum task_type      type;
+    struct dcb          *heap_child, *heap_sibling, *heap_prev;
+    systime_t           heap_key, heap_key2;
+    uint64_t            heap_seq;
+    uint8_t             heap_id;
+};
+
+/// The RBED part of the kernel's struct kcb
+struct kcb {
+    struct dcb *queue_head, *queue_tail;
+    struct dcb *ready_heap, *release_heap;
+    uint64_t queue_seq;
+    unsigned int u_hrt, u_srt, w_be, n_be;
+};
+
+extern struct kcb *kcb_current;
+extern struct dcb *dcb_current;
+extern systime_t kernel_timeslice;
+
+systime_t systime_now(void);
+void panic(const char *fmt, ...)
+    __attribute__((noreturn, format(printf, 1, 2)));
+
+struct dcb *schedule(void);
+void schedule_now(struct dcb *dcb);
+void make_runnable(struct dcb *dcb);
+void scheduler_remove(struct dcb *dcb);
+void scheduler_yield(struct dcb *dcb);
+
+#endif // SCHEDSIM_H
@@ -15,7 +15,16 @@ enum urpc_type {
     init_mem_alloc,
     register_process,
     rpc_over_urpc,
-    rpc_perf_measurement
+    rpc_perf_measurement,
+    urpc_echo
+};
+
+// URPC channels between the two inits, created in this order on both cores.
+// Terminal and process registration traffic goes over the small priority
+// lane so it does not queue up behind bulk transfers.
+enum urpc_lane {
+    URPC_LANE_BULK = URPC2_DEFAULT_CHAN,
+    URPC_LANE_PRIORITY
 };
 
 // TODO: Maybe we can add the receiver ID to this, if we want to support faster
@@ -50,7 +59,8 @@ bool urpc_ram_is_initalized(void);
 // Returns a urpc2_data with the data field owned by this instance and needing
 // to be freed.
 struct urpc2_data urpc2_send_and_receive(struct urpc2_data (*func)(void *data),
-                                         void *payload, char type);
+                                         void *payload, char type,
+                                         enum urpc_lane lane);
 
 void urpc2_send_response(struct recv_list *rl, struct capref cap,
                          size_t payloadsize, void *payload);
@@ -64,7 +74,9 @@ inline void free_urpc_allocated_ack_recv_list(struct recv_list k)
     free(((char *) k.payload) - 2);
 }
 
-void urpc_perf_measurement(void *payload);
+// Runs the URPC latency and throughput benchmark against core 1 and prints
+// the results. Returns immediately, the benchmark runs in the URPC thread.
+void urpc_perf_measurement(void);
 
 domainid_t urpc_register_process(char *str);
 
@@ -11,10 +11,74 @@ struct urpc2_data {
     void *data;
 };
 
-void urpc2_init_and_run(void *sendbuffer, void *receivebuffer,
-                        void (*recv_handler)(struct urpc2_data *),
-                        void (*setup_func)(void));
+// A channel is a pair of rings, one per direction, each with its head and
+// tail index on cache lines of their own followed by the entries. Where the
+// rings live is up to the user (see lib_urpc.c for the frame layout).
+#define URPC2_CACHELINE         64
+#define URPC2_RING_ENTRIES      32
+// entries a side fills or drains before it publishes its index, so one
+// barrier covers a whole batch
+#define URPC2_PUBLISH_BATCH     8
+#define URPC2_RING_BYTES(entries)                                             \
+    (2 * URPC2_CACHELINE + (entries) * URPC2_CACHELINE)
+
+// Messages of at least this size skip the ring on channels with a payload
+// area. They are copied into the area once and the receiver's handler gets
+// them in place. An area is a cache line for the release index followed by
+// a power of two bytes of data.
+#define URPC2_SHARED_MIN_BYTES  2048
+#define URPC2_PAYLOAD_AREA_BYTES(bytes) (URPC2_CACHELINE + (bytes))
+
+#define URPC2_MAX_CHANS         4
+// channel urpc2_enqueue sends on, the first one created
+#define URPC2_DEFAULT_CHAN      0
+
+// How the urpc2 thread waits while all rings are idle. It first polls
+// spin_budget times in a tight loop, then polls once per thread_yield for
+// yield_budget rounds and after that sleeps, starting at sleep_min_us and
+// doubling up to sleep_max_us. Any progress puts it back into spinning.
+// urpc2_enqueue and urpc2_chan_enqueue end a sleep early, so the sleep only
+// delays messages from the other core.
+struct urpc2_wait_policy {
+    uint32_t spin_budget;
+    uint32_t yield_budget;
+    delayus_t sleep_min_us;
+    delayus_t sleep_max_us;
+};
+
+#define URPC2_WAIT_POLICY_DEFAULT                                             \
+    { .spin_budget = 256, .yield_budget = 64, .sleep_min_us = 1000,          \
+      .sleep_max_us = 8000 }
+
+struct urpc2_wait_stats {
+    uint64_t spin_hits;     ///< idle periods that ended while spinning
+    uint64_t backoff_hits;  ///< idle periods that ended after backing off
+    uint64_t yields;        ///< thread_yield calls while idle
+    uint64_t sleeps;        ///< barrelfish_usleep calls while idle
+};
+
+// Adds a channel and returns its number. entries must be a power of two and
+// both cores have to create their channels in the same order. Priority
+// channels are served before every round on the other channels.
+int urpc2_chan_create(void *sendbuffer, void *receivebuffer, uint32_t entries,
+                      void (*recv_handler)(struct urpc2_data *),
+                      bool priority);
+// Gives chan a payload area per direction. The areas must be zeroed before
+// either side uses them. Only call this before urpc2_run or from the setup
+// function.
+void urpc2_chan_attach_payload(int chan, void *send_area, void *recv_area,
+                               uint32_t bytes);
+// Turns the payload areas of chan on or off, for comparing the two paths.
+void urpc2_chan_use_payload(int chan, bool use);
+// Starts the urpc2 thread, which runs setup_func before it touches any ring.
+void urpc2_run(void (*setup_func)(void));
+void urpc2_chan_enqueue(int chan, struct urpc2_data (*func)(void *data),
+                        void *data);
 void urpc2_enqueue(struct urpc2_data (*func)(void *data), void *data);
+void urpc2_set_wait_policy(const struct urpc2_wait_policy *policy);
+void urpc2_get_wait_policy(struct urpc2_wait_policy *policy);
+void urpc2_get_wait_stats(struct urpc2_wait_stats *stats);
+void urpc2_reset_wait_stats(void);
 struct urpc2_data init_urpc2_data(char type, char id, size_t size_in_bytes,
                                   void *data);
 
@@ -288,7 +288,7 @@ errval_t procman_kill_process(domainid_t proc_id)
         // TODO: check why this blocks
         CHECK(send(pi->chan, NULL_CAP, RPC_MESSAGE(RPC_TYPE_PROCESS_KILL), 0,
                    NULL, NULL_EVENT_CLOSURE,
-                   request_fresh_id(RPC_TYPE_PROCESS_KILL)));
+                   request_fresh_id(pi->chan, RPC_MESSAGE(RPC_TYPE_PROCESS_KILL))));
     }
 
     // Deregister.
@@ -4,6 +4,7 @@
 #include <aos/aos.h>
 #include <aos/waitset.h>
 #include <aos/aos_rpc_shared.h>
+#include <barrelfish_kpi/asm_inlines_arch.h>
 
 #include <lib_rpc.h>
 #include <lib_urpc.h>
@@ -72,6 +73,62 @@ static errval_t ram_recv_handler(struct recv_list *data, struct lmp_chan *chan)
     DBG(DETAILED, "sent ram response\n");
     return SYS_ERR_OK;
 }
+// allocates up to count caps and copies them straight into the client's
+// cnode, which it sent along with the request
+static errval_t ram_batch_recv_handler(struct recv_list *data,
+                                       struct lmp_chan *chan)
+{
+    DBG(VERBOSE, "batched ram request received\n");
+
+    assert(data->size == 4);
+
+    size_t size = (size_t) data->payload[0];
+    size_t align = (size_t) data->payload[1];
+    cslot_t first = (cslot_t) data->payload[2];
+    size_t count = (size_t) data->payload[3];
+
+    struct cnoderef dest = build_cnoderef(data->cap, CNODE_TYPE_OTHER);
+    size_t done = 0;
+    while (done < count && first + done < L2_CNODE_SLOTS) {
+        struct capref ram_cap;
+        errval_t err = aos_ram_alloc_aligned(&ram_cap, size, align);
+        if (err_is_fail(err)) {
+            DEBUG_ERR(err, "batched ram request stopped after %zu caps", done);
+            break;
+        }
+        struct capref to = {
+            .cnode = dest,
+            .slot = first + done,
+        };
+        err = cap_copy(to, ram_cap);
+        if (err_is_fail(err)) {
+            DEBUG_ERR(err, "copying ram cap to the client");
+            // hand the range back to mm, which also destroys ram_cap and
+            // frees its slot. If mm refuses it, at least drop the slot.
+            err = aos_ram_free(ram_cap);
+            if (err_is_fail(err)) {
+                DEBUG_ERR(err, "returning the ram cap to mm");
+                err = cap_destroy(ram_cap);
+                if (err_is_fail(err)) {
+                    DEBUG_ERR(err, "freeing the ram cap's slot");
+                }
+            }
+            break;
+        }
+        // the client's copy is the only one we hand out
+        CHECK(cap_destroy(ram_cap));
+        done++;
+    }
+    CHECK(cap_destroy(data->cap));
+
+    if (size % BASE_PAGE_SIZE != 0) {
+        size += (size_t) BASE_PAGE_SIZE - (size % BASE_PAGE_SIZE);
+    }
+    uintptr_t reply[2] = { done, size };
+    CHECK(send_response(data, chan, NULL_CAP, 2, reply));
+    return SYS_ERR_OK;
+}
+
 static errval_t spawn_recv_handler(struct recv_list *data,
                                    struct lmp_chan *chan)
 {
@@ -336,6 +393,7 @@ static void handle_run_testsuite(void)
     init_testing(&t);
     register_memory_tests(&t);
     register_spawn_tests(&t);
+    register_rpc_tests(&t);
     tests_run(&t);
 }
 #include <aos/aos_rpc.h>
@@ -380,6 +438,44 @@ static void register_things_with_nameserver(void)
 }
 
 
+#define SPAWN_BENCH_MAX_ITERATIONS  32
+
+/**
+ * \brief Spawns hello with and without batched capability invocations and
+ * prints how long spawn_load_by_name takes on average.
+ *
+ * The hellos are registered like any other process and run once we are back
+ * in the event loop.
+ */
+static void spawn_bench(size_t iterations)
+{
+    iterations = MIN(MAX(iterations, 1), SPAWN_BENCH_MAX_ITERATIONS);
+    char name[] = "hello";
+
+    printf("%8s %6s %14s\n", "batched", "iters", "cycles/spawn");
+    for (int batched = 0; batched <= 1; batched++) {
+        cap_batch_set_enabled(batched);
+        uint64_t cycles = 0;
+        for (size_t i = 0; i < iterations; i++) {
+            struct spawninfo *si = malloc(sizeof(struct spawninfo));
+            assert(si != NULL);
+            reset_cycle_counter();
+            errval_t err = spawn_load_by_name(name, si);
+            cycles += get_cycle_count();
+            if (err_is_fail(err)) {
+                DEBUG_ERR(err, "spawn_bench: spawning %s", name);
+                free(si);
+                cap_batch_set_enabled(true);
+                return;
+            }
+            procman_register_process(name, disp_get_core_id(), si);
+        }
+        printf("%8s %6zu %14llu\n", batched ? "yes" : "no", iterations,
+               (unsigned long long) (cycles / iterations));
+    }
+    cap_batch_set_enabled(true);
+}
+
 void recv_deal_with_msg(struct recv_list *data)
 {
     // Check the message type and handle it accordingly.
@@ -418,6 +514,11 @@ void recv_deal_with_msg(struct recv_list *data)
                "we can not handle cap transfer across cores via urpc yet");
         CHECK(ram_recv_handler(data, chan));
         break;
+    case RPC_MESSAGE(RPC_TYPE_RAM_BATCH):
+        assert(chan != NULL &&
+               "we can not handle cap transfer across cores via urpc yet");
+        CHECK(ram_batch_recv_handler(data, chan));
+        break;
     case RPC_MESSAGE(RPC_TYPE_GET_MEM_SERVER):
         //send_response(data, chan, cap_selfep, 0, NULL);
         send_response(data, chan, init_chan.local_cap, 0, NULL);
@@ -447,6 +548,17 @@ void recv_deal_with_msg(struct recv_list *data)
             urpc2_rpc_over_urpc(data, NULL_CAP);
         }
         break;
+    case RPC_MESSAGE(RPC_TYPE_BENCH_SINK):
+        send_response(data, chan, NULL_CAP, 0, NULL);
+        break;
+    case RPC_MESSAGE(RPC_TYPE_URPC_BENCH):
+        urpc_perf_measurement();
+        send_response(data, chan, NULL_CAP, 0, NULL);
+        break;
+    case RPC_MESSAGE(RPC_TYPE_SPAWN_BENCH):
+        spawn_bench(data->payload[0]);
+        send_response(data, chan, NULL_CAP, 0, NULL);
+        break;
     case RPC_MESSAGE(RPC_TYPE_GETCHAR):
         getchar_recv_handler(data, chan);
         break;
@@ -564,14 +676,12 @@ static errval_t handshake_recv_handler(unsigned int id,struct capref *child_cap)
         CHECK(debug_cap_identify(*child_cap, &identification_cap));
         dom->identification_cap = identification_cap;
 
-        CHECK(lmp_chan_accept(&dom->chan, DEFAULT_LMP_BUF_WORDS, *child_cap));
+        CHECK(lmp_chan_accept(&dom->chan, RPC_LMP_BUF_WORDS, *child_cap));
 
         DBG(DETAILED, "Created new channel\n");
         // We register recv on new channel.
         struct recv_chan *rc = malloc(sizeof(struct recv_chan));
-        rc->chan = &dom->chan;
-        rc->recv_deal_with_msg = recv_deal_with_msg;
-        rc->rpc_recv_list = NULL;
+        recv_chan_init(rc, &dom->chan, recv_deal_with_msg);
         lmp_chan_alloc_recv_slot(rc->chan);
 
         CHECK(lmp_chan_register_recv(rc->chan, get_default_waitset(),
@@ -41,13 +41,20 @@
         for (thread_mutex_lock(&_mut); _mutx != NULL;                         \
              _mutx = NULL, thread_mutex_unlock(&_mut))
 
-enum urpc_state { non_initalized = 0, needs_to_be_read, available };
+enum urpc_state {
+    non_initalized = 0,
+    needs_to_be_read,
+    available,
+    rings_ready
+};
 
 struct urpc_bootinfo_package {
     struct bootinfo boot_info;
     struct mem_region regions[20];
     genpaddr_t mmstrings_base;
     gensize_t mmstrings_size;
+    genpaddr_t payload_base;
+    gensize_t payload_size;
 };
 
 struct urpc_send_string {
@@ -83,20 +90,233 @@ struct urpc_protocol {
     struct urpc slave_data;
 };
 
+// Frame layout: the first cache line holds the handshake state bytes (the
+// rest of struct urpc_protocol overlaps the rings and is only used before
+// they are set up), then the ring pair of the bulk lane and then the smaller
+// pair of the priority lane. In each pair the master sends on the first ring.
+#define URPC_PRIO_ENTRIES           8
+#define URPC_BULK_RING(n)                                                     \
+    (URPC2_CACHELINE + (n) * URPC2_RING_BYTES(URPC2_RING_ENTRIES))
+#define URPC_PRIO_RING(n)                                                     \
+    (URPC_BULK_RING(2) + (n) * URPC2_RING_BYTES(URPC_PRIO_ENTRIES))
+#define URPC_FRAME_USED             URPC_PRIO_RING(2)
+
+STATIC_ASSERT(URPC_FRAME_USED <= MON_URPC_SIZE,
+              "urpc rings do not fit the urpc frame");
+
+// Large messages on the bulk lane go through a separate frame with one
+// payload area per direction, the master sends through the first one. The
+// master allocates it and passes it on with the boot info.
+#define URPC_PAYLOAD_BYTES          (16 * 1024 * 1024)
+#define URPC_PAYLOAD_AREA(n)                                                  \
+    ((n) * URPC2_PAYLOAD_AREA_BYTES(URPC_PAYLOAD_BYTES))
+#define URPC_PAYLOAD_FRAME_SIZE                                               \
+    ROUND_UP(URPC_PAYLOAD_AREA(2), BASE_PAGE_SIZE)
+
+static char *urpc_payload_vaddr;
+static genpaddr_t urpc_payload_base;
+
+/// URPC benchmark, driven by core 0. First URPC_PERF_LATENCY_ROUNDS single
+/// entry round trips, then for every size a batch of messages is streamed to
+/// core 1, which answers each of them with a short reply. Last, echoes are
+/// bounced off core 1 while a bulk stream is running, once on the priority
+/// lane and once on the bulk lane behind the stream.
+#define URPC_PERF_LATENCY_ROUNDS    1000
+#define URPC_PERF_MIN_SIZE          64
+#define URPC_PERF_MAX_SIZE          (16 * 1024 * 1024)
+// sizes the ring only path is measured at for comparison
+#define URPC_PERF_RING_MIN_SIZE     (4 * 1024)
+#define URPC_PERF_RING_MAX_SIZE     (1024 * 1024)
+#define URPC_PERF_STREAM_BYTES      (4 * 1024 * 1024)
+#define URPC_PERF_ECHO_ROUNDS       100
+#define URPC_PERF_ECHO_SIZE         (64 * 1024)
+#define URPC_PERF_ECHO_MESSAGES     64
+
+struct urpc_perf_state {
+    bool running;
+    bool latency;       ///< in the latency phase
+    size_t size;        ///< message size of the current phase
+    int iterations;     ///< messages sent in the current phase
+    int outstanding;    ///< replies still expected in the current phase
+    int *buf;           ///< payload, the first int is the size
+    bool ring_only;     ///< payload area turned off for comparison
+
+    int echo_lane;      ///< lane of the echo phase, -1 outside of it
+    int echo_left;      ///< echoes still to be sent
+    bool echo_in_flight;
+    uint32_t echo_sent; ///< cycle count when the last echo was sent
+    uint64_t echo_total;
+    uint32_t echo_max;
+    int echo_samples;
+};
+
+static struct urpc_perf_state urpc_perf;
+
+// echo payload, the lane to answer on
+static char urpc_lanes[] = { URPC_LANE_BULK, URPC_LANE_PRIORITY };
+
 /// Performance measurement function.
 static struct urpc2_data perf_func(void *data)
 {
     int *str = (int *) data;
-    debug_printf("size to send: %d on core %u\n", *str,
-                 (unsigned int) disp_get_core_id());
-    reset_cycle_counter();
     return init_urpc2_data(rpc_perf_measurement, TODO_ID, *str, str);
 }
 
-/// Performance measurement call for URPC.
-void urpc_perf_measurement(void *payload)
+static struct urpc2_data echo_func(void *data)
+{
+    return init_urpc2_data(urpc_echo, TODO_ID, 1, data);
+}
+
+static void urpc_perf_start_phase(size_t size, int iterations, bool latency)
+{
+    urpc_perf.size = size;
+    urpc_perf.iterations = iterations;
+    urpc_perf.outstanding = iterations;
+    urpc_perf.latency = latency;
+    urpc_perf.buf[0] = size;
+    reset_cycle_counter();
+    // the latency phase has a single message in flight, the throughput
+    // phases stream the whole batch
+    for (int i = 0; i < (latency ? 1 : iterations); i++)
+        urpc2_enqueue(perf_func, urpc_perf.buf);
+}
+
+static void urpc_perf_send_echo(void)
+{
+    urpc_perf.echo_left--;
+    urpc_perf.echo_in_flight = true;
+    urpc_perf.echo_sent = get_cycle_count();
+    urpc2_chan_enqueue(urpc_perf.echo_lane, echo_func,
+                       &urpc_lanes[urpc_perf.echo_lane]);
+}
+
+static void urpc_perf_start_echo(int lane)
+{
+    urpc_perf.echo_lane = lane;
+    urpc_perf.echo_left = URPC_PERF_ECHO_ROUNDS;
+    urpc_perf.echo_total = 0;
+    urpc_perf.echo_max = 0;
+    urpc_perf.echo_samples = 0;
+    urpc_perf_start_phase(URPC_PERF_ECHO_SIZE, URPC_PERF_ECHO_MESSAGES,
+                          false);
+    urpc_perf_send_echo();
+}
+
+static void urpc_perf_finish(void)
+{
+    struct urpc2_wait_stats stats;
+    urpc2_get_wait_stats(&stats);
+    printf("urpc idle waits: %llu spin hits, %llu backoff hits, "
+           "%llu yields, %llu sleeps\n",
+           (unsigned long long) stats.spin_hits,
+           (unsigned long long) stats.backoff_hits,
+           (unsigned long long) stats.yields,
+           (unsigned long long) stats.sleeps);
+    free(urpc_perf.buf);
+    urpc_perf.echo_lane = -1;
+    urpc_perf.running = false;
+}
+
+// The echo phase ends once the bulk stream is through and the last echo is
+// back.
+static void urpc_perf_echo_check_done(void)
+{
+    if (urpc_perf.outstanding > 0 || urpc_perf.echo_in_flight)
+        return;
+
+    printf("urpc echo on %s lane during bulk transfer: %d samples, "
+           "avg %u cycles, max %u cycles\n",
+           urpc_perf.echo_lane == URPC_LANE_PRIORITY ? "priority" : "bulk",
+           urpc_perf.echo_samples,
+           (unsigned int) (urpc_perf.echo_total /
+                           MAX(urpc_perf.echo_samples, 1)),
+           (unsigned int) urpc_perf.echo_max);
+    if (urpc_perf.echo_lane == URPC_LANE_PRIORITY)
+        urpc_perf_start_echo(URPC_LANE_BULK);
+    else
+        urpc_perf_finish();
+}
+
+/// Core 0 side, called for every echo core 1 bounced back.
+static void urpc_perf_echo_reply(void)
+{
+    if (!urpc_perf.running || urpc_perf.echo_lane < 0)
+        return;
+    uint32_t cycles = get_cycle_count() - urpc_perf.echo_sent;
+    urpc_perf.echo_total += cycles;
+    urpc_perf.echo_max = MAX(urpc_perf.echo_max, cycles);
+    urpc_perf.echo_samples++;
+    urpc_perf.echo_in_flight = false;
+    // only echoes that overlap the stream count
+    if (urpc_perf.echo_left > 0 && urpc_perf.outstanding > 0)
+        urpc_perf_send_echo();
+    else
+        urpc_perf_echo_check_done();
+}
+
+/// Core 0 side, called for every reply of core 1.
+static void urpc_perf_reply(void)
+{
+    if (!urpc_perf.running)
+        return;
+    urpc_perf.outstanding--;
+    if (urpc_perf.echo_lane >= 0) {
+        urpc_perf_echo_check_done();
+        return;
+    }
+    if (urpc_perf.latency && urpc_perf.outstanding > 0) {
+        urpc2_enqueue(perf_func, urpc_perf.buf);
+        return;
+    }
+    if (urpc_perf.outstanding > 0)
+        return;
+
+    uint32_t cycles = get_cycle_count();
+    size_t next;
+    if (urpc_perf.latency) {
+        printf("urpc round trip latency: %u cycles\n",
+               (unsigned int) (cycles / urpc_perf.iterations));
+        next = URPC_PERF_MIN_SIZE;
+    } else {
+        uint64_t bytes = (uint64_t) urpc_perf.size * urpc_perf.iterations;
+        bool shared = !urpc_perf.ring_only &&
+                      urpc_perf.size >= URPC2_SHARED_MIN_BYTES;
+        printf("urpc throughput (%s): %8zu bytes x %4d: %u cycles/msg, "
+               "%llu KiB/s\n", shared ? "shared" : "ring  ", urpc_perf.size,
+               urpc_perf.iterations,
+               (unsigned int) (cycles / urpc_perf.iterations),
+               (unsigned long long) (bytes * (1200000000ULL / 1024) /
+                                     MAX(cycles, 1)));
+        next = urpc_perf.size * 4;
+    }
+    if (!urpc_perf.ring_only && next > URPC_PERF_MAX_SIZE) {
+        urpc_perf.ring_only = true;
+        urpc2_chan_use_payload(URPC_LANE_BULK, false);
+        next = URPC_PERF_RING_MIN_SIZE;
+    } else if (urpc_perf.ring_only && next > URPC_PERF_RING_MAX_SIZE) {
+        urpc_perf.ring_only = false;
+        urpc2_chan_use_payload(URPC_LANE_BULK, true);
+        urpc_perf_start_echo(URPC_LANE_PRIORITY);
+        return;
+    }
+    int iterations = MIN(256, MAX(4, (int) (URPC_PERF_STREAM_BYTES / next)));
+    urpc_perf_start_phase(next, iterations, false);
+}
+
+/// Performance measurement call for URPC, only does something on core 0.
+void urpc_perf_measurement(void)
 {
-    urpc2_enqueue(perf_func, payload);
+    if (disp_get_core_id() != 0 || urpc_perf.running)
+        return;
+    urpc_perf.buf = malloc(URPC_PERF_MAX_SIZE);
+    assert(urpc_perf.buf != NULL);
+    memset(urpc_perf.buf, 'x', URPC_PERF_MAX_SIZE);
+    urpc_perf.running = true;
+    urpc_perf.ring_only = false;
+    urpc_perf.echo_lane = -1;
+    urpc2_reset_wait_stats();
+    // 8 byte messages fit into a single ring entry
+    urpc_perf_start_phase(8, URPC_PERF_LATENCY_ROUNDS, true);
 }
 
 static void
@@ -143,6 +363,19 @@ recv_init_mem_alloc(__volatile struct urpc_bootinfo_package *bootinfo_package)
                               disp_get_core_id()));
         }
     }
+
+    // Map the payload frame of the bulk lane, slave_setup attaches it.
+    if (bootinfo_package->payload_size > 0 && urpc_payload_vaddr == NULL) {
+        struct capref payload_cap;
+        CHECK(slot_alloc(&payload_cap));
+        CHECK(frame_forge(payload_cap, bootinfo_package->payload_base,
+                          bootinfo_package->payload_size,
+                          disp_get_core_id()));
+        CHECK(paging_map_frame(get_current_paging_state(),
+                               (void **) &urpc_payload_vaddr,
+                               bootinfo_package->payload_size, payload_cap,
+                               NULL, NULL));
+    }
     already_received_memory = true;
 }
 
@@ -166,7 +399,8 @@ struct urpc_waiting_state {
 static struct urpc_waiting_state urpc_waiting_calls[255];
 
 struct urpc2_data urpc2_send_and_receive(struct urpc2_data (*func)(void *data),
-                                         void *payload, char type)
+                                         void *payload, char type,
+                                         enum urpc_lane lane)
 {
     uint32_t index = type;
 
@@ -186,7 +420,7 @@ struct urpc2_data urpc2_send_and_receive(struct urpc2_data (*func)(void *data),
     urpc_waiting_calls[index].waiting = true;
 
     // Do the request.
-    urpc2_enqueue(func, payload);
+    urpc2_chan_enqueue(lane, func, payload);
 
     // Wait for the answer.
     while (*waiting)
@@ -263,7 +497,7 @@ struct recv_list urpc2_rpc_over_urpc(struct recv_list *rl, struct capref cap)
         urpc2_rpc_send_helper2,
         urpc2_rpc_send_helper1(rl->type, rl->id, cap, rl->size * 4,
                                rl->payload),
-        rpc_over_urpc);
+        rpc_over_urpc, URPC_LANE_BULK);
     return recv_rpc_over_urpc(&ud);
 }
 
@@ -307,6 +541,7 @@ static void recv(__volatile struct urpc *data)
         break;
     case rpc_over_urpc:
     case rpc_perf_measurement:
+    case urpc_echo:
         assert(!"This shall be called nevermore\n");
     }
 }
@@ -335,30 +570,23 @@ static void recv_wrapper(struct urpc2_data *data)
             return;
         }
     }
-    if (data->type == rpc_perf_measurement) {
-        DBG(RELEASE, "received bytes: %u\n",
+    if (data->type == urpc_echo) {
+        if (disp_get_core_id() == 0) {
+            urpc_perf_echo_reply();
+        } else {
+            char lane = ((char *) data->data)[0];
+            assert(lane == URPC_LANE_BULK || lane == URPC_LANE_PRIORITY);
+            urpc2_chan_enqueue(lane, echo_func, &urpc_lanes[(int) lane]);
+        }
+    } else if (data->type == rpc_perf_measurement) {
+        DBG(DETAILED, "received bytes: %u\n",
             (unsigned int) data->size_in_bytes);
         if (disp_get_core_id() == 0) {
-            unsigned int k = get_cycle_count();
-            int j = ((int *) data->data)[1];
-            DBG(RELEASE, "URPC_PERFORMANCE_CYCLES: %u for datasize %d\n", k,
-                j);
-            if (j < 1024 * 1024 * 1) {
-                int *payload = malloc(1024 * 10 + j);
-                *payload = j + 10 * 1024;
-                DBG(RELEASE, "payload: %d\n", *payload);
-                urpc_perf_measurement((void *) payload);
-            }
+            urpc_perf_reply();
         } else {
-            struct anon {
-                int size;
-                int received_size;
-                char str[46];
-            };
-            struct anon *temp = malloc(54);
-            *temp = (struct anon){54, (int) data->size_in_bytes,
-                                  "just some ponies and stuff"};
-            urpc2_enqueue(perf_func, (void *) temp);
+            // every reply is the same, so they can share a buffer
+            static int reply[2] = { sizeof(reply), 0 };
+            urpc2_enqueue(perf_func, reply);
         }
     } else if (data->type != rpc_over_urpc) {
         assert(data->size_in_bytes < 2000);
@@ -431,6 +659,9 @@ static struct urpc2_data send_init_mem_alloc_func(void *data)
 
     urpc_bootinfo->mmstrings_base = mmstrings_id.base;
     urpc_bootinfo->mmstrings_size = mmstrings_id.bytes;
+    urpc_bootinfo->payload_base = urpc_payload_base;
+    urpc_bootinfo->payload_size =
+        urpc_payload_vaddr != NULL ? URPC_PAYLOAD_FRAME_SIZE : 0;
 
     return init_urpc2_data(init_mem_alloc, TODO_ID,
                            sizeof(struct urpc_bootinfo_package),
@@ -451,46 +682,69 @@ static void slave_setup(void)
         }
     }
 
+    if (urpc_payload_vaddr != NULL) {
+        urpc2_chan_attach_payload(URPC_LANE_BULK,
+                                  urpc_payload_vaddr + URPC_PAYLOAD_AREA(1),
+                                  urpc_payload_vaddr + URPC_PAYLOAD_AREA(0),
+                                  URPC_PAYLOAD_BYTES);
+    }
+
     // We clear it as a signal to the other side that it can go into the real
     // protocol now.
     urpc_protocol->slave_state = available;
 
     MEMORY_BARRIER;
+
+    // The handshake data overlaps the rings, the master clears them before
+    // we may use them.
+    while (urpc_protocol->slave_state != rings_ready)
+        MEMORY_BARRIER;
 }
 
 void urpc_slave_init_and_run(void)
 {
-    urpc2_init_and_run((void *) (MON_URPC_VBASE + (32 * 64)),
-                       (void *) MON_URPC_VBASE, recv_wrapper, slave_setup);
+    char *frame = (char *) MON_URPC_VBASE;
+    int lane;
+
+    lane = urpc2_chan_create(frame + URPC_BULK_RING(1),
+                             frame + URPC_BULK_RING(0), URPC2_RING_ENTRIES,
+                             recv_wrapper, false);
+    assert(lane == URPC_LANE_BULK);
+    lane = urpc2_chan_create(frame + URPC_PRIO_RING(1),
+                             frame + URPC_PRIO_RING(0), URPC_PRIO_ENTRIES,
+                             recv_wrapper, true);
+    assert(lane == URPC_LANE_PRIORITY);
+    urpc2_run(slave_setup);
 }
 
 void urpc_sendstring(char *str) { urpc2_enqueue(send_string_func, str); }
 
 void urpc_term_sendchar(char *c)
 {
-    urpc2_enqueue(term_sendchar_func, c);
+    urpc2_chan_enqueue(URPC_LANE_PRIORITY, term_sendchar_func, c);
 }
 
 void urpc_term_consume(void)
 {
-    urpc2_enqueue(term_consume_func, NULL);
+    urpc2_chan_enqueue(URPC_LANE_PRIORITY, term_consume_func, NULL);
 }
 
 void urpc_term_set_line_mode(void)
 {
-    urpc2_enqueue(term_line_mode_func, NULL);
+    urpc2_chan_enqueue(URPC_LANE_PRIORITY, term_line_mode_func, NULL);
 }
 
 void urpc_term_set_direct_mode(void)
 {
-    urpc2_enqueue(term_direct_mode_func, NULL);
+    urpc2_chan_enqueue(URPC_LANE_PRIORITY, term_direct_mode_func, NULL);
 }
 
 domainid_t urpc_register_process(char *str)
 {
     DBG(DETAILED, "send process register request for %s \n", str);
-    struct urpc2_data ud = urpc2_send_and_receive(send_register_process_func,
-                                                  str, register_process);
+    struct urpc2_data ud =
+        urpc2_send_and_receive(send_register_process_func, str,
+                               register_process, URPC_LANE_PRIORITY);
     DBG(DETAILED, "got answer to process register  request: %d\n",
         *((uint32_t *) ud.data));
     return *((uint32_t *) ud.data);
@@ -501,7 +755,8 @@ static void urpc_register_process_reply(domainid_t *pid)
     DBG(DETAILED, "send process pid %d\n", *pid);
     uint32_t *per_pid = malloc(sizeof(uint32_t));
     *per_pid = *pid;
-    urpc2_enqueue(send_register_process_reply_func, per_pid);
+    urpc2_chan_enqueue(URPC_LANE_PRIORITY, send_register_process_reply_func,
+                       per_pid);
 }
 
 void urpc_init_mem_alloc(struct bootinfo *p_bi)
@@ -543,13 +798,63 @@ static void master_setup(void)
     while (urpc_protocol->slave_state != available)
         MEMORY_BARRIER;
 
+    // The state bytes live in the first cache line, the rings after it.
+    memset((char *) slave_page_urpc_vaddr + URPC2_CACHELINE, 0,
+           URPC_FRAME_USED - URPC2_CACHELINE);
+    MEMORY_BARRIER;
+    urpc_protocol->slave_state = rings_ready;
+    MEMORY_BARRIER;
+
     free(data.data);
 }
 
+// Allocates and maps the payload frame of the bulk lane. The bulk lane
+// works without it, so failing here is not fatal.
+static void urpc_payload_create(void)
+{
+    struct capref frame;
+    struct frame_identity id;
+    size_t retsize;
+    errval_t err;
+
+    err = frame_alloc(&frame, URPC_PAYLOAD_FRAME_SIZE, &retsize);
+    if (err_is_fail(err)) {
+        DEBUG_ERR(err, "no urpc payload frame, large messages use the ring");
+        return;
+    }
+    CHECK(frame_identify(frame, &id));
+    CHECK(paging_map_frame(get_current_paging_state(),
+                           (void **) &urpc_payload_vaddr,
+                           URPC_PAYLOAD_FRAME_SIZE, frame, NULL, NULL));
+    urpc_payload_base = id.base;
+    // only the release indices have to start out zeroed
+    memset(urpc_payload_vaddr + URPC_PAYLOAD_AREA(0), 0, URPC2_CACHELINE);
+    memset(urpc_payload_vaddr + URPC_PAYLOAD_AREA(1), 0, URPC2_CACHELINE);
+}
+
 void urpc_master_init_and_run(void *urpc_vaddr)
 {
     // XXX: Ugly hack.
     slave_page_urpc_vaddr = urpc_vaddr;
-    urpc2_init_and_run(urpc_vaddr, urpc_vaddr + (32 * 64), recv_wrapper,
-                       master_setup);
+
+    char *frame = urpc_vaddr;
+    int lane;
+
+    lane = urpc2_chan_create(frame + URPC_BULK_RING(0),
+                             frame + URPC_BULK_RING(1), URPC2_RING_ENTRIES,
+                             recv_wrapper, false);
+    assert(lane == URPC_LANE_BULK);
+    lane = urpc2_chan_create(frame + URPC_PRIO_RING(0),
+                             frame + URPC_PRIO_RING(1), URPC_PRIO_ENTRIES,
+                             recv_wrapper, true);
+    assert(lane == URPC_LANE_PRIORITY);
+
+    urpc_payload_create();
+    if (urpc_payload_vaddr != NULL) {
+        urpc2_chan_attach_payload(URPC_LANE_BULK,
+                                  urpc_payload_vaddr + URPC_PAYLOAD_AREA(0),
+                                  urpc_payload_vaddr + URPC_PAYLOAD_AREA(1),
+                                  URPC_PAYLOAD_BYTES);
+    }
+    urpc2_run(master_setup);
 }
@@ -2,23 +2,15 @@
 #include <stdlib.h>
 
 #include <aos/aos.h>
+#include <aos/deferred.h>
+#include <aos/static_assert.h>
+#include <aos/waitset_chan.h>
+#include <barrelfish_kpi/init.h>
 
 #include <lib_urpc2.h>
 
-// XXX: WARNING! USE THIS WITH CAUTION. Preliminary returns will NOT return
-// the lock, control flow with 'continue' and 'break' might work differently
-// than expected inside of synchronized blocks, and nested synchronized blocks
-// can cause massive trouble. Be aware of that when using synchronized here!
-#define synchronized(_mut)                                                    \
-    for (struct thread_mutex *_mutx = &_mut; _mutx != NULL; _mutx = NULL)     \
-        for (thread_mutex_lock(&_mut); _mutx != NULL;                         \
-             _mutx = NULL, thread_mutex_unlock(&_mut))
-
-static struct thread_mutex urpc2_thread_mutex;
-
 // Protocol:
 // Flags is 8 bits as follows:
-#define MSG_WAITING 1
 #define MSG_BEGIN_BLOCK 2
 #define MSG_END_BLOCK 4
 #define MSG_HAS_SIZE_INT32 8
@@ -26,29 +18,56 @@ static struct thread_mutex urpc2_thread_mutex;
     16 // this will have to suffice, as INT128 is annoying to emulate.
        // Otherwise we could do 24 as INT128. But 8 yottabyte should be
        // sufficiently large anyway.
-
-#define RINGSIZE 32
+#define MSG_SHARED_PAYLOAD 32 // single entry, payload is in the shared area
 
 struct ringbuffer_entry {
     char flags;
     char entry[63];
 };
 
-enum urpc2_states { BUFFER_FULL, BUFFER_EMPTY, DONE_WITH_TASK, WORKING };
+// Single producer, single consumer ring. The indices are free running, an
+// entry is full iff it lies in [tail, head). Each index is only ever written
+// by one side and sits on a cache line of its own, so the cores don't fight
+// over lines. The number of entries is a power of two chosen per channel.
+struct urpc2_ring {
+    __volatile uint32_t head; // written by the producer
+    char pad0[URPC2_CACHELINE - sizeof(uint32_t)];
+    __volatile uint32_t tail; // written by the consumer
+    char pad1[URPC2_CACHELINE - sizeof(uint32_t)];
+    struct ringbuffer_entry entries[];
+};
 
-// 2 * 32 * 64 = 4kb of ringbuffer.
-// Partitioned in two because we generally have two way communication.
-// TODO: Consider a better split based on expectation of being the sender or
-// the receiver of large quantities of data. Or wether a split really makes
-// things simpler at all.
-int current_send = 0;
-int current_receive = 0;
+STATIC_ASSERT(sizeof(struct urpc2_ring) == URPC2_RING_BYTES(0),
+              "urpc2_ring layout");
+
+// Payload area of one direction. The sender copies large messages into data
+// and only sends a descriptor through the ring. Space is handed out in
+// message order, so the receiver releases it by advancing tail (a free
+// running byte count, like the ring indices) once the handler is done.
+struct urpc2_payload {
+    __volatile uint32_t tail; // written by the receiver
+    char pad0[URPC2_CACHELINE - sizeof(uint32_t)];
+    char data[];
+};
+
+STATIC_ASSERT(sizeof(struct urpc2_payload) == URPC2_PAYLOAD_AREA_BYTES(0),
+              "urpc2_payload layout");
 
-__volatile struct ringbuffer_entry *ringbufferSend;
-__volatile struct ringbuffer_entry *ringbufferReceive;
+// What a MSG_SHARED_PAYLOAD entry carries after its flags.
+struct urpc2_payload_desc {
+    uint32_t offset; // into the data of the payload area
+    uint32_t size;
+    uint32_t end;    // tail to publish once the message is consumed
+    char type;
+    char id;
+} __attribute__((packed));
 
-void (*urpc2_recv_handler)(struct urpc2_data *);
+enum urpc2_states { BUFFER_FULL, BUFFER_EMPTY, DONE_WITH_TASK, WORKING };
 
+// Lock-free queue of pending sends, many producers (any thread in init), one
+// consumer (the urpc2 thread). Producers swap themselves in at queue_head,
+// the consumer takes from queue_tail. The stub keeps the queue non-empty so
+// producers never touch the consumer's end.
 struct urpc2_send_queue {
     struct urpc2_data (*func)(void *rawdata);
     struct urpc2_data cachedata;
@@ -57,55 +76,237 @@ struct urpc2_send_queue {
     bool hasDataInit;
 };
 
-struct urpc2_send_queue *urpc_urpc2_send_queue = NULL;
-struct urpc2_send_queue *urpc_urpc2_send_queue_last = NULL;
+// One ring pair with everything the urpc2 thread keeps about it.
+struct urpc2_chan {
+    struct urpc2_ring *ringSend;
+    struct urpc2_ring *ringReceive;
+    uint32_t mask; // entries - 1
+
+    // Local copies of the indices. send_head/recv_tail run ahead of what we
+    // have published, the caches hold the last value we read from the other
+    // side.
+    uint32_t send_head;
+    uint32_t send_tail_cache;
+    uint32_t recv_tail;
+    uint32_t recv_head_cache;
+
+    void (*recv_handler)(struct urpc2_data *);
+    bool priority;
+
+    struct urpc2_send_queue queue_stub;
+    struct urpc2_send_queue *queue_head;
+    struct urpc2_send_queue *queue_tail;
+    struct urpc2_send_queue *sendobj; // message currently being sent
+
+    struct urpc2_data usd_store; // message currently being received
+    bool usd_store_used;
+
+    // shared payload areas, NULL if the channel has none
+    struct urpc2_payload *payloadSend;
+    struct urpc2_payload *payloadReceive;
+    uint32_t payload_mask;        // area bytes - 1
+    uint32_t payload_head;        // next free byte, free running
+    uint32_t payload_tail_cache;  // last tail read from the receiver
+    bool payload_enabled;
+};
 
-static void enqueue(struct urpc2_data (*func)(void *data), void *data)
+static struct urpc2_chan chans[URPC2_MAX_CHANS];
+// Channels are only ever added. The count is published after the channel is
+// set up, so the urpc2 thread can pick up channels created while it runs.
+static int chan_count = 0;
+
+static void queue_push(struct urpc2_chan *chan, struct urpc2_send_queue *new)
 {
-    synchronized(urpc2_thread_mutex)
-    {
-        struct urpc2_send_queue *new = malloc(sizeof(struct urpc2_send_queue));
-
-        new->func = func;
-        new->rawdata = data;
-        new->next = NULL;
-        new->hasDataInit = false;
-
-        if (urpc_urpc2_send_queue_last == NULL) {
-            assert(urpc_urpc2_send_queue == NULL);
-            urpc_urpc2_send_queue = new;
-            urpc_urpc2_send_queue_last = new;
-        } else {
-            urpc_urpc2_send_queue_last->next = new;
-            urpc_urpc2_send_queue_last = new;
-        }
+    __atomic_store_n(&new->next, NULL, __ATOMIC_RELAXED);
+    struct urpc2_send_queue *prev =
+        __atomic_exchange_n(&chan->queue_head, new, __ATOMIC_ACQ_REL);
+    // between the exchange and this store the consumer sees a gap, it just
+    // retries later in that case
+    __atomic_store_n(&prev->next, new, __ATOMIC_RELEASE);
+}
+
+// The urpc2 thread sleeps on a waitset of its own. A send queued by another
+// thread of init ends the sleep through wake_chan, only messages from the
+// other core wait for the timer.
+static struct waitset sleep_ws;
+static struct waitset_chanstate wake_chan;
+static bool sleep_over;
+static bool sleeping;
+
+static void urpc2_sleep_over(void *arg)
+{
+    sleep_over = true;
+}
+
+static void enqueue(struct urpc2_chan *chan,
+                    struct urpc2_data (*func)(void *data), void *data)
+{
+    struct urpc2_send_queue *new = malloc(sizeof(struct urpc2_send_queue));
+
+    new->func = func;
+    new->rawdata = data;
+    new->hasDataInit = false;
+    queue_push(chan, new);
+
+    if (__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST)) {
+        // fails harmlessly if a wakeup is already pending
+        waitset_chan_trigger_closure(&sleep_ws, &wake_chan,
+                                     MKCLOSURE(urpc2_sleep_over, NULL));
     }
 }
 
-static bool queue_empty(void)
+// Only called by the urpc2 thread. Returns NULL if the queue is empty or a
+// producer is halfway through queue_push.
+static struct urpc2_send_queue *dequeue(struct urpc2_chan *chan)
 {
-    bool status;
-    synchronized(urpc2_thread_mutex) status = urpc_urpc2_send_queue == NULL;
-    return status;
+    struct urpc2_send_queue *stub = &chan->queue_stub;
+    struct urpc2_send_queue *tail = chan->queue_tail;
+    struct urpc2_send_queue *next =
+        __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == stub) {
+        if (next == NULL)
+            return NULL;
+        chan->queue_tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        chan->queue_tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&chan->queue_head, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    // tail is the last element, put the stub behind it so we can take it
+    queue_push(chan, stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        chan->queue_tail = next;
+        return tail;
+    }
+    return NULL;
 }
 
-static struct urpc2_send_queue *dequeue(void)
+// makes the entries filled since the last call visible to the receiver
+static void publish_send(struct urpc2_chan *chan)
 {
-    struct urpc2_send_queue *fst;
-    synchronized(urpc2_thread_mutex)
-    {
-        assert(urpc_urpc2_send_queue != NULL);
+    if (chan->ringSend->head != chan->send_head) {
+        MEMORY_BARRIER;
+        chan->ringSend->head = chan->send_head;
+    }
+}
 
-        fst = urpc_urpc2_send_queue;
-        urpc_urpc2_send_queue = fst->next;
+// hands the entries consumed since the last call back to the sender
+static void publish_receive(struct urpc2_chan *chan)
+{
+    if (chan->ringReceive->tail != chan->recv_tail) {
+        MEMORY_BARRIER;
+        chan->ringReceive->tail = chan->recv_tail;
+    }
+}
 
-        if (urpc_urpc2_send_queue == NULL)
-            urpc_urpc2_send_queue_last = NULL;
+static bool send_full(struct urpc2_chan *chan)
+{
+    if (chan->send_head - chan->send_tail_cache <= chan->mask)
+        return false;
+    chan->send_tail_cache = chan->ringSend->tail;
+    MEMORY_BARRIER;
+    return chan->send_head - chan->send_tail_cache > chan->mask;
+}
+
+static bool receive_empty(struct urpc2_chan *chan)
+{
+    if (chan->recv_tail != chan->recv_head_cache)
+        return false;
+    chan->recv_head_cache = chan->ringReceive->head;
+    MEMORY_BARRIER;
+    return chan->recv_tail == chan->recv_head_cache;
+}
+
+// Reserves size bytes of contiguous space in the send payload area. Returns
+// false if it is currently taken, *fits tells whether it can ever fit.
+static bool payload_alloc(struct urpc2_chan *chan, size_t size,
+                          uint32_t *offset, uint32_t *end, bool *fits)
+{
+    uint32_t area = chan->payload_mask + 1;
+    uint32_t len = ROUND_UP(size, URPC2_CACHELINE);
+
+    *fits = len <= area;
+    if (!*fits)
+        return false;
+
+    // never wrap a message, skip to the start of the area instead
+    uint32_t pos = chan->payload_head & chan->payload_mask;
+    uint32_t skip = pos + len > area ? area - pos : 0;
+    if (chan->payload_head - chan->payload_tail_cache + skip + len > area) {
+        chan->payload_tail_cache = chan->payloadSend->tail;
+        MEMORY_BARRIER;
+        if (chan->payload_head - chan->payload_tail_cache + skip + len > area)
+            return false;
     }
-    return fst;
+    *offset = (chan->payload_head + skip) & chan->payload_mask;
+    chan->payload_head += skip + len;
+    *end = chan->payload_head;
+    return true;
+}
+
+// Sends data as a descriptor to a copy in the payload area. Returns WORKING
+// if the message has to go through the ring instead.
+static enum urpc2_states core_send_shared(struct urpc2_chan *chan,
+                                          struct urpc2_data *data)
+{
+    if (send_full(chan))
+        return BUFFER_FULL;
+
+    struct urpc2_payload_desc desc;
+    bool fits;
+    if (!payload_alloc(chan, data->size_in_bytes, &desc.offset, &desc.end,
+                       &fits)) {
+        return fits ? BUFFER_FULL : WORKING;
+    }
+    desc.size = data->size_in_bytes;
+    desc.type = data->type;
+    desc.id = data->id;
+    // made visible together with the entry by publish_send
+    memcpy(&chan->payloadSend->data[desc.offset], data->data, desc.size);
+
+    struct ringbuffer_entry *e =
+        &chan->ringSend->entries[chan->send_head & chan->mask];
+    e->flags = MSG_BEGIN_BLOCK | MSG_END_BLOCK | MSG_SHARED_PAYLOAD;
+    memcpy(e->entry, &desc, sizeof(desc));
+    data->index = data->size_in_bytes;
+    chan->send_head++;
+    if (chan->send_head % URPC2_PUBLISH_BATCH == 0)
+        publish_send(chan);
+    return DONE_WITH_TASK;
+}
+
+// Hands a MSG_SHARED_PAYLOAD entry to the handler straight from the payload
+// area and releases the space afterwards.
+static void core_recv_shared(struct urpc2_chan *chan,
+                             struct ringbuffer_entry *e,
+                             struct urpc2_data *data)
+{
+    struct urpc2_payload_desc desc;
+    memcpy(&desc, e->entry, sizeof(desc));
+    data->type = desc.type;
+    data->id = desc.id;
+    data->size_in_bytes = desc.size;
+    data->index = desc.size;
+    data->data = &chan->payloadReceive->data[desc.offset];
+
+    chan->recv_handler(data);
+    chan->recv_tail++;
+
+    MEMORY_BARRIER;
+    chan->payloadReceive->tail = desc.end;
 }
 
-static enum urpc2_states core_send(struct urpc2_data *data)
+// Sends data, using at most *budget ring entries. Returns WORKING if the
+// budget ran out before the message was complete.
+static enum urpc2_states core_send(struct urpc2_chan *chan,
+                                   struct urpc2_data *data, uint32_t *budget)
 {
     // we cut the highest bit to make sure we never run into issues with
     // overflow or stuff
@@ -113,120 +314,130 @@ static enum urpc2_states core_send(struct urpc2_data *data)
 
     enum urpc2_states state = WORKING;
 
+    if (*budget == 0)
+        return WORKING;
+    if (data->index == 0 && chan->payload_enabled &&
+        data->size_in_bytes >= URPC2_SHARED_MIN_BYTES) {
+        state = core_send_shared(chan, data);
+        if (state == DONE_WITH_TASK)
+            (*budget)--;
+        if (state != WORKING)
+            return state;
+    }
+
     do {
-        MEMORY_BARRIER;
         int index_in_buffer = 0;
-        if (ringbufferSend[current_send].flags & MSG_WAITING) {
+        if (*budget == 0) {
+            state = WORKING;
+            break;
+        }
+        if (send_full(chan)) {
             state = BUFFER_FULL;
             break;
         }
-        ringbufferSend[current_send].flags = 0;
+        struct ringbuffer_entry *e =
+            &chan->ringSend->entries[chan->send_head & chan->mask];
+        e->flags = 0;
         bool smallRem = false;
         char smallRemCount;
         if (data->index + 63 >= data->size_in_bytes &&
             (data->index > 0 || data->size_in_bytes <= 61)) {
-            ringbufferSend[current_send].flags |= MSG_END_BLOCK;
+            e->flags |= MSG_END_BLOCK;
             smallRem = true;
             smallRemCount = data->size_in_bytes - data->index;
         }
         if (data->index == 0) {
-            ringbufferSend[current_send].flags |= MSG_BEGIN_BLOCK;
+            e->flags |= MSG_BEGIN_BLOCK;
             if ((data->size_in_bytes > 61) &
                 (data->size_in_bytes < (((int64_t) 1) << 32))) {
-                ringbufferSend[current_send].flags |= MSG_HAS_SIZE_INT32;
+                e->flags |= MSG_HAS_SIZE_INT32;
                 uint32_t temp = (uint32_t) data->size_in_bytes;
-                memcpy(
-                    (void *) &(
-                        ringbufferSend[current_send].entry[index_in_buffer]),
-                    &temp, 4);
+                memcpy(&e->entry[index_in_buffer], &temp, 4);
                 index_in_buffer += 4;
             } else if (data->size_in_bytes >= (((int64_t) 1) << 32)) {
-                ringbufferSend[current_send].flags |= MSG_HAS_SIZE_INT64;
-                memcpy(
-                    (void *) &(
-                        ringbufferSend[current_send].entry[index_in_buffer]),
-                    &data->size_in_bytes, 8);
+                e->flags |= MSG_HAS_SIZE_INT64;
+                memcpy(&e->entry[index_in_buffer], &data->size_in_bytes, 8);
                 index_in_buffer += 8;
             }
-            ringbufferSend[current_send].entry[index_in_buffer] = data->type;
+            e->entry[index_in_buffer] = data->type;
             index_in_buffer++;
-            ringbufferSend[current_send].entry[index_in_buffer] = data->id;
+            e->entry[index_in_buffer] = data->id;
             index_in_buffer++;
         }
         size_t length = smallRem ? smallRemCount : 63 - index_in_buffer;
-        memcpy((void *) &ringbufferSend[current_send].entry[index_in_buffer],
+        memcpy(&e->entry[index_in_buffer],
                &(((char *) data->data)[data->index]), length);
         data->index += length;
-        ringbufferSend[current_send].flags |= MSG_WAITING;
-        current_send = (current_send + 1) % RINGSIZE;
+        chan->send_head++;
+        (*budget)--;
+        if (chan->send_head % URPC2_PUBLISH_BATCH == 0)
+            publish_send(chan);
         if (data->index >= data->size_in_bytes) {
             state = DONE_WITH_TASK;
             break;
         }
     } while (true);
 
-    MEMORY_BARRIER;
-
     return state;
 }
 
-static bool usd_store_used = false;
-
-static enum urpc2_states core_recv(struct urpc2_data *data)
+// Receives into data, using at most *budget ring entries. Returns WORKING if
+// the budget ran out before the message was complete.
+static enum urpc2_states core_recv(struct urpc2_chan *chan,
+                                   struct urpc2_data *data, uint32_t *budget)
 {
     enum urpc2_states state = WORKING;
-    int temp_counter = 0;
 
     do {
-        MEMORY_BARRIER;
         int index_in_buffer = 0;
-        if (!(ringbufferReceive[current_receive].flags & MSG_WAITING)) {
+        if (*budget == 0) {
+            state = WORKING;
+            break;
+        }
+        if (receive_empty(chan)) {
             state = BUFFER_EMPTY;
             break;
         }
-        if (data->index != 0 &&
-            ringbufferReceive[current_receive].flags & MSG_BEGIN_BLOCK)
+        struct ringbuffer_entry *e =
+            &chan->ringReceive->entries[chan->recv_tail & chan->mask];
+        if (data->index != 0 && e->flags & MSG_BEGIN_BLOCK)
             debug_printf("this too should never happen\n");
         if (data->index == 0) {
-            if (!(ringbufferReceive[current_receive].flags & MSG_BEGIN_BLOCK))
+            if (!(e->flags & MSG_BEGIN_BLOCK))
                 debug_printf("well this should never occur\n");
-            if (ringbufferReceive[current_receive].flags & MSG_END_BLOCK) {
+            if (e->flags & MSG_SHARED_PAYLOAD) {
+                core_recv_shared(chan, e, data);
+                state = DONE_WITH_TASK;
+                break;
+            }
+            if (e->flags & MSG_END_BLOCK) {
                 data->size_in_bytes = 61;
                 // Best guess as we in that case never actually transmit the
                 // size and assume the type has a static size it knows anyway.
                 // We just immediately handle it here as it's just a single
                 // entry.
 
-                data->type =
-                    ringbufferReceive[current_receive].entry[index_in_buffer];
+                data->type = e->entry[index_in_buffer];
                 index_in_buffer++;
 
-                data->id =
-                    ringbufferReceive[current_receive].entry[index_in_buffer];
+                data->id = e->entry[index_in_buffer];
                 index_in_buffer++;
 
-                // Copyless for efficency.
-                data->data = (void *) &ringbufferReceive[current_receive]
-                                 .entry[index_in_buffer];
+                // Copyless for efficency. The entry is only handed back to
+                // the sender once the handler returned.
+                data->data = &e->entry[index_in_buffer];
 
-                urpc2_recv_handler(data);
-                ringbufferReceive[current_receive].flags &= ~MSG_WAITING;
-                current_receive = (current_receive + 1) % RINGSIZE;
+                chan->recv_handler(data);
+                chan->recv_tail++;
                 state = DONE_WITH_TASK;
                 break;
-            } else if (ringbufferReceive[current_receive].flags &
-                       MSG_HAS_SIZE_INT32) {
-                memcpy(&data->size_in_bytes,
-                       (void *) &(ringbufferReceive[current_receive]
-                                      .entry[index_in_buffer]),
-                       4);
+            } else if (e->flags & MSG_HAS_SIZE_INT32) {
+                uint32_t temp;
+                memcpy(&temp, &e->entry[index_in_buffer], 4);
+                data->size_in_bytes = temp;
                 index_in_buffer += 4;
-            } else if (ringbufferReceive[current_receive].flags &
-                       MSG_HAS_SIZE_INT64) {
-                memcpy(&data->size_in_bytes,
-                       (void *) &(ringbufferReceive[current_receive]
-                                      .entry[index_in_buffer]),
-                       8);
+            } else if (e->flags & MSG_HAS_SIZE_INT64) {
+                memcpy(&data->size_in_bytes, &e->entry[index_in_buffer], 8);
                 index_in_buffer += 8;
             } else {
                 assert(!"IMPOSSIBLE. Getting here means urpc2 is broken");
@@ -237,11 +448,9 @@ static enum urpc2_states core_recv(struct urpc2_data *data)
             // I just realized that it can only be 32bit long because malloc
             // constraints, so whatever. TODO: fix
             data->data = malloc(data->size_in_bytes);
-            data->type =
-                ringbufferReceive[current_receive].entry[index_in_buffer];
+            data->type = e->entry[index_in_buffer];
             index_in_buffer++;
-            data->id =
-                ringbufferReceive[current_receive].entry[index_in_buffer];
+            data->id = e->entry[index_in_buffer];
             index_in_buffer++;
         }
 
@@ -255,100 +464,290 @@ static enum urpc2_states core_recv(struct urpc2_data *data)
 
         size_t length = smallRem ? smallRemCount : 63 - index_in_buffer;
         memcpy(&(((char *) data->data)[data->index]),
-               (void *) &ringbufferReceive[current_receive]
-                   .entry[index_in_buffer],
-               length);
+               &e->entry[index_in_buffer], length);
         data->index += length;
-        ringbufferReceive[current_receive].flags &= ~MSG_WAITING;
-        current_receive = (current_receive + 1) % RINGSIZE;
-        temp_counter++;
+        chan->recv_tail++;
+        (*budget)--;
+        if (chan->recv_tail % URPC2_PUBLISH_BATCH == 0)
+            publish_receive(chan);
         if (data->index >= data->size_in_bytes) {
             DBG(DETAILED, "receive type: %u size:%u\n", data->type,
                          data->size_in_bytes);
             state = DONE_WITH_TASK;
-            usd_store_used = false;
-            urpc2_recv_handler(data);
+            chan->usd_store_used = false;
+            chan->recv_handler(data);
             free(data->data);
             break;
         }
     } while (true);
 
-    MEMORY_BARRIER;
+    publish_receive(chan);
 
     return state;
 }
 
-static struct urpc2_data usd_store;
-struct urpc2_send_queue *sendobj;
+static struct urpc2_wait_policy wait_policy = URPC2_WAIT_POLICY_DEFAULT;
+static struct urpc2_wait_stats wait_stats;
+
+// Cheap check whether a round on chan would get anything done.
+static bool chan_has_work(struct urpc2_chan *chan)
+{
+    if (!receive_empty(chan))
+        return true;
+    if (chan->sendobj != NULL)
+        return !send_full(chan);
+    // the stub is the only element iff the queue is empty
+    return chan->queue_tail != &chan->queue_stub ||
+           __atomic_load_n(&chan->queue_stub.next, __ATOMIC_ACQUIRE) != NULL;
+}
+
+static bool urpc2_has_work(void)
+{
+    int count = __atomic_load_n(&chan_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        if (chan_has_work(&chans[i]))
+            return true;
+    }
+    return false;
+}
+
+// Sleeps for us microseconds or until enqueue wakes us up.
+static errval_t urpc2_sleep(delayus_t us)
+{
+    sleep_over = false;
+    __atomic_store_n(&sleeping, true, __ATOMIC_SEQ_CST);
+    // a send queued before the flag was set did not wake us
+    if (urpc2_has_work()) {
+        __atomic_store_n(&sleeping, false, __ATOMIC_SEQ_CST);
+        return SYS_ERR_OK;
+    }
+
+    struct deferred_event timer;
+    deferred_event_init(&timer);
+    errval_t err = deferred_event_register(&timer, &sleep_ws, us,
+                                           MKCLOSURE(urpc2_sleep_over, NULL));
+    while (err_is_ok(err) && !sleep_over) {
+        err = event_dispatch(&sleep_ws);
+    }
+    __atomic_store_n(&sleeping, false, __ATOMIC_SEQ_CST);
+    // the timer lives on our stack, take it back if the wakeup came first
+    deferred_event_cancel(&timer);
+    return err;
+}
+
+// Called after a round without progress, returns once there may be work.
+// idle_rounds counts the rounds without progress so far, *sleep_us is the
+// current sleep interval. Returns true if work showed up while spinning.
+static bool urpc2_wait(uint32_t idle_rounds, delayus_t *sleep_us)
+{
+    struct urpc2_wait_policy policy = wait_policy;
+
+    if (idle_rounds == 1) {
+        // The other core is usually in the middle of a burst, poll the
+        // ring without giving up the core for a bit.
+        for (uint32_t i = 0; i < policy.spin_budget; i++) {
+            if (urpc2_has_work()) {
+                wait_stats.spin_hits++;
+                return true;
+            }
+        }
+    }
+    if (idle_rounds <= policy.yield_budget + 1) {
+        wait_stats.yields++;
+        thread_yield();
+        return false;
+    }
+
+    // Idle for a while, get off the core. Sends from this core wake us up
+    // right away, messages from the other core wait for at most
+    // sleep_max_us.
+    if (*sleep_us < policy.sleep_min_us)
+        *sleep_us = policy.sleep_min_us;
+    wait_stats.sleeps++;
+    errval_t err = urpc2_sleep(*sleep_us);
+    if (err_is_fail(err)) {
+        DEBUG_ERR(err, "urpc2 sleep failed");
+        thread_yield();
+    }
+    *sleep_us = MIN(*sleep_us * 2, policy.sleep_max_us);
+    return false;
+}
+
+// Receives at most one message and fills the send ring with as many queued
+// messages as fit. Each direction moves at most a ring worth of entries, a
+// peer that keeps the ring busy can't hold up the other channels. Returns
+// whether anything moved.
+static bool chan_round(struct urpc2_chan *chan)
+{
+    bool progress = false;
+    uint32_t recv_budget = chan->mask + 1;
+    uint32_t send_budget = chan->mask + 1;
+
+    if (!receive_empty(chan)) {
+        progress = true;
+        if (chan->usd_store_used != true) {
+            struct urpc2_data usd;
+            usd.index = 0;
+            if (core_recv(chan, &usd, &recv_budget) != DONE_WITH_TASK) {
+                chan->usd_store = usd;
+                chan->usd_store_used = true;
+            }
+        } else {
+            if (core_recv(chan, &chan->usd_store, &recv_budget) ==
+                DONE_WITH_TASK) {
+                chan->usd_store_used = false;
+            }
+        }
+    }
+
+    // Fill the ring with as many queued messages as fit, then make them
+    // visible with a single barrier.
+    uint32_t head_before = chan->send_head;
+    if (chan->sendobj == NULL)
+        chan->sendobj = dequeue(chan);
+    while (chan->sendobj != NULL) {
+        struct urpc2_send_queue *sendobj = chan->sendobj;
+        if (!sendobj->hasDataInit) {
+            sendobj->cachedata = sendobj->func(sendobj->rawdata);
+            sendobj->hasDataInit = true;
+        }
+        if (core_send(chan, &sendobj->cachedata, &send_budget) !=
+            DONE_WITH_TASK) {
+            // ring is full or the budget is used up, we continue with this
+            // one next round
+            break;
+        }
+        // note: this is fine and can't memleak so long as the func
+        // that was passed to us via sendobj cleans its own data up
+        // after it's done using it.
+        free(sendobj);
+        chan->sendobj = dequeue(chan);
+    }
+    publish_send(chan);
+    if (chan->send_head != head_before)
+        progress = true;
+
+    return progress;
+}
 
 static int urpc2_internal(void *data)
 {
     // First we spin on setup, This is so we can transfer ram.
     void (*setup_func)(void) = (void (*)(void)) data;
     setup_func();
+    uint32_t idle_rounds = 0;
+    delayus_t sleep_us = 0;
+    bool spin_hit = false;
     while (true) {
-        MEMORY_BARRIER;
-        if (!(ringbufferReceive[current_receive].flags & MSG_WAITING) &&
-            ((sendobj == NULL && queue_empty()) ||
-             (ringbufferSend[current_send].flags & MSG_WAITING))) {
-            MEMORY_BARRIER;
-            thread_yield();
-        } else {
-            if (ringbufferReceive[current_receive].flags & MSG_WAITING) {
-                if (usd_store_used != true) {
-                    struct urpc2_data usd;
-                    usd.index = 0;
-                    if (core_recv(&usd) != DONE_WITH_TASK) {
-                        usd_store = usd;
-                        usd_store_used = true;
-                    }
-                } else {
-                    if (core_recv(&usd_store) == DONE_WITH_TASK) {
-                        usd_store_used = false;
-                    }
-                }
+        bool progress = false;
+        int count = __atomic_load_n(&chan_count, __ATOMIC_ACQUIRE);
+
+        // A round on a bulk channel moves at most a ring worth of entries,
+        // so the priority channels get looked at again after every such
+        // slice and never queue up behind a large transfer.
+        for (int i = 0; i < count; i++) {
+            if (chans[i].priority)
+                progress |= chan_round(&chans[i]);
+        }
+        for (int i = 0; i < count; i++) {
+            if (!chans[i].priority)
+                progress |= chan_round(&chans[i]);
+        }
 
-            } else {
-                // We can only get into this case if we have something to send
-                // and can send right now.
-                if (sendobj == NULL)
-                    sendobj = dequeue();
-                if (!sendobj->hasDataInit) {
-                    sendobj->cachedata = sendobj->func(sendobj->rawdata);
-                    sendobj->hasDataInit = true;
-                }
-                if (core_send(&sendobj->cachedata) != DONE_WITH_TASK) {
-                    // we are not done yet with this one, so we requeue it
-                    //                    requeue(sendobj);
-                } else {
-                    // note: this is fine and can't memleak so long as the func
-                    // that was passed to us via sendobj cleans its own data up
-                    // after it's done using it.
-                    free(sendobj);
-                    sendobj = NULL;
-                }
-            }
-            MEMORY_BARRIER;
+        if (progress) {
+            if (idle_rounds > 0 && !spin_hit)
+                wait_stats.backoff_hits++;
+            idle_rounds = 0;
+            sleep_us = 0;
+        } else {
+            idle_rounds++;
+            spin_hit = urpc2_wait(idle_rounds, &sleep_us);
         }
     }
     return 0;
 }
 
-void urpc2_init_and_run(void *sendbuffer, void *receivebuffer,
-                        void (*recv_handler)(struct urpc2_data *),
-                        void (*setup_func)(void))
+int urpc2_chan_create(void *sendbuffer, void *receivebuffer, uint32_t entries,
+                      void (*recv_handler)(struct urpc2_data *),
+                      bool priority)
 {
     assert(sizeof(struct ringbuffer_entry) == 64);
-    thread_mutex_init(&urpc2_thread_mutex);
-    ringbufferSend = sendbuffer;
-    ringbufferReceive = receivebuffer;
-    urpc2_recv_handler = recv_handler;
+    assert(entries > 0 && (entries & (entries - 1)) == 0);
+    int id = chan_count;
+    assert(id < URPC2_MAX_CHANS);
+
+    struct urpc2_chan *chan = &chans[id];
+    memset(chan, 0, sizeof(*chan));
+    chan->ringSend = sendbuffer;
+    chan->ringReceive = receivebuffer;
+    chan->mask = entries - 1;
+    chan->recv_handler = recv_handler;
+    chan->priority = priority;
+    chan->queue_head = &chan->queue_stub;
+    chan->queue_tail = &chan->queue_stub;
+
+    __atomic_store_n(&chan_count, id + 1, __ATOMIC_RELEASE);
+    return id;
+}
+
+void urpc2_chan_attach_payload(int chan, void *send_area, void *recv_area,
+                               uint32_t bytes)
+{
+    assert(chan >= 0 && chan < chan_count);
+    assert(bytes >= URPC2_SHARED_MIN_BYTES && (bytes & (bytes - 1)) == 0);
+    struct urpc2_chan *c = &chans[chan];
+    c->payloadSend = send_area;
+    c->payloadReceive = recv_area;
+    c->payload_mask = bytes - 1;
+    c->payload_head = c->payloadSend->tail;
+    c->payload_tail_cache = c->payload_head;
+    c->payload_enabled = true;
+}
+
+void urpc2_chan_use_payload(int chan, bool use)
+{
+    assert(chan >= 0 && chan < chan_count);
+    chans[chan].payload_enabled = use && chans[chan].payloadSend != NULL;
+}
+
+void urpc2_run(void (*setup_func)(void))
+{
+    waitset_init(&sleep_ws);
+    waitset_chanstate_init(&wake_chan, CHANTYPE_OTHER);
     thread_create(urpc2_internal, setup_func);
 }
 
+void urpc2_chan_enqueue(int chan, struct urpc2_data (*func)(void *data),
+                        void *data)
+{
+    assert(chan >= 0 && chan < chan_count);
+    enqueue(&chans[chan], func, data);
+}
+
 void urpc2_enqueue(struct urpc2_data (*func)(void *data), void *data)
 {
-    enqueue(func, data);
+    urpc2_chan_enqueue(URPC2_DEFAULT_CHAN, func, data);
+}
+
+void urpc2_set_wait_policy(const struct urpc2_wait_policy *policy)
+{
+    assert(policy->sleep_min_us <= policy->sleep_max_us);
+    wait_policy = *policy;
+}
+
+void urpc2_get_wait_policy(struct urpc2_wait_policy *policy)
+{
+    *policy = wait_policy;
+}
+
+void urpc2_get_wait_stats(struct urpc2_wait_stats *stats)
+{
+    *stats = wait_stats;
+}
+
+void urpc2_reset_wait_stats(void)
+{
+    memset(&wait_stats, 0, sizeof(wait_stats));
 }
 
 struct urpc2_data init_urpc2_data(char type, char id, size_t size_in_bytes,
@@ -22,6 +22,7 @@
 #include <aos/waitset.h>
 
 #include <barrelfish_kpi/asm_inlines_arch.h>
+#include <barrelfish_kpi/init.h>
 
 #include <mm/mm.h>
 #include <spawn/spawn.h>
@@ -74,8 +75,8 @@ int main(int argc, char *argv[])
     // init urpc channel to 2nd core
     void *buf;
     if (my_core_id == 0) {
-        CHECK(create_urpc_frame(&buf, BASE_PAGE_SIZE));
-        memset(buf, 0, BASE_PAGE_SIZE);
+        CHECK(create_urpc_frame(&buf, MON_URPC_SIZE));
+        memset(buf, 0, MON_URPC_SIZE);
 
         // wake up 2nd core
         CHECK(wake_core(1, my_core_id, bi));
@@ -21,6 +21,9 @@ errval_t aos_ram_free(struct capref cap)
     errval_t err;
     struct frame_identity fi;
     err = frame_identify(cap, &fi);
+    if (err_is_fail(err)) {
+        return err;
+    }
     return mm_free(&aos_mm, cap, fi.base, fi.bytes);
 }
 
@@ -54,15 +57,15 @@ errval_t initialize_ram_alloc(struct bootinfo *bi_override)
     }
 
     // Initialize aos_mm
-    err = mm_init(&aos_mm, ObjType_RAM, NULL, slot_alloc_prealloc,
-                  slot_prealloc_refill, &init_slot_alloc);
+    err = mm_init(&aos_mm, ObjType_RAM, MM_BACKEND_SEGREGATED, NULL,
+                  slot_alloc_prealloc, slot_prealloc_refill, &init_slot_alloc);
     if (err_is_fail(err)) {
         USER_PANIC_ERR(err, "Can't initalize the memory manager.");
     }
 
     // Give aos_mm a bit of memory for the initialization
-    static char nodebuf[sizeof(struct mmnode) * 64];
-    slab_grow(&aos_mm.slabs, nodebuf, sizeof(nodebuf));
+    static char nodebuf[MM_NODE_SIZE * 64];
+    slab_cache_grow(&aos_mm.slabs, nodebuf, sizeof(nodebuf));
 
     // Walk bootinfo and add all RAM caps to allocator handed to us by the
     // kernel
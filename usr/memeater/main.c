@@ -18,8 +18,23 @@
 
 #include <aos/aos.h>
 #include <aos/aos_rpc.h>
+#include <aos/arena.h>
+#include <aos/morecore.h>
 #include <aos/paging.h>
+#include <aos/task_pool.h>
 #include <aos/waitset.h>
+#include <zlib.h>
+
+#include <barrelfish_kpi/asm_inlines_arch.h>
+
+#define FAULT_BENCH_BYTES (8 * 1024 * 1024)
+#define MALLOC_BENCH_OPS   50000
+#define MALLOC_BENCH_SLOTS 512
+#define PRIO_BENCH_RPCS    200
+#define PRIO_BENCH_SPINS   (200 * 1000 * 1000)
+#define THREAD_BENCH_WAVE  64
+#define TASK_BENCH_BYTES   (2 * 1024 * 1024)
+#define TASK_BENCH_BLOCK   (64 * 1024)
 
 static struct aos_rpc *init_rpc, *mem_rpc;
 
@@ -147,6 +162,332 @@ static errval_t test_basic_rpc(void)
     return SYS_ERR_OK;
 }
 
+/// Touches a fresh heap buffer page by page with the given fault-ahead
+/// policy and prints the fault counters and the time per page.
+static void fault_ahead_run(const char *name,
+                            const struct paging_fault_policy *policy)
+{
+    struct paging_fault_policy def = PAGING_FAULT_POLICY_DEFAULT;
+    struct paging_fault_stats stats;
+
+    char *buf = malloc(FAULT_BENCH_BYTES);
+    assert(buf != NULL);
+
+    paging_set_fault_policy(policy);
+    paging_reset_fault_stats();
+    reset_cycle_counter();
+    for (size_t i = 0; i < FAULT_BENCH_BYTES; i += BASE_PAGE_SIZE)
+        buf[i] = 'x';
+    uint64_t cycles = get_cycle_count();
+    paging_get_fault_stats(&stats);
+    paging_set_fault_policy(&def);
+
+    size_t pages = FAULT_BENCH_BYTES / BASE_PAGE_SIZE;
+    debug_printf("\033[33m%-12s faults %5zu sequential %5zu mapped %5zu "
+                 "fallbacks %3zu cycles/page %8llu\033[0m\n",
+                 name, stats.faults, stats.sequential, stats.pages_mapped,
+                 stats.fallbacks, (unsigned long long) (cycles / pages));
+    // unmapped again by the arena malloc, the next run faults afresh
+    free(buf);
+}
+
+static void fault_ahead_bench(void)
+{
+    debug_printf("\033[33mTouching %d MiB of fresh heap with and without "
+                 "fault-ahead\n\033[0m", FAULT_BENCH_BYTES >> 20);
+    struct paging_fault_policy single = { .initial_pages = 1,
+                                          .max_pages = 1 };
+    struct paging_fault_policy ahead = PAGING_FAULT_POLICY_DEFAULT;
+    fault_ahead_run("single page", &single);
+    fault_ahead_run("fault-ahead", &ahead);
+    debug_printf("\033[32mSUCCESS\n\033[0m");
+}
+
+/// Random mix of mostly small allocations and frees, about one in
+/// sixteen is larger than a page. At the end every thread leaves half of
+/// its blocks to the main thread, which frees them remotely.
+static int malloc_bench_thread(void *arg)
+{
+    void **slots = arg;
+    uint32_t seed = (uintptr_t) arg;
+    for (int i = 0; i < MALLOC_BENCH_OPS; i++) {
+        seed = seed * 1103515245 + 12345;
+        size_t slot = (seed >> 8) % MALLOC_BENCH_SLOTS;
+        if (slots[slot] != NULL) {
+            free(slots[slot]);
+            slots[slot] = NULL;
+            continue;
+        }
+        size_t bytes = (seed >> 20) % 16 == 0 ? 4096 + (seed >> 4) % 32768
+                                               : 8 + (seed >> 12) % 504;
+        slots[slot] = malloc(bytes);
+        assert(slots[slot] != NULL);
+        *(char *) slots[slot] = 'x';
+    }
+    for (int i = 0; i < MALLOC_BENCH_SLOTS; i += 2) {
+        free(slots[i]);
+        slots[i] = NULL;
+    }
+    return 0;
+}
+
+static void malloc_bench_run(int nthreads)
+{
+    struct arena_stats before, after;
+    struct thread *threads[8];
+    void **slots[8];
+
+    for (int t = 0; t < nthreads; t++) {
+        slots[t] = calloc(MALLOC_BENCH_SLOTS, sizeof(void *));
+        assert(slots[t] != NULL);
+    }
+    arena_get_stats(&before);
+    size_t calls = __malloc_calls;
+    reset_cycle_counter();
+    for (int t = 0; t < nthreads; t++) {
+        threads[t] = thread_create(malloc_bench_thread, slots[t]);
+        assert(threads[t] != NULL);
+    }
+    for (int t = 0; t < nthreads; t++) {
+        int retval;
+        thread_join(threads[t], &retval);
+    }
+    for (int t = 0; t < nthreads; t++) {
+        for (int i = 0; i < MALLOC_BENCH_SLOTS; i++)
+            free(slots[t][i]);
+    }
+    uint64_t cycles = get_cycle_count();
+    arena_get_stats(&after);
+
+    size_t ops = nthreads * MALLOC_BENCH_OPS;
+    debug_printf("\033[33m%d thread(s): mallocs %6zu cycles/op %6llu runs "
+                 "%4zu/%4zu large %4zu/%4zu remote frees %5zu\033[0m\n",
+                 nthreads, __malloc_calls - calls,
+                 (unsigned long long) (cycles / ops),
+                 after.runs_mapped - before.runs_mapped,
+                 after.runs_unmapped - before.runs_unmapped,
+                 after.large_mapped - before.large_mapped,
+                 after.large_unmapped - before.large_unmapped,
+                 after.remote_frees - before.remote_frees);
+    for (int t = 0; t < nthreads; t++)
+        free(slots[t]);
+}
+
+static void malloc_bench(void)
+{
+    debug_printf("\033[33mAllocation heavy threads, runs and large blocks "
+                 "as mapped/given back\n\033[0m");
+    malloc_bench_run(1);
+    malloc_bench_run(4);
+    malloc_bench_run(8);
+    debug_printf("\033[32mSUCCESS\n\033[0m");
+}
+
+static volatile bool prio_bench_stop;
+
+/// CPU bound background work, it never yields. It gives up by itself after
+/// a while, so a low priority main thread can't starve behind it.
+static int prio_bench_spin(void *arg)
+{
+    for (size_t i = 0; i < PRIO_BENCH_SPINS && !prio_bench_stop; i++)
+        __asm volatile("" ::: "memory");
+    return 0;
+}
+
+/// Round trips to init while a spinning thread of the given priority runs,
+/// -1 runs without one.
+static void prio_bench_run(const char *name, int priority)
+{
+    struct thread *spinner = NULL;
+    prio_bench_stop = false;
+    if (priority >= 0) {
+        spinner = thread_create(prio_bench_spin, NULL);
+        assert(spinner != NULL);
+        thread_set_priority(spinner, priority);
+        // let it get going
+        thread_yield();
+    }
+
+    uintptr_t word = 42;
+    uint64_t worst = 0;
+    uint64_t total = 0;
+    for (int i = 0; i < PRIO_BENCH_RPCS; i++) {
+        reset_cycle_counter();
+        errval_t err = aos_rpc_bench_sink(init_rpc, &word, sizeof(word));
+        uint64_t cycles = get_cycle_count();
+        if (err_is_fail(err)) {
+            DEBUG_ERR(err, "bench sink RPC");
+            break;
+        }
+        total += cycles;
+        worst = MAX(worst, cycles);
+    }
+    prio_bench_stop = true;
+    if (spinner != NULL) {
+        int retval;
+        thread_join(spinner, &retval);
+    }
+
+    debug_printf("\033[33m%-20s avg %8llu worst %10llu cycles per RPC\033[0m\n",
+                 name, (unsigned long long) (total / PRIO_BENCH_RPCS),
+                 (unsigned long long) worst);
+}
+
+static void prio_bench(void)
+{
+    debug_printf("\033[33mRPC latency of a normal priority thread next to a "
+                 "spinning one\n\033[0m");
+    prio_bench_run("no background", -1);
+    prio_bench_run("low background", THREAD_PRIORITY_LOW);
+    prio_bench_run("normal background", THREAD_PRIORITY_NORMAL);
+    // only the wakeup boost is left, so it is round-robin as before
+    prio_bench_run("high background", THREAD_PRIORITY_HIGH);
+    debug_printf("\033[32mSUCCESS\n\033[0m");
+}
+
+static int thread_bench_nop(void *arg)
+{
+    return 0;
+}
+
+/// Creates and joins `count` threads, one at a time for the latency and
+/// in waves of THREAD_BENCH_WAVE live threads for the throughput.
+static void thread_bench_run(size_t count)
+{
+    uint64_t worst = 0;
+    reset_cycle_counter();
+    uint64_t start = get_cycle_count();
+    for (size_t i = 0; i < count; i++) {
+        uint64_t before = get_cycle_count();
+        struct thread *t = thread_create(thread_bench_nop, NULL);
+        assert(t != NULL);
+        int retval;
+        thread_join(t, &retval);
+        worst = MAX(worst, get_cycle_count() - before);
+    }
+    uint64_t serial = get_cycle_count() - start;
+
+    struct thread *threads[THREAD_BENCH_WAVE];
+    reset_cycle_counter();
+    for (size_t done = 0; done < count; done += THREAD_BENCH_WAVE) {
+        size_t wave = MIN(count - done, THREAD_BENCH_WAVE);
+        for (size_t i = 0; i < wave; i++) {
+            threads[i] = thread_create(thread_bench_nop, NULL);
+            assert(threads[i] != NULL);
+        }
+        for (size_t i = 0; i < wave; i++) {
+            int retval;
+            thread_join(threads[i], &retval);
+        }
+    }
+    uint64_t waves = get_cycle_count();
+
+    debug_printf("\033[33m%5zu thread(s): create+join avg %8llu worst %9llu "
+                 "in waves %8llu cycles per thread\033[0m\n", count,
+                 (unsigned long long) (serial / count),
+                 (unsigned long long) worst,
+                 (unsigned long long) (waves / count));
+}
+
+static void thread_bench(void)
+{
+    debug_printf("\033[33mThread create and join, stacks and TCBs come from "
+                 "the pool once warm\n\033[0m");
+    for (size_t count = 1; count <= 10000; count *= 10)
+        thread_bench_run(count);
+    debug_printf("\033[32mSUCCESS\n\033[0m");
+}
+
+struct task_bench {
+    const Bytef *in;
+    uLong crcs[TASK_BENCH_BYTES / TASK_BENCH_BLOCK];
+    uLong compressed[TASK_BENCH_BYTES / TASK_BENCH_BLOCK];
+};
+
+/// Checksums and compresses the blocks [begin, end)
+static void task_bench_blocks(void *arg, size_t begin, size_t end)
+{
+    struct task_bench *tb = arg;
+    uLong bound = compressBound(TASK_BENCH_BLOCK);
+    Bytef *out = malloc(bound);
+    assert(out != NULL);
+    for (size_t b = begin; b < end; b++) {
+        const Bytef *in = tb->in + b * TASK_BENCH_BLOCK;
+        tb->crcs[b] = crc32(crc32(0, Z_NULL, 0), in, TASK_BENCH_BLOCK);
+        uLongf len = bound;
+        int r = compress2(out, &len, in, TASK_BENCH_BLOCK, Z_DEFAULT_COMPRESSION);
+        assert(r == Z_OK);
+        tb->compressed[b] = len;
+    }
+    free(out);
+}
+
+/// Runs the blocks on a pool of `workers`, 0 runs them on the caller
+static void task_bench_run(struct task_bench *tb, size_t workers,
+                           uLong expect)
+{
+    size_t nblocks = TASK_BENCH_BYTES / TASK_BENCH_BLOCK;
+    struct task_pool *pool = NULL;
+    if (workers > 0) {
+        errval_t err = task_pool_create(&pool, workers);
+        if (err_is_fail(err)) {
+            DEBUG_ERR(err, "creating a task pool");
+            return;
+        }
+    }
+
+    reset_cycle_counter();
+    if (pool != NULL) {
+        errval_t err = task_parallel_for(pool, 0, nblocks, 1,
+                                         task_bench_blocks, tb);
+        assert(err_is_ok(err));
+    } else {
+        task_bench_blocks(tb, 0, nblocks);
+    }
+    uLong crc = tb->crcs[0];
+    size_t compressed = tb->compressed[0];
+    for (size_t b = 1; b < nblocks; b++) {
+        crc = crc32_combine(crc, tb->crcs[b], TASK_BENCH_BLOCK);
+        compressed += tb->compressed[b];
+    }
+    uint64_t cycles = get_cycle_count();
+
+    if (pool != NULL)
+        task_pool_destroy(pool);
+    debug_printf("\033[33m%2zu worker(s): crc %08lx %s compressed %7zu "
+                 "bytes cycles %10llu\033[0m\n", workers, crc,
+                 crc == expect ? "ok" : "BAD", compressed,
+                 (unsigned long long) cycles);
+}
+
+static void task_bench(void)
+{
+    debug_printf("\033[33mCRC32 and deflate of %d KiB in %d KiB blocks on "
+                 "task pools\n\033[0m", TASK_BENCH_BYTES >> 10,
+                 TASK_BENCH_BLOCK >> 10);
+    struct task_bench *tb = malloc(sizeof(struct task_bench));
+    Bytef *in = malloc(TASK_BENCH_BYTES);
+    assert(tb != NULL && in != NULL);
+    // text with a bit of noise, so deflate has some work to do
+    size_t len = strlen(str);
+    uint32_t seed = 1;
+    for (size_t i = 0; i < TASK_BENCH_BYTES; i++) {
+        seed = seed * 1103515245 + 12345;
+        in[i] = (seed >> 24) % 8 == 0 ? seed >> 16 : str[i % len];
+    }
+    tb->in = in;
+
+    uLong expect = crc32(crc32(0, Z_NULL, 0), in, TASK_BENCH_BYTES);
+    task_bench_run(tb, 0, expect);
+    task_bench_run(tb, 1, expect);
+    task_bench_run(tb, 2, expect);
+    task_bench_run(tb, 4, expect);
+    task_bench_run(tb, 8, expect);
+    free(in);
+    free(tb);
+    debug_printf("\033[32mSUCCESS\n\033[0m");
+}
+
 static void derference_null(void)
 {
     int *a = NULL;
@@ -236,6 +577,12 @@ int main(int argc, char *argv[])
     printf("\033[32mSUCCESS\033[0m");
     printf("\n");
 
+    fault_ahead_bench();
+    malloc_bench();
+    prio_bench();
+    thread_bench();
+    task_bench();
+
     debug_printf("\033[33mTry to dereference NULL\n\033[0m");
     struct thread *nullthread =
         thread_create((thread_func_t) derference_null, NULL);
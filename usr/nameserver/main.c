@@ -465,10 +465,9 @@ static errval_t ns_recv_handshake(struct capref *recv_cap) {
     DBG(DETAILED, "ns received cap\n");
 
         struct recv_chan *rc = malloc(sizeof(struct recv_chan));
-        rc->chan = malloc(sizeof(struct lmp_chan));
-        rc->recv_deal_with_msg = ns_active_chan_handler;
-        rc->rpc_recv_list = NULL;
-        CHECK(lmp_chan_accept(rc->chan, DEFAULT_LMP_BUF_WORDS, *recv_cap));
+        recv_chan_init(rc, malloc(sizeof(struct lmp_chan)),
+                       ns_active_chan_handler);
+        CHECK(lmp_chan_accept(rc->chan, RPC_LMP_BUF_WORDS, *recv_cap));
         DBG(DETAILED, "Created new channel\n");
         // We register recv on new channel.
         lmp_chan_alloc_recv_slot(rc->chan);
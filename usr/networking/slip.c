@@ -142,7 +142,11 @@ __attribute__((unused))
     }
 
 void slip_init(struct net_msg_buf *message_buffer){
-    thread_create((thread_func_t) slip_receive, message_buffer);
+    // both poll with thread_yield, keep them behind the RPC handlers
+    struct thread *receiver =
+        thread_create((thread_func_t) slip_receive, message_buffer);
+    thread_set_priority(receiver, THREAD_PRIORITY_LOW);
     MEMORY_BARRIER;
-    thread_create((thread_func_t) slip_send, NULL);
+    struct thread *sender = thread_create((thread_func_t) slip_send, NULL);
+    thread_set_priority(sender, THREAD_PRIORITY_LOW);
 }
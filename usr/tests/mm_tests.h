@@ -324,3 +324,300 @@ mm_paging_alloc_aligned_allignment_test(void)
 
     TEST_PRINT_SUCCESS();
 }
+
+#define FAULT_STORM_THREADS 8
+#define FAULT_STORM_BYTES   (1024 * 1024)
+
+struct fault_storm_arg {
+    int id;
+    uint32_t *private;  ///< only touched by this thread
+    uint32_t *shared;   ///< touched by all threads in a different order
+};
+
+static int fault_storm_func(void *arg)
+{
+    struct fault_storm_arg *a = arg;
+    size_t words = BASE_PAGE_SIZE / sizeof(uint32_t);
+    size_t pages = FAULT_STORM_BYTES / BASE_PAGE_SIZE;
+
+    for (size_t i = 0; i < FAULT_STORM_BYTES / sizeof(uint32_t); i++) {
+        a->private[i] = (a->id << 24) ^ i;
+    }
+    // every thread starts at another page, so they run into pages that
+    // someone else is still mapping
+    for (size_t p = 0; p < pages; p++) {
+        size_t page = (p + a->id * pages / FAULT_STORM_THREADS) % pages;
+        a->shared[page * words + a->id] = (a->id << 24) ^ page;
+    }
+    return 0;
+}
+
+__attribute__((unused)) static int mm_paging_fault_storm(void)
+{
+    TEST_PRINT_INFO("\n"
+                    "8 threads fault in a 1 MiB region each, and a shared\n"
+                    "1 MiB region all at once.");
+
+    errval_t err = SYS_ERR_OK;
+    struct paging_state *st = get_current_paging_state();
+    struct fault_storm_arg args[FAULT_STORM_THREADS];
+    struct thread *threads[FAULT_STORM_THREADS];
+    void *shared;
+
+    err = paging_alloc(st, &shared, FAULT_STORM_BYTES);
+    if (err_is_fail(err)) {
+        TEST_PRINT_FAIL();
+    }
+    for (int t = 0; t < FAULT_STORM_THREADS; t++) {
+        void *private;
+        err = paging_alloc(st, &private, FAULT_STORM_BYTES);
+        if (err_is_fail(err)) {
+            TEST_PRINT_FAIL();
+        }
+        args[t].id = t;
+        args[t].private = private;
+        args[t].shared = shared;
+    }
+
+    struct paging_fault_stats before, after;
+    paging_get_fault_stats(&before);
+    for (int t = 0; t < FAULT_STORM_THREADS; t++) {
+        threads[t] = thread_create(fault_storm_func, &args[t]);
+        if (threads[t] == NULL) {
+            err = LIB_ERR_THREAD_CREATE;
+            TEST_PRINT_FAIL();
+        }
+    }
+    for (int t = 0; t < FAULT_STORM_THREADS; t++) {
+        thread_join(threads[t], NULL);
+    }
+    paging_get_fault_stats(&after);
+
+    size_t words = BASE_PAGE_SIZE / sizeof(uint32_t);
+    for (int t = 0; t < FAULT_STORM_THREADS; t++) {
+        for (size_t i = 0; i < FAULT_STORM_BYTES / sizeof(uint32_t); i++) {
+            if (args[t].private[i] != ((t << 24) ^ i)) {
+                debug_printf("thread %d private word %zu is wrong\n", t, i);
+                err = LIB_ERR_VSPACE_PAGEFAULT_HANDER;
+                TEST_PRINT_FAIL();
+            }
+        }
+        for (size_t p = 0; p < FAULT_STORM_BYTES / BASE_PAGE_SIZE; p++) {
+            if (args[t].shared[p * words + t] != ((t << 24) ^ p)) {
+                debug_printf("thread %d shared page %zu is wrong\n", t, p);
+                err = LIB_ERR_VSPACE_PAGEFAULT_HANDER;
+                TEST_PRINT_FAIL();
+            }
+        }
+    }
+    printf("%zu faults, %zu pages, %zu waits on pending pages\n",
+           after.faults - before.faults,
+           after.pages_mapped - before.pages_mapped,
+           after.waits - before.waits);
+
+    // the regions stay mapped, the fault handler does not keep track of
+    // them for unmapping
+    TEST_PRINT_SUCCESS();
+}
+
+__attribute__((unused)) static int mm_paging_region_hole_reuse(void)
+{
+    TEST_PRINT_INFO("\n"
+                    "Freed ranges of a paging region are reused best fit\n"
+                    "and merged with their neighbours.");
+
+    errval_t err;
+    struct paging_region pr;
+    void *buf[6];
+    size_t sizes[6] = { 3000, 100, 200, 100, 5000, 700 };
+    size_t ret;
+
+    err = paging_region_init(get_current_paging_state(), &pr,
+                             16 * BASE_PAGE_SIZE);
+    if (err_is_fail(err)) {
+        TEST_PRINT_FAIL();
+    }
+    for (int i = 0; i < 6; i++) {
+        err = paging_region_map(&pr, sizes[i], &buf[i], &ret);
+        if (err_is_fail(err)) {
+            TEST_PRINT_FAIL();
+        }
+    }
+    lvaddr_t top = pr.current_addr;
+
+    // holes of 3000, 200 and 5000 bytes, 150 goes into the smallest one
+    paging_region_unmap(&pr, (lvaddr_t) buf[0], sizes[0]);
+    paging_region_unmap(&pr, (lvaddr_t) buf[2], sizes[2]);
+    paging_region_unmap(&pr, (lvaddr_t) buf[4], sizes[4]);
+    void *p;
+    err = paging_region_map(&pr, 150, &p, &ret);
+    if (err_is_fail(err) || p != buf[2] || pr.current_addr != top) {
+        TEST_PRINT_FAIL();
+    }
+    // 4000 only fits into the 5000 byte hole
+    err = paging_region_map(&pr, 4000, &p, &ret);
+    if (err_is_fail(err) || p != buf[4]) {
+        TEST_PRINT_FAIL();
+    }
+    paging_region_unmap(&pr, (lvaddr_t) buf[4], 4000);
+    paging_region_unmap(&pr, (lvaddr_t) buf[2], 150);
+
+    // freeing the rest merges everything back into an empty region
+    paging_region_unmap(&pr, (lvaddr_t) buf[1], sizes[1]);
+    paging_region_unmap(&pr, (lvaddr_t) buf[3], sizes[3]);
+    paging_region_unmap(&pr, (lvaddr_t) buf[5], sizes[5]);
+    if (pr.current_addr != pr.base_addr || pr.holes_by_addr != NULL ||
+        pr.holes_by_size != NULL || pr.hole_bytes != 0) {
+        err = LIB_ERR_VSPACE_MMU_AWARE_NO_SPACE;
+        TEST_PRINT_FAIL();
+    }
+
+    TEST_PRINT_SUCCESS();
+}
+
+#define REGION_CHURN_LIVE 256
+#define REGION_CHURN_OPS  50000
+
+__attribute__((unused)) static int mm_paging_region_churn(void)
+{
+    TEST_PRINT_INFO("\n"
+                    "Allocate and free 50000 ranges of a paging region at\n"
+                    "random, the region must not keep growing.");
+
+    errval_t err = SYS_ERR_OK;
+    struct paging_region pr;
+    static void *buf[REGION_CHURN_LIVE];
+    static size_t sizes[REGION_CHURN_LIVE];
+    size_t max_live = 0, live = 0, high = 0;
+
+    // never touched, so this is only vspace
+    err = paging_region_init(get_current_paging_state(), &pr,
+                             64 * 1024 * 1024);
+    if (err_is_fail(err)) {
+        TEST_PRINT_FAIL();
+    }
+
+    uint32_t seed = 7;
+    for (int op = 0; op < REGION_CHURN_OPS; op++) {
+        seed = seed * 1103515245 + 12345;
+        int i = (seed >> 8) % REGION_CHURN_LIVE;
+        if (sizes[i] != 0) {
+            err = paging_region_unmap(&pr, (lvaddr_t) buf[i], sizes[i]);
+            live -= sizes[i];
+            sizes[i] = 0;
+        } else {
+            seed = seed * 1103515245 + 12345;
+            size_t size = 16 + (seed >> 8) % ((seed & 3) ? 512 : 16384);
+            size_t ret;
+            err = paging_region_map(&pr, size, &buf[i], &ret);
+            if (err_is_ok(err) && ret != size) {
+                err = LIB_ERR_VSPACE_MMU_AWARE_NO_SPACE;
+            }
+            sizes[i] = size;
+            live += size;
+        }
+        if (err_is_fail(err)) {
+            TEST_PRINT_FAIL();
+        }
+        max_live = MAX(max_live, live);
+        high = MAX(high, pr.current_addr - pr.base_addr);
+        if (pr.current_addr - pr.base_addr != live + pr.hole_bytes) {
+            debug_printf("region accounting is off after %d ops\n", op);
+            err = LIB_ERR_VSPACE_MMU_AWARE_NO_SPACE;
+            TEST_PRINT_FAIL();
+        }
+    }
+    printf("at most %zu bytes live, region grew to %zu bytes\n", max_live,
+           high);
+    // best fit keeps the fragmentation well below the live data
+    if (high > 2 * max_live) {
+        err = LIB_ERR_VSPACE_MMU_AWARE_NO_SPACE;
+        TEST_PRINT_FAIL();
+    }
+
+    for (int i = 0; i < REGION_CHURN_LIVE; i++) {
+        if (sizes[i] != 0) {
+            paging_region_unmap(&pr, (lvaddr_t) buf[i], sizes[i]);
+            sizes[i] = 0;
+        }
+    }
+    if (pr.current_addr != pr.base_addr || pr.hole_bytes != 0) {
+        err = LIB_ERR_VSPACE_MMU_AWARE_NO_SPACE;
+        TEST_PRINT_FAIL();
+    }
+
+    TEST_PRINT_SUCCESS();
+}
+
+__attribute__((unused)) static int mm_cap_batch(void)
+{
+    TEST_PRINT_INFO("\n"
+                    "Copy a frame cap with batched invocations, check that a\n"
+                    "batch stops at the first failing operation.");
+
+    errval_t err;
+    struct capref frame;
+    size_t frame_size;
+    err = frame_alloc(&frame, BASE_PAGE_SIZE, &frame_size);
+    if (err_is_fail(err)) {
+        TEST_PRINT_FAIL();
+    }
+
+    struct capref slots[4];
+    for (int i = 0; i < 4; i++) {
+        err = slot_alloc(&slots[i]);
+        if (err_is_fail(err)) {
+            TEST_PRINT_FAIL();
+        }
+    }
+
+    struct cap_batch batch;
+    cap_batch_init(&batch);
+    // once in one system call, once one by one
+    for (int batched = 1; batched >= 0; batched--) {
+        cap_batch_set_enabled(batched);
+
+        // the second copy into slots[1] fails, slots[3] stays empty
+        for (int i = 0; i < 3; i++)
+            cap_batch_copy(&batch, slots[i], frame);
+        cap_batch_copy(&batch, slots[1], frame);
+        err = cap_batch_copy(&batch, slots[3], frame);
+        if (err_is_fail(err)) {
+            TEST_PRINT_FAIL();
+        }
+        errval_t batch_err = cap_batch_run(&batch);
+        if (err_is_ok(batch_err) || batch.done != 3 ||
+            batch.ops[3].err != batch_err || batch.count != 0) {
+            debug_printf("batch did %zu operations\n", batch.done);
+            err = LIB_ERR_CAP_COPY;
+            TEST_PRINT_FAIL();
+        }
+        if (err_is_ok(cap_delete(slots[3]))) {
+            err = LIB_ERR_CAP_COPY;
+            TEST_PRINT_FAIL();
+        }
+
+        for (int i = 0; i < 3; i++)
+            cap_batch_delete(&batch, slots[i]);
+        err = cap_batch_run(&batch);
+        if (err_is_fail(err) || batch.done != 3) {
+            TEST_PRINT_FAIL();
+        }
+    }
+    cap_batch_set_enabled(true);
+
+    // a batch takes CAP_BATCH_MAX_OPS operations
+    while (!cap_batch_full(&batch))
+        cap_batch_delete(&batch, slots[0]);
+    err = cap_batch_delete(&batch, slots[0]);
+    if (err_no(err) != LIB_ERR_CAP_BATCH_FULL) {
+        TEST_PRINT_FAIL();
+    }
+    cap_batch_init(&batch);
+
+    for (int i = 0; i < 4; i++)
+        slot_free(slots[i]);
+    cap_destroy(frame);
+
+    TEST_PRINT_SUCCESS();
+}
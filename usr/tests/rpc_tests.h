@@ -0,0 +1,295 @@
+#include <aos/aos_rpc_shared.h>
+
+#define RPC_STRESS_CHANNELS 4
+#define RPC_STRESS_MESSAGES 300
+#define RPC_STRESS_TYPES    4
+
+static struct lmp_chan rpc_stress_lmp[RPC_STRESS_CHANNELS];
+static size_t rpc_stress_received[RPC_STRESS_CHANNELS];
+static size_t rpc_stress_corrupt;
+
+static uintptr_t rpc_stress_word(int chan, unsigned char type,
+                                 unsigned char id, size_t i)
+{
+    return ((uintptr_t) chan << 28) ^ ((uintptr_t) type << 20) ^
+           ((uintptr_t) id << 12) ^ i;
+}
+
+static size_t rpc_stress_size(int chan, int msg)
+{
+    // mix of slab pooled and malloc'd reassembly buffers
+    return 9 + (chan * 37 + msg * 13) % (2 * RPC_RECV_SLAB_WORDS);
+}
+
+static void rpc_stress_handler(struct recv_list *rl)
+{
+    int chan = rl->chan - rpc_stress_lmp;
+    assert(chan >= 0 && chan < RPC_STRESS_CHANNELS);
+
+    for (size_t i = 0; i < rl->size; i++) {
+        if (rl->payload[i] != rpc_stress_word(chan, rl->type, rl->id, i)) {
+            rpc_stress_corrupt++;
+            break;
+        }
+    }
+    rpc_stress_received[chan]++;
+}
+
+/**
+ * \brief Feeds 300 messages per channel in fragments of up to `max_fragment`
+ * words, picking the message and the fragment length pseudo-randomly.
+ */
+static errval_t rpc_reassembly_feed(size_t max_fragment)
+{
+    errval_t err = SYS_ERR_OK;
+
+    struct recv_chan *rc[RPC_STRESS_CHANNELS];
+    // fragments already fed per message
+    size_t *sent = calloc(RPC_STRESS_CHANNELS * RPC_STRESS_MESSAGES,
+                          sizeof(size_t));
+    assert(sent != NULL);
+
+    for (int c = 0; c < RPC_STRESS_CHANNELS; c++) {
+        rc[c] = malloc(sizeof(struct recv_chan));
+        recv_chan_init(rc[c], &rpc_stress_lmp[c], rpc_stress_handler);
+        rpc_stress_received[c] = 0;
+    }
+    rpc_stress_corrupt = 0;
+
+    size_t remaining = RPC_STRESS_CHANNELS * RPC_STRESS_MESSAGES;
+    uint32_t seed = 42;
+    while (remaining > 0) {
+        seed = seed * 1103515245 + 12345;
+        size_t pick = (seed >> 8) % (RPC_STRESS_CHANNELS * RPC_STRESS_MESSAGES);
+        // walk to the next message that still has fragments left
+        while (sent[pick] == SIZE_MAX)
+            pick = (pick + 1) % (RPC_STRESS_CHANNELS * RPC_STRESS_MESSAGES);
+
+        int c = pick / RPC_STRESS_MESSAGES;
+        int m = pick % RPC_STRESS_MESSAGES;
+        // every (type, id) pair is unique per channel, so all 300 messages
+        // can be in flight at once
+        unsigned char type = RPC_MESSAGE(2 + m % RPC_STRESS_TYPES);
+        unsigned char id = m / RPC_STRESS_TYPES;
+        size_t size = rpc_stress_size(c, m);
+
+        seed = seed * 1103515245 + 12345;
+        size_t start = sent[pick];
+        size_t count = MIN(1 + (seed >> 8) % max_fragment, size - start);
+
+        struct rpc_recv_msg msg = RPC_RECV_MSG_INIT;
+        msg.buf.msglen = count + 1;
+        msg.words[0] = (type << 24) + (id << 16) + size;
+        for (size_t i = 0; i < count; i++)
+            msg.words[1 + i] = rpc_stress_word(c, type, id, start + i);
+
+        recv_process_msg(rc[c], &msg.buf, NULL_CAP);
+
+        sent[pick] += count;
+        if (sent[pick] >= size) {
+            sent[pick] = SIZE_MAX;
+            remaining--;
+        }
+    }
+
+    for (int c = 0; c < RPC_STRESS_CHANNELS; c++) {
+        if (rpc_stress_received[c] != RPC_STRESS_MESSAGES) {
+            debug_printf("channel %d delivered %zu of %d messages\n", c,
+                         rpc_stress_received[c], RPC_STRESS_MESSAGES);
+            err = LIB_ERR_LMP_CHAN_RECV;
+        }
+        for (int t = 0; t < 256; t++) {
+            if (rc[c]->rpc_recv_table[t] == NULL)
+                continue;
+            for (int i = 0; i < 256; i++) {
+                if (rc[c]->rpc_recv_table[t][i] != NULL) {
+                    debug_printf("channel %d left type %d id %d behind\n", c,
+                                 t, i);
+                    err = LIB_ERR_LMP_CHAN_RECV;
+                }
+            }
+        }
+    }
+    if (rpc_stress_corrupt != 0) {
+        debug_printf("%zu messages arrived corrupted\n", rpc_stress_corrupt);
+        err = LIB_ERR_LMP_CHAN_RECV;
+    }
+
+    // the reassembly tables and slab pools are leaked on purpose, recv_chans
+    // are never torn down in the rpc layer either
+    free(sent);
+    return err;
+}
+
+__attribute__((unused)) static int rpc_reassembly_stress(void)
+{
+    TEST_PRINT_INFO("\n"
+                    "Reassemble 300 interleaved long messages on each of 4\n"
+                    "channels, feeding fragments in pseudo-random order.");
+
+    errval_t err = rpc_reassembly_feed(LMP_MSG_LENGTH - 1);
+    if (err_is_fail(err)) {
+        TEST_PRINT_FAIL();
+    }
+
+    TEST_PRINT_SUCCESS();
+}
+
+__attribute__((unused)) static int rpc_long_reassembly(void)
+{
+    TEST_PRINT_INFO("\n"
+                    "Reassemble interleaved messages arriving in long LMP\n"
+                    "fragments of varying length, some of them whole.");
+
+    errval_t err = rpc_reassembly_feed(RPC_LONG_MAX_WORDS);
+    if (err_is_fail(err)) {
+        TEST_PRINT_FAIL();
+    }
+
+    TEST_PRINT_SUCCESS();
+}
+
+__attribute__((unused)) static int rpc_id_wraparound(void)
+{
+    TEST_PRINT_INFO("\n"
+                    "Exhaust the 256 ids of a message type on a channel and\n"
+                    "check that released ids are reused in next-fit order.");
+
+    static struct lmp_chan idchan;
+    unsigned char type = RPC_MESSAGE(RPC_TYPE_NUMBER);
+    unsigned char id;
+    errval_t err;
+
+    for (int i = 0; i < 256; i++) {
+        err = rpc_id_alloc(&idchan, type, &id);
+        if (err_is_fail(err) || id != i) {
+            debug_printf("allocation %d returned id %u\n", i,
+                         (unsigned int) id);
+            TEST_PRINT_FAIL();
+        }
+    }
+    if (rpc_ids_in_flight(&idchan, type) != 256 ||
+        rpc_ids_in_flight(&idchan, RPC_ACK_MESSAGE(RPC_TYPE_NUMBER)) != 0) {
+        TEST_PRINT_FAIL();
+    }
+    err = rpc_id_alloc(&idchan, type, &id);
+    if (err_no(err) != LIB_ERR_RPC_NO_IDS) {
+        TEST_PRINT_FAIL();
+    }
+
+    // release out of order, allocation wraps around to the lowest free id
+    // and then continues after it
+    rpc_id_free(&idchan, type, 200);
+    rpc_id_free(&idchan, type, 7);
+    rpc_id_free(&idchan, type, 3);
+    err = rpc_id_alloc(&idchan, type, &id);
+    if (err_is_fail(err) || id != 3) {
+        TEST_PRINT_FAIL();
+    }
+    rpc_id_free(&idchan, type, 3);
+    err = rpc_id_alloc(&idchan, type, &id);
+    if (err_is_fail(err) || id != 7) {
+        TEST_PRINT_FAIL();
+    }
+    err = rpc_id_alloc(&idchan, type, &id);
+    if (err_is_fail(err) || id != 200) {
+        TEST_PRINT_FAIL();
+    }
+    if (rpc_ids_in_flight(&idchan, type) != 255) {
+        TEST_PRINT_FAIL();
+    }
+
+    for (int i = 0; i < 256; i++) {
+        if (i != 3)
+            rpc_id_free(&idchan, type, i);
+    }
+
+    TEST_PRINT_SUCCESS();
+}
+
+static size_t rpc_bulk_delivered;
+
+static void rpc_bulk_handler(struct recv_list *rl)
+{
+    rpc_bulk_delivered++;
+}
+
+// feeds a bulk descriptor to rc, returns what recv_process_msg made of it
+static errval_t rpc_bulk_feed(struct recv_chan *rc, unsigned char id,
+                              size_t offset, size_t bytes, size_t total,
+                              size_t pos)
+{
+    struct rpc_recv_msg msg = RPC_RECV_MSG_INIT;
+    msg.buf.msglen = 5;
+    msg.words[0] = (RPC_MESSAGE(RPC_TYPE_NUMBER) << 24) + (id << 16) +
+                   RPC_BULK_SIZE_MARKER;
+    msg.words[1] = offset;
+    msg.words[2] = bytes;
+    msg.words[3] = total;
+    msg.words[4] = pos;
+    return recv_process_msg(rc, &msg.buf, NULL_CAP);
+}
+
+__attribute__((unused)) static int rpc_bulk_bad_desc(void)
+{
+    TEST_PRINT_INFO("\n"
+                    "Feed bulk descriptors pointing outside the bulk frame\n"
+                    "or the message and check that they are dropped.");
+
+    static struct lmp_chan bulkchan;
+    struct recv_chan *rc = malloc(sizeof(struct recv_chan));
+    recv_chan_init(rc, &bulkchan, rpc_bulk_handler);
+    rpc_bulk_delivered = 0;
+
+    // descriptors before the frame is set up
+    if (err_no(rpc_bulk_feed(rc, 0, 0, 8, 8, 0)) != LIB_ERR_RPC_BULK_DESC) {
+        TEST_PRINT_FAIL();
+    }
+
+    // stand in for the peer's frame
+    size_t frame_size = 4 * BASE_PAGE_SIZE;
+    rc->bulk_base = calloc(1, frame_size);
+    rc->bulk_size = frame_size;
+
+    const size_t hdr = sizeof(uint32_t) * 2;
+    struct {
+        size_t offset, bytes, total, pos;
+    } bad[] = {
+        { frame_size, 8, 8, 0 },                    // header past the end
+        { frame_size - hdr, 8, 8, 0 },              // payload past the end
+        { 8, SIZE_MAX - 4, SIZE_MAX - 4, 0 },       // wraps around
+        { 4, 8, 8, 0 },                             // misaligned entry
+        { 0, 16, 8, 0 },                            // chunk bigger than total
+        { 0, 8, 16, 12 },                           // chunk past the total
+        { 0, 8, 16, SIZE_MAX - 4 },                 // pos wraps around
+        { 0, 6, 6, 0 },                             // not whole words
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        errval_t err = rpc_bulk_feed(rc, i, bad[i].offset, bad[i].bytes,
+                                     bad[i].total, bad[i].pos);
+        if (err_no(err) != LIB_ERR_RPC_BULK_DESC) {
+            debug_printf("descriptor %zu was accepted\n", i);
+            TEST_PRINT_FAIL();
+        }
+    }
+
+    // a chunk claiming a different total than the message it continues
+    if (err_is_fail(rpc_bulk_feed(rc, 20, 0, 8, 16, 0)) ||
+        err_no(rpc_bulk_feed(rc, 20, 32, 16, 32, 16)) !=
+            LIB_ERR_RPC_BULK_DESC) {
+        TEST_PRINT_FAIL();
+    }
+    if (rpc_bulk_delivered != 0) {
+        TEST_PRINT_FAIL();
+    }
+
+    // well-formed ones still get through
+    if (err_is_fail(rpc_bulk_feed(rc, 20, 64, 8, 16, 8)) ||
+        err_is_fail(rpc_bulk_feed(rc, 21, 128, 24, 24, 0)) ||
+        rpc_bulk_delivered != 2) {
+        TEST_PRINT_FAIL();
+    }
+
+    // the frame is leaked along with rc, like in the other rpc tests
+    TEST_PRINT_SUCCESS();
+}
@@ -23,6 +23,7 @@
 
 #include "mm_tests.h"
 #include "spawn_tests.h"
+#include "rpc_tests.h"
 
 struct tester {
     int (*tests[MAX_N_TESTS])(void);
@@ -73,6 +74,10 @@ __attribute__((unused)) static void register_memory_tests(struct tester *t)
     register_test(t, mm_alloc_and_map_large_10f);
     register_test(t, mm_paging_map_fixed_attr_cursize_test);
     register_test(t, mm_paging_alloc_aligned_allignment_test);
+    register_test(t, mm_paging_fault_storm);
+    register_test(t, mm_paging_region_hole_reuse);
+    register_test(t, mm_paging_region_churn);
+    register_test(t, mm_cap_batch);
 }
 
 __attribute__((unused)) static void register_spawn_tests(struct tester *t)
@@ -82,4 +87,12 @@ __attribute__((unused)) static void register_spawn_tests(struct tester *t)
     // register_test(t, spawn_hello10);
 }
 
+__attribute__((unused)) static void register_rpc_tests(struct tester *t)
+{
+    register_test(t, rpc_reassembly_stress);
+    register_test(t, rpc_long_reassembly);
+    register_test(t, rpc_id_wraparound);
+    register_test(t, rpc_bulk_bad_desc);
+}
+
 #endif /* _TESTS_TESTS_H_ */
@@ -301,3 +301,379 @@ void shell_threads(int argc, char **argv)
     for (int i = 0; i < n_threads; i++)
         thread_join(threads[i], NULL);
 }
+
+static uint64_t rpcbench_run(size_t bytes, int iterations, char *buf)
+{
+    uint64_t cycles = 0;
+    for (int i = 0; i < iterations; i++) {
+        reset_cycle_counter();
+        CHECK(aos_rpc_bench_sink(get_init_rpc(), buf, bytes));
+        cycles += get_cycle_count();
+    }
+    return cycles;
+}
+
+void shell_rpcbench(int argc, char **argv)
+{
+    size_t max_size = 1024 * 1024;
+    if (argc > 1)
+        max_size = atoi(argv[1]);
+
+    char *buf = malloc(max_size);
+    if (buf == NULL) {
+        printf("Unable to allocate a %zu byte buffer\n", max_size);
+        return;
+    }
+    memset(buf, 'x', max_size);
+
+    size_t threshold = rpc_bulk_get_threshold();
+
+    printf("%10s %6s %14s %14s %14s\n", "bytes", "iters", "lmp8 (MiB/s)",
+           "lmp (MiB/s)", "bulk (MiB/s)");
+    for (size_t bytes = 64; bytes <= max_size; bytes *= 4) {
+        // keep the amount of data moved per size roughly constant
+        int iterations = MAX(4, (int) ((4 * 1024 * 1024) / bytes));
+        if (iterations > 256)
+            iterations = 256;
+
+        double lmp8 = 0, lmp = 0;
+        // the lmp path encodes the length in 16 bits
+        if (bytes / sizeof(uintptr_t) < RPC_BULK_SIZE_MARKER) {
+            rpc_bulk_set_threshold(SIZE_MAX);
+            // 8 words per message against long messages
+            rpc_lmp_long_set(false);
+            uint64_t cycles = rpcbench_run(bytes, iterations, buf);
+            lmp8 = ((double) bytes * iterations / (1024 * 1024)) /
+                   ((double) cycles / CLOCK_FREQUENCY);
+            rpc_lmp_long_set(true);
+            cycles = rpcbench_run(bytes, iterations, buf);
+            lmp = ((double) bytes * iterations / (1024 * 1024)) /
+                  ((double) cycles / CLOCK_FREQUENCY);
+        }
+
+        rpc_bulk_set_threshold(8);
+        uint64_t cycles = rpcbench_run(bytes, iterations, buf);
+        double bulk = ((double) bytes * iterations / (1024 * 1024)) /
+                      ((double) cycles / CLOCK_FREQUENCY);
+
+        if (lmp > 0)
+            printf("%10zu %6d %14.2lf %14.2lf %14.2lf\n", bytes, iterations,
+                   lmp8, lmp, bulk);
+        else
+            printf("%10zu %6d %14s %14s %14.2lf\n", bytes, iterations, "-",
+                   "-", bulk);
+    }
+
+    rpc_bulk_set_threshold(threshold);
+    free(buf);
+}
+
+enum rpclat_op {
+    RPCLAT_NUMBER,
+    RPCLAT_PUTCHAR,
+    RPCLAT_RAM,
+};
+
+static void rpclat_run(enum rpclat_op op, int iterations, uint64_t *cycles,
+                       size_t *allocs)
+{
+    struct aos_rpc *rpc = get_init_rpc();
+    *cycles = 0;
+    size_t mallocs = __malloc_calls;
+    for (int i = 0; i < iterations; i++) {
+        struct capref ram;
+        size_t bytes;
+        reset_cycle_counter();
+        switch (op) {
+        case RPCLAT_NUMBER:
+            CHECK(aos_rpc_send_number(rpc, i));
+            break;
+        case RPCLAT_PUTCHAR:
+            CHECK(aos_rpc_serial_putchar(rpc, '\0'));
+            break;
+        case RPCLAT_RAM:
+            CHECK(aos_rpc_get_ram_cap(rpc, BASE_PAGE_SIZE, BASE_PAGE_SIZE,
+                                      &ram, &bytes));
+            break;
+        }
+        *cycles += get_cycle_count();
+        if (op == RPCLAT_RAM)
+            CHECK(cap_destroy(ram));
+    }
+    *allocs = __malloc_calls - mallocs;
+}
+
+void shell_rpclat(int argc, char **argv)
+{
+    int iterations = 1000;
+    if (argc > 1)
+        iterations = atoi(argv[1]);
+    if (iterations <= 0) {
+        printf("Usage: %s\n", RPCLAT_USAGE);
+        return;
+    }
+
+    static const char *names[] = { "number", "putchar", "ram" };
+    // queued and fast stay runnable after switching to init, call waits
+    // for the reply in the kernel
+    static const char *paths[] = { "queued", "fast", "call" };
+
+    printf("%8s %8s %12s %10s %12s\n", "rpc", "path", "cycles/call",
+           "us/call", "mallocs/call");
+    for (int op = RPCLAT_NUMBER; op <= RPCLAT_RAM; op++) {
+        // get_ram_cap always takes its own non-queueing path
+        for (int path = (op == RPCLAT_RAM); path <= 2; path++) {
+            uint64_t cycles;
+            size_t allocs;
+            aos_rpc_set_fast_path(path >= 1);
+            aos_rpc_set_call_mode(path == 2);
+            // warm up the id and reassembly tables
+            rpclat_run(op, 1, &cycles, &allocs);
+            rpclat_run(op, iterations, &cycles, &allocs);
+            printf("%8s %8s %12llu %10.2lf %12.2lf\n", names[op],
+                   paths[path], (unsigned long long) (cycles / iterations),
+                   (double) cycles / iterations / (CLOCK_FREQUENCY / 1000000),
+                   (double) allocs / iterations);
+        }
+    }
+    aos_rpc_set_fast_path(true);
+    aos_rpc_set_call_mode(true);
+}
+
+void shell_urpcbench(int argc, char **argv)
+{
+    // init runs the benchmark in its URPC thread and prints the results
+    CHECK(aos_rpc_urpc_bench(get_init_rpc()));
+}
+
+void shell_spawnbench(int argc, char **argv)
+{
+    size_t iterations = 8;
+    if (argc > 1)
+        iterations = atoi(argv[1]);
+
+    // init spawns the hellos itself and prints the results
+    CHECK(aos_rpc_spawn_bench(get_init_rpc(), iterations));
+}
+
+void shell_vspacebench(int argc, char **argv)
+{
+    int regions = 10000;
+    if (argc > 1)
+        regions = atoi(argv[1]);
+    if (regions <= 0) {
+        printf("Usage: %s\n", VSPACEBENCH_USAGE);
+        return;
+    }
+
+    struct paging_state *st = get_current_paging_state();
+    void **bufs = malloc(regions * sizeof(void *));
+    if (bufs == NULL) {
+        printf("Unable to allocate the region table\n");
+        return;
+    }
+
+    // one frame mapped over and over, so only the vspace bookkeeping and
+    // the page table updates are measured
+    struct capref frame;
+    size_t bytes;
+    CHECK(frame_alloc(&frame, 4 * BASE_PAGE_SIZE, &bytes));
+
+    uint64_t map_cycles = 0;
+    uint32_t seed = 42;
+    for (int i = 0; i < regions; i++) {
+        // mix of one to four page regions, so unmapping leaves uneven holes
+        seed = seed * 1103515245 + 12345;
+        size_t size = BASE_PAGE_SIZE * (1 + (seed >> 16) % 4);
+        reset_cycle_counter();
+        CHECK(paging_map_frame(st, &bufs[i], size, frame, NULL, NULL));
+        map_cycles += get_cycle_count();
+    }
+
+    // unmap in random order
+    for (int i = regions - 1; i > 0; i--) {
+        seed = seed * 1103515245 + 12345;
+        int j = (seed >> 8) % (i + 1);
+        void *tmp = bufs[i];
+        bufs[i] = bufs[j];
+        bufs[j] = tmp;
+    }
+    uint64_t unmap_cycles = 0;
+    for (int i = 0; i < regions; i++) {
+        reset_cycle_counter();
+        CHECK(paging_unmap(st, bufs[i]));
+        unmap_cycles += get_cycle_count();
+    }
+
+    printf("%8s %10s %12s %10s\n", "op", "regions", "cycles/op", "us/op");
+    printf("%8s %10d %12llu %10.2lf\n", "map", regions,
+           (unsigned long long) (map_cycles / regions),
+           (double) map_cycles / regions / (CLOCK_FREQUENCY / 1000000));
+    printf("%8s %10d %12llu %10.2lf\n", "unmap", regions,
+           (unsigned long long) (unmap_cycles / regions),
+           (double) unmap_cycles / regions / (CLOCK_FREQUENCY / 1000000));
+
+    cap_destroy(frame);
+    free(bufs);
+}
+
+static void tlbbench_run(size_t bytes, bool large, int passes)
+{
+    struct paging_state *st = get_current_paging_state();
+    struct paging_map_stats before, after;
+
+    struct capref frame;
+    size_t frame_bytes;
+    CHECK(frame_alloc(&frame, bytes, &frame_bytes));
+
+    paging_set_large_mappings(large);
+    paging_get_map_stats(&before);
+    reset_cycle_counter();
+    volatile uint32_t *buf;
+    CHECK(paging_map_frame(st, (void **) &buf, frame_bytes, frame, NULL,
+                           NULL));
+    uint64_t map_cycles = get_cycle_count();
+    paging_get_map_stats(&after);
+    paging_set_large_mappings(true);
+
+    // touch one word per page, every access needs another TLB entry unless
+    // the pages are large
+    size_t words = frame_bytes / sizeof(uint32_t);
+    size_t stride = BASE_PAGE_SIZE / sizeof(uint32_t);
+    uint64_t scan_cycles = 0;
+    for (int p = 0; p <= passes; p++) {
+        reset_cycle_counter();
+        for (size_t i = 0; i < words; i += stride)
+            buf[i] += p;
+        // the first pass only warms the caches
+        if (p > 0)
+            scan_cycles += get_cycle_count();
+    }
+
+    size_t pages = frame_bytes / BASE_PAGE_SIZE;
+    printf("%6s %8zu %6zu %6zu %6zu %12llu %12llu\n", large ? "large" : "small",
+           after.invocations - before.invocations,
+           after.sections - before.sections,
+           after.large_pages - before.large_pages,
+           after.small_pages - before.small_pages,
+           (unsigned long long) map_cycles,
+           (unsigned long long) (scan_cycles / passes / pages));
+
+    CHECK(paging_unmap(st, (void *) buf));
+    cap_destroy(frame);
+}
+
+void shell_tlbbench(int argc, char **argv)
+{
+    size_t mib = 16;
+    if (argc > 1)
+        mib = atoi(argv[1]);
+    if (mib == 0) {
+        printf("Usage: %s\n", TLBBENCH_USAGE);
+        return;
+    }
+
+    printf("%6s %8s %6s %6s %6s %12s %12s\n", "pages", "invokes", "1M",
+           "64K", "4K", "map cycles", "cycles/page");
+    tlbbench_run(mib * 1024 * 1024, false, 8);
+    tlbbench_run(mib * 1024 * 1024, true, 8);
+}
+
+#define SLABBENCH_BLOCKSIZE 64
+#define SLABBENCH_ROUNDS    16
+
+/// Maps fresh memory for the benchmark, so that nothing faults while the
+/// slab cache has the dispatcher disabled.
+static void *slabbench_memory(size_t bytes)
+{
+    struct capref frame;
+    size_t frame_bytes;
+    void *buf;
+    CHECK(frame_alloc(&frame, bytes, &frame_bytes));
+    CHECK(paging_map_frame(get_current_paging_state(), &buf, frame_bytes,
+                           frame, NULL, NULL));
+    return buf;
+}
+
+void shell_slabbench(int argc, char **argv)
+{
+    int blocks = 2048;
+    if (argc > 1)
+        blocks = atoi(argv[1]);
+    if (blocks <= 0) {
+        printf("Usage: %s\n", SLABBENCH_USAGE);
+        return;
+    }
+
+    void **live = malloc(blocks * sizeof(void *));
+    int *order = malloc(blocks * sizeof(int));
+    if (live == NULL || order == NULL) {
+        printf("Unable to allocate the block table\n");
+        free(live);
+        free(order);
+        return;
+    }
+    // frees come in a different order than the allocations
+    uint32_t seed = 42;
+    for (int i = 0; i < blocks; i++)
+        order[i] = i;
+    for (int i = blocks - 1; i > 0; i--) {
+        seed = seed * 1103515245 + 12345;
+        int j = (seed >> 8) % (i + 1);
+        int tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    // one page per slab, like slab_default_refill grows them
+    size_t per_page = (BASE_PAGE_SIZE - sizeof(struct slab_head)) /
+                      SLABBENCH_BLOCKSIZE;
+    size_t pages = blocks / per_page + 1;
+    struct slab_allocator slabs;
+    struct slab_cache cache;
+    slab_init(&slabs, SLABBENCH_BLOCKSIZE, NULL);
+    slab_cache_init(&cache, SLABBENCH_BLOCKSIZE, NULL, 0);
+    char *mem = slabbench_memory(pages * BASE_PAGE_SIZE);
+    for (size_t p = 0; p < pages; p++)
+        slab_grow(&slabs, mem + p * BASE_PAGE_SIZE, BASE_PAGE_SIZE);
+    mem = slabbench_memory(pages * BASE_PAGE_SIZE);
+    for (size_t p = 0; p < pages; p++)
+        slab_cache_grow(&cache, mem + p * BASE_PAGE_SIZE, BASE_PAGE_SIZE);
+
+    uint64_t cycles[2][2] = { { 0 } };
+    for (int round = 0; round < SLABBENCH_ROUNDS; round++) {
+        reset_cycle_counter();
+        for (int i = 0; i < blocks; i++)
+            live[i] = slab_alloc(&slabs);
+        cycles[0][0] += get_cycle_count();
+        reset_cycle_counter();
+        for (int i = 0; i < blocks; i++)
+            slab_free(&slabs, live[order[i]]);
+        cycles[0][1] += get_cycle_count();
+
+        reset_cycle_counter();
+        for (int i = 0; i < blocks; i++)
+            live[i] = slab_cache_alloc(&cache);
+        cycles[1][0] += get_cycle_count();
+        reset_cycle_counter();
+        for (int i = 0; i < blocks; i++)
+            slab_cache_free(&cache, live[order[i]]);
+        cycles[1][1] += get_cycle_count();
+    }
+
+    uint64_t ops = (uint64_t) blocks * SLABBENCH_ROUNDS;
+    printf("%8s %8s %8s %12s %12s %14s\n", "", "blocks", "slabs",
+           "alloc cyc", "free cyc", "Mops/s");
+    const char *names[2] = { "slab", "cache" };
+    for (int k = 0; k < 2; k++) {
+        uint64_t total = cycles[k][0] + cycles[k][1];
+        printf("%8s %8d %8zu %12llu %12llu %14.2lf\n", names[k], blocks,
+               pages, (unsigned long long) (cycles[k][0] / ops),
+               (unsigned long long) (cycles[k][1] / ops),
+               (double) 2 * ops * (CLOCK_FREQUENCY / 1000000) / total);
+    }
+
+    // the benchmark memory stays mapped, neither allocator can give it back
+    free(live);
+    free(order);
+}
@@ -23,6 +23,7 @@
 #include <aos/aos.h>
 #include <aos/aos_rpc.h>
 #include <aos/inthandler.h>
+#include <aos/morecore.h>
 
 #include <ascii_codes.h>
 
@@ -44,6 +45,13 @@
 #define TIME_USAGE                  "time [cmd [..]]"
 #define DETACHED_USAGE              "detached [cmd [..]]"
 #define THREADS_USAGE              "threads [n]"
+#define RPCBENCH_USAGE              "rpcbench [max size (bytes)]"
+#define RPCLAT_USAGE                "rpclat [iterations]"
+#define URPCBENCH_USAGE             "urpcbench"
+#define SPAWNBENCH_USAGE            "spawnbench [iterations]"
+#define VSPACEBENCH_USAGE           "vspacebench [regions]"
+#define TLBBENCH_USAGE              "tlbbench [size (MiB)]"
+#define SLABBENCH_USAGE             "slabbench [blocks]"
 
 #define CLOCK_FREQUENCY             1200000000 // PB_ES CLK Frequency (Hz)
 
@@ -69,6 +77,13 @@ void shell_run_testsuite(int argc, char **argv);
 void shell_detached(int argc, char **argv);
 void shell_time(int argc, char **argv);
 void shell_threads(int argc, char **argv);
+void shell_rpcbench(int argc, char **argv);
+void shell_rpclat(int argc, char **argv);
+void shell_urpcbench(int argc, char **argv);
+void shell_spawnbench(int argc, char **argv);
+void shell_vspacebench(int argc, char **argv);
+void shell_tlbbench(int argc, char **argv);
+void shell_slabbench(int argc, char **argv);
 
 // List of TurtleBack builtin functions.
 static struct shell_cmd shell_builtins[] = {
@@ -138,6 +153,49 @@ static struct shell_cmd shell_builtins[] = {
         .usage = THREADS_USAGE,
         .invoke = shell_threads
     },
+    {
+        .cmd = "rpcbench",
+        .help_text = "Compare RPC throughput of the LMP and bulk frame paths",
+        .usage = RPCBENCH_USAGE,
+        .invoke = shell_rpcbench
+    },
+    {
+        .cmd = "rpclat",
+        .help_text = "Measure small RPC round trip latency and allocations",
+        .usage = RPCLAT_USAGE,
+        .invoke = shell_rpclat
+    },
+    {
+        .cmd = "urpcbench",
+        .help_text = "Measure cross-core URPC latency and throughput in init",
+        .usage = URPCBENCH_USAGE,
+        .invoke = shell_urpcbench
+    },
+    {
+        .cmd = "spawnbench",
+        .help_text = "Time spawning hello in init with and without batched "
+                     "capability invocations",
+        .usage = SPAWNBENCH_USAGE,
+        .invoke = shell_spawnbench
+    },
+    {
+        .cmd = "vspacebench",
+        .help_text = "Map and unmap regions to time the vspace bookkeeping",
+        .usage = VSPACEBENCH_USAGE,
+        .invoke = shell_vspacebench
+    },
+    {
+        .cmd = "tlbbench",
+        .help_text = "Scan a buffer mapped with small and with large pages",
+        .usage = TLBBENCH_USAGE,
+        .invoke = shell_tlbbench
+    },
+    {
+        .cmd = "slabbench",
+        .help_text = "Compare slab allocator and slab cache throughput",
+        .usage = SLABBENCH_USAGE,
+        .invoke = shell_slabbench
+    },
     // Builtins list terminator.
     {
         .cmd = NULL,